@@ -50,9 +50,10 @@ typedef struct
   gint timeout_seconds;
   gchar *served_remote;
   gchar *config_file;
+  gboolean persistent;
 } Options;
 
-#define OPTIONS_CLEARED { 0u, NULL, 0, NULL, NULL }
+#define OPTIONS_CLEARED { 0u, NULL, 0, NULL, NULL, FALSE }
 
 static gboolean
 check_option_is (const gchar *option_name,
@@ -139,6 +140,10 @@ options_init (Options *options,
       G_OPTION_FLAG_NONE, G_OPTION_ARG_FILENAME, &options->config_file,
       "Configuration file to use (default: "
       SYSCONFDIR "/eos-updater/eos-update-server.conf" ")", "PATH" },
+    { "persistent", 0,
+      G_OPTION_FLAG_NONE, G_OPTION_ARG_NONE, &options->persistent,
+      "Keep running when idle, reloading repositories when they change "
+      "(overrides --timeout)", NULL },
     { NULL }
   };
 
@@ -163,6 +168,7 @@ options_clear (Options *options)
 {
   options->local_port = 0;
   options->timeout_seconds = 0;
+  options->persistent = FALSE;
   g_clear_pointer (&options->served_remote, g_free);
   g_clear_pointer (&options->raw_port_path, g_free);
   g_clear_pointer (&options->config_file, g_free);
@@ -298,7 +304,8 @@ timeout_data_init (TimeoutData  *data,
   memset (data, 0, sizeof (*data));
   data->loop = g_main_loop_new (NULL, FALSE);
   data->server = g_object_ref (server);
-  data->timeout_seconds = options->timeout_seconds;
+  /* A persistent server never exits due to inactivity. */
+  data->timeout_seconds = options->persistent ? 0 : options->timeout_seconds;
 
   timeout_data_setup_timeout (data);
   if (!timeout_data_maybe_setup_quit_file (data, error))
@@ -428,12 +435,14 @@ start_listening (SoupServer *server,
 }
 
 /* Create an #EusRepo to wrap the given #OstreeRepo and add it to the
- * #EusServer. Print an error and return %FALSE on failure. */
+ * #EusServer. If @monitor is %TRUE, the #EusRepo will reload itself when the
+ * repository changes on disk. Print an error and return %FALSE on failure. */
 static gboolean
 add_repo (EusServer   *server,
           OstreeRepo  *repo,
           const gchar *root_path,
-          const gchar *remote_name)
+          const gchar *remote_name,
+          gboolean     monitor)
 {
   g_autoptr(EusRepo) eus_repo = NULL;
   g_autoptr(GError) error = NULL;
@@ -460,6 +469,16 @@ add_repo (EusServer   *server,
       return FALSE;
     }
 
+  if (monitor && !eus_repo_start_monitoring (eus_repo, &error))
+    {
+      GFile *path = ostree_repo_get_path (repo);
+      g_autofree gchar *path_str = g_file_get_path (path);
+
+      g_message ("Failed to monitor repo ‘%s’ for changes: %s",
+                 path_str, error->message);
+      return FALSE;
+    }
+
   eus_server_add_repo (server, eus_repo);
 
   return TRUE;
@@ -485,6 +504,8 @@ main (int argc, char **argv)
   g_autoptr(EusServer) eus_server = NULL;
   g_auto(TimeoutData) data = TIMEOUT_DATA_CLEARED;
   gboolean advertise_updates = FALSE;
+  guint client_timeout_seconds = 0;
+  guint client_min_throughput = 0;
   g_autoptr(GPtrArray) repository_configs = NULL;
   gsize i;
 
@@ -498,6 +519,7 @@ main (int argc, char **argv)
 
   /* Load our configuration. */
   if (!eus_read_config_file (options.config_file, &advertise_updates,
+                             &client_timeout_seconds, &client_min_throughput,
                              &repository_configs, &error))
     {
       g_message ("Failed to load configuration file: %s", error->message);
@@ -515,6 +537,8 @@ main (int argc, char **argv)
   /* Set up the server and repositories. */
   soup_server = soup_server_new (NULL, NULL);
   eus_server = eus_server_new (soup_server);
+  eus_server_set_client_limits (eus_server, client_timeout_seconds,
+                                client_min_throughput);
 
   for (i = 0; i < repository_configs->len; i++)
     {
@@ -529,15 +553,19 @@ main (int argc, char **argv)
        * could only serve a single repository. It’s intended that
        * (config->index == 0) is always the system OSTree repository
        * (though this is not enforced).
+       *
+       * Both #EusRepos share the #OstreeRepo, so only monitor it once.
        */
       ostree_repo_path = g_file_new_for_path (config->path);
       ostree_repo = ostree_repo_new (ostree_repo_path);
       if (config->index == 0)
-        if (!add_repo (eus_server, ostree_repo, "", config->remote_name))
+        if (!add_repo (eus_server, ostree_repo, "", config->remote_name,
+                       FALSE))
           return EXIT_FAILED;
 
       root_path = g_strdup_printf ("/%u", config->index);
-      if (!add_repo (eus_server, ostree_repo, root_path, config->remote_name))
+      if (!add_repo (eus_server, ostree_repo, root_path, config->remote_name,
+                     options.persistent))
         return EXIT_FAILED;
     }
 
@@ -549,11 +577,14 @@ main (int argc, char **argv)
       /* Serve the default repository at both (root_path="/0") and
        * (root_path == "") for backwards compatibility with the old
        * version of eos-update-server which could only serve a single
-       * repository.
+       * repository. Both #EusRepos share the #OstreeRepo, so only monitor
+       * it once.
        */
-      if (!add_repo (eus_server, ostree_repo, "", options.served_remote))
+      if (!add_repo (eus_server, ostree_repo, "", options.served_remote,
+                     FALSE))
         return EXIT_FAILED;
-      if (!add_repo (eus_server, ostree_repo, "/0", options.served_remote))
+      if (!add_repo (eus_server, ostree_repo, "/0", options.served_remote,
+                     options.persistent))
         return EXIT_FAILED;
     }
 
@@ -573,5 +604,9 @@ main (int argc, char **argv)
 
   g_main_loop_run (data.loop);
 
+  if (eus_server_get_evicted_requests (eus_server) > 0)
+    g_message ("Evicted %u requests from slow or stalled clients",
+               eus_server_get_evicted_requests (eus_server));
+
   return EXIT_OK;
 }
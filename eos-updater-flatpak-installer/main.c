@@ -147,12 +147,15 @@ main (int    argc,
   g_autoptr(FlatpakInstallation) installation = NULL;
   const gchar *resolved_mode = NULL;
   EosUpdaterInstallerMode parsed_mode;
+  EosUpdaterInstallerFlags flags = EU_INSTALLER_FLAGS_NONE;
 
   g_autofree gchar *mode = NULL;
   gboolean also_pull = FALSE;
+  gboolean defer_non_critical = FALSE;
   gboolean dry_run = FALSE;
   GOptionEntry entries[] =
     {
+      { "defer-non-critical", 0, 0, G_OPTION_ARG_NONE, &defer_non_critical, "Leave installs and updates of apps to a later run", NULL },
       { "dry-run", 0, 0, G_OPTION_ARG_NONE, &dry_run, "Print actions without applying them", NULL },
       { "mode", 'm', 0, G_OPTION_ARG_STRING, &mode, "Mode to use (perform, stamp, check) (default: perform)", NULL },
       { "pull", 'p', 0, G_OPTION_ARG_NONE, &also_pull, "Also pull flatpaks", NULL },
@@ -184,7 +187,16 @@ main (int    argc,
   g_message ("Running in mode ‘%s’", resolved_mode);
 
   if (also_pull)
-    g_message ("Will pull flatpaks as well as deploying them");
+    {
+      g_message ("Will pull flatpaks as well as deploying them");
+      flags |= EU_INSTALLER_FLAGS_ALSO_PULL;
+    }
+
+  if (defer_non_critical)
+    {
+      g_message ("Will defer installs and updates of apps to a later run");
+      flags |= EU_INSTALLER_FLAGS_DEFER_NON_CRITICAL;
+    }
 
   /* Check mode is completely different — we need to read in the action
    * application state and check if there’s a delta between what we expect
@@ -298,7 +310,7 @@ main (int    argc,
                                                euu_pending_flatpak_deployments_state_path (),
                                                squashed_ref_actions_to_apply_with_dependencies,
                                                parsed_mode,
-                                               also_pull ? EU_INSTALLER_FLAGS_ALSO_PULL : EU_INSTALLER_FLAGS_NONE,
+                                               flags,
                                                &error))
             return fail (EXIT_APPLY_FAILED,
                          "Couldn’t apply some flatpak update actions for this boot: %s",
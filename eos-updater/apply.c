@@ -25,6 +25,7 @@
 #include <eos-updater/apply.h>
 #include <eos-updater/data.h>
 #include <eos-updater/object.h>
+#include <eos-updater/poll-common.h>
 #include <libeos-updater-util/ostree-util.h>
 #include <libeos-updater-util/types.h>
 #include <libeos-updater-util/util.h>
@@ -75,6 +76,7 @@ apply_finished (GObject *object,
   else
     {
       eos_updater_clear_error (updater, EOS_UPDATER_STATE_UPDATE_APPLIED);
+      eos_updater_data_forget_state ();
     }
 
   return;
@@ -364,6 +366,10 @@ apply_internal (ApplyData     *apply_data,
                local_error->message);
   g_clear_error (&local_error);
 
+  /* The cleanup prunes the repository, so cached missing object sizes may
+   * now be wrong. */
+  clear_commit_sizes_cache ();
+
   /* Try to update the remote branches option to use the new refspec.
    * This option is almost never used and has no impact on future
    * upgrades, so ignore any errors. */
@@ -23,6 +23,9 @@
  */
 
 #include <eos-updater/data.h>
+#include <eos-updater/object.h>
+#include <errno.h>
+#include <glib/gstdio.h>
 #include <libeos-updater-util/util.h>
 #include <string.h>
 
@@ -47,6 +50,10 @@ eos_updater_data_clear (EosUpdaterData *data)
   g_clear_pointer (&data->overridden_urls, g_strfreev);
   g_clear_object (&data->repo);
   g_clear_object (&data->cancellable);
+
+  if (data->finder_avahi != NULL)
+    ostree_repo_finder_avahi_stop (data->finder_avahi);
+  g_clear_object (&data->finder_avahi);
 }
 
 void
@@ -61,3 +68,338 @@ eos_updater_data_reset_cancellable (EosUpdaterData *data)
   g_object_unref (data->cancellable);
   data->cancellable = g_cancellable_new ();
 }
+
+/* The state of the updater after a successful poll or fetch is saved to
+ * UPDATE_STATE_FILE_NAME, so that if the daemon exits (for example, when it is
+ * restarted, or after being idle) it can pick up where it left off, rather
+ * than having to poll again before it can fetch. */
+static const gchar *const UPDATE_STATE_FILE_NAME = "update-state";
+static const gchar *const UPDATE_STATE_GROUP = "Update";
+
+/* String properties which have never been set are %NULL. */
+static void
+set_state_string (GKeyFile    *key_file,
+                  const gchar *key,
+                  const gchar *value)
+{
+  g_key_file_set_string (key_file, UPDATE_STATE_GROUP, key, (value != NULL) ? value : "");
+}
+
+/* Get the URLs of the LAN/USB sources in @results. */
+static GPtrArray *
+get_result_urls (const OstreeRepoFinderResult * const *results)
+{
+  g_autoptr(GPtrArray) urls = g_ptr_array_new_with_free_func (g_free);
+  gsize i;
+
+  for (i = 0; results != NULL && results[i] != NULL; i++)
+    {
+      gchar *url = ostree_remote_get_url (results[i]->remote);
+
+      if (url != NULL)
+        g_ptr_array_add (urls, url);
+    }
+
+  g_ptr_array_add (urls, NULL);
+
+  return g_steal_pointer (&urls);
+}
+
+/**
+ * eos_updater_data_save_state:
+ * @data: updater data
+ * @updater: the updater object
+ * @fetched: %TRUE if the update has been fetched, %FALSE if it has only been
+ *    polled for
+ *
+ * Save the details of the update which @updater is advertising, and how to
+ * fetch it from @data, so they can be restored by
+ * eos_updater_data_restore_state() if the daemon is restarted. Failure to save
+ * them is not an error: it only means the daemon will have to poll again.
+ */
+void
+eos_updater_data_save_state (EosUpdaterData *data,
+                             EosUpdater     *updater,
+                             gboolean        fetched)
+{
+  g_autoptr(GKeyFile) key_file = g_key_file_new ();
+  g_autofree gchar *path = eos_updater_get_state_file_path (UPDATE_STATE_FILE_NAME);
+  g_autofree gchar *dir = g_path_get_dirname (path);
+  g_autoptr(GError) local_error = NULL;
+
+  g_return_if_fail (data != NULL);
+  g_return_if_fail (EOS_IS_UPDATER (updater));
+
+  set_state_string (key_file, "BootedChecksum", eos_updater_get_current_id (updater));
+  g_key_file_set_boolean (key_file, UPDATE_STATE_GROUP, "Fetched", fetched);
+  set_state_string (key_file, "UpdateID", eos_updater_get_update_id (updater));
+  set_state_string (key_file, "UpdateRefspec", eos_updater_get_update_refspec (updater));
+  set_state_string (key_file, "OriginalRefspec", eos_updater_get_original_refspec (updater));
+  set_state_string (key_file, "UpdateLabel", eos_updater_get_update_label (updater));
+  set_state_string (key_file, "UpdateMessage", eos_updater_get_update_message (updater));
+  set_state_string (key_file, "Version", eos_updater_get_version (updater));
+  g_key_file_set_boolean (key_file, UPDATE_STATE_GROUP, "UpdateIsUserVisible",
+                          eos_updater_get_update_is_user_visible (updater));
+  set_state_string (key_file, "ReleaseNotesUri", eos_updater_get_release_notes_uri (updater));
+  g_key_file_set_int64 (key_file, UPDATE_STATE_GROUP, "DownloadSize",
+                        eos_updater_get_download_size (updater));
+  set_state_string (key_file, "DownloadSizeEstimate", eos_updater_get_download_size_estimate (updater));
+  g_key_file_set_int64 (key_file, UPDATE_STATE_GROUP, "UnpackedSize",
+                        eos_updater_get_unpacked_size (updater));
+  g_key_file_set_int64 (key_file, UPDATE_STATE_GROUP, "FullDownloadSize",
+                        eos_updater_get_full_download_size (updater));
+  g_key_file_set_int64 (key_file, UPDATE_STATE_GROUP, "FullUnpackedSize",
+                        eos_updater_get_full_unpacked_size (updater));
+  g_key_file_set_boolean (key_file, UPDATE_STATE_GROUP, "OfflineResultsOnly",
+                          data->offline_results_only);
+
+  if (data->overridden_urls != NULL)
+    g_key_file_set_string_list (key_file, UPDATE_STATE_GROUP, "OverriddenUrls",
+                                (const gchar * const *) data->overridden_urls,
+                                g_strv_length (data->overridden_urls));
+
+  /* The #OstreeRepoFinderResults themselves can’t be recreated, so save where
+   * they came from. If they were all from LAN/USB sources, the update will be
+   * fetched from the USB sources directly after a restart; LAN sources are
+   * saved, but not restored (see get_available_source_urls()). */
+  if (data->offline_results_only)
+    {
+      g_autoptr(GPtrArray) urls = get_result_urls ((const OstreeRepoFinderResult * const *) data->results);
+
+      g_key_file_set_string_list (key_file, UPDATE_STATE_GROUP, "SourceUrls",
+                                  (const gchar * const *) urls->pdata, urls->len - 1);
+    }
+
+  if (g_mkdir_with_parents (dir, 0755) != 0 ||
+      !g_key_file_save_to_file (key_file, path, &local_error))
+    g_message ("Error saving update state to ‘%s’: %s", path,
+               (local_error != NULL) ? local_error->message : g_strerror (errno));
+}
+
+/* Check that the saved update described by @key_file is still valid: that the
+ * system hasn’t since booted into a different commit, and that the update’s
+ * ref in @repo hasn’t moved on. */
+static gboolean
+check_saved_state (OstreeRepo   *repo,
+                   GKeyFile     *key_file,
+                   const gchar  *booted_checksum,
+                   GError      **error)
+{
+  g_autofree gchar *saved_booted_checksum = NULL;
+  g_autofree gchar *update_id = NULL;
+  g_autofree gchar *update_refspec = NULL;
+  g_autofree gchar *ref_checksum = NULL;
+
+  saved_booted_checksum = g_key_file_get_string (key_file, UPDATE_STATE_GROUP, "BootedChecksum", error);
+  if (saved_booted_checksum == NULL)
+    return FALSE;
+
+  update_id = g_key_file_get_string (key_file, UPDATE_STATE_GROUP, "UpdateID", error);
+  if (update_id == NULL)
+    return FALSE;
+
+  update_refspec = g_key_file_get_string (key_file, UPDATE_STATE_GROUP, "UpdateRefspec", error);
+  if (update_refspec == NULL)
+    return FALSE;
+
+  if (g_strcmp0 (saved_booted_checksum, booted_checksum) != 0)
+    {
+      g_set_error (error, G_IO_ERROR, G_IO_ERROR_FAILED,
+                   "It was saved while booted into a different commit (%s)",
+                   saved_booted_checksum);
+      return FALSE;
+    }
+
+  if (!ostree_validate_checksum_string (update_id, error))
+    return FALSE;
+
+  if (g_str_equal (update_id, booted_checksum))
+    {
+      g_set_error (error, G_IO_ERROR, G_IO_ERROR_FAILED,
+                   "Update %s is already booted", update_id);
+      return FALSE;
+    }
+
+  if (!ostree_repo_resolve_rev (repo, update_refspec, TRUE, &ref_checksum, error))
+    return FALSE;
+
+  if (ref_checksum != NULL && !g_str_equal (ref_checksum, update_id))
+    {
+      g_set_error (error, G_IO_ERROR, G_IO_ERROR_FAILED,
+                   "Ref %s has moved from update %s to %s",
+                   update_refspec, update_id, ref_checksum);
+      return FALSE;
+    }
+
+  return TRUE;
+}
+
+/* Get the saved USB source URLs from @key_file which can still be used.
+ * LAN sources are never restored: the peers which advertised the update may
+ * have gone away, or something else may now be at their addresses, and there
+ * is no way to tell without resolving them again through Avahi, which is
+ * what a poll does. */
+static gchar **
+get_available_source_urls (GKeyFile *key_file)
+{
+  g_auto(GStrv) saved_urls = NULL;
+  g_autoptr(GPtrArray) urls = g_ptr_array_new_with_free_func (g_free);
+  gsize i;
+
+  saved_urls = g_key_file_get_string_list (key_file, UPDATE_STATE_GROUP, "SourceUrls", NULL, NULL);
+
+  for (i = 0; saved_urls != NULL && saved_urls[i] != NULL; i++)
+    {
+      g_autofree gchar *path = NULL;
+
+      /* Skip LAN sources, and USB sources which have since been removed. */
+      if (!g_str_has_prefix (saved_urls[i], "file://") ||
+          (path = g_filename_from_uri (saved_urls[i], NULL, NULL)) == NULL ||
+          !g_file_test (path, G_FILE_TEST_IS_DIR))
+        continue;
+
+      g_ptr_array_add (urls, g_strdup (saved_urls[i]));
+    }
+
+  if (urls->len == 0)
+    return NULL;
+
+  g_ptr_array_add (urls, NULL);
+  return (gchar **) g_ptr_array_free (g_steal_pointer (&urls), FALSE);
+}
+
+/**
+ * eos_updater_data_restore_state:
+ * @data: updater data
+ * @updater: the updater object, which must be in the `Ready` state
+ *
+ * Restore the update details saved by eos_updater_data_save_state() into the
+ * properties of @updater and into @data, and move @updater to the
+ * `UpdateAvailable` or `UpdateReady` state as appropriate. This only happens
+ * if the saved state is still valid; otherwise it is deleted.
+ *
+ * Returns: %TRUE if the state was restored, %FALSE otherwise
+ */
+gboolean
+eos_updater_data_restore_state (EosUpdaterData *data,
+                                EosUpdater     *updater)
+{
+  g_autoptr(GKeyFile) key_file = g_key_file_new ();
+  g_autofree gchar *path = eos_updater_get_state_file_path (UPDATE_STATE_FILE_NAME);
+  g_autoptr(GError) local_error = NULL;
+  g_autofree gchar *update_id = NULL;
+  g_autofree gchar *update_refspec = NULL;
+  g_autofree gchar *original_refspec = NULL;
+  g_autofree gchar *label = NULL;
+  g_autofree gchar *message = NULL;
+  g_autofree gchar *version = NULL;
+  g_autofree gchar *release_notes_uri = NULL;
+  g_autofree gchar *download_size_estimate = NULL;
+  g_auto(GStrv) overridden_urls = NULL;
+  gboolean offline_results_only;
+  gboolean fetched;
+  gint64 download_size;
+  OstreeRepoCommitState commit_state;
+
+  g_return_val_if_fail (data != NULL, FALSE);
+  g_return_val_if_fail (EOS_IS_UPDATER (updater), FALSE);
+
+  if (!g_key_file_load_from_file (key_file, path, G_KEY_FILE_NONE, &local_error))
+    {
+      if (!g_error_matches (local_error, G_FILE_ERROR, G_FILE_ERROR_NOENT))
+        g_message ("Error loading update state from ‘%s’: %s", path, local_error->message);
+      return FALSE;
+    }
+
+  if (!check_saved_state (data->repo, key_file,
+                          eos_updater_get_current_id (updater), &local_error) ||
+      (update_id = g_key_file_get_string (key_file, UPDATE_STATE_GROUP, "UpdateID", &local_error)) == NULL ||
+      !ostree_repo_load_commit (data->repo, update_id, NULL, &commit_state, &local_error))
+    {
+      g_message ("Not restoring update state from ‘%s’: %s", path, local_error->message);
+      eos_updater_data_forget_state ();
+      return FALSE;
+    }
+
+  offline_results_only = g_key_file_get_boolean (key_file, UPDATE_STATE_GROUP, "OfflineResultsOnly", NULL);
+
+  if (offline_results_only)
+    {
+      /* Fetching from the internet instead would cost the traffic which
+       * restoring the state is meant to save. */
+      overridden_urls = get_available_source_urls (key_file);
+
+      if (overridden_urls == NULL)
+        {
+          g_message ("Not restoring update state from ‘%s’: The update was "
+                     "found on LAN sources, which are not restored, or on USB "
+                     "sources which are no longer available", path);
+          eos_updater_data_forget_state ();
+          return FALSE;
+        }
+    }
+  else
+    {
+      overridden_urls = g_key_file_get_string_list (key_file, UPDATE_STATE_GROUP, "OverriddenUrls", NULL, NULL);
+    }
+
+  /* If the fetch was interrupted after the state was saved, the update will
+   * have to be fetched again. */
+  fetched = (g_key_file_get_boolean (key_file, UPDATE_STATE_GROUP, "Fetched", NULL) &&
+             !(commit_state & OSTREE_REPO_COMMIT_STATE_PARTIAL));
+
+  update_refspec = g_key_file_get_string (key_file, UPDATE_STATE_GROUP, "UpdateRefspec", NULL);
+  original_refspec = g_key_file_get_string (key_file, UPDATE_STATE_GROUP, "OriginalRefspec", NULL);
+  label = g_key_file_get_string (key_file, UPDATE_STATE_GROUP, "UpdateLabel", NULL);
+  message = g_key_file_get_string (key_file, UPDATE_STATE_GROUP, "UpdateMessage", NULL);
+  version = g_key_file_get_string (key_file, UPDATE_STATE_GROUP, "Version", NULL);
+  release_notes_uri = g_key_file_get_string (key_file, UPDATE_STATE_GROUP, "ReleaseNotesUri", NULL);
+  download_size_estimate = g_key_file_get_string (key_file, UPDATE_STATE_GROUP, "DownloadSizeEstimate", NULL);
+  download_size = g_key_file_get_int64 (key_file, UPDATE_STATE_GROUP, "DownloadSize", NULL);
+
+  g_strfreev (data->overridden_urls);
+  data->overridden_urls = g_steal_pointer (&overridden_urls);
+  g_clear_pointer (&data->results, ostree_repo_finder_result_freev);
+  data->offline_results_only = offline_results_only;
+
+  eos_updater_set_full_download_size (updater, g_key_file_get_int64 (key_file, UPDATE_STATE_GROUP, "FullDownloadSize", NULL));
+  eos_updater_set_full_unpacked_size (updater, g_key_file_get_int64 (key_file, UPDATE_STATE_GROUP, "FullUnpackedSize", NULL));
+  eos_updater_set_download_size (updater, download_size);
+  eos_updater_set_unpacked_size (updater, g_key_file_get_int64 (key_file, UPDATE_STATE_GROUP, "UnpackedSize", NULL));
+  eos_updater_set_downloaded_bytes (updater, (download_size < 0) ? -1 : (fetched ? download_size : 0));
+  eos_updater_set_download_size_estimate (updater, (download_size_estimate != NULL) ? download_size_estimate : "");
+
+  eos_updater_set_update_id (updater, update_id);
+  eos_updater_set_update_refspec (updater, update_refspec);
+  eos_updater_set_original_refspec (updater, (original_refspec != NULL) ? original_refspec : "");
+  eos_updater_set_version (updater, (version != NULL) ? version : "");
+  eos_updater_set_update_is_user_visible (updater, g_key_file_get_boolean (key_file, UPDATE_STATE_GROUP, "UpdateIsUserVisible", NULL));
+  eos_updater_set_release_notes_uri (updater, (release_notes_uri != NULL) ? release_notes_uri : "");
+  eos_updater_set_update_label (updater, (label != NULL) ? label : "");
+  eos_updater_set_update_message (updater, (message != NULL) ? message : "");
+
+  g_message ("Restored update %s from ‘%s’ (%s)", update_id, path,
+             fetched ? "fetched" : "not yet fetched");
+  eos_updater_clear_error (updater, fetched ? EOS_UPDATER_STATE_UPDATE_READY
+                                            : EOS_UPDATER_STATE_UPDATE_AVAILABLE);
+
+  return TRUE;
+}
+
+/**
+ * eos_updater_data_forget_state:
+ *
+ * Delete the state saved by eos_updater_data_save_state(), once the update has
+ * been applied or there is no longer an update available.
+ */
+void
+eos_updater_data_forget_state (void)
+{
+  g_autofree gchar *path = eos_updater_get_state_file_path (UPDATE_STATE_FILE_NAME);
+
+  if (g_unlink (path) != 0 && errno != ENOENT)
+    {
+      int errsv = errno;
+      g_message ("Error deleting update state ‘%s’: %s", path, g_strerror (errsv));
+    }
+}
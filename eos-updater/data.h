@@ -24,6 +24,7 @@
 
 #pragma once
 
+#include <eos-updater/dbus.h>
 #include <ostree.h>
 
 G_BEGIN_DECLS
@@ -62,9 +63,17 @@ struct EosUpdaterData
    * able to cancel them. Upon cancellation (which is done by the Cancel()
    * method), the object is renewed (unreffed + replaced by a new instance). */
   GCancellable *cancellable;
+
+  /* A long-lived OstreeRepoFinderAvahi, processing events in the main context,
+   * which is shared between polls so that its cache of peers on the local
+   * network stays warm. It is created by the first poll which has the LAN
+   * source enabled, and is NULL before then or if it failed to start. Poll
+   * worker threads can use it, as the finder hands its work over to the main
+   * context. */
+  OstreeRepoFinderAvahi *finder_avahi;
 };
 
-#define EOS_UPDATER_DATA_CLEARED { NULL, NULL, NULL, FALSE, NULL }
+#define EOS_UPDATER_DATA_CLEARED { NULL, NULL, NULL, FALSE, NULL, NULL }
 
 void eos_updater_data_init (EosUpdaterData *data,
                             OstreeRepo *repo);
@@ -73,6 +82,13 @@ void eos_updater_data_clear (EosUpdaterData *data);
 
 void eos_updater_data_reset_cancellable (EosUpdaterData *data);
 
+void eos_updater_data_save_state (EosUpdaterData *data,
+                                  EosUpdater     *updater,
+                                  gboolean        fetched);
+gboolean eos_updater_data_restore_state (EosUpdaterData *data,
+                                         EosUpdater     *updater);
+void eos_updater_data_forget_state (void);
+
 G_DEFINE_AUTO_CLEANUP_CLEAR_FUNC (EosUpdaterData, eos_updater_data_clear)
 
 G_END_DECLS
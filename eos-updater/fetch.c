@@ -25,6 +25,7 @@
 #include <eos-updater/data.h>
 #include <eos-updater/fetch.h>
 #include <eos-updater/object.h>
+#include <eos-updater/poll-common.h>
 #include <flatpak.h>
 #include <libeos-updater-util/flatpak-util.h>
 #include <libeos-updater-util/types.h>
@@ -34,6 +35,17 @@
 
 #define APP_CENTER_OS_UPDATES_PRIORITY 30
 
+/* Directory in the OS commit containing its autoinstall lists. */
+#define AUTOINSTALL_SUBDIR "usr/share/eos-application-tools/flatpak-autoinstall.d"
+
+static const gchar *const DOWNLOAD_GROUP = "Download";
+static const gchar *const FLATPAK_PULL_CONCURRENCY_KEY = "FlatpakPullConcurrency";
+#define MAX_FLATPAK_PULL_CONCURRENCY 16
+
+/* Key in FetchData.progress holding the bytes downloaded for flatpaks so far.
+ * libostree uses `bytes-transferred` for the OS pull. */
+#define FLATPAK_BYTES_TRANSFERRED_KEY "eos-updater-flatpak-bytes-transferred"
+
 /* Closure containing the data for the fetch worker thread. The
  * worker thread must not access EosUpdater or EosUpdaterData directly,
  * as they are not thread safe. */
@@ -51,6 +63,10 @@ typedef struct
 
   /* Progress. */
   OstreeAsyncProgress *progress;  /* (owned) */
+
+  /* Local repositories (such as on USB drives) which poll found the update
+   * in, to pull flatpaks from too. */
+  gchar **flatpak_sideload_repos;  /* (owned) (nullable) (array zero-terminated=1) */
 } FetchData;
 
 static void
@@ -59,6 +75,7 @@ fetch_data_free (FetchData *data)
   g_free (data->update_id);
   g_free (data->update_refspec);
   g_clear_object (&data->progress);
+  g_strfreev (data->flatpak_sideload_repos);
   g_clear_object (&data->schedule_entry);
   g_free (data);
 }
@@ -139,6 +156,7 @@ content_fetch_finished (GObject *object,
   else
     {
       eos_updater_clear_error (updater, EOS_UPDATER_STATE_UPDATE_READY);
+      eos_updater_data_save_state (fetch_data->data, updater, TRUE);
     }
 
   return;
@@ -159,6 +177,14 @@ update_progress (OstreeAsyncProgress *progress,
   EosUpdater *updater = EOS_UPDATER (object);
   guint64 bytes = ostree_async_progress_get_uint64 (progress,
                                                     "bytes-transferred");
+  guint64 flatpak_bytes = ostree_async_progress_get_uint64 (progress,
+                                                            FLATPAK_BYTES_TRANSFERRED_KEY);
+
+  /* Report the OS and flatpak pulls together, as they may overlap. */
+  if (flatpak_bytes > G_MAXUINT64 - bytes)
+    bytes = G_MAXUINT64;
+  else
+    bytes += flatpak_bytes;
 
   /* FIXME: Cap to the limit of eos_updater_set_downloaded_bytes(). */
   if (bytes > G_MAXINT64)
@@ -313,6 +339,21 @@ content_fetch_new (FetchData     *fetch_data,
                                  cancellable, error);
 }
 
+/* Pick one of the URLs which the poll stage said to use instead of the
+ * remote’s configured URL, or %NULL to use the remote’s. */
+static const gchar *
+get_url_override (EosUpdaterData *data)
+{
+  if (data->overridden_urls != NULL && data->overridden_urls[0] != NULL)
+    {
+      guint idx = (guint) g_random_int_range (0, (gint32) g_strv_length (data->overridden_urls));
+
+      return data->overridden_urls[idx];
+    }
+
+  return NULL;
+}
+
 static gboolean
 content_fetch_old (FetchData     *fetch_data,
                    GMainContext  *context,
@@ -354,12 +395,8 @@ content_fetch_old (FetchData     *fetch_data,
 
   g_message ("Fetch: %s:%s resolved to: %s", remote, ref, commit_id);
 
-  if (data->overridden_urls != NULL && data->overridden_urls[0] != NULL)
-    {
-      guint idx = (guint) g_random_int_range (0, (gint32) g_strv_length (data->overridden_urls));
+  url_override = get_url_override (data);
 
-      url_override = data->overridden_urls[idx];
-    }
   /* rather than re-resolving the update, we get the last ID that the
    * user Poll()ed. We do this because that is the last update for which
    * we had size data: If there's been a new update since, then the
@@ -484,29 +521,28 @@ transition_pending_ref_action_collection_ids_to_remote_names (FlatpakInstallatio
 }
 
 static gboolean
-perform_install_preparation (FlatpakInstallation             *installation,
-                             EuuFlatpakLocationRef           *ref,
-                             EuuFlatpakRemoteRefActionFlags   action_flags,
-                             GCancellable                    *cancellable,
-                             GError                         **error)
+perform_install_preparation (FlatpakInstallation                *installation,
+                             EuuFlatpakLocationRef              *ref,
+                             gboolean                            no_deploy,
+                             gboolean                            no_pull,
+                             const gchar * const                *sideload_repos,
+                             EuuFlatpakTransactionProgressFunc   progress_func,
+                             gpointer                            progress_data,
+                             GCancellable                       *cancellable,
+                             GError                            **error)
 {
   const gchar *remote = ref->remote;
   g_autofree char *formatted_ref = flatpak_ref_format_ref (ref->ref);
-  gboolean no_deploy = !(action_flags & EUU_FLATPAK_REMOTE_REF_ACTION_FLAG_IS_DEPENDENCY);
   g_autoptr(GError) local_error = NULL;
 
-  /* Note here the no_deploy parameter. Dependency ref actions are immediately
-   * deployed upon the fetch() stage as opposed to waiting for
-   * eos-updater-flatpak-installer to handle them. This is because we can
-   * deploy them "safely" as they are "invisible" to the user. This saves us
-   * from having to maintain dependency state in the ostree repo across
-   * reboots.
-   */
   if (!euu_flatpak_transaction_install (installation,
                                         remote,
                                         formatted_ref,
                                         no_deploy,
-                                        FALSE, /* no_pull */
+                                        no_pull,
+                                        sideload_repos,
+                                        progress_func,
+                                        progress_data,
                                         cancellable,
                                         &local_error))
     {
@@ -520,8 +556,11 @@ perform_install_preparation (FlatpakInstallation             *installation,
           return euu_flatpak_transaction_update (installation,
                                                  formatted_ref,
                                                  no_deploy,
-                                                 FALSE, /* no_pull */
+                                                 no_pull,
                                                  TRUE, /* no_prune */
+                                                 sideload_repos,
+                                                 progress_func,
+                                                 progress_data,
                                                  cancellable,
                                                  error);
         }
@@ -546,21 +585,27 @@ perform_install_preparation (FlatpakInstallation             *installation,
 }
 
 static gboolean
-perform_update_preparation (FlatpakInstallation             *installation,
-                            EuuFlatpakLocationRef           *ref,
-                            EuuFlatpakRemoteRefActionFlags   action_flags,
-                            GCancellable                    *cancellable,
-                            GError                         **error)
+perform_update_preparation (FlatpakInstallation                *installation,
+                            EuuFlatpakLocationRef              *ref,
+                            gboolean                            no_deploy,
+                            gboolean                            no_pull,
+                            const gchar * const                *sideload_repos,
+                            EuuFlatpakTransactionProgressFunc   progress_func,
+                            gpointer                            progress_data,
+                            GCancellable                       *cancellable,
+                            GError                            **error)
 {
   g_autofree char *formatted_ref = flatpak_ref_format_ref (ref->ref);
-  gboolean no_deploy = !(action_flags & EUU_FLATPAK_REMOTE_REF_ACTION_FLAG_IS_DEPENDENCY);
   g_autoptr(GError) local_error = NULL;
 
   if (!euu_flatpak_transaction_update (installation,
                                        formatted_ref,
                                        no_deploy,
-                                       FALSE, /* no_pull */
+                                       no_pull,
                                        TRUE, /* no_prune */
+                                       sideload_repos,
+                                       progress_func,
+                                       progress_data,
                                        cancellable,
                                        &local_error))
     {
@@ -577,26 +622,50 @@ perform_update_preparation (FlatpakInstallation             *installation,
   return TRUE;
 }
 
+/* Pull the flatpak for @action, unless @no_pull is set, in which case it must
+ * already have been pulled.
+ *
+ * Dependency ref actions are deployed as well, rather than waiting for
+ * eos-updater-flatpak-installer to handle them. This is because we can deploy
+ * them "safely" as they are "invisible" to the user. This saves us from having
+ * to maintain dependency state in the ostree repo across reboots. If
+ * @defer_dependency_deploy is set, they are only pulled, and must be deployed
+ * later by calling this again with @no_pull set. */
 static gboolean
-perform_action_preparation (FlatpakInstallation        *installation,
-                            EuuFlatpakRemoteRefAction  *action,
-                            GCancellable               *cancellable,
-                            GError                    **error)
+perform_action_preparation (FlatpakInstallation                *installation,
+                            EuuFlatpakRemoteRefAction          *action,
+                            gboolean                            defer_dependency_deploy,
+                            gboolean                            no_pull,
+                            const gchar * const                *sideload_repos,
+                            EuuFlatpakTransactionProgressFunc   progress_func,
+                            gpointer                            progress_data,
+                            GCancellable                       *cancellable,
+                            GError                            **error)
 {
   EuuFlatpakLocationRef *ref = action->ref;
+  gboolean no_deploy = (!(action->flags & EUU_FLATPAK_REMOTE_REF_ACTION_FLAG_IS_DEPENDENCY) ||
+                        defer_dependency_deploy);
 
   switch (action->type)
     {
       case EUU_FLATPAK_REMOTE_REF_ACTION_INSTALL:
         return perform_install_preparation (installation,
                                             ref,
-                                            action->flags,
+                                            no_deploy,
+                                            no_pull,
+                                            sideload_repos,
+                                            progress_func,
+                                            progress_data,
                                             cancellable,
                                             error);
       case EUU_FLATPAK_REMOTE_REF_ACTION_UPDATE:
         return perform_update_preparation (installation,
                                            ref,
-                                           action->flags,
+                                           no_deploy,
+                                           no_pull,
+                                           sideload_repos,
+                                           progress_func,
+                                           progress_data,
                                            cancellable,
                                            error);
       case EUU_FLATPAK_REMOTE_REF_ACTION_UNINSTALL:
@@ -608,12 +677,233 @@ perform_action_preparation (FlatpakInstallation        *installation,
 
 }
 
+/* State shared between the threads pulling one batch of flatpaks in
+ * pull_flatpak_actions(). Each thread takes the next action from @actions
+ * until there are none left or the batch is cancelled. */
+typedef struct
+{
+  GPtrArray *actions;  /* (element-type EuuFlatpakRemoteRefAction) (unowned) */
+  const gchar * const *sideload_repos;  /* (unowned) (nullable) */
+  gboolean defer_dependency_deploy;
+  OstreeAsyncProgress *progress;  /* (unowned) */
+
+  /* Cancelled when the caller’s cancellable is, or on the first failure. */
+  GCancellable *cancellable;  /* (owned) */
+
+  GMutex lock;
+  /* The following members are protected by @lock: */
+  guint next_action;
+  guint64 total_bytes;
+  GPtrArray *errors;  /* (element-type GError) (owned) */
+} FlatpakPullState;
+
+typedef struct
+{
+  FlatpakPullState *state;  /* (unowned) */
+  guint64 action_bytes;  /* bytes reported so far for the current transaction */
+} FlatpakPullWorker;
+
+/* This may be called from several threads at once. */
+static void
+flatpak_pull_progress_cb (guint64  bytes_transferred,
+                          gpointer user_data)
+{
+  FlatpakPullWorker *worker = user_data;
+  FlatpakPullState *state = worker->state;
+
+  /* Installing an already-installed ref falls back to a second transaction
+   * for the same action, which starts counting from zero again. */
+  if (bytes_transferred < worker->action_bytes)
+    worker->action_bytes = 0;
+
+  /* Update @progress with the lock held, so a total from one thread can’t
+   * overwrite a larger one from another and make the count go backwards. */
+  g_mutex_lock (&state->lock);
+  state->total_bytes += bytes_transferred - worker->action_bytes;
+  ostree_async_progress_set_uint64 (state->progress,
+                                    FLATPAK_BYTES_TRANSFERRED_KEY,
+                                    state->total_bytes);
+  g_mutex_unlock (&state->lock);
+
+  worker->action_bytes = bytes_transferred;
+}
+
+/* Pull actions from @state until there are none left. If @installation is
+ * %NULL, a new one is opened for this thread, as #FlatpakInstallation is not
+ * thread safe. */
+static void
+flatpak_pull_worker_run (FlatpakPullState    *state,
+                         FlatpakInstallation *installation)
+{
+  g_autoptr(FlatpakInstallation) own_installation = NULL;
+  FlatpakPullWorker worker = { state, 0 };
+  g_autoptr(GError) local_error = NULL;
+
+  if (installation == NULL)
+    {
+      own_installation = eos_updater_get_flatpak_installation (state->cancellable,
+                                                               &local_error);
+      installation = own_installation;
+    }
+
+  while (local_error == NULL)
+    {
+      EuuFlatpakRemoteRefAction *action;
+
+      g_mutex_lock (&state->lock);
+      action = (state->next_action < state->actions->len) ?
+               g_ptr_array_index (state->actions, state->next_action++) : NULL;
+      g_mutex_unlock (&state->lock);
+
+      if (action == NULL)
+        break;
+
+      worker.action_bytes = 0;
+      perform_action_preparation (installation, action,
+                                  state->defer_dependency_deploy,
+                                  FALSE,  /* no_pull */
+                                  state->sideload_repos,
+                                  flatpak_pull_progress_cb, &worker,
+                                  state->cancellable, &local_error);
+    }
+
+  if (local_error != NULL)
+    {
+      /* Don’t report the cancellation of the other pulls due to this
+       * failure as errors of their own. */
+      g_mutex_lock (&state->lock);
+      if (!g_error_matches (local_error, G_IO_ERROR, G_IO_ERROR_CANCELLED) ||
+          state->errors->len == 0)
+        g_ptr_array_add (state->errors, g_steal_pointer (&local_error));
+      g_mutex_unlock (&state->lock);
+
+      g_cancellable_cancel (state->cancellable);
+    }
+}
+
+static gpointer
+flatpak_pull_thread (gpointer user_data)
+{
+  FlatpakPullState *state = user_data;
+  g_autoptr(GMainContext) context = g_main_context_new ();
+
+  g_main_context_push_thread_default (context);
+  flatpak_pull_worker_run (state, NULL);
+  g_main_context_pop_thread_default (context);
+
+  return NULL;
+}
+
+static void
+pull_cancelled_cb (GCancellable *cancellable,
+                   gpointer      user_data)
+{
+  GCancellable *pull_cancellable = user_data;
+  g_cancellable_cancel (pull_cancellable);
+}
+
+/* Pull @actions using up to @concurrency threads. On failure, the remaining
+ * pulls are cancelled and the errors from all the pulls which failed are
+ * combined; the first one’s domain and code are returned. @total_bytes is the
+ * number of bytes reported to @progress so far, and is updated. */
+static gboolean
+pull_flatpak_actions (FlatpakInstallation  *installation,
+                      GPtrArray            *actions,
+                      const gchar * const  *sideload_repos,
+                      gboolean              defer_dependency_deploy,
+                      guint                 concurrency,
+                      OstreeAsyncProgress  *progress,
+                      guint64              *total_bytes,
+                      GCancellable         *cancellable,
+                      GError              **error)
+{
+  FlatpakPullState state = { NULL, };
+  g_autoptr(GPtrArray) threads = g_ptr_array_new ();
+  guint n_threads = MIN (concurrency, actions->len);
+  gulong cancelled_id = 0;
+  gboolean success;
+  gsize i;
+
+  if (actions->len == 0)
+    return TRUE;
+
+  state.actions = actions;
+  state.sideload_repos = sideload_repos;
+  state.defer_dependency_deploy = defer_dependency_deploy;
+  state.progress = progress;
+  state.cancellable = g_cancellable_new ();
+  g_mutex_init (&state.lock);
+  state.total_bytes = *total_bytes;
+  state.errors = g_ptr_array_new_with_free_func ((GDestroyNotify) g_error_free);
+
+  if (cancellable != NULL)
+    cancelled_id = g_cancellable_connect (cancellable,
+                                          G_CALLBACK (pull_cancelled_cb),
+                                          state.cancellable, NULL);
+
+  /* Pulling one at a time needs no threads, and can reuse @installation. */
+  if (n_threads <= 1)
+    {
+      flatpak_pull_worker_run (&state, installation);
+    }
+  else
+    {
+      for (i = 0; i < n_threads; i++)
+        g_ptr_array_add (threads, g_thread_new ("flatpak-pull",
+                                                flatpak_pull_thread, &state));
+
+      for (i = 0; i < threads->len; i++)
+        g_thread_join (g_ptr_array_index (threads, i));
+    }
+
+  if (cancellable != NULL)
+    g_cancellable_disconnect (cancellable, cancelled_id);
+
+  *total_bytes = state.total_bytes;
+  success = (state.errors->len == 0);
+
+  if (g_cancellable_set_error_if_cancelled (cancellable, error))
+    success = FALSE;
+  else if (!success)
+    {
+      GError *first_error = g_ptr_array_index (state.errors, 0);
+      g_autoptr(GString) message = g_string_new (first_error->message);
+
+      for (i = 1; i < state.errors->len; i++)
+        {
+          const GError *other_error = g_ptr_array_index (state.errors, i);
+          g_string_append_printf (message, "; %s", other_error->message);
+        }
+
+      g_set_error_literal (error, first_error->domain, first_error->code,
+                           message->str);
+    }
+
+  g_ptr_array_unref (state.errors);
+  g_mutex_clear (&state.lock);
+  g_object_unref (state.cancellable);
+
+  return success;
+}
+
+/* Pull the flatpaks for @pending_flatpak_ref_actions. If
+ * @out_deferred_dependency_actions is non-%NULL, the dependency flatpaks are
+ * not deployed; instead, the actions for them are returned in it, to be
+ * passed to deploy_dependency_flatpaks() once it’s safe to deploy them. */
 static gboolean
 pull_flatpaks (FlatpakInstallation  *installation,
                GPtrArray            *pending_flatpak_ref_actions,
+               const gchar * const  *sideload_repos,
+               guint                 concurrency,
+               OstreeAsyncProgress  *progress,
+               GPtrArray           **out_deferred_dependency_actions,
                GCancellable         *cancellable,
                GError              **error)
 {
+  g_autoptr(GPtrArray) dependency_actions =
+    g_ptr_array_new_with_free_func ((GDestroyNotify) euu_flatpak_remote_ref_action_unref);
+  g_autoptr(GPtrArray) other_actions = g_ptr_array_new ();
+  guint64 total_bytes = 0;
   gsize i;
 
   if (!installation)
@@ -639,21 +929,118 @@ pull_flatpaks (FlatpakInstallation  *installation,
             action->type == EUU_FLATPAK_REMOTE_REF_ACTION_UPDATE))
         continue;
 
-      if (!perform_action_preparation (installation, action, cancellable, error))
-        return FALSE;
+      if (action->flags & EUU_FLATPAK_REMOTE_REF_ACTION_FLAG_IS_DEPENDENCY)
+        g_ptr_array_add (dependency_actions, euu_flatpak_remote_ref_action_ref (action));
+      else
+        g_ptr_array_add (other_actions, action);
+    }
+
+  g_message ("Fetch: pulling %u dependency flatpaks then %u other flatpaks, "
+             "up to %u at once",
+             dependency_actions->len, other_actions->len, concurrency);
+
+  /* The actions are ordered so that dependencies come before the flatpaks
+   * which need them, and dependencies are deployed as they are pulled (unless
+   * that is deferred). Keep that guarantee by pulling all the dependencies
+   * before anything else; within each batch, the pulls are independent. */
+  if (!pull_flatpak_actions (installation, dependency_actions, sideload_repos,
+                             (out_deferred_dependency_actions != NULL),
+                             concurrency, progress, &total_bytes,
+                             cancellable, error) ||
+      !pull_flatpak_actions (installation, other_actions, sideload_repos,
+                             FALSE, concurrency, progress, &total_bytes,
+                             cancellable, error))
+    return FALSE;
+
+  if (out_deferred_dependency_actions != NULL)
+    *out_deferred_dependency_actions = g_steal_pointer (&dependency_actions);
+
+  return TRUE;
+}
+
+/* Add the local repository at @url, if it is one, to @repos. */
+static void
+add_sideload_repo (GPtrArray   *repos,
+                   const gchar *url)
+{
+  g_autofree gchar *path = NULL;
+
+  if (url == NULL || !g_str_has_prefix (url, "file://"))
+    return;
+
+  path = g_filename_from_uri (url, NULL, NULL);
+  if (path == NULL ||
+      g_ptr_array_find_with_equal_func (repos, path, g_str_equal, NULL))
+    return;
+
+  g_message ("Fetch: using %s as a local source for flatpaks", path);
+  g_ptr_array_add (repos, g_steal_pointer (&path));
+}
+
+/* Work out which of the sources found by poll for the update in @data are
+ * local repositories, such as on a USB stick, which the flatpaks for the
+ * update can be pulled from too. Volumes prepared by eos-updater-prepare-volume
+ * contain the flatpaks from the autoinstall lists alongside the OS, so a
+ * machine updating from one needn’t download them from the internet. Returns
+ * %NULL if there are none. */
+static gchar **
+sideload_repos_for_update (EosUpdaterData *data)
+{
+  g_autoptr(GPtrArray) repos = g_ptr_array_new_with_free_func (g_free);
+  gsize i;
+
+  for (i = 0; data->results != NULL && data->results[i] != NULL; i++)
+    {
+      g_autofree gchar *url = ostree_remote_get_url (data->results[i]->remote);
+      add_sideload_repo (repos, url);
     }
 
+  /* An update restored by eos_updater_data_restore_state() has no results,
+   * but its LAN/USB sources are in @overridden_urls. */
+  for (i = 0; data->offline_results_only &&
+              data->overridden_urls != NULL && data->overridden_urls[i] != NULL; i++)
+    add_sideload_repo (repos, data->overridden_urls[i]);
+
+  if (repos->len == 0)
+    return NULL;
+
+  g_ptr_array_add (repos, NULL);
+  return (gchar **) g_ptr_array_free (g_steal_pointer (&repos), FALSE);
+}
+
+static gboolean
+read_flatpak_pull_concurrency (guint   *out_concurrency,
+                               GError **error)
+{
+  g_autoptr(EuuConfigFile) config = eos_updater_load_config_file ();
+  g_autoptr(GError) local_error = NULL;
+  guint concurrency;
+
+  concurrency = euu_config_file_get_uint (config,
+                                          DOWNLOAD_GROUP,
+                                          FLATPAK_PULL_CONCURRENCY_KEY,
+                                          1, MAX_FLATPAK_PULL_CONCURRENCY,
+                                          &local_error);
+  if (local_error != NULL)
+    {
+      g_propagate_error (error, g_steal_pointer (&local_error));
+      return FALSE;
+    }
+
+  *out_concurrency = concurrency;
   return TRUE;
 }
 
 static gboolean
-prepare_flatpaks_to_deploy (OstreeRepo    *repo,
-                            const gchar   *update_id,
-                            GCancellable  *cancellable,
-                            GError       **error)
+prepare_flatpaks_to_deploy (GHashTable           *flatpak_ref_actions_this_commit_wants,
+                            const gchar * const  *sideload_repos,
+                            guint                 concurrency,
+                            OstreeAsyncProgress  *progress,
+                            GPtrArray           **out_deferred_dependency_actions,
+                            GCancellable         *cancellable,
+                            GError              **error)
 {
   g_autoptr(FlatpakInstallation) installation = NULL;
-  g_autoptr(GHashTable) flatpak_ref_actions_this_commit_wants = NULL;
   g_autoptr(GHashTable) flatpak_ref_action_progresses = NULL;
   g_autoptr(GHashTable) relevant_flatpak_ref_actions = NULL;
   g_autoptr(GPtrArray) flatpaks_to_deploy = NULL;
@@ -663,15 +1050,6 @@ prepare_flatpaks_to_deploy (OstreeRepo    *repo,
   g_autofree gchar *formatted_flatpak_ref_actions_progress = NULL;
   g_autofree gchar *formatted_flatpak_ref_actions_with_deps = NULL;
 
-  flatpak_ref_actions_this_commit_wants =
-      euu_flatpak_ref_actions_from_ostree_commit (repo,
-                                                  update_id,
-                                                  cancellable,
-                                                  error);
-
-  if (flatpak_ref_actions_this_commit_wants == NULL)
-    return FALSE;
-
   formatted_flatpak_ref_actions_this_commit_wants =
     euu_format_all_flatpak_ref_actions ("All flatpak ref actions that this commit wants to have applied on deployment",
                                         flatpak_ref_actions_this_commit_wants);
@@ -738,10 +1116,48 @@ prepare_flatpaks_to_deploy (OstreeRepo    *repo,
 
   return pull_flatpaks (installation,
                         flatpaks_to_deploy_with_dependencies,
+                        sideload_repos,
+                        concurrency,
+                        progress,
+                        out_deferred_dependency_actions,
                         cancellable,
                         error);
 }
 
+/* Deploy the dependency flatpaks for @dependency_actions, which were pulled
+ * by prepare_flatpaks_to_deploy() without being deployed. */
+static gboolean
+deploy_dependency_flatpaks (GPtrArray     *dependency_actions,
+                            GCancellable  *cancellable,
+                            GError       **error)
+{
+  g_autoptr(FlatpakInstallation) installation = NULL;
+  gsize i;
+
+  if (dependency_actions == NULL || dependency_actions->len == 0)
+    return TRUE;
+
+  installation = eos_updater_get_flatpak_installation (cancellable, error);
+  if (installation == NULL)
+    return FALSE;
+
+  g_message ("Fetch: deploying %u dependency flatpaks", dependency_actions->len);
+
+  for (i = 0; i < dependency_actions->len; i++)
+    {
+      EuuFlatpakRemoteRefAction *action = g_ptr_array_index (dependency_actions, i);
+
+      if (!perform_action_preparation (installation, action,
+                                       FALSE,  /* defer_dependency_deploy */
+                                       TRUE,  /* no_pull */
+                                       NULL, NULL, NULL,
+                                       cancellable, error))
+        return FALSE;
+    }
+
+  return TRUE;
+}
+
 static void
 download_now_cb (GObject    *obj,
                  GParamSpec *pspec,
@@ -1053,6 +1469,246 @@ connect_cancellable_to_entry (MwscScheduleEntry *entry,
   return helper;
 }
 
+/* Pull the OS update from the P2P results or, failing that, from the
+ * update’s remote. */
+static gboolean
+content_fetch_os (FetchData     *fetch_data,
+                  GMainContext  *context,
+                  GCancellable  *cancellable,
+                  GError       **error)
+{
+  g_autoptr(GError) local_error = NULL;
+  EosUpdaterData *data = fetch_data->data;
+
+  /* Do we want to use the new libostree code for P2P, or fall back on the old
+   * eos-updater code?
+   * FIXME: Eventually drop the old code. See:
+   * https://phabricator.endlessm.com/T19606 */
+  if (data->results != NULL)
+    {
+      g_message ("Fetch: using results %p", data->results);
+
+      if (content_fetch_new (fetch_data, context, cancellable, &local_error))
+        {
+          g_message ("Fetch: finished pulling using libostree P2P code");
+          return TRUE;
+        }
+      else if (g_error_matches (local_error, G_IO_ERROR, G_IO_ERROR_CANCELLED))
+        {
+          g_propagate_error (error, g_steal_pointer (&local_error));
+          return FALSE;
+        }
+      else
+        g_warning ("Error fetching updates using libostree P2P code; falling back to old code: %s",
+                   local_error->message);
+    }
+
+  g_clear_error (&local_error);
+
+  if (data->results == NULL)
+    g_message ("Fetch: using old code due to lack of repo finder results");
+
+  if (content_fetch_old (fetch_data, context, cancellable, &local_error))
+    {
+      g_message ("Fetch: finished pulling using old code");
+      return TRUE;
+    }
+
+  g_message ("Fetch: error pulling using old code: %s", local_error->message);
+  g_propagate_error (error, g_steal_pointer (&local_error));
+  return FALSE;
+}
+
+/* Pull just the autoinstall lists from the update commit, so the flatpaks it
+ * needs can be worked out before the rest of the commit has been pulled. This
+ * pulls from the update’s remote, so it’s only useful if the update isn’t
+ * coming solely from LAN or USB sources. */
+static gboolean
+pull_autoinstall_subdir (FetchData     *fetch_data,
+                         GCancellable  *cancellable,
+                         GError       **error)
+{
+  EosUpdaterData *data = fetch_data->data;
+  g_autofree gchar *remote = NULL;
+  g_auto(GVariantDict) dict = { 0, };
+  g_autoptr(GVariant) commit_options = NULL;
+  g_autoptr(GVariant) options = NULL;
+  const gchar *subdirs[] = { "/" AUTOINSTALL_SUBDIR, NULL };
+
+  if (!ostree_parse_refspec (fetch_data->update_refspec, &remote, NULL, error))
+    return FALSE;
+
+  if (remote == NULL)
+    {
+      g_set_error (error, G_IO_ERROR, G_IO_ERROR_NOT_SUPPORTED,
+                   "Refspec ‘%s’ did not contain a remote name",
+                   fetch_data->update_refspec);
+      return FALSE;
+    }
+
+  /* Static deltas are for whole commits, so can’t be used here. */
+  commit_options = g_variant_ref_sink (get_options_for_pull (fetch_data->update_id,
+                                                             get_url_override (data),
+                                                             TRUE));
+  g_variant_dict_init (&dict, commit_options);
+  g_variant_dict_insert (&dict, "subdirs", "^as", subdirs);
+  options = g_variant_ref_sink (g_variant_dict_end (&dict));
+
+  return ostree_repo_pull_with_options (data->repo, remote, options,
+                                        NULL, cancellable, error);
+}
+
+/* Closure for prepare_flatpaks_thread(). */
+typedef struct
+{
+  GHashTable *flatpak_ref_actions;  /* (owned) */
+  const gchar * const *sideload_repos;  /* (unowned) (nullable) */
+  guint concurrency;
+  OstreeAsyncProgress *progress;  /* (unowned) */
+  GCancellable *cancellable;  /* (unowned) */
+  GCancellable *pipeline_cancellable;  /* (unowned); cancelled on failure */
+  GPtrArray *dependency_actions;  /* (owned) (nullable) (element-type EuuFlatpakRemoteRefAction) */
+  GError *error;  /* (owned) (nullable) */
+} PrepareFlatpaksData;
+
+static gpointer
+prepare_flatpaks_thread (gpointer user_data)
+{
+  PrepareFlatpaksData *prepare_data = user_data;
+  g_autoptr(GMainContext) context = g_main_context_new ();
+
+  g_main_context_push_thread_default (context);
+
+  if (!prepare_flatpaks_to_deploy (prepare_data->flatpak_ref_actions,
+                                   prepare_data->sideload_repos,
+                                   prepare_data->concurrency,
+                                   prepare_data->progress,
+                                   &prepare_data->dependency_actions,
+                                   prepare_data->cancellable,
+                                   &prepare_data->error))
+    g_cancellable_cancel (prepare_data->pipeline_cancellable);
+
+  g_main_context_pop_thread_default (context);
+
+  return NULL;
+}
+
+/* Pull the OS update, and prepare the flatpaks it needs at the same time. The
+ * autoinstall lists are pulled first on their own so that the flatpak pulls
+ * can start straight away. The OS pull counts against the flatpak pull
+ * concurrency limit, so the fetch as a whole keeps to it. If either half
+ * fails, the other is cancelled. Dependency flatpaks are normally deployed as
+ * soon as they are pulled, but here that waits until the OS has been pulled,
+ * so that nothing is deployed for an update which fails to download.
+ *
+ * If the update can’t be fetched this way, %TRUE is returned and
+ * @out_fetched is set to %FALSE; the caller should then pull the OS and the
+ * flatpaks one after the other. */
+static gboolean
+content_fetch_pipelined (FetchData     *fetch_data,
+                         GMainContext  *context,
+                         guint          concurrency,
+                         GCancellable  *cancellable,
+                         gboolean      *out_fetched,
+                         GError       **error)
+{
+  EosUpdaterData *data = fetch_data->data;
+  g_autoptr(GError) local_error = NULL;
+  g_autoptr(GError) os_error = NULL;
+  g_autoptr(GCancellable) pipeline_cancellable = NULL;
+  PrepareFlatpaksData prepare_data = { NULL, };
+  GThread *thread;
+  gulong cancelled_id = 0;
+  gboolean os_success;
+
+  *out_fetched = FALSE;
+
+  /* The refspec and commit are checked properly by content_fetch_old(). */
+  if (concurrency < 2 || data->offline_results_only ||
+      fetch_data->update_refspec == NULL || *fetch_data->update_refspec == '\0' ||
+      fetch_data->update_id == NULL || *fetch_data->update_id == '\0')
+    return TRUE;
+
+  if (!pull_autoinstall_subdir (fetch_data, cancellable, &local_error))
+    {
+      if (g_error_matches (local_error, G_IO_ERROR, G_IO_ERROR_CANCELLED))
+        {
+          g_propagate_error (error, g_steal_pointer (&local_error));
+          return FALSE;
+        }
+
+      g_message ("Fetch: failed to pull autoinstall lists on their own; "
+                 "pulling flatpaks after the OS instead: %s",
+                 local_error->message);
+      return TRUE;
+    }
+
+  prepare_data.flatpak_ref_actions =
+    euu_flatpak_ref_actions_from_ostree_commit (data->repo,
+                                                fetch_data->update_id,
+                                                cancellable,
+                                                error);
+  if (prepare_data.flatpak_ref_actions == NULL)
+    return FALSE;
+
+  g_message ("Fetch: pulling flatpaks while pulling the OS");
+
+  pipeline_cancellable = g_cancellable_new ();
+  if (cancellable != NULL)
+    cancelled_id = g_cancellable_connect (cancellable,
+                                          G_CALLBACK (pull_cancelled_cb),
+                                          pipeline_cancellable, NULL);
+
+  prepare_data.sideload_repos = (const gchar * const *) fetch_data->flatpak_sideload_repos;
+  prepare_data.concurrency = concurrency - 1;
+  prepare_data.progress = fetch_data->progress;
+  prepare_data.cancellable = pipeline_cancellable;
+  prepare_data.pipeline_cancellable = pipeline_cancellable;
+
+  thread = g_thread_new ("prepare-flatpaks", prepare_flatpaks_thread, &prepare_data);
+
+  os_success = content_fetch_os (fetch_data, context, pipeline_cancellable, &os_error);
+  if (!os_success)
+    g_cancellable_cancel (pipeline_cancellable);
+
+  g_thread_join (thread);
+  if (cancellable != NULL)
+    g_cancellable_disconnect (cancellable, cancelled_id);
+  g_hash_table_unref (prepare_data.flatpak_ref_actions);
+
+  *out_fetched = TRUE;
+
+  if (os_success && prepare_data.error == NULL)
+    {
+      gboolean deployed = deploy_dependency_flatpaks (prepare_data.dependency_actions,
+                                                      cancellable, error);
+      g_clear_pointer (&prepare_data.dependency_actions, g_ptr_array_unref);
+      return deployed;
+    }
+
+  g_clear_pointer (&prepare_data.dependency_actions, g_ptr_array_unref);
+
+  /* Report the error which caused the other half to be cancelled, unless the
+   * whole fetch was cancelled. */
+  if (g_cancellable_set_error_if_cancelled (cancellable, error))
+    g_clear_error (&prepare_data.error);
+  else if (os_error != NULL &&
+           (!g_error_matches (os_error, G_IO_ERROR, G_IO_ERROR_CANCELLED) ||
+            prepare_data.error == NULL))
+    {
+      g_propagate_error (error, g_steal_pointer (&os_error));
+      g_clear_error (&prepare_data.error);
+    }
+  else
+    {
+      g_message ("Fetch: failed to pull necessary new flatpaks for update: %s",
+                 prepare_data.error->message);
+      g_propagate_error (error, g_steal_pointer (&prepare_data.error));
+    }
+
+  return FALSE;
+}
+
 static gboolean
 content_fetch (FetchData     *fetch_data,
                GMainContext  *context,
@@ -1064,6 +1720,8 @@ content_fetch (FetchData     *fetch_data,
   EosUpdaterData *data = fetch_data->data;
   GCancellable *fetch_cancellable = cancellable;
   g_autoptr(ScheduledEntryCancellableHelper) cancellable_helper = NULL;
+  guint concurrency;
+  gboolean fetched;
 
   /* Query the scheduler here. Just fail if downloads aren’t allowed; the
    * updater will return a D-Bus error which the caller can interpret. */
@@ -1085,46 +1743,36 @@ content_fetch (FetchData     *fetch_data,
       fetch_cancellable = cancellable_helper->scheduled_entry_cancellable;
     }
 
-  /* Do we want to use the new libostree code for P2P, or fall back on the old
-   * eos-updater code?
-   * FIXME: Eventually drop the old code. See:
-   * https://phabricator.endlessm.com/T19606 */
-  if (data->results != NULL)
-    {
-      g_message ("Fetch: using results %p", data->results);
+  if (!read_flatpak_pull_concurrency (&concurrency, &local_error))
+    goto error;
 
-      if (content_fetch_new (fetch_data, context, fetch_cancellable, &local_error))
-        g_message ("Fetch: finished pulling using libostree P2P code");
-      else if (g_error_matches (local_error, G_IO_ERROR, G_IO_ERROR_CANCELLED))
-        goto error;
-      else
-        g_warning ("Error fetching updates using libostree P2P code; falling back to old code: %s",
-                   local_error->message);
-    }
+  if (!content_fetch_pipelined (fetch_data, context, concurrency,
+                                fetch_cancellable, &fetched, &local_error))
+    goto error;
 
-  if (local_error != NULL || data->results == NULL)
+  if (!fetched)
     {
-      g_clear_error (&local_error);
+      g_autoptr(GHashTable) flatpak_ref_actions = NULL;
 
-      if (data->results == NULL)
-        g_message ("Fetch: using old code due to lack of repo finder results");
+      if (!content_fetch_os (fetch_data, context, fetch_cancellable, &local_error))
+        goto error;
 
-      if (content_fetch_old (fetch_data, context, fetch_cancellable, &local_error))
-        g_message ("Fetch: finished pulling using old code");
-      else
+      g_message ("Fetch: pulling any necessary new flatpaks for this update");
+      flatpak_ref_actions = euu_flatpak_ref_actions_from_ostree_commit (data->repo,
+                                                                        update_id,
+                                                                        fetch_cancellable,
+                                                                        &local_error);
+      if (flatpak_ref_actions == NULL ||
+          !prepare_flatpaks_to_deploy (flatpak_ref_actions,
+                                       (const gchar * const *) fetch_data->flatpak_sideload_repos,
+                                       concurrency, fetch_data->progress,
+                                       NULL, fetch_cancellable, &local_error))
         {
-          g_message ("Fetch: error pulling using old code: %s", local_error->message);
+          g_message ("Fetch: failed to pull necessary new flatpaks for update: %s", local_error->message);
           goto error;
         }
     }
 
-  g_message ("Fetch: pulling any necessary new flatpaks for this update");
-  if (!prepare_flatpaks_to_deploy (data->repo, update_id, fetch_cancellable, &local_error))
-    {
-      g_message ("Fetch: failed to pull necessary new flatpaks for update: %s", local_error->message);
-      goto error;
-    }
-
   /* No longer need to worry about invalidation. Remove it now before it
    * conflicts with removing the scheduler entry. */
   if (cancellable_helper != NULL)
@@ -1215,6 +1863,7 @@ handle_fetch_full (EosUpdater            *updater,
   fetch_data->update_id = g_strdup (eos_updater_get_update_id (updater));
   fetch_data->update_refspec = g_strdup (eos_updater_get_update_refspec (updater));
   fetch_data->progress = ostree_async_progress_new_and_connect (update_progress, updater);
+  fetch_data->flatpak_sideload_repos = sideload_repos_for_update (data);
 
   /* FIXME: Passing the EosUpdaterData to the worker thread is not thread safe.
    * See: https://phabricator.endlessm.com/T15923 */
@@ -122,6 +122,9 @@ on_bus_acquired (GDBusConnection *connection,
   LocalData *local_data = user_data;
   GError *error = NULL;
   g_autofree gchar *sum = NULL;
+  gint64 start_time = g_get_monotonic_time ();
+  guint n_sysroot_loads, n_sysroot_reuses;
+  guint64 sysroot_load_time_us;
 
   g_message ("Acquired a message bus connection");
 
@@ -139,12 +142,14 @@ on_bus_acquired (GDBusConnection *connection,
   local_data->updater = eos_updater_skeleton_new ();
   updater = local_data->updater;
   eos_object_skeleton_set_updater (object, updater);
+  eos_updater_set_poll_sources (updater, g_variant_new ("aa{sv}", NULL));
 
   sum = eos_updater_get_booted_checksum (&error);
   if (sum != NULL)
     {
       eos_updater_set_current_id (updater, sum);
       eos_updater_set_download_size (updater, 0);
+      eos_updater_set_download_size_estimate (updater, "");
       eos_updater_set_downloaded_bytes (updater, 0);
       eos_updater_set_unpacked_size (updater, 0);
       eos_updater_set_update_id (updater, "");
@@ -192,6 +197,10 @@ on_bus_acquired (GDBusConnection *connection,
                         G_CALLBACK (handle_poll_volume), local_data->data);
       g_signal_connect (updater, "handle-apply", G_CALLBACK (handle_apply), local_data->data);
       g_signal_connect (updater, "handle-cancel",  G_CALLBACK (handle_cancel), local_data->data);
+
+      /* Pick up from the last poll or fetch, if the daemon exited since. */
+      if (sum != NULL)
+        eos_updater_data_restore_state (local_data->data, updater);
     }
 
   /* Export the object (@manager takes its own reference to @object) */
@@ -201,6 +210,13 @@ on_bus_acquired (GDBusConnection *connection,
   /* Export all objects */
   g_message ("Exporting objects");
   g_dbus_object_manager_server_set_connection (local_data->manager, connection);
+
+  eos_updater_get_sysroot_snapshot_stats (&n_sysroot_loads, &n_sysroot_reuses,
+                                          &sysroot_load_time_us);
+  g_message ("Startup: Took %" G_GINT64_FORMAT " ms; loaded the sysroot %u times "
+             "(%" G_GUINT64_FORMAT " ms) and reused it %u times",
+             (g_get_monotonic_time () - start_time) / 1000,
+             n_sysroot_loads, sysroot_load_time_us / 1000, n_sysroot_reuses);
 }
 
 static void
@@ -28,6 +28,8 @@
 
 #include <eos-updater/object.h>
 #include <eos-updater/poll-common.h>
+#include <eos-updater/resources.h>
+#include <errno.h>
 #include <gio/gunixmounts.h>
 #include <glib.h>
 #include <glib/gi18n.h>
@@ -46,6 +48,9 @@
 #include <eosmetrics/eosmetrics.h>
 #endif /* HAS_EOSMETRICS_0 */
 
+static const gchar *const CONFIG_FILE_PATH = SYSCONFDIR "/eos-updater/eos-updater.conf";
+static const gchar *const LOCAL_CONFIG_FILE_PATH = PREFIX "/local/share/eos-updater/eos-updater.conf";
+static const gchar *const STATIC_CONFIG_FILE_PATH = DATADIR "/eos-updater/eos-updater.conf";
 static const gchar *const VENDOR_KEY = "sys_vendor";
 static const gchar *const PRODUCT_KEY = "product_name";
 static const gchar *const DT_COMPATIBLE = "/proc/device-tree/compatible";
@@ -384,6 +389,39 @@ eos_update_info_get_commit_timestamp (EosUpdateInfo *info)
   return g_date_time_new_from_unix_utc ((gint64) ostree_commit_get_timestamp (info->commit));
 }
 
+/* Takes ownership of @info and sinks @source_reports, which may be %NULL for
+ * an empty list. */
+PollResult *
+poll_result_new (EosUpdateInfo *info,
+                 GVariant      *source_reports)
+{
+  g_autoptr(PollResult) result = g_new0 (PollResult, 1);
+
+  g_return_val_if_fail (info == NULL || EOS_IS_UPDATE_INFO (info), NULL);
+
+  result->info = info;
+  result->full_download_size = -1;
+  result->full_unpacked_size = -1;
+  result->download_size = -1;
+  result->unpacked_size = -1;
+  result->download_size_estimate = "";
+
+  if (source_reports != NULL)
+    result->source_reports = g_variant_ref_sink (source_reports);
+  else
+    result->source_reports = g_variant_ref_sink (g_variant_new ("aa{sv}", NULL));
+
+  return g_steal_pointer (&result);
+}
+
+void
+poll_result_free (PollResult *result)
+{
+  g_clear_object (&result->info);
+  g_clear_pointer (&result->source_reports, g_variant_unref);
+  g_free (result);
+}
+
 static gchar *
 cleanstr (gchar *s)
 {
@@ -536,20 +574,30 @@ booted_system_is_arm64 (void)
 }
 
 /* Check for an Intel i-8565U CPU using the info from /proc/cpuinfo. If the
- * system has multiple CPUs, this will match any of them. */
+ * system has multiple CPUs, this will match any of them. The CPU can’t change
+ * without a reboot, so this is only worked out once per process. */
 static gboolean
 booted_system_has_i8565u_cpu (void)
 {
-  const gchar *cpuinfo_path;
-  g_autofree gchar *cpuinfo = NULL;
+  /* 0 if not yet known; otherwise 1 + the result */
+  static gsize has_i8565u_cpu = 0;
 
-  cpuinfo_path = allow_env_override ("/proc/cpuinfo", "EOS_UPDATER_TEST_CPUINFO_PATH");
+  if (g_once_init_enter (&has_i8565u_cpu))
+    {
+      const gchar *cpuinfo_path;
+      g_autofree gchar *cpuinfo = NULL;
+      gboolean result = FALSE;
 
-  if (!g_file_get_contents (cpuinfo_path, &cpuinfo, NULL, NULL))
-    return FALSE;
+      cpuinfo_path = allow_env_override ("/proc/cpuinfo", "EOS_UPDATER_TEST_CPUINFO_PATH");
+
+      if (g_file_get_contents (cpuinfo_path, &cpuinfo, NULL, NULL))
+        result = g_regex_match_simple ("^model name\\s*:\\s*Intel\\(R\\) Core\\(TM\\) i7-8565U CPU @ 1.80GHz$", cpuinfo,
+                                       G_REGEX_MULTILINE, 0);
 
-  return g_regex_match_simple ("^model name\\s*:\\s*Intel\\(R\\) Core\\(TM\\) i7-8565U CPU @ 1.80GHz$", cpuinfo,
-                               G_REGEX_MULTILINE, 0);
+      g_once_init_leave (&has_i8565u_cpu, 1 + (gsize) result);
+    }
+
+  return (has_i8565u_cpu == 2);
 }
 
 /* Check @sys_vendor/@product_name against a list of systems which are no longer
@@ -612,21 +660,38 @@ booted_system_is_unsupported_by_eos5_kernel (const gchar *sys_vendor,
   return FALSE;
 }
 
+/* Get the contents of /proc/cmdline, or the empty string if it can’t be read.
+ * The kernel command line can’t change without a reboot, so it’s only read
+ * once per process. */
+static const gchar *
+get_boot_args (void)
+{
+  static const gchar *boot_args = NULL;
+
+  if (g_once_init_enter (&boot_args))
+    {
+      const gchar *cmdline_path;
+      gchar *cmdline = NULL;
+
+      cmdline_path = allow_env_override ("/proc/cmdline", "EOS_UPDATER_TEST_CMDLINE_PATH");
+
+      if (!g_file_get_contents (cmdline_path, &cmdline, NULL, NULL))
+        cmdline = g_strdup ("");
+
+      g_once_init_leave (&boot_args, cmdline);
+    }
+
+  return boot_args;
+}
+
 /* Check if /proc/cmdline contains the given @needle, surrounded by word boundaries. */
 static gboolean
 boot_args_contain (const gchar *needle)
 {
-  const gchar *cmdline_path;
-  g_autofree gchar *cmdline = NULL;
   g_autofree gchar *regex = NULL;
 
-  cmdline_path = allow_env_override ("/proc/cmdline", "EOS_UPDATER_TEST_CMDLINE_PATH");
-
-  if (!g_file_get_contents (cmdline_path, &cmdline, NULL, NULL))
-    return FALSE;
-
   regex = g_strconcat ("\\b", needle, "\\b", NULL);
-  return g_regex_match_simple (regex, cmdline, 0, 0);
+  return g_regex_match_simple (regex, get_boot_args (), 0, 0);
 }
 
 /* Check if /var/lib/flatpak/repo has been split from /ostree/repo. A
@@ -902,10 +967,11 @@ get_refspec_to_upgrade_on (gchar               **refspec_to_upgrade_on,
   g_autofree gchar *booted_ref = NULL;
   g_autoptr(OstreeCollectionRef) booted_collection_ref = NULL;
   g_autofree gchar *checkpoint_ref_for_deployment = NULL;
-  g_autoptr(OstreeSysroot) sysroot = ostree_sysroot_new_default ();
+  g_autoptr(OstreeSysroot) sysroot = NULL;
   g_autoptr(OstreeDeployment) booted_deployment = NULL;
 
-  if (!ostree_sysroot_load (sysroot, NULL, error))
+  sysroot = eos_updater_get_sysroot_snapshot (NULL, error);
+  if (sysroot == NULL)
     return FALSE;
 
   booted_deployment = eos_updater_get_booted_deployment_from_loaded_sysroot (sysroot,
@@ -969,8 +1035,9 @@ get_refspec_to_upgrade_on (gchar               **refspec_to_upgrade_on,
 }
 
 static GVariant *
-get_repo_pull_options (const gchar *url_override,
-                       const gchar *ref)
+get_repo_pull_options (const gchar         *url_override,
+                       const gchar * const *refs,
+                       gssize               n_refs)
 {
   g_auto(GVariantBuilder) builder;
 
@@ -981,11 +1048,367 @@ get_repo_pull_options (const gchar *url_override,
   g_variant_builder_add (&builder, "{s@v}", "flags",
                          g_variant_new_variant (g_variant_new_int32 (OSTREE_REPO_PULL_FLAGS_COMMIT_ONLY)));
   g_variant_builder_add (&builder, "{s@v}", "refs",
-                         g_variant_new_variant (g_variant_new_strv (&ref, 1)));
+                         g_variant_new_variant (g_variant_new_strv (refs, n_refs)));
 
   return g_variant_ref_sink (g_variant_builder_end (&builder));
 };
 
+/* Cache of the outcome of fetch_latest_commit() for the main source, keyed by
+ * the refspec polled and validated against a digest of the remote’s summary
+ * file. If the summary has not changed since the last poll, none of the refs
+ * in it have moved, so pulling and parsing the commits again would give the
+ * same result. */
+static const gchar *const SUMMARY_DIGESTS_FILE_NAME = "poll-summary-digests";
+
+G_LOCK_DEFINE_STATIC (summary_digests);
+
+typedef struct
+{
+  gchar *checksum;
+  gchar *new_refspec;
+  gchar *version;  /* (nullable) */
+  gchar *release_notes_uri_template;  /* (nullable) */
+  guint64 pull_bytes;
+  guint64 pull_milliseconds;
+  guint redirect_hops;
+} SummaryDigestEntry;
+
+static void
+summary_digest_entry_clear (SummaryDigestEntry *entry)
+{
+  g_clear_pointer (&entry->checksum, g_free);
+  g_clear_pointer (&entry->new_refspec, g_free);
+  g_clear_pointer (&entry->version, g_free);
+  g_clear_pointer (&entry->release_notes_uri_template, g_free);
+}
+
+G_DEFINE_AUTO_CLEANUP_CLEAR_FUNC (SummaryDigestEntry, summary_digest_entry_clear)
+
+/* Fetch the summary file for @remote_name (or from @url_override).
+ * libostree caches summary files it has downloaded, and revalidates them with
+ * conditional requests, so this is cheap if the summary has not changed. */
+static GBytes *
+fetch_summary (OstreeRepo    *repo,
+               const gchar   *remote_name,
+               const gchar   *url_override,
+               GCancellable  *cancellable,
+               GError       **error)
+{
+  g_auto(GVariantBuilder) builder = G_VARIANT_BUILDER_INIT (G_VARIANT_TYPE ("a{sv}"));
+  g_autoptr(GVariant) options = NULL;
+  g_autoptr(GBytes) summary = NULL;
+
+  if (url_override != NULL)
+    g_variant_builder_add (&builder, "{s@v}", "override-url",
+                           g_variant_new_variant (g_variant_new_string (url_override)));
+  options = g_variant_ref_sink (g_variant_builder_end (&builder));
+
+  if (!ostree_repo_remote_fetch_summary_with_options (repo, remote_name, options,
+                                                      &summary, NULL,
+                                                      cancellable, error))
+    return NULL;
+
+  if (summary == NULL)
+    {
+      g_set_error (error, G_IO_ERROR, G_IO_ERROR_NOT_FOUND,
+                   "Remote ‘%s’ has no summary file", remote_name);
+      return NULL;
+    }
+
+  return g_steal_pointer (&summary);
+}
+
+/* Get the checksum which @summary advertises for @ref, or %NULL if it does
+ * not list @ref. */
+static gchar *
+get_summary_ref_checksum (GVariant    *summary,
+                          const gchar *ref)
+{
+  g_autoptr(GVariant) summary_refs = NULL;
+  GVariantIter iter;
+  const gchar *summary_ref;
+  GVariant *summary_csum_v = NULL;
+
+  summary_refs = g_variant_get_child_value (summary, 0);
+  g_variant_iter_init (&iter, summary_refs);
+
+  while (g_variant_iter_loop (&iter, "(&s(t@aya{sv}))", &summary_ref, NULL,
+                              &summary_csum_v, NULL))
+    {
+      if (g_str_equal (summary_ref, ref))
+        {
+          gchar *summary_checksum = ostree_checksum_from_bytes_v (summary_csum_v);
+
+          g_variant_unref (summary_csum_v);
+
+          return summary_checksum;
+        }
+    }
+
+  return NULL;
+}
+
+/* Whether @summary advertises the commit which @refspec (for @ref) already
+ * points to locally, in which case pulling it would be a no-op. */
+static gboolean
+summary_advertises_local_commit (OstreeRepo  *repo,
+                                 GVariant    *summary,
+                                 const gchar *refspec,
+                                 const gchar *ref)
+{
+  g_autofree gchar *local_checksum = NULL;
+  g_autofree gchar *summary_checksum = NULL;
+  gboolean have_commit = FALSE;
+
+  if (!ostree_repo_resolve_rev (repo, refspec, TRUE, &local_checksum, NULL) ||
+      local_checksum == NULL)
+    return FALSE;
+
+  summary_checksum = get_summary_ref_checksum (summary, ref);
+  if (summary_checksum == NULL || !g_str_equal (summary_checksum, local_checksum))
+    return FALSE;
+
+  return (ostree_repo_has_object (repo, OSTREE_OBJECT_TYPE_COMMIT, local_checksum,
+                                  &have_commit, NULL, NULL) &&
+          have_commit);
+}
+
+/* Maximum number of commits to pull in one go when resolving an
+ * endoflife-rebase chain. */
+#define MAX_CHAIN_CANDIDATE_COMMITS 32
+
+/* Get the checksums of the commits which could be on the endoflife-rebase
+ * chain from @ref, so they can all be pulled in one round trip: the one
+ * @summary advertises for @ref itself, plus those for the refs in the same
+ * directory as it (for example, os/eos/amd64/eos4 for os/eos/amd64/eos3), as
+ * those are the likely targets of a rebase. The summary carries no commit
+ * metadata, so which of them are actually on the chain is only known once
+ * they have been pulled. Commits which are already in @repo are skipped. */
+static GPtrArray *
+get_chain_candidate_checksums (OstreeRepo  *repo,
+                               GVariant    *summary,
+                               const gchar *ref)
+{
+  g_autoptr(GPtrArray) checksums = g_ptr_array_new_with_free_func (g_free);
+  g_autoptr(GVariant) summary_refs = NULL;
+  const gchar *slash = strrchr (ref, '/');
+  gsize prefix_len = (slash != NULL) ? (gsize) (slash - ref) + 1 : 0;
+  GVariantIter iter;
+  const gchar *summary_ref;
+  GVariant *summary_csum_v = NULL;
+
+  summary_refs = g_variant_get_child_value (summary, 0);
+  g_variant_iter_init (&iter, summary_refs);
+
+  while (checksums->len < MAX_CHAIN_CANDIDATE_COMMITS &&
+         g_variant_iter_loop (&iter, "(&s(t@aya{sv}))", &summary_ref, NULL,
+                              &summary_csum_v, NULL))
+    {
+      g_autofree gchar *checksum = NULL;
+      gboolean have_commit = FALSE;
+
+      if (!g_str_equal (summary_ref, ref) &&
+          (strncmp (summary_ref, ref, prefix_len) != 0 ||
+           strchr (summary_ref + prefix_len, '/') != NULL))
+        continue;
+
+      checksum = ostree_checksum_from_bytes_v (summary_csum_v);
+
+      if (ostree_repo_has_object (repo, OSTREE_OBJECT_TYPE_COMMIT, checksum,
+                                  &have_commit, NULL, NULL) &&
+          have_commit)
+        continue;
+
+      g_ptr_array_add (checksums, g_steal_pointer (&checksum));
+    }
+
+  /* g_variant_iter_loop() only frees the last values when it returns FALSE. */
+  g_clear_pointer (&summary_csum_v, g_variant_unref);
+
+  return g_steal_pointer (&checksums);
+}
+
+/* Point @ref on @remote_name at @checksum, which @summary advertises for it
+ * and which has already been pulled into @repo, if the commit is bound to
+ * @ref (or not bound to any refs). This is what pulling @ref would do,
+ * without another round trip. */
+static gboolean
+set_ref_from_pulled_commit (OstreeRepo    *repo,
+                            const gchar   *remote_name,
+                            const gchar   *ref,
+                            const gchar   *checksum,
+                            GCancellable  *cancellable,
+                            GError       **error)
+{
+  g_autoptr(GVariant) commit = NULL;
+  g_autoptr(GVariant) metadata = NULL;
+  g_autofree const gchar **ref_bindings = NULL;
+
+  if (!ostree_repo_load_variant (repo, OSTREE_OBJECT_TYPE_COMMIT, checksum,
+                                 &commit, error))
+    return FALSE;
+
+  metadata = g_variant_get_child_value (commit, 0);
+  if (g_variant_lookup (metadata, OSTREE_COMMIT_META_KEY_REF_BINDING, "^a&s", &ref_bindings) &&
+      !g_strv_contains (ref_bindings, ref))
+    {
+      g_set_error (error, G_IO_ERROR, G_IO_ERROR_FAILED,
+                   "Commit %s is not bound to ref ‘%s’", checksum, ref);
+      return FALSE;
+    }
+
+  return ostree_repo_set_ref_immediate (repo, remote_name, ref, checksum,
+                                        cancellable, error);
+}
+
+/* Look up the cached outcome of polling @refspec, if the summary @digest
+ * matches the one it was cached against and the commit is still in @repo. */
+static gboolean
+lookup_summary_digest (OstreeRepo         *repo,
+                       const gchar        *refspec,
+                       const gchar        *url_override,
+                       const gchar        *digest,
+                       SummaryDigestEntry *out_entry)
+{
+  g_autoptr(GKeyFile) key_file = g_key_file_new ();
+  g_autofree gchar *path = eos_updater_get_state_file_path (SUMMARY_DIGESTS_FILE_NAME);
+  g_autofree gchar *cached_digest = NULL;
+  g_autofree gchar *cached_url = NULL;
+  g_auto(SummaryDigestEntry) entry = { NULL, };
+  g_autoptr(GError) local_error = NULL;
+  gboolean have_commit = FALSE;
+
+  G_LOCK (summary_digests);
+  g_key_file_load_from_file (key_file, path, G_KEY_FILE_NONE, &local_error);
+  G_UNLOCK (summary_digests);
+
+  if (local_error != NULL)
+    {
+      if (!g_error_matches (local_error, G_FILE_ERROR, G_FILE_ERROR_NOENT))
+        g_debug ("%s: Error loading ‘%s’: %s", G_STRFUNC, path, local_error->message);
+      return FALSE;
+    }
+
+  cached_digest = g_key_file_get_string (key_file, refspec, "SummaryDigest", NULL);
+  cached_url = g_key_file_get_string (key_file, refspec, "UrlOverride", NULL);
+  entry.checksum = g_key_file_get_string (key_file, refspec, "Checksum", NULL);
+  entry.new_refspec = g_key_file_get_string (key_file, refspec, "NewRefspec", NULL);
+  entry.version = g_key_file_get_string (key_file, refspec, "Version", NULL);
+  entry.release_notes_uri_template = g_key_file_get_string (key_file, refspec, "ReleaseNotesUriTemplate", NULL);
+  entry.pull_bytes = g_key_file_get_uint64 (key_file, refspec, "PullBytes", NULL);
+  entry.pull_milliseconds = g_key_file_get_uint64 (key_file, refspec, "PullMilliseconds", NULL);
+  entry.redirect_hops = (guint) g_key_file_get_uint64 (key_file, refspec, "RedirectHops", NULL);
+
+  if (g_strcmp0 (cached_digest, digest) != 0 ||
+      g_strcmp0 (cached_url, (url_override != NULL) ? url_override : "") != 0 ||
+      entry.checksum == NULL || entry.new_refspec == NULL ||
+      !ostree_validate_checksum_string (entry.checksum, NULL))
+    return FALSE;
+
+  if (!ostree_repo_has_object (repo, OSTREE_OBJECT_TYPE_COMMIT, entry.checksum,
+                               &have_commit, NULL, NULL) ||
+      !have_commit)
+    return FALSE;
+
+  /* Normalise empty strings back to NULL. */
+  if (entry.version != NULL && *entry.version == '\0')
+    g_clear_pointer (&entry.version, g_free);
+  if (entry.release_notes_uri_template != NULL && *entry.release_notes_uri_template == '\0')
+    g_clear_pointer (&entry.release_notes_uri_template, g_free);
+
+  *out_entry = entry;
+  memset (&entry, 0, sizeof (entry));
+
+  return TRUE;
+}
+
+static void
+save_summary_digest (const gchar        *refspec,
+                     const gchar        *url_override,
+                     const gchar        *digest,
+                     SummaryDigestEntry *entry)
+{
+  g_autoptr(GKeyFile) key_file = g_key_file_new ();
+  g_autofree gchar *path = eos_updater_get_state_file_path (SUMMARY_DIGESTS_FILE_NAME);
+  g_autofree gchar *dir = g_path_get_dirname (path);
+  g_autoptr(GError) local_error = NULL;
+
+  G_LOCK (summary_digests);
+
+  if (!g_key_file_load_from_file (key_file, path, G_KEY_FILE_KEEP_COMMENTS, &local_error) &&
+      !g_error_matches (local_error, G_FILE_ERROR, G_FILE_ERROR_NOENT))
+    g_debug ("%s: Error loading ‘%s’; overwriting it: %s",
+             G_STRFUNC, path, local_error->message);
+  g_clear_error (&local_error);
+
+  g_key_file_set_string (key_file, refspec, "SummaryDigest", digest);
+  g_key_file_set_string (key_file, refspec, "UrlOverride", (url_override != NULL) ? url_override : "");
+  g_key_file_set_string (key_file, refspec, "Checksum", entry->checksum);
+  g_key_file_set_string (key_file, refspec, "NewRefspec", entry->new_refspec);
+  g_key_file_set_string (key_file, refspec, "Version", (entry->version != NULL) ? entry->version : "");
+  g_key_file_set_string (key_file, refspec, "ReleaseNotesUriTemplate",
+                         (entry->release_notes_uri_template != NULL) ? entry->release_notes_uri_template : "");
+  g_key_file_set_uint64 (key_file, refspec, "PullBytes", entry->pull_bytes);
+  g_key_file_set_uint64 (key_file, refspec, "PullMilliseconds", entry->pull_milliseconds);
+  g_key_file_set_uint64 (key_file, refspec, "RedirectHops", entry->redirect_hops);
+
+  /* Failing to save this only means the next poll won’t be short-circuited. */
+  if (g_mkdir_with_parents (dir, 0755) != 0 ||
+      !g_key_file_save_to_file (key_file, path, &local_error))
+    g_debug ("%s: Error saving ‘%s’: %s", G_STRFUNC, path,
+             (local_error != NULL) ? local_error->message : g_strerror (errno));
+
+  G_UNLOCK (summary_digests);
+}
+
+static void
+metrics_report_summary_unchanged (guint64 saved_bytes,
+                                  guint64 saved_milliseconds)
+{
+  g_debug ("%s: Recording metric event %s (saved %" G_GUINT64_FORMAT
+           " bytes and %" G_GUINT64_FORMAT " ms)",
+           G_STRFUNC, EOS_UPDATER_METRIC_POLL_SUMMARY_UNCHANGED,
+           saved_bytes, saved_milliseconds);
+
+#ifdef HAS_EOSMETRICS_0
+  if (euu_get_metrics_enabled ())
+    emtr_event_recorder_record_event_sync (emtr_event_recorder_get_default (),
+                                           EOS_UPDATER_METRIC_POLL_SUMMARY_UNCHANGED,
+                                           g_variant_new ("(tt)", saved_bytes,
+                                                          saved_milliseconds));
+#endif
+}
+
+/* Whether every result in @results advertises the commit which @refspec
+ * already points to locally, in which case pulling it would be a no-op. */
+static gboolean
+results_advertise_local_commit (OstreeRepo                    *repo,
+                                const gchar                   *refspec,
+                                const OstreeCollectionRef     *collection_ref,
+                                const OstreeRepoFinderResult * const *results)
+{
+  g_autofree gchar *local_checksum = NULL;
+  gboolean have_commit = FALSE;
+  gsize i;
+
+  if (!ostree_repo_resolve_rev (repo, refspec, TRUE, &local_checksum, NULL) ||
+      local_checksum == NULL)
+    return FALSE;
+
+  for (i = 0; results[i] != NULL; i++)
+    {
+      const gchar *checksum = g_hash_table_lookup (results[i]->ref_to_checksum,
+                                                   collection_ref);
+
+      if (checksum != NULL && !g_str_equal (checksum, local_checksum))
+        return FALSE;
+    }
+
+  return (ostree_repo_has_object (repo, OSTREE_OBJECT_TYPE_COMMIT, local_checksum,
+                                  &have_commit, NULL, NULL) &&
+          have_commit);
+}
+
 /* @refspec *must* contain a remote and ref name (not just a ref name).
  * @out_new_refspec is guaranteed to include a remote and a ref name. */
 gboolean
@@ -1001,10 +1424,11 @@ fetch_latest_commit (OstreeRepo *repo,
                      gchar **out_new_refspec,
                      gchar **out_version,
                      gchar **out_release_notes_uri_template,
+                     guint *out_redirect_hops,
+                     guint64 *out_resolve_milliseconds,
                      GError **error)
 {
   g_autofree gchar *checksum = NULL;
-  g_autoptr(GVariant) options = NULL;
   g_autoptr(GVariant) commit = NULL;
   g_autoptr(GVariant) rebase = NULL;
   g_autoptr(GVariant) metadata = NULL;
@@ -1018,6 +1442,15 @@ fetch_latest_commit (OstreeRepo *repo,
   g_auto(OstreeRepoFinderResultv) results = NULL;
   g_autoptr(OstreeCollectionRef) upgrade_collection_ref = NULL;
   g_autoptr(OstreeCollectionRef) new_collection_ref = NULL;
+  g_autofree gchar *summary_digest = NULL;
+  g_autoptr(GVariant) summary = NULL;
+  g_autofree gchar *summary_remote_name = NULL;
+  g_autoptr(GHashTable) chain_refs = NULL;  /* (element-type utf8) */
+  guint64 pull_bytes = 0;
+  guint redirect_hops = 0;
+  guint n_pulls = 0;
+  guint64 resolve_ms;
+  gint64 start_time = g_get_monotonic_time ();
 
   g_return_val_if_fail (OSTREE_IS_REPO (repo), FALSE);
   g_return_val_if_fail (cancellable == NULL || G_IS_CANCELLABLE (cancellable), FALSE);
@@ -1039,12 +1472,141 @@ fetch_latest_commit (OstreeRepo *repo,
   if (collection_ref != NULL)
     upgrade_collection_ref = ostree_collection_ref_dup (collection_ref);
 
+  chain_refs = g_hash_table_new_full (g_str_hash, g_str_equal, g_free, NULL);
+
+  /* If the remote’s summary hasn’t changed since the last poll, none of the
+   * refs in it have moved, so reuse the outcome of that poll rather than
+   * pulling and parsing each commit along the redirect chain again. */
+  if (finders == NULL)
+    {
+      g_auto(SummaryDigestEntry) entry = { NULL, };
+      g_autoptr(GBytes) summary_bytes = NULL;
+      g_autoptr(GError) local_error = NULL;
+
+      if (!ostree_parse_refspec (refspec, &summary_remote_name, NULL, error))
+        return FALSE;
+      g_assert (summary_remote_name != NULL);  /* caller must guarantee this */
+
+      summary_bytes = fetch_summary (repo, summary_remote_name, url_override,
+                                     cancellable, &local_error);
+
+      if (summary_bytes != NULL)
+        {
+          summary_digest = g_compute_checksum_for_bytes (G_CHECKSUM_SHA256, summary_bytes);
+          summary = g_variant_ref_sink (g_variant_new_from_bytes (OSTREE_SUMMARY_GVARIANT_FORMAT,
+                                                                  summary_bytes, FALSE));
+        }
+
+      if (g_error_matches (local_error, G_IO_ERROR, G_IO_ERROR_CANCELLED))
+        {
+          g_propagate_error (error, g_steal_pointer (&local_error));
+          return FALSE;
+        }
+      else if (local_error != NULL)
+        {
+          /* Any real problem with the remote will be reported by the pull. */
+          g_debug ("%s: Error fetching summary for remote ‘%s’: %s",
+                   G_STRFUNC, summary_remote_name, local_error->message);
+        }
+      else if (lookup_summary_digest (repo, refspec, url_override,
+                                      summary_digest, &entry))
+        {
+          guint64 elapsed_ms = (guint64) (g_get_monotonic_time () - start_time) / 1000;
+          guint64 saved_ms = (entry.pull_milliseconds > elapsed_ms) ? entry.pull_milliseconds - elapsed_ms : 0;
+
+          g_message ("Poll: Summary for remote ‘%s’ is unchanged; reusing "
+                     "previous result %s for ‘%s’ (saved %" G_GUINT64_FORMAT
+                     " bytes and %" G_GUINT64_FORMAT " ms)",
+                     summary_remote_name, entry.checksum, refspec,
+                     entry.pull_bytes, saved_ms);
+          metrics_report_summary_unchanged (entry.pull_bytes, saved_ms);
+
+          if (out_redirect_hops != NULL)
+            *out_redirect_hops = entry.redirect_hops;
+          if (out_resolve_milliseconds != NULL)
+            *out_resolve_milliseconds = elapsed_ms;
+
+          *out_version = g_steal_pointer (&entry.version);
+          *out_release_notes_uri_template = g_steal_pointer (&entry.release_notes_uri_template);
+          *out_checksum = g_steal_pointer (&entry.checksum);
+          *out_new_refspec = g_steal_pointer (&entry.new_refspec);
+          if (out_results != NULL)
+            *out_results = NULL;
+
+          return TRUE;
+        }
+    }
+
+  /* When polling a remote directly, pull the commits which could be on the
+   * endoflife-rebase chain in one go, by checksum. Pulling by checksum does
+   * not create or move any local refs: only the refs on the chain which is
+   * followed below are pointed at their commits. If this fails, each hop is
+   * pulled separately instead. */
+  if (summary != NULL)
+    {
+      g_autofree gchar *polled_ref = NULL;
+      g_autoptr(GPtrArray) candidates = NULL;
+
+      if (!ostree_parse_refspec (refspec, NULL, &polled_ref, error))
+        return FALSE;
+
+      candidates = get_chain_candidate_checksums (repo, summary, polled_ref);
+
+      if (candidates->len > 0)
+        {
+          g_autoptr(OstreeAsyncProgress) progress = ostree_async_progress_new ();
+          g_autoptr(GVariant) options = get_repo_pull_options (url_override,
+                                                               (const gchar * const *) candidates->pdata,
+                                                               (gssize) candidates->len);
+          g_autoptr(GError) local_error = NULL;
+
+          g_debug ("%s: Pulling %u candidate commits for ‘%s’ from the summary",
+                   G_STRFUNC, candidates->len, refspec);
+
+          if (ostree_repo_pull_with_options (repo, summary_remote_name, options,
+                                             progress, cancellable, &local_error))
+            {
+              pull_bytes += ostree_async_progress_get_uint64 (progress, "bytes-transferred");
+              n_pulls++;
+            }
+          else if (g_error_matches (local_error, G_IO_ERROR, G_IO_ERROR_CANCELLED))
+            {
+              g_propagate_error (error, g_steal_pointer (&local_error));
+              return FALSE;
+            }
+          else
+            {
+              g_debug ("%s: Error pulling candidate commits for ‘%s’; pulling "
+                       "each ref instead: %s",
+                       G_STRFUNC, refspec, local_error->message);
+            }
+        }
+    }
+
   /* Check whether the commit is a redirection; if so, fetch the new ref and
-   * check again. */
+   * check again. When polling a remote directly, the summary fetched above
+   * shows which refs along the chain the local repository is already up to
+   * date with, or already has the commits for, so only the remaining refs
+   * are pulled. */
   do
     {
+      if (g_hash_table_contains (chain_refs, upgrade_refspec))
+        {
+          g_set_error (error, G_IO_ERROR, G_IO_ERROR_FAILED,
+                       "Redirect loop detected at ref ‘%s’", upgrade_refspec);
+          return FALSE;
+        }
+
+      g_hash_table_add (chain_refs, g_strdup (upgrade_refspec));
+
       if (finders == NULL)
         {
+          /* The summary only lists refs on the remote it came from. */
+          GVariant *remote_summary = NULL;
+          g_autofree gchar *summary_checksum = NULL;
+          gboolean have_commit = FALSE;
+          g_autoptr(GError) local_error = NULL;
+
           g_clear_pointer (&remote_name, g_free);
           g_clear_pointer (&ref, g_free);
 
@@ -1052,14 +1614,55 @@ fetch_latest_commit (OstreeRepo *repo,
             return FALSE;
           g_assert (remote_name != NULL);  /* caller must guarantee this */
 
-          options = get_repo_pull_options (url_override, ref);
-          if (!ostree_repo_pull_with_options (repo,
-                                              remote_name,
-                                              options,
-                                              NULL,
-                                              cancellable,
-                                              error))
-            return FALSE;
+          if (g_strcmp0 (remote_name, summary_remote_name) == 0)
+            remote_summary = summary;
+
+          if (remote_summary != NULL)
+            summary_checksum = get_summary_ref_checksum (remote_summary, ref);
+
+          if (remote_summary != NULL &&
+              summary_advertises_local_commit (repo, remote_summary,
+                                               upgrade_refspec, ref))
+            {
+              g_debug ("%s: Not pulling ‘%s’ as the local commit is already the latest",
+                       G_STRFUNC, upgrade_refspec);
+            }
+          else if (summary_checksum != NULL &&
+                   ostree_repo_has_object (repo, OSTREE_OBJECT_TYPE_COMMIT,
+                                           summary_checksum, &have_commit,
+                                           cancellable, NULL) &&
+                   have_commit &&
+                   set_ref_from_pulled_commit (repo, remote_name, ref,
+                                               summary_checksum, cancellable,
+                                               &local_error))
+            {
+              g_debug ("%s: Not pulling ‘%s’ as commit %s is already present",
+                       G_STRFUNC, upgrade_refspec, summary_checksum);
+            }
+          else
+            {
+              g_autoptr(OstreeAsyncProgress) progress = ostree_async_progress_new ();
+              g_autoptr(GVariant) options = get_repo_pull_options (url_override,
+                                                                   (const gchar * const *) &ref, 1);
+
+              if (local_error != NULL)
+                {
+                  g_debug ("%s: Pulling ‘%s’ as the pulled commit can’t be used: %s",
+                           G_STRFUNC, upgrade_refspec, local_error->message);
+                  g_clear_error (&local_error);
+                }
+
+              if (!ostree_repo_pull_with_options (repo,
+                                                  remote_name,
+                                                  options,
+                                                  progress,
+                                                  cancellable,
+                                                  error))
+                return FALSE;
+
+              pull_bytes += ostree_async_progress_get_uint64 (progress, "bytes-transferred");
+              n_pulls++;
+            }
         }
       else
         {
@@ -1085,8 +1688,17 @@ fetch_latest_commit (OstreeRepo *repo,
           if (results == NULL)
             return FALSE;
 
-          /* Only pull commit metadata if there's an update available. */
-          if (results[0] != NULL)
+          /* Only pull commit metadata if there's an update available, and
+           * if it isn’t already the commit the ref points to locally. */
+          if (results[0] != NULL &&
+              results_advertise_local_commit (repo, upgrade_refspec,
+                                              upgrade_collection_ref,
+                                              (const OstreeRepoFinderResult * const *) results))
+            {
+              g_debug ("%s: Not pulling ‘%s’ as the local commit is already the latest",
+                       G_STRFUNC, upgrade_refspec);
+            }
+          else if (results[0] != NULL)
             {
               g_variant_builder_add (&builder, "{s@v}", "flags",
                                      g_variant_new_variant (g_variant_new_int32 (OSTREE_REPO_PULL_FLAGS_COMMIT_ONLY)));
@@ -1118,6 +1730,9 @@ fetch_latest_commit (OstreeRepo *repo,
                                 &version, &release_notes_uri_template, cancellable, error))
         return FALSE;
 
+      if (redirect_followed)
+        redirect_hops++;
+
       if (new_refspec != NULL)
         {
           g_clear_pointer (&upgrade_refspec, g_free);
@@ -1131,6 +1746,30 @@ fetch_latest_commit (OstreeRepo *repo,
     }
   while (redirect_followed);
 
+  resolve_ms = (guint64) (g_get_monotonic_time () - start_time) / 1000;
+
+  if (redirect_hops > 0)
+    g_message ("Poll: Resolved ‘%s’ to ‘%s’ after %u redirects in %" G_GUINT64_FORMAT " ms",
+               refspec, upgrade_refspec, redirect_hops, resolve_ms);
+  if (finders == NULL)
+    g_debug ("%s: Resolving ‘%s’ took %u pulls", G_STRFUNC, refspec, n_pulls);
+
+  if (summary_digest != NULL)
+    {
+      SummaryDigestEntry entry =
+        {
+          checksum,
+          (new_refspec != NULL) ? new_refspec : (gchar *) refspec,
+          version,
+          release_notes_uri_template,
+          pull_bytes,
+          resolve_ms,
+          redirect_hops,
+        };
+
+      save_summary_digest (refspec, url_override, summary_digest, &entry);
+    }
+
   *out_version = g_steal_pointer (&version);
   *out_release_notes_uri_template = g_steal_pointer (&release_notes_uri_template);
   *out_checksum = g_steal_pointer (&checksum);
@@ -1141,6 +1780,10 @@ fetch_latest_commit (OstreeRepo *repo,
 
   if (out_results != NULL)
     *out_results = g_steal_pointer (&results);
+  if (out_redirect_hops != NULL)
+    *out_redirect_hops = redirect_hops;
+  if (out_resolve_milliseconds != NULL)
+    *out_resolve_milliseconds = resolve_ms;
 
   return TRUE;
 }
@@ -1324,8 +1967,8 @@ get_custom_descriptors_path (void)
   return g_getenv ("EOS_UPDATER_TEST_UPDATER_CUSTOM_DESCRIPTORS_PATH");
 }
 
-GHashTable *
-get_hw_descriptors (void)
+static GHashTable *
+read_hw_descriptors (void)
 {
   GHashTable *hw_descriptors = g_hash_table_new_full (g_str_hash, g_str_equal,
                                                       g_free, g_free);
@@ -1350,6 +1993,23 @@ get_hw_descriptors (void)
   return hw_descriptors;
 }
 
+/* Get the hardware descriptors (vendor, product, etc.) for this machine.
+ * These can’t change without a reboot, so they are read from DMI or the
+ * device tree once per process, and the same table is returned to every
+ * caller. It must not be modified.
+ *
+ * Returns: (transfer full) (element-type utf8 utf8): hardware descriptors */
+GHashTable *
+get_hw_descriptors (void)
+{
+  static GHashTable *hw_descriptors = NULL;
+
+  if (g_once_init_enter (&hw_descriptors))
+    g_once_init_leave (&hw_descriptors, read_hw_descriptors ());
+
+  return g_hash_table_ref (hw_descriptors);
+}
+
 static void
 maybe_send_metric (EosMetricsInfo *metrics)
 {
@@ -1521,15 +2181,212 @@ get_latest_update (GArray *sources,
   return NULL;
 }
 
+typedef struct
+{
+  MetadataFetcher fetcher;
+  gpointer fetcher_data;
+  GFile *repo_path;  /* (owned) */
+  GCancellable *cancellable;  /* (owned) */
+  GSource *timeout_source;  /* (owned) (nullable) */
+  guint timeout_seconds;  /* 0 for no deadline */
+  guint *n_pending;  /* (unowned) */
+
+  /* Only accessed from the thread calling run_fetchers(). */
+  gint64 start_time;  /* monotonic, in microseconds */
+  gint64 end_time;  /* monotonic, in microseconds */
+  gboolean finished;
+  gboolean timed_out;
+  gboolean superseded;
+  EosUpdateInfo *info;  /* (owned) (nullable) */
+  GError *error;  /* (owned) (nullable) */
+} FetcherState;
+
+static void
+fetcher_state_free (FetcherState *state)
+{
+  if (state->timeout_source != NULL)
+    g_source_destroy (state->timeout_source);
+  g_clear_pointer (&state->timeout_source, g_source_unref);
+  g_clear_object (&state->cancellable);
+  g_clear_object (&state->repo_path);
+  g_clear_object (&state->info);
+  g_clear_error (&state->error);
+  g_free (state);
+}
+
+static void
+fetcher_thread_cb (GTask        *task,
+                   gpointer      source_object,
+                   gpointer      task_data,
+                   GCancellable *cancellable)
+{
+  FetcherState *state = task_data;
+  g_autoptr(GMainContext) context = g_main_context_new ();
+  g_autoptr(OstreeRepo) repo = NULL;
+  g_autoptr(EosUpdateInfo) info = NULL;
+  g_autoptr(GError) local_error = NULL;
+
+  g_main_context_push_thread_default (context);
+
+  /* An #OstreeRepo only supports one transaction at a time, so give each
+   * fetcher its own instance of the repository. */
+  repo = ostree_repo_new (state->repo_path);
+
+  if (!ostree_repo_open (repo, cancellable, &local_error) ||
+      !state->fetcher (repo, context, state->fetcher_data, &info,
+                       cancellable, &local_error))
+    g_task_return_error (task, g_steal_pointer (&local_error));
+  else
+    g_task_return_pointer (task, g_steal_pointer (&info), g_object_unref);
+
+  g_main_context_pop_thread_default (context);
+}
+
+static void
+fetcher_finished_cb (GObject      *source_object,
+                     GAsyncResult *result,
+                     gpointer      user_data)
+{
+  FetcherState *state = user_data;
+
+  state->info = g_task_propagate_pointer (G_TASK (result), &state->error);
+  state->finished = TRUE;
+  state->end_time = g_get_monotonic_time ();
+
+  if (state->timeout_source != NULL)
+    g_source_destroy (state->timeout_source);
+
+  *state->n_pending -= 1;
+}
+
+static gboolean
+fetcher_timeout_cb (gpointer user_data)
+{
+  FetcherState *state = user_data;
+
+  state->timed_out = TRUE;
+  g_cancellable_cancel (state->cancellable);
+
+  return G_SOURCE_REMOVE;
+}
+
+static void
+cancel_fetchers_cb (GCancellable *cancellable,
+                    gpointer      user_data)
+{
+  GPtrArray *states = user_data;
+  gsize i;
+
+  /* This may be called from any thread, but the fetchers’ cancellables are
+   * never modified after run_fetchers() has started them. */
+  for (i = 0; i < states->len; i++)
+    {
+      FetcherState *state = g_ptr_array_index (states, i);
+      g_cancellable_cancel (state->cancellable);
+    }
+}
+
+static void
+add_source_report (GVariantBuilder *builder,
+                   const gchar     *name,
+                   FetcherState    *state)
+{
+  const gchar *result;
+
+  if (state->superseded)
+    result = "superseded";
+  else if (state->timed_out)
+    result = "timed-out";
+  else if (state->error != NULL)
+    result = "failed";
+  else if (state->info != NULL)
+    result = "update";
+  else
+    result = "no-update";
+
+  g_variant_builder_open (builder, G_VARIANT_TYPE_VARDICT);
+  g_variant_builder_add (builder, "{sv}", "source", g_variant_new_string (name));
+  g_variant_builder_add (builder, "{sv}", "result", g_variant_new_string (result));
+  g_variant_builder_add (builder, "{sv}", "elapsed-ms",
+                         g_variant_new_uint64 ((guint64) (state->end_time - state->start_time) / 1000));
+  g_variant_builder_add (builder, "{sv}", "timeout-seconds",
+                         g_variant_new_uint32 (state->timeout_seconds));
+  if (state->error != NULL && !state->timed_out && !state->superseded)
+    g_variant_builder_add (builder, "{sv}", "error-message",
+                           g_variant_new_string (state->error->message));
+  if (state->info != NULL)
+    {
+      g_variant_builder_add (builder, "{sv}", "redirect-hops",
+                             g_variant_new_uint32 (state->info->redirect_hops));
+      g_variant_builder_add (builder, "{sv}", "resolve-ms",
+                             g_variant_new_uint64 (state->info->resolve_milliseconds));
+    }
+  g_variant_builder_close (builder);
+}
+
+/* Offline sources (the local network and removable drives) are preferred to
+ * the main server, so that updates are downloaded from peers where possible.
+ * Override URIs are polled as %EOS_UPDATER_DOWNLOAD_MAIN, so they are treated
+ * as online too, so as not to bypass the scheduler. */
+static gboolean
+download_source_is_offline (EosUpdaterDownloadSource source)
+{
+  return (source != EOS_UPDATER_DOWNLOAD_MAIN);
+}
+
+/* Whether any fetcher for an offline source has finished with an update. */
+static gboolean
+have_offline_update (GPtrArray *states,
+                     GArray    *sources)
+{
+  gsize i;
+
+  for (i = 0; i < states->len; i++)
+    {
+      const FetcherState *state = g_ptr_array_index (states, i);
+      EosUpdaterDownloadSource source = g_array_index (sources,
+                                                       EosUpdaterDownloadSource,
+                                                       i);
+
+      if (download_source_is_offline (source) &&
+          state->finished && state->error == NULL && state->info != NULL)
+        return TRUE;
+    }
+
+  return FALSE;
+}
+
+/* Run all the @fetchers concurrently, each in its own thread with its own
+ * #OstreeRepo instance for @repo. @sources gives the source polled by each
+ * fetcher, in priority order. If @source_timeouts is non-%NULL, it is indexed
+ * by #EosUpdaterDownloadSource and gives the number of seconds each fetcher
+ * may run before it is cancelled, or 0 for no deadline.
+ *
+ * If any offline source finds an update, only the updates from offline
+ * sources are merged by get_latest_update(); otherwise the updates from
+ * online sources are. So as soon as an offline source has found an update,
+ * the online fetchers can no longer win, and are cancelled.
+ *
+ * If @source_reports is non-%NULL, an `a{sv}` describing the outcome and
+ * elapsed time of each fetcher is added to it.
+ *
+ * May return %NULL without setting an error if no updates were found. */
 EosUpdateInfo *
-run_fetchers (OstreeRepo   *repo,
-              GMainContext *context,
-              GCancellable *cancellable,
-              GPtrArray    *fetchers,
-              GArray       *sources,
-              GError      **error)
+run_fetchers (OstreeRepo      *repo,
+              GMainContext    *context,
+              GCancellable    *cancellable,
+              GPtrArray       *fetchers,
+              GArray          *sources,
+              gpointer         fetcher_data,
+              const guint     *source_timeouts,
+              GVariantBuilder *source_reports,
+              GError         **error)
 {
   guint idx;
+  guint n_pending = 0;
+  gulong cancelled_id = 0;
+  gboolean offline_update;
+  g_autoptr(GPtrArray) states = NULL;  /* (element-type FetcherState) */
   g_autoptr(GHashTable) source_to_update = g_hash_table_new_full (NULL,
                                                                   NULL,
                                                                   NULL,
@@ -1542,33 +2399,130 @@ run_fetchers (OstreeRepo   *repo,
   g_return_val_if_fail (sources != NULL, NULL);
   g_return_val_if_fail (fetchers->len == sources->len, NULL);
 
+  states = g_ptr_array_new_full (fetchers->len, (GDestroyNotify) fetcher_state_free);
+
   for (idx = 0; idx < fetchers->len; ++idx)
     {
-      MetadataFetcher fetcher = g_ptr_array_index (fetchers, idx);
-      g_autoptr(EosUpdateInfo) info = NULL;
+      FetcherState *state = g_new0 (FetcherState, 1);
       EosUpdaterDownloadSource source = g_array_index (sources,
                                                        EosUpdaterDownloadSource,
                                                        idx);
-      const gchar *name = download_source_to_string (source);
-      g_autoptr(GError) local_error = NULL;
 
-      if (!fetcher (repo, context, &info, cancellable, &local_error))
+      state->fetcher = g_ptr_array_index (fetchers, idx);
+      state->fetcher_data = fetcher_data;
+      state->repo_path = g_object_ref (ostree_repo_get_path (repo));
+      state->cancellable = g_cancellable_new ();
+      state->timeout_seconds = (source_timeouts != NULL) ? source_timeouts[source] : 0;
+      state->n_pending = &n_pending;
+      g_ptr_array_add (states, state);
+    }
+
+  if (cancellable != NULL)
+    cancelled_id = g_cancellable_connect (cancellable,
+                                          G_CALLBACK (cancel_fetchers_cb),
+                                          states, NULL);
+
+  /* The #GTask callbacks are invoked in the thread-default main context at the
+   * time the task is created, which must be @context. */
+  g_main_context_push_thread_default (context);
+
+  for (idx = 0; idx < states->len; ++idx)
+    {
+      FetcherState *state = g_ptr_array_index (states, idx);
+      g_autoptr(GTask) task = NULL;
+
+      if (state->timeout_seconds > 0)
         {
-          if (g_error_matches (local_error, G_IO_ERROR, G_IO_ERROR_CANCELLED))
+          state->timeout_source = g_timeout_source_new_seconds (state->timeout_seconds);
+          g_source_set_callback (state->timeout_source, fetcher_timeout_cb, state, NULL);
+          g_source_attach (state->timeout_source, context);
+        }
+
+      state->start_time = g_get_monotonic_time ();
+
+      task = g_task_new (NULL, state->cancellable, fetcher_finished_cb, state);
+      g_task_set_source_tag (task, run_fetchers);
+      g_task_set_task_data (task, state, NULL);
+      g_task_run_in_thread (task, fetcher_thread_cb);
+      n_pending++;
+    }
+
+  g_main_context_pop_thread_default (context);
+
+  /* Wait for all the fetchers to finish. The states must outlive their
+   * threads, so the ones which are cancelled are waited for too. */
+  while (n_pending > 0)
+    {
+      g_main_context_iteration (context, TRUE);
+
+      if (have_offline_update (states, sources))
+        {
+          for (idx = 0; idx < states->len; ++idx)
             {
-              g_propagate_error (error, g_steal_pointer (&local_error));
-              return NULL;
+              FetcherState *state = g_ptr_array_index (states, idx);
+              EosUpdaterDownloadSource source = g_array_index (sources,
+                                                               EosUpdaterDownloadSource,
+                                                               idx);
+
+              if (!download_source_is_offline (source) &&
+                  !state->finished && !state->superseded)
+                {
+                  state->superseded = TRUE;
+                  g_cancellable_cancel (state->cancellable);
+                }
             }
+        }
+    }
+
+  if (cancellable != NULL)
+    g_cancellable_disconnect (cancellable, cancelled_id);
+
+  if (g_cancellable_set_error_if_cancelled (cancellable, error))
+    return NULL;
+
+  offline_update = have_offline_update (states, sources);
+
+  for (idx = 0; idx < states->len; ++idx)
+    {
+      FetcherState *state = g_ptr_array_index (states, idx);
+      EosUpdaterDownloadSource source = g_array_index (sources,
+                                                       EosUpdaterDownloadSource,
+                                                       idx);
+      const gchar *name = download_source_to_string (source);
+
+      if (source_reports != NULL)
+        add_source_report (source_reports, name, state);
 
-          g_message ("Failed to poll metadata from source %s: %s",
-                     name, local_error->message);
+      if (state->superseded)
+        {
+          g_debug ("%s: Not waiting for source %s as an offline source has an update",
+                   G_STRFUNC, name);
+          continue;
+        }
+
+      if (state->error != NULL)
+        {
+          if (state->timed_out)
+            g_message ("Timed out after %u seconds polling metadata from source %s",
+                       state->timeout_seconds, name);
+          else
+            g_message ("Failed to poll metadata from source %s: %s",
+                       name, state->error->message);
           continue;
         }
 
-      if (info != NULL)
+      if (state->info != NULL && offline_update &&
+          !download_source_is_offline (source))
+        {
+          g_debug ("%s: Ignoring update from source %s as an offline source has an update",
+                   G_STRFUNC, name);
+          continue;
+        }
+
+      if (state->info != NULL)
         {
           g_hash_table_insert (source_to_update,
-                               (gpointer) name, g_object_ref (info));
+                               (gpointer) name, g_object_ref (state->info));
         }
     }
 
@@ -1642,6 +2596,49 @@ string_to_download_source (const gchar *str,
       (a) = G_MAXINT64;            \
   } G_STMT_END
 
+#ifdef HAVE_OSTREE_COMMIT_GET_OBJECT_SIZES
+/* Cache of the sizes computed by get_commit_sizes(), keyed by repository path,
+ * commit checksum, and the inode and modification time of the commit object.
+ * The full sizes of a commit never change, and between polls objects are only
+ * ever added to the repository, so only the objects which were missing last
+ * time need checking again. Pruning can remove objects, so the cache is
+ * cleared by clear_commit_sizes_cache() whenever the updater prunes the
+ * repository. Something else (such as `ostree prune`) can also prune it;
+ * that only removes the objects of commits which are no longer referenced,
+ * and removes the commit object with them, so if the commit is pulled again,
+ * its new commit object doesn’t match the cached entry. */
+typedef struct
+{
+  guint64 archived;
+  guint64 unpacked;
+  GPtrArray *missing;  /* (owned) (element-type OstreeCommitSizesEntry) */
+} CommitSizes;
+
+static void
+commit_sizes_free (CommitSizes *sizes)
+{
+  g_clear_pointer (&sizes->missing, g_ptr_array_unref);
+  g_free (sizes);
+}
+
+/* Maximum number of commits to cache sizes for; there is normally only one
+ * update on offer at a time. */
+#define MAX_CACHED_COMMIT_SIZES 8
+
+G_LOCK_DEFINE_STATIC (commit_sizes_cache);
+static GHashTable *commit_sizes_cache = NULL;  /* (owned) (nullable) (element-type utf8 CommitSizes) */
+#endif  /* HAVE_OSTREE_COMMIT_GET_OBJECT_SIZES */
+
+void
+clear_commit_sizes_cache (void)
+{
+#ifdef HAVE_OSTREE_COMMIT_GET_OBJECT_SIZES
+  G_LOCK (commit_sizes_cache);
+  g_clear_pointer (&commit_sizes_cache, g_hash_table_unref);
+  G_UNLOCK (commit_sizes_cache);
+#endif
+}
+
 static gboolean
 get_commit_sizes (OstreeRepo    *repo,
                   const gchar   *checksum,
@@ -1658,26 +2655,68 @@ get_commit_sizes (OstreeRepo    *repo,
   g_return_val_if_fail (unpacked != NULL, FALSE);
 
 #ifdef HAVE_OSTREE_COMMIT_GET_OBJECT_SIZES
-  g_autoptr(GVariant) commit = NULL;
-  if (!ostree_repo_load_variant (repo, OSTREE_OBJECT_TYPE_COMMIT, checksum,
-                                 &commit, error))
+  g_autofree gchar *repo_path = g_file_get_path (ostree_repo_get_path (repo));
+  g_autofree gchar *commit_relpath = ostree_get_relative_object_path (checksum, OSTREE_OBJECT_TYPE_COMMIT, TRUE);
+  g_autofree gchar *commit_path = g_build_filename (repo_path, commit_relpath, NULL);
+  g_autofree gchar *key = NULL;
+  g_autoptr(GPtrArray) candidates = NULL;  /* (element-type OstreeCommitSizesEntry) */
+  g_autoptr(GPtrArray) missing = NULL;  /* (element-type OstreeCommitSizesEntry) */
+  guint64 full_archived = 0, full_unpacked = 0;
+  CommitSizes *cached;
+  struct stat commit_buf;
+
+  /* If the commit object can’t be stat()ed, loading it below will fail. */
+  if (stat (commit_path, &commit_buf) == 0)
+    key = g_strdup_printf ("%s:%s:%" G_GUINT64_FORMAT ":%" G_GINT64_FORMAT ".%09ld",
+                           repo_path, checksum, (guint64) commit_buf.st_ino,
+                           (gint64) commit_buf.st_mtim.tv_sec,
+                           (long) commit_buf.st_mtim.tv_nsec);
+
+  G_LOCK (commit_sizes_cache);
+  cached = (commit_sizes_cache != NULL && key != NULL) ? g_hash_table_lookup (commit_sizes_cache, key) : NULL;
+  if (cached != NULL)
     {
-      g_prefix_error (error, "Failed to read commit: ");
-      return FALSE;
+      full_archived = cached->archived;
+      full_unpacked = cached->unpacked;
+      candidates = g_ptr_array_ref (cached->missing);
     }
+  G_UNLOCK (commit_sizes_cache);
 
-  g_autoptr(GPtrArray) sizes = NULL;
-  if (!ostree_commit_get_object_sizes (commit, &sizes, error))
-    return FALSE;
+  if (candidates != NULL)
+    {
+      g_debug ("%s: Reusing sizes for commit %s; checking %u previously missing objects",
+               G_STRFUNC, checksum, candidates->len);
+    }
+  else
+    {
+      g_autoptr(GVariant) commit = NULL;
+
+      if (!ostree_repo_load_variant (repo, OSTREE_OBJECT_TYPE_COMMIT, checksum,
+                                     &commit, error))
+        {
+          g_prefix_error (error, "Failed to read commit: ");
+          return FALSE;
+        }
+
+      if (!ostree_commit_get_object_sizes (commit, &candidates, error))
+        return FALSE;
+
+      for (guint i = 0; i < candidates->len; i++)
+        {
+          OstreeCommitSizesEntry *entry = candidates->pdata[i];
+
+          SATURATED_INCREMENT_GUINT64 (full_archived, entry->archived);
+          SATURATED_INCREMENT_GUINT64 (full_unpacked, entry->unpacked);
+        }
+    }
+
+  missing = g_ptr_array_new_with_free_func ((GDestroyNotify) ostree_commit_sizes_entry_free);
 
-  for (guint i = 0; i < sizes->len; i++)
+  for (guint i = 0; i < candidates->len; i++)
     {
-      OstreeCommitSizesEntry *entry = sizes->pdata[i];
+      OstreeCommitSizesEntry *entry = candidates->pdata[i];
       gboolean exists;
 
-      SATURATED_INCREMENT_GUINT64 (*archived, entry->archived);
-      SATURATED_INCREMENT_GUINT64 (*unpacked, entry->unpacked);
-
       if (!ostree_repo_has_object (repo, entry->objtype, entry->checksum,
                                    &exists, cancellable, error))
         return FALSE;
@@ -1687,9 +2726,32 @@ get_commit_sizes (OstreeRepo    *repo,
           /* Object not in local repo */
           SATURATED_INCREMENT_GUINT64 (*new_archived, entry->archived);
           SATURATED_INCREMENT_GUINT64 (*new_unpacked, entry->unpacked);
+          g_ptr_array_add (missing, ostree_commit_sizes_entry_copy (entry));
         }
     }
 
+  SATURATED_INCREMENT_GUINT64 (*archived, full_archived);
+  SATURATED_INCREMENT_GUINT64 (*unpacked, full_unpacked);
+
+  if (key == NULL)
+    return TRUE;
+
+  cached = g_new0 (CommitSizes, 1);
+  cached->archived = full_archived;
+  cached->unpacked = full_unpacked;
+  cached->missing = g_steal_pointer (&missing);
+
+  G_LOCK (commit_sizes_cache);
+  if (commit_sizes_cache == NULL ||
+      g_hash_table_size (commit_sizes_cache) >= MAX_CACHED_COMMIT_SIZES)
+    {
+      g_clear_pointer (&commit_sizes_cache, g_hash_table_unref);
+      commit_sizes_cache = g_hash_table_new_full (g_str_hash, g_str_equal, g_free,
+                                                  (GDestroyNotify) commit_sizes_free);
+    }
+  g_hash_table_replace (commit_sizes_cache, g_steal_pointer (&key), cached);
+  G_UNLOCK (commit_sizes_cache);
+
   return TRUE;
 #else
   /* API not available, just pretend as if sizes could not be found */
@@ -1699,6 +2761,205 @@ get_commit_sizes (OstreeRepo    *repo,
 #endif
 }
 
+/* Estimate the number of bytes which will be downloaded to pull
+ * @to_checksum (as @ref) from @remote_name (or @url_override), if libostree
+ * will use a static delta for it. libostree uses such a delta in preference
+ * to fetching individual objects. A dry-run pull is done to find out: it goes
+ * through libostree’s fetcher and the remote’s configuration, picks the delta
+ * as a real pull would, fetches only its superblock, and reports the total
+ * size of the delta’s parts in its progress.
+ *
+ * Returns %G_IO_ERROR_NOT_FOUND if there is no delta libostree would use. */
+static gboolean
+get_delta_download_size (OstreeRepo    *repo,
+                         const gchar   *remote_name,
+                         const gchar   *url_override,
+                         const gchar   *ref,
+                         const gchar   *to_checksum,
+                         guint64       *out_download_size,
+                         GCancellable  *cancellable,
+                         GError       **error)
+{
+  g_auto(GVariantBuilder) builder;
+  g_autoptr(GVariant) options = NULL;
+  g_autoptr(OstreeAsyncProgress) progress = NULL;
+  g_autoptr(GVariant) n_superblocks_v = NULL;
+  g_autoptr(GVariant) part_size_v = NULL;
+  g_autoptr(GError) local_error = NULL;
+
+  g_variant_builder_init (&builder, G_VARIANT_TYPE ("a{sv}"));
+  if (url_override != NULL)
+    g_variant_builder_add (&builder, "{s@v}", "override-url",
+                           g_variant_new_variant (g_variant_new_string (url_override)));
+  g_variant_builder_add (&builder, "{s@v}", "refs",
+                         g_variant_new_variant (g_variant_new_strv (&ref, 1)));
+  g_variant_builder_add (&builder, "{s@v}", "override-commit-ids",
+                         g_variant_new_variant (g_variant_new_strv (&to_checksum, 1)));
+  g_variant_builder_add (&builder, "{s@v}", "require-static-deltas",
+                         g_variant_new_variant (g_variant_new_boolean (TRUE)));
+  g_variant_builder_add (&builder, "{s@v}", "dry-run",
+                         g_variant_new_variant (g_variant_new_boolean (TRUE)));
+  options = g_variant_ref_sink (g_variant_builder_end (&builder));
+
+  progress = ostree_async_progress_new ();
+
+  /* libostree has no specific error for there being no delta to use, so
+   * treat any failure other than cancellation as that. */
+  if (!ostree_repo_pull_with_options (repo, remote_name, options, progress,
+                                      cancellable, &local_error))
+    {
+      if (g_error_matches (local_error, G_IO_ERROR, G_IO_ERROR_CANCELLED))
+        {
+          g_propagate_error (error, g_steal_pointer (&local_error));
+          return FALSE;
+        }
+
+      g_set_error (error, G_IO_ERROR, G_IO_ERROR_NOT_FOUND,
+                   "No usable static delta to %s: %s",
+                   to_checksum, local_error->message);
+      return FALSE;
+    }
+
+  n_superblocks_v = ostree_async_progress_get_variant (progress, "total-delta-superblocks");
+  part_size_v = ostree_async_progress_get_variant (progress, "total-delta-part-size");
+
+  if (n_superblocks_v == NULL || g_variant_get_uint32 (n_superblocks_v) == 0 ||
+      part_size_v == NULL)
+    {
+      g_set_error (error, G_IO_ERROR, G_IO_ERROR_NOT_FOUND,
+                   "No usable static delta to %s", to_checksum);
+      return FALSE;
+    }
+
+  *out_download_size = g_variant_get_uint64 (part_size_v);
+
+  return TRUE;
+}
+
+/* Work out the download and unpacked sizes of the update in @result (if any)
+ * against @repo, and store them in @result. This can involve checking for
+ * hundreds of thousands of objects in @repo, so must be called from the poll
+ * worker thread rather than the main thread. The sizes are left as -1 if the
+ * commit has no size metadata. */
+gboolean
+poll_result_compute_sizes (PollResult    *result,
+                           OstreeRepo    *repo,
+                           GCancellable  *cancellable,
+                           GError       **error)
+{
+  guint64 archived = 0;
+  guint64 unpacked = 0;
+  guint64 new_archived = 0;
+  guint64 new_unpacked = 0;
+  guint64 delta_download_size = 0;
+  g_autofree gchar *remote_name = NULL;
+  g_autofree gchar *ref = NULL;
+  const gchar *url_override;
+  g_autoptr(GError) local_error = NULL;
+
+  g_return_val_if_fail (result != NULL, FALSE);
+  g_return_val_if_fail (OSTREE_IS_REPO (repo), FALSE);
+  g_return_val_if_fail (error == NULL || *error == NULL, FALSE);
+
+  if (result->info == NULL)
+    return TRUE;
+
+  if (get_commit_sizes (repo, result->info->checksum,
+                        &new_archived, &new_unpacked,
+                        &archived, &unpacked,
+                        cancellable, &local_error))
+    {
+      /* Clamp to signed 64 bit max */
+      CLAMP_GUINT64_TO_GINT64 (archived);
+      CLAMP_GUINT64_TO_GINT64 (unpacked);
+      CLAMP_GUINT64_TO_GINT64 (new_archived);
+      CLAMP_GUINT64_TO_GINT64 (new_unpacked);
+      result->full_download_size = (gint64) archived;
+      result->full_unpacked_size = (gint64) unpacked;
+      result->download_size = (gint64) new_archived;
+      result->unpacked_size = (gint64) new_unpacked;
+      result->download_size_estimate = "objects";
+    }
+  else if (g_error_matches (local_error, G_IO_ERROR, G_IO_ERROR_NOT_FOUND))
+    {
+      /* no size data available or no size parsing API available; this
+       * shouldn't actually stop us offering an update, as long as the
+       * branch itself is resolvable in the next step, but log it anyway. */
+      g_message ("No size summary data: %s", local_error->message);
+      g_clear_error (&local_error);
+    }
+  else
+    {
+      g_propagate_error (error, g_steal_pointer (&local_error));
+      return FALSE;
+    }
+
+  /* If there’s a static delta to the update which libostree will use, it
+   * will download that rather than the missing objects, so estimate the
+   * download size from the delta instead. Deltas are only looked up on
+   * the remote itself, not on LAN or USB sources. */
+  if (result->info->offline_results_only)
+    return TRUE;
+
+  if (!ostree_parse_refspec (result->info->new_refspec, &remote_name, &ref, &local_error))
+    {
+      g_debug ("%s: Not looking for a static delta: %s", G_STRFUNC, local_error->message);
+      return TRUE;
+    }
+
+  url_override = (result->info->urls != NULL) ? result->info->urls[0] : NULL;
+
+  if (remote_name != NULL &&
+      get_delta_download_size (repo, remote_name, url_override, ref,
+                               result->info->checksum,
+                               &delta_download_size, cancellable, &local_error))
+    {
+      CLAMP_GUINT64_TO_GINT64 (delta_download_size);
+      g_debug ("%s: Download size estimated from static delta as %" G_GUINT64_FORMAT
+               " bytes (from objects: %" G_GINT64_FORMAT " bytes)",
+               G_STRFUNC, delta_download_size, result->download_size);
+      result->download_size = (gint64) delta_download_size;
+      result->download_size_estimate = "delta";
+    }
+  else if (g_error_matches (local_error, G_IO_ERROR, G_IO_ERROR_CANCELLED))
+    {
+      g_propagate_error (error, g_steal_pointer (&local_error));
+      return FALSE;
+    }
+  else if (local_error != NULL)
+    {
+      g_debug ("%s: Not estimating download size from a static delta: %s",
+               G_STRFUNC, local_error->message);
+    }
+
+  return TRUE;
+}
+
+static const gchar *
+get_config_file_path (void)
+{
+  return eos_updater_get_envvar_or ("EOS_UPDATER_TEST_UPDATER_CONFIG_FILE_PATH",
+                                    CONFIG_FILE_PATH);
+}
+
+/* Load eos-updater.conf, falling back to the defaults compiled into the
+ * daemon for any keys which are not set. This is used by both the poll and
+ * fetch stages, so the file is re-read each time; it is small. */
+EuuConfigFile *
+eos_updater_load_config_file (void)
+{
+  const gchar * const paths[] =
+    {
+      get_config_file_path (),  /* typically CONFIG_FILE_PATH unless testing */
+      LOCAL_CONFIG_FILE_PATH,
+      STATIC_CONFIG_FILE_PATH,
+      NULL
+    };
+
+  return euu_config_file_new (paths, eos_updater_resources_get_resource (),
+                              "/com/endlessm/Updater/config/eos-updater.conf");
+}
+
 void
 metadata_fetch_finished (GObject *object,
                          GAsyncResult *res,
@@ -1708,22 +2969,24 @@ metadata_fetch_finished (GObject *object,
   GTask *task;
   GError *error = NULL;
   EosUpdaterData *data = user_data;
-  OstreeRepo *repo = data->repo;
-  g_autoptr(EosUpdateInfo) info = NULL;
+  g_autoptr(PollResult) result = NULL;
+  EosUpdateInfo *info = NULL;
 
   if (!g_task_is_valid (res, object))
     goto invalid_task;
 
   /* get the info about the fetched update */
   task = G_TASK (res);
-  info = g_task_propagate_pointer (task, &error);
+  result = g_task_propagate_pointer (task, &error);
+
+  if (result != NULL)
+    {
+      info = result->info;
+      eos_updater_set_poll_sources (updater, result->source_reports);
+    }
 
   if (info != NULL)
     {
-      guint64 archived = 0;
-      guint64 unpacked = 0;
-      guint64 new_archived = 0;
-      guint64 new_unpacked = 0;
       const gchar *label;
       const gchar *message;
 
@@ -1735,6 +2998,17 @@ metadata_fetch_finished (GObject *object,
 
       data->offline_results_only = info->offline_results_only;
 
+      /* The sizes were computed in the poll thread by
+       * poll_result_compute_sizes(); set them before changing state so
+       * they’re ready as soon as clients see the update. -1 means that no
+       * size data is available. */
+      eos_updater_set_full_download_size (updater, result->full_download_size);
+      eos_updater_set_full_unpacked_size (updater, result->full_unpacked_size);
+      eos_updater_set_download_size (updater, result->download_size);
+      eos_updater_set_unpacked_size (updater, result->unpacked_size);
+      eos_updater_set_downloaded_bytes (updater, (result->download_size >= 0) ? 0 : -1);
+      eos_updater_set_download_size_estimate (updater, result->download_size_estimate);
+
       /* Everything is happy thusfar */
       /* if we have a checksum for the remote upgrade candidate
        * and it's ≠ what we're currently booted into, advertise it as such.
@@ -1752,42 +3026,15 @@ metadata_fetch_finished (GObject *object,
       eos_updater_set_update_label (updater, label ? label : "");
       eos_updater_set_update_message (updater, message ? message : "");
 
-      if (get_commit_sizes (repo, info->checksum,
-                            &new_archived, &new_unpacked,
-                            &archived, &unpacked,
-                            g_task_get_cancellable (task),
-                            &error))
-        {
-          /* Clamp to signed 64 bit max */
-          CLAMP_GUINT64_TO_GINT64 (archived);
-          CLAMP_GUINT64_TO_GINT64 (unpacked);
-          CLAMP_GUINT64_TO_GINT64 (new_archived);
-          CLAMP_GUINT64_TO_GINT64 (new_unpacked);
-          eos_updater_set_full_download_size (updater, (gint64) archived);
-          eos_updater_set_full_unpacked_size (updater, (gint64) unpacked);
-          eos_updater_set_download_size (updater, (gint64) new_archived);
-          eos_updater_set_unpacked_size (updater, (gint64) new_unpacked);
-          eos_updater_set_downloaded_bytes (updater, 0);
-        }
-      else if (g_error_matches (error, G_IO_ERROR, G_IO_ERROR_NOT_FOUND))
-        {
-          /* no size data available or no size parsing API available */
-          eos_updater_set_full_download_size (updater, -1);
-          eos_updater_set_full_unpacked_size (updater, -1);
-          eos_updater_set_download_size (updater, -1);
-          eos_updater_set_unpacked_size (updater, -1);
-          eos_updater_set_downloaded_bytes (updater, -1);
-
-          /* shouldn't actually stop us offering an update, as long
-           * as the branch itself is resolvable in the next step,
-           * but log it anyway.
-           */
-          g_message ("No size summary data: %s", error->message);
-          g_clear_error (&error);
-        }
+      eos_updater_data_save_state (data, updater, FALSE);
     }
   else /* info == NULL means OnHold=true, nothing to do here */
-    eos_updater_clear_error (updater, EOS_UPDATER_STATE_READY);
+    {
+      eos_updater_clear_error (updater, EOS_UPDATER_STATE_READY);
+
+      if (error == NULL)
+        eos_updater_data_forget_state ();
+    }
 
   if (error)
     {
@@ -27,6 +27,7 @@
 #include <eos-updater/data.h>
 #include <glib.h>
 #include <gio/gio.h>
+#include <libeos-updater-util/config-util.h>
 #include <ostree.h>
 
 G_BEGIN_DECLS
@@ -81,6 +82,8 @@ struct _EosUpdateInfo
   gboolean offline_results_only;
   gboolean is_user_visible;
   gchar *release_notes_uri;
+  guint redirect_hops;
+  guint64 resolve_milliseconds;
 
   OstreeRepoFinderResult **results;  /* (owned) (array zero-terminated=1) */
 };
@@ -102,6 +105,7 @@ eos_update_info_get_commit_timestamp (EosUpdateInfo *info);
 
 typedef gboolean (*MetadataFetcher) (OstreeRepo     *repo,
                                      GMainContext   *context,
+                                     gpointer        user_data,
                                      EosUpdateInfo **out_info,
                                      GCancellable   *cancellable,
                                      GError        **error);
@@ -131,6 +135,8 @@ gboolean fetch_latest_commit (OstreeRepo *repo,
                               gchar **out_new_refspec,
                               gchar **out_version,
                               gchar **out_release_notes_uri_template,
+                              guint *out_redirect_hops,
+                              guint64 *out_resolve_milliseconds,
                               GError **error);
 
 gboolean parse_latest_commit (OstreeRepo           *repo,
@@ -165,12 +171,44 @@ gboolean string_to_download_source (const gchar *str,
                                     EosUpdaterDownloadSource *source,
                                     GError **error);
 
-EosUpdateInfo *run_fetchers (OstreeRepo   *repo,
-                             GMainContext *context,
-                             GCancellable *cancellable,
-                             GPtrArray    *fetchers,
-                             GArray       *sources,
-                             GError      **error);
+EosUpdateInfo *run_fetchers (OstreeRepo      *repo,
+                             GMainContext    *context,
+                             GCancellable    *cancellable,
+                             GPtrArray       *fetchers,
+                             GArray          *sources,
+                             gpointer         fetcher_data,
+                             const guint     *source_timeouts,
+                             GVariantBuilder *source_reports,
+                             GError         **error);
+
+typedef struct
+{
+  EosUpdateInfo *info;  /* (owned) (nullable) */
+  GVariant *source_reports;  /* (owned) (not nullable) (type aa{sv}) */
+
+  /* Sizes of the update, or -1 if unknown; set by poll_result_compute_sizes() */
+  gint64 full_download_size;
+  gint64 full_unpacked_size;
+  gint64 download_size;
+  gint64 unpacked_size;
+  /* How @download_size was estimated: `objects`, `delta`, or empty if it’s
+   * unknown */
+  const gchar *download_size_estimate;  /* (not owned) */
+} PollResult;
+
+PollResult *poll_result_new (EosUpdateInfo *info,
+                             GVariant      *source_reports);
+void poll_result_free (PollResult *result);
+gboolean poll_result_compute_sizes (PollResult    *result,
+                                    OstreeRepo    *repo,
+                                    GCancellable  *cancellable,
+                                    GError       **error);
+
+void clear_commit_sizes_cache (void);
+
+G_DEFINE_AUTOPTR_CLEANUP_FUNC (PollResult, poll_result_free)
+
+EuuConfigFile *eos_updater_load_config_file (void);
 
 void metadata_fetch_finished (GObject *object,
                               GAsyncResult *res,
@@ -28,16 +28,18 @@
 #include <eos-updater/object.h>
 #include <eos-updater/poll-common.h>
 #include <eos-updater/poll.h>
-#include <eos-updater/resources.h>
 #include <libeos-updater-util/config-util.h>
 #include <libeos-updater-util/ostree-util.h>
 #include <libeos-updater-util/util.h>
 
-static const gchar *const CONFIG_FILE_PATH = SYSCONFDIR "/eos-updater/eos-updater.conf";
-static const gchar *const LOCAL_CONFIG_FILE_PATH = PREFIX "/local/share/eos-updater/eos-updater.conf";
-static const gchar *const STATIC_CONFIG_FILE_PATH = DATADIR "/eos-updater/eos-updater.conf";
 static const gchar *const DOWNLOAD_GROUP = "Download";
 static const gchar *const ORDER_KEY = "Order";
+static const gchar *const TIMEOUT_KEYS[] = {
+  "MainTimeoutSeconds",  /* EOS_UPDATER_DOWNLOAD_MAIN */
+  "LanTimeoutSeconds",  /* EOS_UPDATER_DOWNLOAD_LAN */
+  "VolumeTimeoutSeconds",  /* EOS_UPDATER_DOWNLOAD_VOLUME */
+};
+G_STATIC_ASSERT (G_N_ELEMENTS (TIMEOUT_KEYS) == EOS_UPDATER_DOWNLOAD_LAST + 1);
 
 static gboolean
 strv_to_download_order (gchar **sources,
@@ -79,50 +81,42 @@ strv_to_download_order (gchar **sources,
   return TRUE;
 }
 
-static const gchar *
-get_config_file_path (void)
-{
-  return eos_updater_get_envvar_or ("EOS_UPDATER_TEST_UPDATER_CONFIG_FILE_PATH",
-                                    CONFIG_FILE_PATH);
-}
-
 typedef struct
 {
   GArray *download_order;
   /* @override_uris must be non-empty if it’s non-%NULL: */
   gchar **override_uris;  /* (owned) (nullable) (array zero-terminated=1) */
+  /* Time budget for polling each source, in seconds, or 0 for no deadline;
+   * indexed by #EosUpdaterDownloadSource: */
+  guint timeouts[EOS_UPDATER_DOWNLOAD_LAST + 1];
+  /* Already-running finder to use for the LAN source, if any; it runs in the
+   * main context, so must only be used through an #EosRepoFinderProxy: */
+  OstreeRepoFinderAvahi *finder_avahi;  /* (owned) (nullable) */
 } SourcesConfig;
 
-#define SOURCES_CONFIG_CLEARED { NULL, NULL }
+#define SOURCES_CONFIG_CLEARED { NULL, NULL, { 0, }, NULL }
 
 static void
 sources_config_clear (SourcesConfig *config)
 {
   g_clear_pointer (&config->download_order, g_array_unref);
   g_clear_pointer (&config->override_uris, g_strfreev);
+  g_clear_object (&config->finder_avahi);
 }
 
 G_DEFINE_AUTO_CLEANUP_CLEAR_FUNC (SourcesConfig, sources_config_clear)
 
 static gboolean
-read_config (const gchar *config_file_path,
-             SourcesConfig *sources_config,
+read_config (SourcesConfig *sources_config,
              GError **error)
 {
   g_autoptr(EuuConfigFile) config = NULL;
   g_auto(GStrv) download_order_strv = NULL;
   g_autofree gchar *group_name = NULL;
-  const gchar * const paths[] =
-    {
-      config_file_path,  /* typically CONFIG_FILE_PATH unless testing */
-      LOCAL_CONFIG_FILE_PATH,
-      STATIC_CONFIG_FILE_PATH,
-      NULL
-    };
+  EosUpdaterDownloadSource source;
 
   /* Load the config file. */
-  config = euu_config_file_new (paths, eos_updater_resources_get_resource (),
-                                "/com/endlessm/Updater/config/eos-updater.conf");
+  config = eos_updater_load_config_file ();
 
   /* Parse the options. */
   download_order_strv = euu_config_file_get_strv (config,
@@ -146,106 +140,263 @@ read_config (const gchar *config_file_path,
   if (sources_config->override_uris != NULL && sources_config->override_uris[0] == NULL)
     g_clear_pointer (&sources_config->override_uris, g_strfreev);
 
+  for (source = EOS_UPDATER_DOWNLOAD_FIRST; source <= EOS_UPDATER_DOWNLOAD_LAST; source++)
+    {
+      g_autoptr(GError) local_error = NULL;
+
+      sources_config->timeouts[source] = euu_config_file_get_uint (config,
+                                                                   DOWNLOAD_GROUP,
+                                                                   TIMEOUT_KEYS[source],
+                                                                   0, G_MAXUINT,
+                                                                   &local_error);
+      if (local_error != NULL)
+        {
+          g_propagate_error (error, g_steal_pointer (&local_error));
+          return FALSE;
+        }
+    }
+
   return TRUE;
 }
 
+/* #OstreeRepoFinder which forwards resolve requests to another finder, running
+ * them in the #GMainContext that finder belongs to. #OstreeRepoFinderAvahi is
+ * tied to the context it was created in and isn’t thread safe, so the
+ * long-lived one (see update_finder_avahi()) can only be used by the poll
+ * worker threads through one of these. The results are returned to the
+ * thread which called ostree_repo_finder_resolve_async(). */
+#define EOS_TYPE_REPO_FINDER_PROXY (eos_repo_finder_proxy_get_type ())
+G_DECLARE_FINAL_TYPE (EosRepoFinderProxy, eos_repo_finder_proxy, EOS, REPO_FINDER_PROXY, GObject)
+
+struct _EosRepoFinderProxy
+{
+  GObject parent_instance;
+
+  OstreeRepoFinder *finder;  /* (owned) */
+  GMainContext *context;  /* (owned) */
+};
+
+static void eos_repo_finder_proxy_iface_init (OstreeRepoFinderInterface *iface);
+
+G_DEFINE_TYPE_WITH_CODE (EosRepoFinderProxy, eos_repo_finder_proxy, G_TYPE_OBJECT,
+                         G_IMPLEMENT_INTERFACE (OSTREE_TYPE_REPO_FINDER,
+                                                eos_repo_finder_proxy_iface_init))
+
 static void
-object_unref0 (gpointer obj)
+eos_repo_finder_proxy_finalize (GObject *object)
 {
-  if (obj == NULL)
-    return;
-  g_object_unref (obj);
+  EosRepoFinderProxy *self = EOS_REPO_FINDER_PROXY (object);
+
+  g_clear_object (&self->finder);
+  g_clear_pointer (&self->context, g_main_context_unref);
+
+  G_OBJECT_CLASS (eos_repo_finder_proxy_parent_class)->finalize (object);
 }
 
 static void
-get_finders (SourcesConfig          *config,
-             GMainContext           *context,
-             GPtrArray             **out_offline_finders,
-             GPtrArray             **out_online_finders,
-             OstreeRepoFinderAvahi **out_finder_avahi)
+eos_repo_finder_proxy_class_init (EosRepoFinderProxyClass *klass)
 {
-  g_autoptr(OstreeRepoFinderAvahi) finder_avahi = NULL;
-  g_autoptr(GPtrArray) offline_finders = g_ptr_array_new_full (0, object_unref0);
-  g_autoptr(GPtrArray) online_finders = g_ptr_array_new_full (0, object_unref0);
+  GObjectClass *object_class = G_OBJECT_CLASS (klass);
+
+  object_class->finalize = eos_repo_finder_proxy_finalize;
+}
+
+static void
+eos_repo_finder_proxy_init (EosRepoFinderProxy *self)
+{
+  /* nothing here */
+}
+
+typedef struct
+{
+  OstreeCollectionRef **refs;  /* (owned) (array zero-terminated=1) */
+  OstreeRepo *parent_repo;  /* (owned) */
+} ProxyResolveData;
+
+static void
+proxy_resolve_data_free (ProxyResolveData *data)
+{
+  ostree_collection_ref_freev (data->refs);
+  g_clear_object (&data->parent_repo);
+  g_free (data);
+}
+
+/* Runs in the proxied finder’s context. */
+static void
+proxy_resolve_cb (GObject      *source_object,
+                  GAsyncResult *result,
+                  gpointer      user_data)
+{
+  g_autoptr(GTask) task = G_TASK (user_data);
+  g_autoptr(GPtrArray) results = NULL;
   g_autoptr(GError) local_error = NULL;
-  gsize i;
 
-  /* FIXME: Refactor the download_order handling once the old code paths have
-   * been dropped, since we no longer care about the *order* of entries in
-   * download_order. */
-  g_assert (config->download_order->len > 0);
+  results = ostree_repo_finder_resolve_finish (OSTREE_REPO_FINDER (source_object),
+                                               result, &local_error);
+
+  if (results == NULL)
+    g_task_return_error (task, g_steal_pointer (&local_error));
+  else
+    g_task_return_pointer (task, g_steal_pointer (&results),
+                           (GDestroyNotify) g_ptr_array_unref);
+}
 
-  for (i = 0; i < config->download_order->len; i++)
+/* Runs in the proxied finder’s context. */
+static gboolean
+proxy_resolve_invoke_cb (gpointer user_data)
+{
+  GTask *task = G_TASK (user_data);  /* (transfer full) */
+  EosRepoFinderProxy *self = g_task_get_source_object (task);
+  ProxyResolveData *data = g_task_get_task_data (task);
+
+  ostree_repo_finder_resolve_async (self->finder,
+                                    (const OstreeCollectionRef * const *) data->refs,
+                                    data->parent_repo,
+                                    g_task_get_cancellable (task),
+                                    proxy_resolve_cb,
+                                    task);
+
+  return G_SOURCE_REMOVE;
+}
+
+static void
+eos_repo_finder_proxy_resolve_async (OstreeRepoFinder                  *finder,
+                                     const OstreeCollectionRef * const *refs,
+                                     OstreeRepo                        *parent_repo,
+                                     GCancellable                      *cancellable,
+                                     GAsyncReadyCallback                callback,
+                                     gpointer                           user_data)
+{
+  EosRepoFinderProxy *self = EOS_REPO_FINDER_PROXY (finder);
+  g_autoptr(GTask) task = NULL;
+  ProxyResolveData *data;
+
+  task = g_task_new (self, cancellable, callback, user_data);
+  g_task_set_source_tag (task, eos_repo_finder_proxy_resolve_async);
+
+  data = g_new0 (ProxyResolveData, 1);
+  data->refs = ostree_collection_ref_dupv (refs);
+  data->parent_repo = g_object_ref (parent_repo);
+  g_task_set_task_data (task, data, (GDestroyNotify) proxy_resolve_data_free);
+
+  g_main_context_invoke (self->context, proxy_resolve_invoke_cb,
+                         g_steal_pointer (&task));
+}
+
+static GPtrArray *
+eos_repo_finder_proxy_resolve_finish (OstreeRepoFinder  *finder,
+                                      GAsyncResult      *result,
+                                      GError           **error)
+{
+  g_return_val_if_fail (g_task_is_valid (result, finder), NULL);
+
+  return g_task_propagate_pointer (G_TASK (result), error);
+}
+
+static void
+eos_repo_finder_proxy_iface_init (OstreeRepoFinderInterface *iface)
+{
+  iface->resolve_async = eos_repo_finder_proxy_resolve_async;
+  iface->resolve_finish = eos_repo_finder_proxy_resolve_finish;
+}
+
+static OstreeRepoFinder *
+eos_repo_finder_proxy_new (OstreeRepoFinder *finder,
+                           GMainContext     *context)
+{
+  EosRepoFinderProxy *self = g_object_new (EOS_TYPE_REPO_FINDER_PROXY, NULL);
+
+  self->finder = g_object_ref (finder);
+  self->context = g_main_context_ref (context);
+
+  return OSTREE_REPO_FINDER (self);
+}
+
+static void
+object_unref0 (gpointer obj)
+{
+  if (obj == NULL)
+    return;
+  g_object_unref (obj);
+}
+
+/* Create a finder for @source, using @context for any asynchronous work it
+ * needs to do. If override URIs are configured, they take the place of the
+ * main source. For %EOS_UPDATER_DOWNLOAD_LAN, the long-lived
+ * #OstreeRepoFinderAvahi from @config is used through an #EosRepoFinderProxy
+ * if that is set, as it runs in the main context; otherwise a new
+ * #OstreeRepoFinderAvahi is returned, already started. */
+static OstreeRepoFinder *
+get_finder_for_source (SourcesConfig             *config,
+                       EosUpdaterDownloadSource   source,
+                       GMainContext              *context,
+                       GError                   **error)
+{
+  switch (source)
     {
-      switch (g_array_index (config->download_order, EosUpdaterDownloadSource, i))
+    case EOS_UPDATER_DOWNLOAD_MAIN:
+      if (config->override_uris != NULL)
         {
-        case EOS_UPDATER_DOWNLOAD_MAIN:
-          g_ptr_array_add (online_finders, ostree_repo_finder_config_new ());
-          break;
-
-        case EOS_UPDATER_DOWNLOAD_LAN:
-          /* strv_to_download_order() already checks for duplicated download_order entries */
-          g_assert (finder_avahi == NULL);
-          finder_avahi = ostree_repo_finder_avahi_new (context);
-          g_ptr_array_add (offline_finders, g_object_ref (finder_avahi));
-          break;
-
-        case EOS_UPDATER_DOWNLOAD_VOLUME:
-          /* TODO: How to make this one testable? */
-          g_ptr_array_add (offline_finders, ostree_repo_finder_mount_new (NULL));
-          break;
-
-        default:
-          g_assert_not_reached ();
+          g_autoptr(OstreeRepoFinderOverride) finder_override = ostree_repo_finder_override_new ();
+          gsize i;
+
+          for (i = 0; config->override_uris[i] != NULL; i++)
+            {
+              g_message ("Poll: Adding override URI ‘%s’", config->override_uris[i]);
+              ostree_repo_finder_override_add_uri (finder_override, config->override_uris[i]);
+            }
+
+          return OSTREE_REPO_FINDER (g_steal_pointer (&finder_override));
         }
-    }
 
-  if (config->override_uris != NULL)
-    {
-      g_autoptr(OstreeRepoFinderOverride) finder_override = ostree_repo_finder_override_new ();
+      return OSTREE_REPO_FINDER (ostree_repo_finder_config_new ());
 
-      g_ptr_array_set_size (offline_finders, 0);  /* override everything */
-      g_ptr_array_set_size (online_finders, 0);  /* override everything */
+    case EOS_UPDATER_DOWNLOAD_LAN:
+      {
+        g_autoptr(OstreeRepoFinderAvahi) finder_avahi = NULL;
+        g_autoptr(GError) local_error = NULL;
 
-      /* We don't know if the URIs are online or offline; assume online so we
-       * don't accidentally bypass the scheduler */
-      g_ptr_array_add (online_finders, g_object_ref (finder_override));
+        if (config->finder_avahi != NULL)
+          return eos_repo_finder_proxy_new (OSTREE_REPO_FINDER (config->finder_avahi),
+                                            g_main_context_default ());
 
-      g_clear_object (&finder_avahi);
+        finder_avahi = ostree_repo_finder_avahi_new (context);
+        ostree_repo_finder_avahi_start (finder_avahi, &local_error);
 
-      for (i = 0; config->override_uris[i] != NULL; i++)
-        {
-          g_message ("Poll: Adding override URI ‘%s’", config->override_uris[i]);
-          ostree_repo_finder_override_add_uri (finder_override, config->override_uris[i]);
-        }
-    }
+        if (local_error != NULL)
+          {
+            g_propagate_prefixed_error (error, g_steal_pointer (&local_error),
+                                        "Avahi finder failed: ");
+            return NULL;
+          }
 
-  if (offline_finders->len > 0)
-    g_ptr_array_add (offline_finders, NULL);  /* NULL terminator */
-  if (online_finders->len > 0)
-    g_ptr_array_add (online_finders, NULL);  /* NULL terminator */
+        return OSTREE_REPO_FINDER (g_steal_pointer (&finder_avahi));
+      }
 
-  /* TODO: Stop this at some point; think of a better way to store it and
-   * control its lifecycle. */
-  if (finder_avahi != NULL)
-    ostree_repo_finder_avahi_start (OSTREE_REPO_FINDER_AVAHI (finder_avahi),
-                                    &local_error);
+    case EOS_UPDATER_DOWNLOAD_VOLUME:
+      {
+        const gchar *test_uris = g_getenv ("EOS_UPDATER_TEST_VOLUME_REPO_URIS");
 
-  if (local_error != NULL)
-    {
-      g_warning ("Avahi finder failed; removing it: %s", local_error->message);
-      g_ptr_array_remove (offline_finders, finder_avahi);
-      g_clear_object (&finder_avahi);
-      g_clear_error (&local_error);
-    }
+        /* Volumes can’t be mounted in the tests, so they list the URIs of the
+         * repositories which would be found on them instead. */
+        if (test_uris != NULL && *test_uris != '\0')
+          {
+            g_autoptr(OstreeRepoFinderOverride) finder_override = ostree_repo_finder_override_new ();
+            g_auto(GStrv) uris = g_strsplit (test_uris, ";", -1);
+            gsize i;
+
+            for (i = 0; uris[i] != NULL; i++)
+              ostree_repo_finder_override_add_uri (finder_override, uris[i]);
 
-  if (out_finder_avahi != NULL)
-    *out_finder_avahi = g_steal_pointer (&finder_avahi);
+            return OSTREE_REPO_FINDER (g_steal_pointer (&finder_override));
+          }
 
-  if (out_offline_finders != NULL)
-    *out_offline_finders = g_steal_pointer (&offline_finders);
-  if (out_online_finders != NULL)
-    *out_online_finders = g_steal_pointer (&online_finders);
+        return OSTREE_REPO_FINDER (ostree_repo_finder_mount_new (NULL));
+      }
+
+    default:
+      g_assert_not_reached ();
+    }
 }
 
 typedef OstreeRepoFinderAvahi RepoFinderAvahiRunning;
@@ -274,6 +425,8 @@ typedef struct {
   gboolean is_user_visible;
   gchar *release_notes_uri;
   GVariant *commit;
+  guint redirect_hops;
+  guint64 resolve_milliseconds;
 } UpdateRefInfo;
 
 static void
@@ -290,6 +443,8 @@ update_ref_info_init (UpdateRefInfo *update_ref_info)
   update_ref_info->is_user_visible = FALSE;
   update_ref_info->release_notes_uri = NULL;
   update_ref_info->commit = NULL;
+  update_ref_info->redirect_hops = 0;
+  update_ref_info->resolve_milliseconds = 0;
 }
 
 static void
@@ -316,10 +471,11 @@ get_booted_refspec_from_default_booted_sysroot_deployment (gchar               *
                                                            OstreeCollectionRef **out_collection_ref,
                                                            GError              **error)
 {
-  g_autoptr(OstreeSysroot) sysroot = ostree_sysroot_new_default ();
+  g_autoptr(OstreeSysroot) sysroot = NULL;
   g_autoptr(OstreeDeployment) booted_deployment = NULL;
 
-  if (!ostree_sysroot_load (sysroot, NULL, error))
+  sysroot = eos_updater_get_sysroot_snapshot (NULL, error);
+  if (sysroot == NULL)
     return FALSE;
 
   booted_deployment = eos_updater_get_booted_deployment_from_loaded_sysroot (sysroot,
@@ -373,11 +529,11 @@ check_for_update_using_booted_branch (OstreeRepo           *repo,
   g_autofree gchar *checksum = NULL;
   g_autoptr(GVariant) commit = NULL;
   gboolean is_update_user_visible = FALSE;
-  g_autoptr(OstreeSysroot) sysroot = ostree_sysroot_new_default ();
-  g_autoptr(OstreeDeployment) booted_deployment = NULL;
   g_auto(OstreeRepoFinderResultv) results = NULL;
   g_autofree gchar *booted_version = NULL;
   g_autofree gchar *update_version = NULL;
+  guint redirect_hops = 0;
+  guint64 resolve_ms = 0;
 
   g_return_val_if_fail (out_is_update != NULL, FALSE);
   g_return_val_if_fail (out_update_ref_info != NULL, FALSE);
@@ -402,6 +558,8 @@ check_for_update_using_booted_branch (OstreeRepo           *repo,
                             &new_refspec,
                             &version,
                             &release_notes_uri_template,
+                            &redirect_hops,
+                            &resolve_ms,
                             error))
     return FALSE;
 
@@ -435,6 +593,8 @@ check_for_update_using_booted_branch (OstreeRepo           *repo,
       out_update_ref_info->release_notes_uri = format_release_notes_uri (release_notes_uri_template, booted_version, update_version);
       out_update_ref_info->is_user_visible = is_update_user_visible;
       out_update_ref_info->commit = g_steal_pointer (&commit);
+      out_update_ref_info->redirect_hops = redirect_hops;
+      out_update_ref_info->resolve_milliseconds = resolve_ms;
     }
   else
     {
@@ -468,6 +628,8 @@ check_for_update_following_checkpoint_commits (OstreeRepo     *repo,
   g_auto(OstreeRepoFinderResultv) results = NULL;
   g_autofree gchar *booted_version = NULL;
   g_autofree gchar *update_version = NULL;
+  guint redirect_hops = 0;
+  guint64 resolve_ms = 0;
 
   g_return_val_if_fail (out_update_ref_info != NULL, FALSE);
   g_return_val_if_fail (error == NULL || *error == NULL, FALSE);
@@ -508,6 +670,8 @@ check_for_update_following_checkpoint_commits (OstreeRepo     *repo,
                             &new_refspec,
                             &version,
                             &release_notes_uri_template,
+                            &redirect_hops,
+                            &resolve_ms,
                             error))
     return FALSE;
 
@@ -550,6 +714,8 @@ check_for_update_following_checkpoint_commits (OstreeRepo     *repo,
       out_update_ref_info->is_user_visible = is_update_user_visible;
       out_update_ref_info->release_notes_uri = format_release_notes_uri (release_notes_uri_template, booted_version, update_version);
       out_update_ref_info->commit = g_steal_pointer (&commit);
+      out_update_ref_info->redirect_hops = redirect_hops;
+      out_update_ref_info->resolve_milliseconds = resolve_ms;
     }
   else
     {
@@ -604,87 +770,195 @@ check_for_update_following_checkpoint_if_allowed (OstreeRepo     *repo,
   return TRUE;
 }
 
-/* Fetch metadata such as commit checksums from OSTree repositories that may be
- * found on the Internet, the local network, or a removable drive. May return
- * NULL without setting an error if no updates were found. */
-static EosUpdateInfo *
-metadata_fetch_new (OstreeRepo    *repo,
-                    SourcesConfig *config,
-                    GMainContext  *context,
-                    GCancellable  *cancellable,
-                    GError       **error)
+/* Fetch metadata such as commit checksums from the OSTree repositories found
+ * by the finder for @source. May return NULL in @out_info without setting an
+ * error if no updates were found. */
+static gboolean
+metadata_fetch_from_source (OstreeRepo                *repo,
+                            GMainContext              *context,
+                            SourcesConfig             *config,
+                            EosUpdaterDownloadSource   source,
+                            EosUpdateInfo            **out_info,
+                            GCancellable              *cancellable,
+                            GError                   **error)
 {
-  g_auto(OstreeRepoFinderResultv) results = NULL;
-  g_autoptr(EosUpdateInfo) info = NULL;
-  g_auto(UpdateRefInfo) update_ref_info;
-  g_autoptr(GPtrArray) offline_finders = NULL;  /* (element-type OstreeRepoFinder) */
-  g_autoptr(GPtrArray) online_finders = NULL;  /* (element-type OstreeRepoFinder) */
+  g_autoptr(OstreeRepoFinder) finder = NULL;
   g_autoptr(RepoFinderAvahiRunning) finder_avahi = NULL;
-  gboolean offline_results_only = TRUE;
-
-  get_finders (config, context, &offline_finders, &online_finders, &finder_avahi);
-  if (offline_finders->len == 0 && online_finders->len == 0)
-    {
-      g_set_error (error, G_IO_ERROR, G_IO_ERROR_FAILED,
-                   "All configured update sources failed to initialize.");
-      return NULL;
-    }
+  g_autoptr(GPtrArray) finders = g_ptr_array_new_full (2, object_unref0);  /* (element-type OstreeRepoFinder) */
+  g_auto(UpdateRefInfo) update_ref_info;
+  /* We don't know if override URIs are online or offline; assume online so we
+   * don't accidentally bypass the scheduler */
+  gboolean offline = (source != EOS_UPDATER_DOWNLOAD_MAIN);
 
   update_ref_info_init (&update_ref_info);
 
+  finder = get_finder_for_source (config, source, context, error);
+  if (finder == NULL)
+    return FALSE;
+
+  /* Stop the finder afterwards if it was created just for this poll. */
+  if (OSTREE_IS_REPO_FINDER_AVAHI (finder))
+    finder_avahi = g_object_ref (OSTREE_REPO_FINDER_AVAHI (finder));
+
+  g_ptr_array_add (finders, g_object_ref (finder));
+  g_ptr_array_add (finders, NULL);  /* NULL terminator */
+
   /* The upgrade refspec here is either the booted refspec if
    * there were new commits on the branch of the booted refspec, or
    * the checkpoint refspec. */
-  if (offline_finders->len > 0 &&
-      !check_for_update_following_checkpoint_if_allowed (repo,
+  if (!check_for_update_following_checkpoint_if_allowed (repo,
                                                          &update_ref_info,
-                                                         offline_finders,
+                                                         finders,
                                                          context,
                                                          cancellable,
                                                          error))
-    return NULL;
-
-  /* If checking for updates offline failed, check online */
-  if (update_ref_info.commit == NULL ||
-      update_ref_info.results == NULL ||
-      update_ref_info.results[0] == NULL)
-    {
-      offline_results_only = FALSE;
-
-      update_ref_info_clear (&update_ref_info);
-
-      if (online_finders->len > 0 &&
-          !check_for_update_following_checkpoint_if_allowed (repo,
-                                                             &update_ref_info,
-                                                             online_finders,
-                                                             context,
-                                                             cancellable,
-                                                             error))
-        return NULL;
-    }
+    return FALSE;
 
   if (update_ref_info.commit != NULL &&
       update_ref_info.results != NULL &&
       update_ref_info.results[0] != NULL)
     {
-      info = eos_update_info_new (update_ref_info.checksum,
-                                  update_ref_info.commit,
-                                  update_ref_info.new_refspec,
-                                  update_ref_info.refspec,
-                                  update_ref_info.version,
-                                  update_ref_info.is_user_visible,
-                                  update_ref_info.release_notes_uri,
-                                  NULL,
-                                  offline_results_only,
-                                  g_steal_pointer (&update_ref_info.results));
-      metrics_report_successful_poll (info);
-      return g_steal_pointer (&info);
+      *out_info = eos_update_info_new (update_ref_info.checksum,
+                                       update_ref_info.commit,
+                                       update_ref_info.new_refspec,
+                                       update_ref_info.refspec,
+                                       update_ref_info.version,
+                                       update_ref_info.is_user_visible,
+                                       update_ref_info.release_notes_uri,
+                                       NULL,
+                                       offline,
+                                       g_steal_pointer (&update_ref_info.results));
+      (*out_info)->redirect_hops = update_ref_info.redirect_hops;
+      (*out_info)->resolve_milliseconds = update_ref_info.resolve_milliseconds;
+    }
+  else
+    *out_info = NULL;
+
+  return TRUE;
+}
+
+static gboolean
+metadata_fetch_from_main_source (OstreeRepo     *repo,
+                                 GMainContext   *context,
+                                 gpointer        user_data,
+                                 EosUpdateInfo **out_info,
+                                 GCancellable   *cancellable,
+                                 GError        **error)
+{
+  return metadata_fetch_from_source (repo, context, user_data,
+                                     EOS_UPDATER_DOWNLOAD_MAIN, out_info,
+                                     cancellable, error);
+}
+
+static gboolean
+metadata_fetch_from_lan_source (OstreeRepo     *repo,
+                                GMainContext   *context,
+                                gpointer        user_data,
+                                EosUpdateInfo **out_info,
+                                GCancellable   *cancellable,
+                                GError        **error)
+{
+  return metadata_fetch_from_source (repo, context, user_data,
+                                     EOS_UPDATER_DOWNLOAD_LAN, out_info,
+                                     cancellable, error);
+}
+
+static gboolean
+metadata_fetch_from_volume_source (OstreeRepo     *repo,
+                                   GMainContext   *context,
+                                   gpointer        user_data,
+                                   EosUpdateInfo **out_info,
+                                   GCancellable   *cancellable,
+                                   GError        **error)
+{
+  return metadata_fetch_from_source (repo, context, user_data,
+                                     EOS_UPDATER_DOWNLOAD_VOLUME, out_info,
+                                     cancellable, error);
+}
+
+static void
+add_fetcher_for_source (GPtrArray                *fetchers,
+                        GArray                   *sources,
+                        EosUpdaterDownloadSource  source)
+{
+  switch (source)
+    {
+    case EOS_UPDATER_DOWNLOAD_MAIN:
+      g_ptr_array_add (fetchers, metadata_fetch_from_main_source);
+      break;
+    case EOS_UPDATER_DOWNLOAD_LAN:
+      g_ptr_array_add (fetchers, metadata_fetch_from_lan_source);
+      break;
+    case EOS_UPDATER_DOWNLOAD_VOLUME:
+      g_ptr_array_add (fetchers, metadata_fetch_from_volume_source);
+      break;
+    default:
+      g_assert_not_reached ();
+    }
+
+  g_array_append_val (sources, source);
+}
+
+/* Fetch metadata such as commit checksums from OSTree repositories that may be
+ * found on the Internet, the local network, or a removable drive. All the
+ * configured sources are polled concurrently; offline sources take priority
+ * over the main source, so that updates are downloaded from peers where
+ * possible. Each source is polled within its configured time budget. May
+ * return NULL without setting an error if no updates were found. */
+static EosUpdateInfo *
+metadata_fetch_new (OstreeRepo      *repo,
+                    SourcesConfig   *config,
+                    GMainContext    *context,
+                    GVariantBuilder *source_reports,
+                    GCancellable    *cancellable,
+                    GError         **error)
+{
+  g_autoptr(EosUpdateInfo) info = NULL;
+  g_autoptr(GPtrArray) fetchers = g_ptr_array_new ();  /* (element-type MetadataFetcher) */
+  g_autoptr(GArray) sources = g_array_new (FALSE, /* not null terminated */
+                                           FALSE, /* no clearing */
+                                           sizeof (EosUpdaterDownloadSource));
+  g_autoptr(GError) local_error = NULL;
+  gboolean main_enabled = FALSE;
+  gsize i;
+
+  g_assert (config->download_order->len > 0);
+
+  if (config->override_uris != NULL)
+    {
+      /* The override URIs replace all the configured sources. */
+      add_fetcher_for_source (fetchers, sources, EOS_UPDATER_DOWNLOAD_MAIN);
     }
   else
     {
-      g_message ("Poll: Couldn’t find any updates");
+      for (i = 0; i < config->download_order->len; i++)
+        {
+          EosUpdaterDownloadSource source = g_array_index (config->download_order,
+                                                           EosUpdaterDownloadSource, i);
+
+          if (source == EOS_UPDATER_DOWNLOAD_MAIN)
+            main_enabled = TRUE;
+          else
+            add_fetcher_for_source (fetchers, sources, source);
+        }
+
+      if (main_enabled)
+        add_fetcher_for_source (fetchers, sources, EOS_UPDATER_DOWNLOAD_MAIN);
+    }
+
+  info = run_fetchers (repo, context, cancellable, fetchers, sources, config,
+                       config->timeouts, source_reports, &local_error);
+
+  if (local_error != NULL)
+    {
+      g_propagate_error (error, g_steal_pointer (&local_error));
       return NULL;
     }
+
+  if (info == NULL)
+    g_message ("Poll: Couldn’t find any updates");
+
+  return g_steal_pointer (&info);
 }
 
 /* Fetch metadata such as commit checksums from OSTree repositories, only
@@ -693,6 +967,7 @@ metadata_fetch_new (OstreeRepo    *repo,
 static gboolean
 metadata_fetch_from_main (OstreeRepo     *repo,
                           GMainContext   *context,
+                          gpointer        user_data,
                           EosUpdateInfo **out_info,
                           GCancellable   *cancellable,
                           GError        **error)
@@ -717,16 +992,20 @@ metadata_fetch_from_main (OstreeRepo     *repo,
     return FALSE;
 
   if (update_ref_info.commit != NULL)
-    info = eos_update_info_new (update_ref_info.checksum,
-                                update_ref_info.commit,
-                                update_ref_info.new_refspec,
-                                update_ref_info.refspec,
-                                update_ref_info.version,
-                                update_ref_info.is_user_visible,
-                                update_ref_info.release_notes_uri,
-                                NULL,
-                                FALSE,
-                                NULL);
+    {
+      info = eos_update_info_new (update_ref_info.checksum,
+                                  update_ref_info.commit,
+                                  update_ref_info.new_refspec,
+                                  update_ref_info.refspec,
+                                  update_ref_info.version,
+                                  update_ref_info.is_user_visible,
+                                  update_ref_info.release_notes_uri,
+                                  NULL,
+                                  FALSE,
+                                  NULL);
+      info->redirect_hops = update_ref_info.redirect_hops;
+      info->resolve_milliseconds = update_ref_info.resolve_milliseconds;
+    }
 
   *out_info = g_steal_pointer (&info);
 
@@ -734,11 +1013,13 @@ metadata_fetch_from_main (OstreeRepo     *repo,
 }
 
 static gboolean
-metadata_fetch_internal (OstreeRepo     *repo,
-                         EosUpdateInfo **out_info,
-                         GCancellable   *cancellable,
-                         GError        **error)
+metadata_fetch_internal (OstreeRepo             *repo,
+                         OstreeRepoFinderAvahi  *finder_avahi,
+                         PollResult            **out_result,
+                         GCancellable           *cancellable,
+                         GError                **error)
 {
+  g_auto(GVariantBuilder) source_reports = G_VARIANT_BUILDER_INIT (G_VARIANT_TYPE ("aa{sv}"));
   g_autoptr(GError) local_error = NULL;
   g_autoptr(GMainContext) task_context = g_main_context_ref_thread_default ();
   g_auto(SourcesConfig) config = SOURCES_CONFIG_CLEARED;
@@ -764,16 +1045,20 @@ metadata_fetch_internal (OstreeRepo     *repo,
   g_clear_error (&local_error);
 
   /* Work out which sources to poll. */
-  if (!read_config (get_config_file_path (), &config, error))
+  if (!read_config (&config, error))
     return FALSE;
 
+  if (finder_avahi != NULL)
+    config.finder_avahi = g_object_ref (finder_avahi);
+
   /* Do we want to use the new libostree code for P2P, or fall back on the old
    * eos-updater code?
    * FIXME: Eventually drop the old code. See:
    * https://phabricator.endlessm.com/T19606 */
   if (use_new_code)
     {
-      info = metadata_fetch_new (repo, &config, task_context, cancellable, &local_error);
+      info = metadata_fetch_new (repo, &config, task_context, &source_reports,
+                                 cancellable, &local_error);
 
       if (local_error != NULL)
         {
@@ -835,6 +1120,9 @@ metadata_fetch_internal (OstreeRepo     *repo,
                                cancellable,
                                fetchers,
                                order,
+                               NULL,
+                               config.timeouts,
+                               &source_reports,
                                &local_error);
         }
       else
@@ -851,12 +1139,86 @@ metadata_fetch_internal (OstreeRepo     *repo,
       return FALSE;
     }
 
-  if (out_info != NULL)
-    *out_info = g_steal_pointer (&info);
+  if (out_result != NULL)
+    *out_result = poll_result_new (g_steal_pointer (&info),
+                                   g_variant_builder_end (&source_reports));
 
   return TRUE;
 }
 
+typedef struct
+{
+  OstreeRepo *repo;  /* (owned) */
+  OstreeRepoFinderAvahi *finder_avahi;  /* (owned) (nullable) */
+} MetadataFetchData;
+
+static void
+metadata_fetch_data_free (MetadataFetchData *data)
+{
+  g_clear_object (&data->finder_avahi);
+  g_clear_object (&data->repo);
+  g_free (data);
+}
+
+G_DEFINE_AUTOPTR_CLEANUP_FUNC (MetadataFetchData, metadata_fetch_data_free)
+
+static MetadataFetchData *
+metadata_fetch_data_new (OstreeRepo            *repo,
+                         OstreeRepoFinderAvahi *finder_avahi)
+{
+  g_autoptr(MetadataFetchData) data = NULL;
+
+  data = g_new0 (MetadataFetchData, 1);
+  data->repo = g_object_ref (repo);
+  data->finder_avahi = (finder_avahi != NULL) ? g_object_ref (finder_avahi) : NULL;
+
+  return g_steal_pointer (&data);
+}
+
+typedef struct
+{
+  gint64 start_time;
+  guint n_sysroot_loads;
+  guint n_sysroot_reuses;
+  guint64 sysroot_load_time_us;
+} PollTimings;
+
+static void
+poll_timings_start (PollTimings *timings)
+{
+  timings->start_time = g_get_monotonic_time ();
+  eos_updater_get_sysroot_snapshot_stats (&timings->n_sysroot_loads,
+                                          &timings->n_sysroot_reuses,
+                                          &timings->sysroot_load_time_us);
+}
+
+/* Log how long a poll took, and how many sysroot loads were saved during it
+ * by reusing the shared sysroot snapshot. */
+static void
+poll_timings_report (const PollTimings *timings,
+                     const gchar       *method_name)
+{
+  guint n_loads, n_reuses;
+  guint64 load_time_us, saved_time_us;
+
+  eos_updater_get_sysroot_snapshot_stats (&n_loads, &n_reuses, &load_time_us);
+  n_loads -= timings->n_sysroot_loads;
+  n_reuses -= timings->n_sysroot_reuses;
+  load_time_us -= timings->sysroot_load_time_us;
+
+  /* Estimate the saving from the average load time overall. */
+  if (n_loads > 0)
+    saved_time_us = n_reuses * (load_time_us / n_loads);
+  else
+    saved_time_us = 0;
+
+  g_message ("%s: Took %" G_GINT64_FORMAT " ms; loaded the sysroot %u times "
+             "(%" G_GUINT64_FORMAT " ms) and reused it %u times (saving about "
+             "%" G_GUINT64_FORMAT " ms)",
+             method_name, (g_get_monotonic_time () - timings->start_time) / 1000,
+             n_loads, load_time_us / 1000, n_reuses, saved_time_us / 1000);
+}
+
 static void
 metadata_fetch (GTask *task,
                 gpointer object,
@@ -864,21 +1226,108 @@ metadata_fetch (GTask *task,
                 GCancellable *cancellable)
 {
   g_autoptr(GError) local_error = NULL;
-  OstreeRepo *repo = task_data;
-  g_autoptr(EosUpdateInfo) info = NULL;
+  MetadataFetchData *metadata_fetch_data = task_data;
+  g_autoptr(PollResult) result = NULL;
   g_autoptr(GMainContext) task_context = g_main_context_new ();
+  PollTimings timings;
 
+  poll_timings_start (&timings);
   g_main_context_push_thread_default (task_context);
 
-  if (!metadata_fetch_internal (repo,
-                                &info,
+  if (!metadata_fetch_internal (metadata_fetch_data->repo,
+                                metadata_fetch_data->finder_avahi,
+                                &result,
                                 cancellable,
-                                &local_error))
+                                &local_error) ||
+      !poll_result_compute_sizes (result, metadata_fetch_data->repo,
+                                  cancellable, &local_error))
     g_task_return_error (task, g_steal_pointer (&local_error));
   else
-    g_task_return_pointer (task, g_steal_pointer (&info), g_object_unref);
+    g_task_return_pointer (task, g_steal_pointer (&result),
+                           (GDestroyNotify) poll_result_free);
 
   g_main_context_pop_thread_default (task_context);
+  poll_timings_report (&timings, "Poll");
+}
+
+/* Whether the LAN source was polled and failed during the last poll, according
+ * to the reports in @poll_sources. */
+static gboolean
+lan_source_failed (GVariant *poll_sources)
+{
+  GVariantIter iter;
+  GVariant *report_ptr;
+
+  if (poll_sources == NULL)
+    return FALSE;
+
+  g_variant_iter_init (&iter, poll_sources);
+
+  while ((report_ptr = g_variant_iter_next_value (&iter)) != NULL)
+    {
+      g_autoptr(GVariant) report = report_ptr;
+      const gchar *source, *result;
+
+      if (g_variant_lookup (report, "source", "&s", &source) &&
+          g_variant_lookup (report, "result", "&s", &result) &&
+          g_str_equal (source, download_source_to_string (EOS_UPDATER_DOWNLOAD_LAN)))
+        return g_str_equal (result, "failed");
+    }
+
+  return FALSE;
+}
+
+/* Keep a single #OstreeRepoFinderAvahi running in the main context while the
+ * LAN source is enabled, rather than starting one for each poll and waiting
+ * for peers to be discovered from scratch. It keeps browsing between polls,
+ * and peers are removed from it as avahi-daemon expires their records, so LAN
+ * polls can be resolved straight away from its cache. If it failed during the
+ * previous poll (for example, because avahi-daemon was restarted), replace
+ * it. */
+static void
+update_finder_avahi (EosUpdater     *updater,
+                     EosUpdaterData *data)
+{
+  g_auto(SourcesConfig) config = SOURCES_CONFIG_CLEARED;
+  g_autoptr(OstreeRepoFinderAvahi) finder_avahi = NULL;
+  g_autoptr(GError) local_error = NULL;
+  gboolean lan_enabled = FALSE;
+  gsize i;
+
+  /* Any error in the configuration is reported by the poll itself. */
+  if (read_config (&config, NULL))
+    {
+      for (i = 0; i < config.download_order->len; i++)
+        if (g_array_index (config.download_order,
+                           EosUpdaterDownloadSource, i) == EOS_UPDATER_DOWNLOAD_LAN)
+          lan_enabled = TRUE;
+    }
+
+  if (data->finder_avahi != NULL &&
+      (!lan_enabled || lan_source_failed (eos_updater_get_poll_sources (updater))))
+    {
+      g_debug ("%s: Stopping long-lived Avahi finder", G_STRFUNC);
+      ostree_repo_finder_avahi_stop (data->finder_avahi);
+      g_clear_object (&data->finder_avahi);
+    }
+
+  if (!lan_enabled || data->finder_avahi != NULL)
+    return;
+
+  /* Process Avahi events in the main context. The poll worker threads only
+   * use the finder through an #EosRepoFinderProxy, which resolves with it in
+   * this context. */
+  finder_avahi = ostree_repo_finder_avahi_new (g_main_context_default ());
+  ostree_repo_finder_avahi_start (finder_avahi, &local_error);
+
+  if (local_error != NULL)
+    {
+      g_message ("Failed to start long-lived Avahi finder; will try again on the next poll: %s",
+                 local_error->message);
+      return;
+    }
+
+  data->finder_avahi = g_steal_pointer (&finder_avahi);
 }
 
 gboolean
@@ -913,9 +1362,12 @@ handle_poll (EosUpdater            *updater,
   /* FIXME: Passing the #OstreeRepo to the worker thread here is not thread safe.
    * See: https://phabricator.endlessm.com/T15923 */
   eos_updater_data_reset_cancellable (data);
+  update_finder_avahi (updater, data);
   eos_updater_clear_error (updater, EOS_UPDATER_STATE_POLLING);
   task = g_task_new (updater, data->cancellable, metadata_fetch_finished, data);
-  g_task_set_task_data (task, g_object_ref (data->repo), g_object_unref);
+  g_task_set_task_data (task,
+                        metadata_fetch_data_new (data->repo, data->finder_avahi),
+                        (GDestroyNotify) metadata_fetch_data_free);
   g_task_run_in_thread (task, metadata_fetch);
 
   eos_updater_complete_poll (updater, call);
@@ -954,10 +1406,11 @@ poll_volume_data_new (OstreeRepo  *repo,
 
 static gboolean
 poll_volume_internal (PollVolumeData  *poll_volume_data,
-                      EosUpdateInfo  **out_info,
+                      PollResult     **out_result,
                       GCancellable    *cancellable,
                       GError         **error)
 {
+  g_auto(GVariantBuilder) source_reports = G_VARIANT_BUILDER_INIT (G_VARIANT_TYPE ("aa{sv}"));
   g_autoptr(GError) local_error = NULL;
   g_autoptr(GMainContext) task_context = g_main_context_ref_thread_default ();
   g_auto(SourcesConfig) config = SOURCES_CONFIG_CLEARED;
@@ -989,7 +1442,10 @@ poll_volume_internal (PollVolumeData  *poll_volume_data,
   config.override_uris = g_new0 (gchar *, 2);
   config.override_uris[0] = g_strconcat ("file://", repo_path, NULL);
 
-  info = metadata_fetch_new (poll_volume_data->repo, &config, task_context, cancellable, &local_error);
+  /* The volume was explicitly requested by the caller, which can cancel the
+   * poll if it takes too long, so leave config.timeouts unset. */
+  info = metadata_fetch_new (poll_volume_data->repo, &config, task_context,
+                             &source_reports, cancellable, &local_error);
 
   if (local_error != NULL)
     {
@@ -997,8 +1453,9 @@ poll_volume_internal (PollVolumeData  *poll_volume_data,
       return FALSE;
     }
 
-  if (out_info != NULL)
-    *out_info = g_steal_pointer (&info);
+  if (out_result != NULL)
+    *out_result = poll_result_new (g_steal_pointer (&info),
+                                   g_variant_builder_end (&source_reports));
 
   return TRUE;
 }
@@ -1011,20 +1468,26 @@ poll_volume (GTask        *task,
 {
   g_autoptr(GError) local_error = NULL;
   PollVolumeData *poll_volume_data = task_data;
-  g_autoptr(EosUpdateInfo) info = NULL;
+  g_autoptr(PollResult) result = NULL;
   g_autoptr(GMainContext) task_context = g_main_context_new ();
+  PollTimings timings;
 
+  poll_timings_start (&timings);
   g_main_context_push_thread_default (task_context);
 
   if (!poll_volume_internal (poll_volume_data,
-                             &info,
+                             &result,
                              cancellable,
-                             &local_error))
+                             &local_error) ||
+      !poll_result_compute_sizes (result, poll_volume_data->repo,
+                                  cancellable, &local_error))
     g_task_return_error (task, g_steal_pointer (&local_error));
   else
-    g_task_return_pointer (task, g_steal_pointer (&info), g_object_unref);
+    g_task_return_pointer (task, g_steal_pointer (&result),
+                           (GDestroyNotify) poll_result_free);
 
   g_main_context_pop_thread_default (task_context);
+  poll_timings_report (&timings, "PollVolume");
 }
 
 gboolean
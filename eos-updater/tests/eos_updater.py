@@ -103,6 +103,8 @@ def load(mock, parameters):
             'ReleaseNotesUri':
                 dbus.String(parameters.get('ReleaseNotesUri', '')),
             'DownloadSize': dbus.Int64(parameters.get('DownloadSize', 0)),
+            'DownloadSizeEstimate':
+                dbus.String(parameters.get('DownloadSizeEstimate', '')),
             'DownloadedBytes':
                 dbus.Int64(parameters.get('DownloadedBytes', 0)),
             'UnpackedSize': dbus.Int64(parameters.get('UnpackedSize', 0)),
@@ -110,6 +112,9 @@ def load(mock, parameters):
                 dbus.Int64(parameters.get('FullDownloadSize', 0)),
             'FullUnpackedSize':
                 dbus.Int64(parameters.get('FullUnpackedSize', 0)),
+            'PollSources':
+                dbus.Array(parameters.get('PollSources', []),
+                           signature='a{sv}'),
             'ErrorCode': dbus.UInt32(parameters.get('ErrorCode', 0)),
             'ErrorName': dbus.String(parameters.get('ErrorName', '')),
             'ErrorMessage': dbus.String(parameters.get('ErrorMessage', '')),
@@ -294,6 +299,7 @@ def SetPollAction(self, action, update_properties, error_name, error_message):
             'ReleaseNotesUri':
                 dbus.String('https://example.com/release-notes', variant_level=1),
             'DownloadSize': dbus.Int64(1000000000, variant_level=1),
+            'DownloadSizeEstimate': dbus.String('objects', variant_level=1),
             'UnpackedSize': dbus.Int64(1500000000, variant_level=1),
             'FullDownloadSize': dbus.Int64(1000000000 * 0.8, variant_level=1),
             'FullUnpackedSize': dbus.Int64(1500000000 * 0.8, variant_level=1),
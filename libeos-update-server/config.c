@@ -57,6 +57,8 @@ static const char *LOCAL_CONFIG_FILE_PATH = PREFIX "/local/share/eos-updater/eos
 /* Configuration file keys. */
 static const char *LOCAL_NETWORK_UPDATES_GROUP = "Local Network Updates";
 static const char *ADVERTISE_UPDATES_KEY = "AdvertiseUpdates";
+static const char *CLIENT_TIMEOUT_KEY = "ClientTimeoutSeconds";
+static const char *CLIENT_MIN_THROUGHPUT_KEY = "ClientMinimumThroughput";
 
 static const gchar *REPOSITORY_GROUP = "Repository ";  /* should be followed by an integer */
 static const gchar *PATH_KEY = "Path";
@@ -116,6 +118,10 @@ repository_configs_contains_index (GPtrArray *repository_configs,
  *    use the system search paths
  * @out_advertise_updates: (out caller-allocates) (optional): return location
  *    for the `AdvertiseUpdates=` parameter
+ * @out_client_timeout_seconds: (out caller-allocates) (optional): return
+ *    location for the `ClientTimeoutSeconds=` parameter
+ * @out_client_min_throughput: (out caller-allocates) (optional): return
+ *    location for the `ClientMinimumThroughput=` parameter
  * @out_repository_configs: (out callee-allocates) (transfer container)
  *    (element-type EusRepoConfig) (optional): return location for the
  *    `[Repository 0–65535]` sections
@@ -127,7 +133,8 @@ repository_configs_contains_index (GPtrArray *repository_configs,
  * [`eos-update-server.conf(5)`](man:eos-update-server.conf(5)).
  *
  * The configuration values loaded from the file will be returned in
- * @out_advertise_updates and @out_repository_configs. See
+ * @out_advertise_updates, @out_client_timeout_seconds,
+ * @out_client_min_throughput and @out_repository_configs. See
  * [`eos-update-server.conf(5)`](man:eos-update-server.conf(5)) for the
  * semantics of the options.
  *
@@ -140,6 +147,8 @@ repository_configs_contains_index (GPtrArray *repository_configs,
 gboolean
 eus_read_config_file (const gchar  *config_file_path,
                       gboolean     *out_advertise_updates,
+                      guint        *out_client_timeout_seconds,
+                      guint        *out_client_min_throughput,
                       GPtrArray   **out_repository_configs,
                       GError      **error)
 {
@@ -161,6 +170,7 @@ eus_read_config_file (const gchar  *config_file_path,
   g_auto(GStrv) groups = NULL;
   gsize n_groups, i;
   gboolean advertise_updates;
+  guint client_timeout_seconds, client_min_throughput;
   g_autoptr(GPtrArray) repository_configs = NULL;
 
   g_return_val_if_fail (error == NULL || *error == NULL, FALSE);
@@ -179,6 +189,28 @@ eus_read_config_file (const gchar  *config_file_path,
       return FALSE;
     }
 
+  client_timeout_seconds = euu_config_file_get_uint (config,
+                                                     LOCAL_NETWORK_UPDATES_GROUP,
+                                                     CLIENT_TIMEOUT_KEY,
+                                                     0, G_MAXUINT,
+                                                     &local_error);
+  if (local_error != NULL)
+    {
+      g_propagate_error (error, g_steal_pointer (&local_error));
+      return FALSE;
+    }
+
+  client_min_throughput = euu_config_file_get_uint (config,
+                                                    LOCAL_NETWORK_UPDATES_GROUP,
+                                                    CLIENT_MIN_THROUGHPUT_KEY,
+                                                    0, G_MAXUINT,
+                                                    &local_error);
+  if (local_error != NULL)
+    {
+      g_propagate_error (error, g_steal_pointer (&local_error));
+      return FALSE;
+    }
+
   /* Load all the repositories configured in all the config files. Note that
    * this means it’s currently impossible to disable a repository config from
    * one config file in another config file which has higher priority. If that’s
@@ -240,6 +272,10 @@ eus_read_config_file (const gchar  *config_file_path,
   /* Success. */
   if (out_advertise_updates != NULL)
     *out_advertise_updates = advertise_updates;
+  if (out_client_timeout_seconds != NULL)
+    *out_client_timeout_seconds = client_timeout_seconds;
+  if (out_client_min_throughput != NULL)
+    *out_client_min_throughput = client_min_throughput;
   if (out_repository_configs != NULL)
     *out_repository_configs = g_steal_pointer (&repository_configs);
 
@@ -60,6 +60,8 @@ G_DEFINE_AUTOPTR_CLEANUP_FUNC (EusRepoConfig, eus_repo_config_free)
 
 gboolean eus_read_config_file (const gchar  *config_file_path,
                                gboolean     *out_advertise_updates,
+                               guint        *out_client_timeout_seconds,
+                               guint        *out_client_min_throughput,
                                GPtrArray   **out_repository_configs,
                                GError      **error);
 
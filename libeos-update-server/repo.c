@@ -59,6 +59,10 @@ struct _EusRepo
   GCancellable *cancellable;
   gchar *cached_repo_root;
   GBytes *cached_config;
+
+  GFileMonitor *monitor;  /* (nullable) (owned) */
+  guint reload_id;
+  gboolean refs_changed;
 };
 
 static void eus_repo_initable_iface_init (GInitableIface *initable_iface);
@@ -218,6 +222,7 @@ eus_repo_dispose (GObject *object)
 
   eus_repo_disconnect (self);
 
+  eus_repo_stop_monitoring (self);
   g_clear_object (&self->cancellable);
   g_clear_pointer (&self->cached_config, g_bytes_unref);
   g_clear_object (&self->repo);
@@ -1051,6 +1056,93 @@ eus_repo_initable_iface_init (GInitableIface *initable_iface)
   initable_iface->init = eus_repo_initable_init;
 }
 
+/* Changes to any of these files in the root of the repository (or to the
+ * repository directory itself, whose mtime libostree bumps whenever refs are
+ * updated) cause the repository to be reloaded. */
+static const gchar *const monitored_root_files[] =
+  {
+    "config",
+    "summary",
+    "summary.sig",
+    NULL
+  };
+
+/* How long to wait for a burst of changes to settle before reloading. */
+#define RELOAD_DELAY_MS 1000
+
+static gboolean
+reload_cb (gpointer user_data)
+{
+  EusRepo *self = EUS_REPO (user_data);
+  g_autofree gchar *summary_path = NULL;
+  gboolean refs_changed = self->refs_changed;
+  g_autoptr(GError) local_error = NULL;
+
+  self->reload_id = 0;
+  self->refs_changed = FALSE;
+
+  g_debug ("Reloading repository ‘%s’", self->cached_repo_root);
+
+  /* This updates the remotes and collection IDs used to serve
+   * /refs/heads/ and /refs/mirrors/. The faked /config does not depend on the
+   * repository configuration, so it is left alone. */
+  if (!ostree_repo_reload_config (self->repo, self->cancellable, &local_error))
+    {
+      g_warning ("Failed to reload repository ‘%s’, continuing to use the "
+                 "previous configuration: %s",
+                 self->cached_repo_root, local_error->message);
+      return G_SOURCE_REMOVE;
+    }
+
+  /* handle_summary() only generates the summary if it doesn’t exist, so once
+   * one has been served it has to be regenerated here to advertise the new
+   * refs. Regenerating it triggers another reload, but not another
+   * regeneration, as only the summary files change. */
+  summary_path = g_build_filename (self->cached_repo_root, "summary", NULL);
+  if (refs_changed && g_file_test (summary_path, G_FILE_TEST_EXISTS) &&
+      !ostree_repo_regenerate_summary (self->repo, NULL, self->cancellable,
+                                       &local_error))
+    g_warning ("Failed to regenerate summary for repository ‘%s’: %s",
+               self->cached_repo_root, local_error->message);
+
+  return G_SOURCE_REMOVE;
+}
+
+static gboolean
+file_is_monitored (GFile *file)
+{
+  g_autofree gchar *basename = g_file_get_basename (file);
+
+  return g_strv_contains (monitored_root_files, basename);
+}
+
+static void
+repo_changed_cb (GFileMonitor      *monitor,
+                 GFile             *file,
+                 GFile             *other_file,
+                 GFileMonitorEvent  event_type,
+                 gpointer           user_data)
+{
+  EusRepo *self = EUS_REPO (user_data);
+
+  /* Wait for CHANGES_DONE_HINT rather than reloading on each write. */
+  if (event_type == G_FILE_MONITOR_EVENT_CHANGED)
+    return;
+
+  if (g_file_equal (file, ostree_repo_get_path (self->repo)))
+    self->refs_changed = TRUE;
+  else if (!file_is_monitored (file) &&
+           (other_file == NULL || !file_is_monitored (other_file)))
+    return;
+
+  g_debug ("Repository ‘%s’ changed (event %u); scheduling reload",
+           self->cached_repo_root, event_type);
+
+  if (self->reload_id != 0)
+    g_source_remove (self->reload_id);
+  self->reload_id = g_timeout_add (RELOAD_DELAY_MS, reload_cb, self);
+}
+
 /**
  * eus_repo_new:
  * @server: #SoupServer to handle requests from
@@ -1143,3 +1235,74 @@ eus_repo_disconnect (EusRepo *self)
   g_clear_object (&self->server);
   g_object_notify_by_pspec (G_OBJECT (self), props[PROP_SERVER]);
 }
+
+/**
+ * eus_repo_start_monitoring:
+ * @self: an #EusRepo
+ * @error: return location for a #GError, or %NULL
+ *
+ * Start monitoring the underlying #OstreeRepo for changes to its
+ * configuration, summary or refs. When a change is detected, the repository
+ * configuration is reloaded and, if refs have changed, any summary which has
+ * already been generated is regenerated, so a long-lived server keeps serving
+ * an up-to-date view of the repository without having to be restarted.
+ *
+ * #EusRepos which wrap the same #OstreeRepo share its configuration and
+ * summary, so only one of them needs to be monitored.
+ *
+ * This is intended for servers which do not exit when idle. It is an error to
+ * call this twice without calling eus_repo_stop_monitoring() between.
+ *
+ * Returns: %TRUE on success, %FALSE otherwise
+ * Since: UNRELEASED
+ */
+gboolean
+eus_repo_start_monitoring (EusRepo  *self,
+                           GError  **error)
+{
+  g_autoptr(GFileMonitor) monitor = NULL;
+
+  g_return_val_if_fail (EUS_IS_REPO (self), FALSE);
+  g_return_val_if_fail (self->monitor == NULL, FALSE);
+  g_return_val_if_fail (error == NULL || *error == NULL, FALSE);
+
+  monitor = g_file_monitor_directory (ostree_repo_get_path (self->repo),
+                                      G_FILE_MONITOR_WATCH_MOVES,
+                                      self->cancellable,
+                                      error);
+  if (monitor == NULL)
+    return FALSE;
+
+  g_signal_connect (monitor, "changed", G_CALLBACK (repo_changed_cb), self);
+  self->monitor = g_steal_pointer (&monitor);
+
+  return TRUE;
+}
+
+/**
+ * eus_repo_stop_monitoring:
+ * @self: an #EusRepo
+ *
+ * Stop monitoring the underlying #OstreeRepo for changes, as started by
+ * eus_repo_start_monitoring(). Any pending reload is dropped.
+ *
+ * This is called automatically if the #EusRepo is disposed.
+ *
+ * Since: UNRELEASED
+ */
+void
+eus_repo_stop_monitoring (EusRepo *self)
+{
+  g_return_if_fail (EUS_IS_REPO (self));
+
+  if (self->reload_id != 0)
+    g_source_remove (self->reload_id);
+  self->reload_id = 0;
+
+  if (self->monitor != NULL)
+    {
+      g_signal_handlers_disconnect_by_func (self->monitor, repo_changed_cb, self);
+      g_file_monitor_cancel (self->monitor);
+    }
+  g_clear_object (&self->monitor);
+}
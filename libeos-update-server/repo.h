@@ -47,4 +47,8 @@ void eus_repo_connect (EusRepo    *self,
                        SoupServer *server);
 void eus_repo_disconnect (EusRepo *self);
 
+gboolean eus_repo_start_monitoring (EusRepo  *self,
+                                    GError  **error);
+void eus_repo_stop_monitoring (EusRepo *self);
+
 G_END_DECLS
@@ -61,6 +61,12 @@ struct _EusServer
 
   guint pending_requests;
   gint64 last_request_time;
+
+  guint client_timeout_seconds;  /* 0 if disabled */
+  guint client_min_throughput;  /* bytes per second; 0 if disabled */
+  GHashTable *requests;  /* (element-type SoupMessage RequestData) (owned) */
+  guint check_clients_id;
+  guint evicted_requests;
 };
 
 G_DEFINE_TYPE (EusServer, eus_server, G_TYPE_OBJECT)
@@ -70,9 +76,41 @@ typedef enum
   PROP_SERVER = 1,
   PROP_PENDING_REQUESTS,
   PROP_LAST_REQUEST_TIME,
+  PROP_CLIENT_TIMEOUT,
+  PROP_CLIENT_MIN_THROUGHPUT,
+  PROP_EVICTED_REQUESTS,
 } EusServerProperty;
 
-static GParamSpec *props[PROP_LAST_REQUEST_TIME + 1] = { NULL, };
+static GParamSpec *props[PROP_EVICTED_REQUESTS + 1] = { NULL, };
+
+/* How long a client is given before its throughput is checked against
+ * #EusServer:client-min-throughput, if #EusServer:client-timeout is zero. */
+#define DEFAULT_THROUGHPUT_GRACE_SECONDS 30
+
+/* Book-keeping for an in-flight request, used to evict clients which stop
+ * reading their response, or read it too slowly. */
+typedef struct
+{
+  SoupMessage *msg;  /* (owned) */
+  GSocket *socket;  /* (owned) (nullable) */
+  gulong wrote_body_data_id;
+  gint64 start_time;  /* when the first body chunk was written; 0 before then */
+  gint64 last_progress_time;
+  guint64 bytes_written;
+  gboolean evicted;
+} RequestData;
+
+static void
+request_data_free (RequestData *data)
+{
+  if (data->wrote_body_data_id != 0)
+    g_signal_handler_disconnect (data->msg, data->wrote_body_data_id);
+  g_clear_object (&data->msg);
+  g_clear_object (&data->socket);
+  g_free (data);
+}
+
+G_DEFINE_AUTOPTR_CLEANUP_FUNC (RequestData, request_data_free)
 
 static void request_read_cb (SoupServer        *soup_server,
                              SoupMessage       *message,
@@ -91,6 +129,8 @@ static void
 eus_server_init (EusServer *self)
 {
   self->repos = g_ptr_array_new_with_free_func (g_object_unref);
+  self->requests = g_hash_table_new_full (g_direct_hash, g_direct_equal, NULL,
+                                          (GDestroyNotify) request_data_free);
 }
 
 static void
@@ -129,6 +169,18 @@ eus_server_get_property (GObject    *object,
       g_value_set_int64 (value, self->last_request_time);
       break;
 
+    case PROP_CLIENT_TIMEOUT:
+      g_value_set_uint (value, self->client_timeout_seconds);
+      break;
+
+    case PROP_CLIENT_MIN_THROUGHPUT:
+      g_value_set_uint (value, self->client_min_throughput);
+      break;
+
+    case PROP_EVICTED_REQUESTS:
+      g_value_set_uint (value, self->evicted_requests);
+      break;
+
     default:
       G_OBJECT_WARN_INVALID_PROPERTY_ID (object, property_id, spec);
       break;
@@ -149,8 +201,17 @@ eus_server_set_property (GObject      *object,
       g_set_object (&self->server, g_value_get_object (value));
       break;
 
+    case PROP_CLIENT_TIMEOUT:
+      self->client_timeout_seconds = g_value_get_uint (value);
+      break;
+
+    case PROP_CLIENT_MIN_THROUGHPUT:
+      self->client_min_throughput = g_value_get_uint (value);
+      break;
+
     case PROP_PENDING_REQUESTS:
     case PROP_LAST_REQUEST_TIME:
+    case PROP_EVICTED_REQUESTS:
       /* Read only. */
 
     default:
@@ -171,6 +232,11 @@ eus_server_dispose (GObject *object)
   self->last_request_time = 0;
   g_clear_pointer (&self->repos, g_ptr_array_unref);
 
+  if (self->check_clients_id != 0)
+    g_source_remove (self->check_clients_id);
+  self->check_clients_id = 0;
+  g_clear_pointer (&self->requests, g_hash_table_unref);
+
   if (self->server != NULL)
     {
       g_signal_handlers_disconnect_by_func (self->server, request_aborted_cb, self);
@@ -245,6 +311,65 @@ eus_server_class_init (EusServerClass *klass)
                                                       G_PARAM_EXPLICIT_NOTIFY |
                                                       G_PARAM_STATIC_STRINGS);
 
+  /**
+   * EusServer:client-timeout:
+   *
+   * Number of seconds a client may go without reading any of the response to
+   * a pending request before the request is aborted and its resources are
+   * released. The time starts once the server has written the first chunk
+   * of the response body, so the time the server takes to start responding
+   * isn’t counted against the client. Zero disables the timeout.
+   *
+   * Since: UNRELEASED
+   */
+  props[PROP_CLIENT_TIMEOUT] = g_param_spec_uint ("client-timeout",
+                                                  "Client timeout",
+                                                  "Seconds a client may stall reading a response before being evicted",
+                                                  0,
+                                                  G_MAXUINT,
+                                                  0,
+                                                  G_PARAM_READWRITE |
+                                                  G_PARAM_STATIC_STRINGS);
+
+  /**
+   * EusServer:client-min-throughput:
+   *
+   * Minimum average rate, in bytes per second, at which a client must read the
+   * response to a pending request. Clients which read more slowly than this
+   * (once they have been given #EusServer:client-timeout seconds to get
+   * going) have the request aborted, so they cannot pin the server’s memory
+   * and file descriptors indefinitely. Zero disables the check.
+   *
+   * Since: UNRELEASED
+   */
+  props[PROP_CLIENT_MIN_THROUGHPUT] = g_param_spec_uint ("client-min-throughput",
+                                                         "Client minimum throughput",
+                                                         "Minimum rate in bytes per second at which clients must read responses",
+                                                         0,
+                                                         G_MAXUINT,
+                                                         0,
+                                                         G_PARAM_READWRITE |
+                                                         G_PARAM_STATIC_STRINGS);
+
+  /**
+   * EusServer:evicted-requests:
+   *
+   * Number of requests which have been aborted because the client stalled or
+   * was reading the response too slowly. See #EusServer:client-timeout and
+   * #EusServer:client-min-throughput.
+   *
+   * Since: UNRELEASED
+   */
+  props[PROP_EVICTED_REQUESTS] = g_param_spec_uint ("evicted-requests",
+                                                    "Evicted requests",
+                                                    "Number of requests aborted due to slow or stalled clients",
+                                                    0,
+                                                    G_MAXUINT,
+                                                    0,
+                                                    G_PARAM_READABLE |
+                                                    G_PARAM_EXPLICIT_NOTIFY |
+                                                    G_PARAM_STATIC_STRINGS);
+
   g_object_class_install_properties (object_class,
                                      G_N_ELEMENTS (props),
                                      props);
@@ -273,6 +398,118 @@ update_pending_requests (EusServer *self,
   g_object_thaw_notify (obj);
 }
 
+static void
+evict_request (EusServer   *self,
+               RequestData *data,
+               const gchar *reason)
+{
+  g_autoptr(GError) local_error = NULL;
+  SoupURI *uri = soup_message_get_uri (data->msg);
+
+  g_message ("Evicting client requesting ‘%s’: %s",
+             (uri != NULL) ? soup_uri_get_path (uri) : "(unknown)", reason);
+
+  data->evicted = TRUE;
+  self->evicted_requests++;
+  g_object_notify_by_pspec (G_OBJECT (self), props[PROP_EVICTED_REQUESTS]);
+
+  /* Shutting down the socket causes the pending write to fail, which aborts
+   * the #SoupMessage and releases everything associated with it (including
+   * any #EusRepo read buffers and streams). */
+  if (data->socket != NULL &&
+      !g_socket_shutdown (data->socket, TRUE, TRUE, &local_error))
+    g_debug ("Error shutting down socket for evicted client: %s",
+             local_error->message);
+}
+
+static gboolean
+check_clients_cb (gpointer user_data)
+{
+  EusServer *self = EUS_SERVER (user_data);
+  GHashTableIter iter;
+  RequestData *data;
+  gint64 now = g_get_monotonic_time ();
+  guint grace_seconds = (self->client_timeout_seconds > 0) ? self->client_timeout_seconds : DEFAULT_THROUGHPUT_GRACE_SECONDS;
+
+  g_hash_table_iter_init (&iter, self->requests);
+
+  while (g_hash_table_iter_next (&iter, NULL, (gpointer *) &data))
+    {
+      gint64 elapsed = now - data->start_time;
+
+      /* Until the first chunk of the body has been written, it’s the server
+       * which hasn’t made progress, not the client. */
+      if (data->evicted || data->start_time == 0)
+        continue;
+
+      if (self->client_timeout_seconds > 0 &&
+          now - data->last_progress_time > (gint64) self->client_timeout_seconds * G_USEC_PER_SEC)
+        {
+          evict_request (self, data, "client stopped reading");
+          continue;
+        }
+
+      if (self->client_min_throughput > 0 &&
+          elapsed > (gint64) grace_seconds * G_USEC_PER_SEC &&
+          data->bytes_written * G_USEC_PER_SEC / (guint64) elapsed < self->client_min_throughput)
+        {
+          g_autofree gchar *reason = NULL;
+
+          reason = g_strdup_printf ("throughput %" G_GUINT64_FORMAT " B/s below minimum %u B/s",
+                                    data->bytes_written * G_USEC_PER_SEC / (guint64) elapsed,
+                                    self->client_min_throughput);
+          evict_request (self, data, reason);
+          continue;
+        }
+    }
+
+  if (g_hash_table_size (self->requests) == 0)
+    {
+      self->check_clients_id = 0;
+      return G_SOURCE_REMOVE;
+    }
+
+  return G_SOURCE_CONTINUE;
+}
+
+static void
+wrote_body_data_cb (SoupMessage *message,
+                    SoupBuffer  *chunk,
+                    gpointer     user_data)
+{
+  RequestData *data = user_data;
+
+  data->last_progress_time = g_get_monotonic_time ();
+  if (data->start_time == 0)
+    data->start_time = data->last_progress_time;
+  data->bytes_written += chunk->length;
+}
+
+static void
+track_request (EusServer         *self,
+               SoupMessage       *message,
+               SoupClientContext *client)
+{
+  g_autoptr(RequestData) data = NULL;
+  GSocket *socket;
+
+  if (self->client_timeout_seconds == 0 && self->client_min_throughput == 0)
+    return;
+
+  data = g_new0 (RequestData, 1);
+  data->msg = g_object_ref (message);
+  socket = soup_client_context_get_gsocket (client);
+  data->socket = (socket != NULL) ? g_object_ref (socket) : NULL;
+  data->wrote_body_data_id = g_signal_connect (message, "wrote-body-data",
+                                               (GCallback) wrote_body_data_cb,
+                                               data);
+
+  g_hash_table_replace (self->requests, message, g_steal_pointer (&data));
+
+  if (self->check_clients_id == 0)
+    self->check_clients_id = g_timeout_add_seconds (1, check_clients_cb, self);
+}
+
 static void
 request_read_cb (SoupServer        *soup_server,
                  SoupMessage       *message,
@@ -282,6 +519,7 @@ request_read_cb (SoupServer        *soup_server,
   EusServer *self = EUS_SERVER (user_data);
 
   update_pending_requests (self, TRUE);
+  track_request (self, message, client);
 }
 
 static void
@@ -292,6 +530,7 @@ request_finished_cb (SoupServer        *soup_server,
 {
   EusServer *self = EUS_SERVER (user_data);
 
+  g_hash_table_remove (self->requests, message);
   update_pending_requests (self, FALSE);
 }
 
@@ -303,6 +542,7 @@ request_aborted_cb (SoupServer        *soup_server,
 {
   EusServer *self = EUS_SERVER (user_data);
 
+  g_hash_table_remove (self->requests, message);
   update_pending_requests (self, FALSE);
 }
 
@@ -405,3 +645,56 @@ eus_server_get_last_request_time (EusServer *self)
 {
   return self->last_request_time;
 }
+
+/**
+ * eus_server_set_client_limits:
+ * @self: The #EusServer
+ * @timeout_seconds: new value for #EusServer:client-timeout
+ * @min_throughput: new value for #EusServer:client-min-throughput
+ *
+ * Set the limits used to evict slow or stalled clients. They apply to requests
+ * received after this is called.
+ *
+ * Since: UNRELEASED
+ */
+void
+eus_server_set_client_limits (EusServer *self,
+                              guint      timeout_seconds,
+                              guint      min_throughput)
+{
+  GObject *obj;
+
+  g_return_if_fail (EUS_IS_SERVER (self));
+
+  obj = G_OBJECT (self);
+  g_object_freeze_notify (obj);
+
+  if (self->client_timeout_seconds != timeout_seconds)
+    {
+      self->client_timeout_seconds = timeout_seconds;
+      g_object_notify_by_pspec (obj, props[PROP_CLIENT_TIMEOUT]);
+    }
+
+  if (self->client_min_throughput != min_throughput)
+    {
+      self->client_min_throughput = min_throughput;
+      g_object_notify_by_pspec (obj, props[PROP_CLIENT_MIN_THROUGHPUT]);
+    }
+
+  g_object_thaw_notify (obj);
+}
+
+/**
+ * eus_server_get_evicted_requests:
+ * @self: The #EusServer
+ *
+ * Get the value of #EusServer:evicted-requests.
+ *
+ * Returns: Number of requests aborted due to slow or stalled clients
+ * Since: UNRELEASED
+ */
+guint
+eus_server_get_evicted_requests (EusServer *self)
+{
+  return self->evicted_requests;
+}
@@ -46,4 +46,9 @@ void eus_server_disconnect (EusServer *self);
 guint eus_server_get_pending_requests (EusServer *self);
 gint64 eus_server_get_last_request_time (EusServer *self);
 
+void eus_server_set_client_limits (EusServer *self,
+                                   guint      timeout_seconds,
+                                   guint      min_throughput);
+guint eus_server_get_evicted_requests (EusServer *self);
+
 G_END_DECLS
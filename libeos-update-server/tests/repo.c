@@ -0,0 +1,302 @@
+/* -*- mode: C; c-file-style: "gnu"; indent-tabs-mode: nil; -*-
+ *
+ * Copyright © 2020 Endless OS Foundation, LLC
+ *
+ * SPDX-License-Identifier: LGPL-2.1-or-later
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+ */
+
+#include <gio/gio.h>
+#include <glib.h>
+#include <libeos-update-server/repo.h>
+#include <libeos-updater-util/util.h>
+#include <libsoup/soup.h>
+#include <locale.h>
+#include <ostree.h>
+
+typedef struct
+{
+  GFile *tmp_dir;  /* owned */
+  OstreeRepo *repo;  /* owned */
+  gchar *commit_checksum;  /* owned */
+  SoupServer *server;  /* owned */
+  SoupSession *session;  /* owned */
+  gchar *base_uri;  /* owned */
+} Fixture;
+
+/* Write an empty commit to @repo and return its checksum. */
+static gchar *
+write_empty_commit (OstreeRepo *repo)
+{
+  g_autoptr(GError) error = NULL;
+  g_autoptr(GFileInfo) dir_info = NULL;
+  g_autoptr(GVariant) dirmeta = NULL;
+  g_autofree guchar *dirmeta_csum_raw = NULL;
+  g_autofree gchar *dirmeta_csum = NULL;
+  g_autoptr(OstreeMutableTree) mtree = NULL;
+  g_autoptr(GFile) root = NULL;
+  g_autofree gchar *commit_checksum = NULL;
+
+  dir_info = g_file_info_new ();
+  g_file_info_set_attribute_uint32 (dir_info, "unix::uid", 0);
+  g_file_info_set_attribute_uint32 (dir_info, "unix::gid", 0);
+  g_file_info_set_attribute_uint32 (dir_info, "unix::mode", 040755);
+  dirmeta = g_variant_ref_sink (ostree_create_directory_metadata (dir_info, NULL));
+
+  ostree_repo_prepare_transaction (repo, NULL, NULL, &error);
+  g_assert_no_error (error);
+
+  ostree_repo_write_metadata (repo, OSTREE_OBJECT_TYPE_DIR_META, NULL, dirmeta,
+                              &dirmeta_csum_raw, NULL, &error);
+  g_assert_no_error (error);
+  dirmeta_csum = ostree_checksum_from_bytes (dirmeta_csum_raw);
+
+  mtree = ostree_mutable_tree_new ();
+  ostree_mutable_tree_set_metadata_checksum (mtree, dirmeta_csum);
+
+  ostree_repo_write_mtree (repo, mtree, &root, NULL, &error);
+  g_assert_no_error (error);
+  ostree_repo_write_commit (repo, NULL, "Test commit", NULL, NULL,
+                            OSTREE_REPO_FILE (root), &commit_checksum,
+                            NULL, &error);
+  g_assert_no_error (error);
+
+  ostree_repo_commit_transaction (repo, NULL, NULL, &error);
+  g_assert_no_error (error);
+
+  return g_steal_pointer (&commit_checksum);
+}
+
+/* Set up a bare repository with a single ref in it, and a #SoupServer
+ * listening on localhost to serve it from. */
+static void
+setup (Fixture       *fixture,
+       gconstpointer  user_data G_GNUC_UNUSED)
+{
+  g_autoptr(GError) error = NULL;
+  g_autofree gchar *tmp_dir = NULL;
+  g_autoptr(GFile) repo_dir = NULL;
+  GSList *uris = NULL;
+
+  tmp_dir = g_dir_make_tmp ("eos-update-server-tests-repo-XXXXXX", &error);
+  g_assert_no_error (error);
+  fixture->tmp_dir = g_file_new_for_path (tmp_dir);
+
+  repo_dir = g_file_get_child (fixture->tmp_dir, "repo");
+  fixture->repo = ostree_repo_new (repo_dir);
+  ostree_repo_create (fixture->repo, OSTREE_REPO_MODE_BARE, NULL, &error);
+  g_assert_no_error (error);
+
+  fixture->commit_checksum = write_empty_commit (fixture->repo);
+  ostree_repo_set_ref_immediate (fixture->repo, NULL, "test/ref1",
+                                 fixture->commit_checksum, NULL, &error);
+  g_assert_no_error (error);
+
+  fixture->server = soup_server_new (NULL, NULL);
+  soup_server_listen_local (fixture->server, 0, SOUP_SERVER_LISTEN_IPV4_ONLY,
+                            &error);
+  g_assert_no_error (error);
+
+  uris = soup_server_get_uris (fixture->server);
+  g_assert_nonnull (uris);
+  fixture->base_uri = g_strdup_printf ("http://127.0.0.1:%u",
+                                       soup_uri_get_port (uris->data));
+  g_slist_free_full (uris, (GDestroyNotify) soup_uri_free);
+
+  fixture->session = soup_session_new ();
+}
+
+static void
+teardown (Fixture       *fixture,
+          gconstpointer  user_data G_GNUC_UNUSED)
+{
+  g_autoptr(GError) error = NULL;
+
+  g_clear_object (&fixture->session);
+
+  if (fixture->server != NULL)
+    soup_server_disconnect (fixture->server);
+  g_clear_object (&fixture->server);
+
+  g_clear_pointer (&fixture->base_uri, g_free);
+  g_clear_pointer (&fixture->commit_checksum, g_free);
+  g_clear_object (&fixture->repo);
+
+  eos_updater_remove_recursive (fixture->tmp_dir, NULL, &error);
+  g_assert_no_error (error);
+  g_clear_object (&fixture->tmp_dir);
+}
+
+static void
+message_done_cb (SoupSession *session,
+                 SoupMessage *msg,
+                 gpointer     user_data)
+{
+  gboolean *done = user_data;
+
+  *done = TRUE;
+}
+
+/* Request @path from the server and iterate the main context until the
+ * response arrives, since the server runs in the same thread. */
+static SoupMessage *
+request (Fixture     *fixture,
+         const gchar *path)
+{
+  g_autofree gchar *uri = g_strconcat (fixture->base_uri, path, NULL);
+  g_autoptr(SoupMessage) msg = soup_message_new ("GET", uri);
+  gboolean done = FALSE;
+
+  soup_session_queue_message (fixture->session, g_object_ref (msg),
+                              message_done_cb, &done);
+
+  while (!done)
+    g_main_context_iteration (NULL, TRUE);
+
+  return g_steal_pointer (&msg);
+}
+
+/* Fetch the summary from the server and return whether @ref is listed in
+ * it. */
+static gboolean
+served_summary_contains_ref (Fixture     *fixture,
+                             const gchar *ref)
+{
+  g_autoptr(SoupMessage) msg = request (fixture, "/summary");
+  g_autoptr(SoupBuffer) buffer = NULL;
+  g_autoptr(GBytes) bytes = NULL;
+  g_autoptr(GVariant) summary = NULL;
+  g_autoptr(GVariant) refs = NULL;
+  gsize i, n_refs;
+
+  g_assert_cmpuint (msg->status_code, ==, SOUP_STATUS_OK);
+
+  buffer = soup_message_body_flatten (msg->response_body);
+  bytes = soup_buffer_get_as_bytes (buffer);
+  summary = g_variant_ref_sink (g_variant_new_from_bytes (OSTREE_SUMMARY_GVARIANT_FORMAT,
+                                                          bytes, FALSE));
+  refs = g_variant_get_child_value (summary, 0);
+  n_refs = g_variant_n_children (refs);
+
+  for (i = 0; i < n_refs; i++)
+    {
+      const gchar *ref_name = NULL;
+
+      g_variant_get_child (refs, i, "(&s@(taya{sv}))", &ref_name, NULL);
+      if (g_str_equal (ref_name, ref))
+        return TRUE;
+    }
+
+  return FALSE;
+}
+
+static gboolean
+timeout_cb (gpointer user_data)
+{
+  gboolean *timed_out = user_data;
+
+  *timed_out = TRUE;
+
+  return G_SOURCE_REMOVE;
+}
+
+/* Test that a monitored #EusRepo picks up refs which are added to the
+ * repository while it is being served, by regenerating the summary it has
+ * already served. */
+static void
+test_repo_reload_refs (Fixture       *fixture,
+                       gconstpointer  user_data G_GNUC_UNUSED)
+{
+  g_autoptr(GError) error = NULL;
+  g_autoptr(EusRepo) eus_repo = NULL;
+  gboolean timed_out = FALSE;
+  guint timeout_id;
+
+  eus_repo = eus_repo_new (fixture->repo, "", "eos", NULL, &error);
+  g_assert_no_error (error);
+  eus_repo_start_monitoring (eus_repo, &error);
+  g_assert_no_error (error);
+  eus_repo_connect (eus_repo, fixture->server);
+
+  /* The first request generates the summary. */
+  g_assert_true (served_summary_contains_ref (fixture, "test/ref1"));
+  g_assert_false (served_summary_contains_ref (fixture, "test/ref2"));
+
+  /* Add a ref behind the server’s back and wait for it to be served. */
+  ostree_repo_set_ref_immediate (fixture->repo, NULL, "test/ref2",
+                                 fixture->commit_checksum, NULL, &error);
+  g_assert_no_error (error);
+
+  timeout_id = g_timeout_add_seconds (10, timeout_cb, &timed_out);
+
+  while (!timed_out && !served_summary_contains_ref (fixture, "test/ref2"))
+    g_main_context_iteration (NULL, TRUE);
+
+  g_assert_false (timed_out);
+  g_source_remove (timeout_id);
+
+  g_assert_true (served_summary_contains_ref (fixture, "test/ref1"));
+
+  eus_repo_stop_monitoring (eus_repo);
+  eus_repo_disconnect (eus_repo);
+}
+
+/* Test that an #EusRepo which is not monitored keeps serving the summary it
+ * first generated. */
+static void
+test_repo_no_reload_unmonitored (Fixture       *fixture,
+                                 gconstpointer  user_data G_GNUC_UNUSED)
+{
+  g_autoptr(GError) error = NULL;
+  g_autoptr(EusRepo) eus_repo = NULL;
+  gboolean timed_out = FALSE;
+
+  eus_repo = eus_repo_new (fixture->repo, "", "eos", NULL, &error);
+  g_assert_no_error (error);
+  eus_repo_connect (eus_repo, fixture->server);
+
+  g_assert_true (served_summary_contains_ref (fixture, "test/ref1"));
+
+  ostree_repo_set_ref_immediate (fixture->repo, NULL, "test/ref2",
+                                 fixture->commit_checksum, NULL, &error);
+  g_assert_no_error (error);
+
+  /* Give a reload (if one were wrongly scheduled) time to happen. */
+  g_timeout_add_seconds (2, timeout_cb, &timed_out);
+
+  while (!timed_out)
+    g_main_context_iteration (NULL, TRUE);
+
+  g_assert_false (served_summary_contains_ref (fixture, "test/ref2"));
+
+  eus_repo_disconnect (eus_repo);
+}
+
+int
+main (int   argc,
+      char *argv[])
+{
+  setlocale (LC_ALL, "");
+
+  g_test_init (&argc, &argv, G_TEST_OPTION_ISOLATE_DIRS, NULL);
+
+  g_test_add ("/repo/reload/refs", Fixture, NULL, setup,
+              test_repo_reload_refs, teardown);
+  g_test_add ("/repo/reload/unmonitored", Fixture, NULL, setup,
+              test_repo_no_reload_unmonitored, teardown);
+
+  return g_test_run ();
+}
@@ -0,0 +1,352 @@
+/* -*- mode: C; c-file-style: "gnu"; indent-tabs-mode: nil; -*-
+ *
+ * Copyright © 2020 Endless OS Foundation, LLC
+ *
+ * SPDX-License-Identifier: LGPL-2.1-or-later
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+ */
+
+#include <gio/gio.h>
+#include <glib.h>
+#include <libeos-update-server/repo.h>
+#include <libeos-update-server/server.h>
+#include <libeos-updater-util/util.h>
+#include <libsoup/soup.h>
+#include <locale.h>
+#include <ostree.h>
+
+/* Large enough that the response can’t be buffered entirely in the kernel’s
+ * socket buffers, so the server has to wait for the client to read it. */
+#define LARGE_FILE_SIZE (32 * 1024 * 1024)
+
+typedef struct
+{
+  GFile *tmp_dir;  /* owned */
+  OstreeRepo *repo;  /* owned */
+  SoupServer *soup_server;  /* owned */
+  EusServer *server;  /* owned */
+  EusRepo *eus_repo;  /* owned */
+  guint16 port;
+} Fixture;
+
+/* Set up a bare repository containing a large delta file, and serve it from
+ * an #EusServer listening on localhost. */
+static void
+setup (Fixture       *fixture,
+       gconstpointer  user_data G_GNUC_UNUSED)
+{
+  g_autoptr(GError) error = NULL;
+  g_autofree gchar *tmp_dir = NULL;
+  g_autoptr(GFile) repo_dir = NULL;
+  g_autofree gchar *deltas_path = NULL;
+  g_autofree gchar *large_file_path = NULL;
+  g_autofree gchar *large_file_contents = NULL;
+  GSList *uris = NULL;
+
+  tmp_dir = g_dir_make_tmp ("eos-update-server-tests-server-XXXXXX", &error);
+  g_assert_no_error (error);
+  fixture->tmp_dir = g_file_new_for_path (tmp_dir);
+
+  repo_dir = g_file_get_child (fixture->tmp_dir, "repo");
+  fixture->repo = ostree_repo_new (repo_dir);
+  ostree_repo_create (fixture->repo, OSTREE_REPO_MODE_BARE, NULL, &error);
+  g_assert_no_error (error);
+
+  deltas_path = g_build_filename (tmp_dir, "repo", "deltas", NULL);
+  g_assert_cmpint (g_mkdir_with_parents (deltas_path, 0755), ==, 0);
+  large_file_path = g_build_filename (deltas_path, "large", NULL);
+  large_file_contents = g_malloc0 (LARGE_FILE_SIZE);
+  g_file_set_contents (large_file_path, large_file_contents, LARGE_FILE_SIZE,
+                       &error);
+  g_assert_no_error (error);
+
+  fixture->soup_server = soup_server_new (NULL, NULL);
+  soup_server_listen_local (fixture->soup_server, 0,
+                            SOUP_SERVER_LISTEN_IPV4_ONLY, &error);
+  g_assert_no_error (error);
+
+  uris = soup_server_get_uris (fixture->soup_server);
+  g_assert_nonnull (uris);
+  fixture->port = soup_uri_get_port (uris->data);
+  g_slist_free_full (uris, (GDestroyNotify) soup_uri_free);
+
+  fixture->server = eus_server_new (fixture->soup_server);
+  fixture->eus_repo = eus_repo_new (fixture->repo, "", "eos", NULL, &error);
+  g_assert_no_error (error);
+  eus_server_add_repo (fixture->server, fixture->eus_repo);
+}
+
+static void
+teardown (Fixture       *fixture,
+          gconstpointer  user_data G_GNUC_UNUSED)
+{
+  g_autoptr(GError) error = NULL;
+
+  if (fixture->server != NULL)
+    eus_server_disconnect (fixture->server);
+  g_clear_object (&fixture->server);
+  g_clear_object (&fixture->eus_repo);
+
+  if (fixture->soup_server != NULL)
+    soup_server_disconnect (fixture->soup_server);
+  g_clear_object (&fixture->soup_server);
+
+  g_clear_object (&fixture->repo);
+
+  eos_updater_remove_recursive (fixture->tmp_dir, NULL, &error);
+  g_assert_no_error (error);
+  g_clear_object (&fixture->tmp_dir);
+}
+
+/* Open a raw connection to the server and request the large file on it,
+ * without reading any of the response. The returned socket is non-blocking. */
+static GSocketConnection *
+request_large_file (Fixture *fixture)
+{
+  g_autoptr(GError) error = NULL;
+  g_autoptr(GSocketClient) client = g_socket_client_new ();
+  g_autoptr(GSocketConnection) connection = NULL;
+  g_autofree gchar *request = NULL;
+  GOutputStream *output;
+
+  connection = g_socket_client_connect_to_host (client, "127.0.0.1",
+                                                fixture->port, NULL, &error);
+  g_assert_no_error (error);
+
+  request = g_strdup_printf ("GET /deltas/large HTTP/1.1\r\n"
+                             "Host: 127.0.0.1:%u\r\n"
+                             "Connection: close\r\n"
+                             "\r\n", fixture->port);
+  output = g_io_stream_get_output_stream (G_IO_STREAM (connection));
+  g_output_stream_write_all (output, request, strlen (request), NULL, NULL,
+                             &error);
+  g_assert_no_error (error);
+
+  g_socket_set_blocking (g_socket_connection_get_socket (connection), FALSE);
+
+  return g_steal_pointer (&connection);
+}
+
+/* Read from @socket until the server closes the connection, iterating the
+ * main context in between so the server can make progress. Return the number
+ * of bytes read. */
+static gsize
+read_until_closed (GSocket *socket)
+{
+  g_autofree gchar *buffer = g_malloc (65536);
+  gsize total = 0;
+
+  while (TRUE)
+    {
+      g_autoptr(GError) error = NULL;
+      gssize n_read;
+
+      n_read = g_socket_receive (socket, buffer, 65536, NULL, &error);
+
+      if (n_read == 0 ||
+          g_error_matches (error, G_IO_ERROR, G_IO_ERROR_CONNECTION_CLOSED))
+        break;
+      else if (g_error_matches (error, G_IO_ERROR, G_IO_ERROR_WOULD_BLOCK))
+        g_main_context_iteration (NULL, TRUE);
+      else
+        {
+          g_assert_no_error (error);
+          total += n_read;
+        }
+    }
+
+  return total;
+}
+
+static gboolean
+timeout_cb (gpointer user_data)
+{
+  gboolean *timed_out = user_data;
+
+  *timed_out = TRUE;
+
+  return G_SOURCE_REMOVE;
+}
+
+/* Iterate the main context until @server has evicted @n_evicted requests, or
+ * until 10 seconds pass. */
+static void
+wait_for_evictions (EusServer *server,
+                    guint      n_evicted)
+{
+  gboolean timed_out = FALSE;
+  guint timeout_id;
+
+  timeout_id = g_timeout_add_seconds (10, timeout_cb, &timed_out);
+
+  while (!timed_out && eus_server_get_evicted_requests (server) < n_evicted)
+    g_main_context_iteration (NULL, TRUE);
+
+  g_assert_false (timed_out);
+  g_source_remove (timeout_id);
+}
+
+/* Iterate the main context until @server has no pending requests. */
+static void
+wait_for_no_pending_requests (EusServer *server)
+{
+  while (eus_server_get_pending_requests (server) > 0)
+    g_main_context_iteration (NULL, TRUE);
+}
+
+/* Test that a client which stops reading its response is disconnected once
+ * #EusServer:client-timeout has passed, and its request is released. */
+static void
+test_server_evict_stalled (Fixture       *fixture,
+                           gconstpointer  user_data G_GNUC_UNUSED)
+{
+  g_autoptr(GSocketConnection) connection = NULL;
+  gsize n_read;
+
+  eus_server_set_client_limits (fixture->server, 1, 0);
+
+  g_test_expect_message ("libeos-update-server", G_LOG_LEVEL_MESSAGE,
+                         "Evicting client requesting ‘/deltas/large’: client stopped reading");
+
+  connection = request_large_file (fixture);
+  wait_for_evictions (fixture->server, 1);
+
+  g_test_assert_expected_messages ();
+
+  /* The server should have shut down the socket, so the client sees the
+   * connection close part way through the response. */
+  n_read = read_until_closed (g_socket_connection_get_socket (connection));
+  g_assert_cmpuint (n_read, <, LARGE_FILE_SIZE);
+
+  wait_for_no_pending_requests (fixture->server);
+  g_assert_cmpuint (eus_server_get_evicted_requests (fixture->server), ==, 1);
+}
+
+typedef struct
+{
+  GSocket *socket;  /* (unowned) */
+  gsize n_read;
+  gboolean closed;
+} TrickleData;
+
+/* Read a little of the response every 50ms, so the client never stalls for
+ * long but reads far more slowly than a real client would. */
+static gboolean
+trickle_read_cb (gpointer user_data)
+{
+  TrickleData *data = user_data;
+  g_autoptr(GError) error = NULL;
+  gchar buffer[65536];
+  gssize n_read;
+
+  n_read = g_socket_receive (data->socket, buffer, sizeof (buffer), NULL,
+                             &error);
+
+  if (n_read == 0 ||
+      g_error_matches (error, G_IO_ERROR, G_IO_ERROR_CONNECTION_CLOSED))
+    {
+      data->closed = TRUE;
+      return G_SOURCE_REMOVE;
+    }
+  else if (!g_error_matches (error, G_IO_ERROR, G_IO_ERROR_WOULD_BLOCK))
+    {
+      g_assert_no_error (error);
+      data->n_read += n_read;
+    }
+
+  return G_SOURCE_CONTINUE;
+}
+
+/* Test that a client which keeps reading, but more slowly than
+ * #EusServer:client-min-throughput, is disconnected once it has been given
+ * #EusServer:client-timeout seconds to get going. */
+static void
+test_server_evict_slow (Fixture       *fixture,
+                        gconstpointer  user_data G_GNUC_UNUSED)
+{
+  g_autoptr(GSocketConnection) connection = NULL;
+  TrickleData data = { NULL, 0, FALSE };
+
+  /* The timeout is long compared to the gaps between reads, so the client is
+   * evicted for its throughput rather than for stalling. */
+  eus_server_set_client_limits (fixture->server, 3, 100 * 1024 * 1024);
+
+  g_test_expect_message ("libeos-update-server", G_LOG_LEVEL_MESSAGE,
+                         "Evicting client requesting ‘/deltas/large’: throughput * B/s below minimum 104857600 B/s");
+
+  connection = request_large_file (fixture);
+  data.socket = g_socket_connection_get_socket (connection);
+  g_timeout_add (50, trickle_read_cb, &data);
+
+  while (!data.closed)
+    g_main_context_iteration (NULL, TRUE);
+
+  g_test_assert_expected_messages ();
+
+  g_assert_cmpuint (eus_server_get_evicted_requests (fixture->server), ==, 1);
+  g_assert_cmpuint (data.n_read, <, LARGE_FILE_SIZE);
+
+  wait_for_no_pending_requests (fixture->server);
+}
+
+/* Test that clients are never evicted if both limits are disabled, which is
+ * the default. */
+static void
+test_server_evict_disabled (Fixture       *fixture,
+                            gconstpointer  user_data G_GNUC_UNUSED)
+{
+  g_autoptr(GSocketConnection) connection = NULL;
+  gboolean timed_out = FALSE;
+  gsize n_read;
+
+  g_assert_cmpuint (eus_server_get_pending_requests (fixture->server), ==, 0);
+
+  connection = request_large_file (fixture);
+
+  /* Stall for longer than the eviction check interval. */
+  g_timeout_add_seconds (3, timeout_cb, &timed_out);
+
+  while (!timed_out)
+    g_main_context_iteration (NULL, TRUE);
+
+  g_assert_cmpuint (eus_server_get_evicted_requests (fixture->server), ==, 0);
+  g_assert_cmpuint (eus_server_get_pending_requests (fixture->server), ==, 1);
+
+  /* The whole response can still be read. */
+  n_read = read_until_closed (g_socket_connection_get_socket (connection));
+  g_assert_cmpuint (n_read, >, LARGE_FILE_SIZE);
+
+  wait_for_no_pending_requests (fixture->server);
+  g_assert_cmpuint (eus_server_get_evicted_requests (fixture->server), ==, 0);
+}
+
+int
+main (int   argc,
+      char *argv[])
+{
+  setlocale (LC_ALL, "");
+
+  g_test_init (&argc, &argv, G_TEST_OPTION_ISOLATE_DIRS, NULL);
+
+  g_test_add ("/server/evict/stalled", Fixture, NULL, setup,
+              test_server_evict_stalled, teardown);
+  g_test_add ("/server/evict/slow", Fixture, NULL, setup,
+              test_server_evict_slow, teardown);
+  g_test_add ("/server/evict/disabled", Fixture, NULL, setup,
+              test_server_evict_disabled, teardown);
+
+  return g_test_run ();
+}
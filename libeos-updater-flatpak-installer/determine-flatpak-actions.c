@@ -35,6 +35,7 @@
 
 static gboolean
 flatpak_ref_actions_and_progresses (GStrv        directories_to_search,
+                                    gboolean     update_cache,
                                     GHashTable **out_actions  /* (element-type filename GPtrArray<EuuFlatpakRemoteRefAction>) */,
                                     GHashTable **out_progresses  /* (element-type filename gint32) */,
                                     GError     **error)
@@ -48,6 +49,7 @@ flatpak_ref_actions_and_progresses (GStrv        directories_to_search,
   g_assert (out_progresses != NULL);
 
   flatpak_ref_actions_for_this_boot = euu_flatpak_ref_actions_from_paths (directories_to_search,
+                                                                          update_cache,
                                                                           error);
 
   if (flatpak_ref_actions_for_this_boot == NULL)
@@ -101,6 +103,7 @@ eufi_determine_flatpak_ref_actions_to_check (GStrv    directories_to_search,
   g_autoptr(GHashTable) flatpak_ref_actions_progress = NULL;
 
   if (!flatpak_ref_actions_and_progresses (directories_to_search,
+                                           FALSE,
                                            &flatpak_ref_actions_for_this_boot,
                                            &flatpak_ref_actions_progress,
                                            error))
@@ -129,7 +132,10 @@ eufi_determine_flatpak_ref_actions_to_apply (GStrv    directories_to_search,
   g_autoptr(GHashTable) flatpak_ref_actions_for_this_boot = NULL;
   g_autoptr(GHashTable) flatpak_ref_actions_progress = NULL;
 
+  /* Only applying the actions should update the autoinstall cache; checking
+   * them must not modify the system. */
   if (!flatpak_ref_actions_and_progresses (directories_to_search,
+                                           TRUE,
                                            &flatpak_ref_actions_for_this_boot,
                                            &flatpak_ref_actions_progress,
                                            error))
@@ -22,8 +22,11 @@
  *  - Sam Spilsbury <sam@endlessm.com>
  */
 
+#include <errno.h>
+#include <fcntl.h>
 #include <flatpak.h>
 #include <glib.h>
+#include <glib/gstdio.h>
 #include <libeos-updater-flatpak-installer/installer.h>
 #include <libeos-updater-util/enums.h>
 #include <libeos-updater-util/flatpak-util.h>
@@ -32,181 +35,574 @@
 #include <locale.h>
 #include <stdlib.h>
 #include <string.h>
+#include <unistd.h>
 
+/* Check that @in_remote_name is the remote configured for @collection_id, if
+ * there is one. */
 static gboolean
-try_update_application (FlatpakInstallation       *installation,
-                        FlatpakRef                *ref,
-                        EosUpdaterInstallerFlags   flags,
-                        GError                   **error)
+check_remote_for_collection_id (FlatpakInstallation  *installation,
+                                const gchar          *collection_id,
+                                const gchar          *in_remote_name,
+                                GError              **error)
 {
-  g_autofree gchar *formatted_ref = flatpak_ref_format_ref (ref);
-  gboolean no_pull = !(flags & EU_INSTALLER_FLAGS_ALSO_PULL);
-  g_autoptr(GError) local_error = NULL;
+  g_autofree gchar *candidate_remote_name = NULL;
 
-  g_message ("Attempting to update %s", formatted_ref);
+  if (collection_id == NULL)
+    return TRUE;
 
-  if (!euu_flatpak_transaction_update (installation,
-                                       formatted_ref,
-                                       FALSE, /* no_deploy */
-                                       no_pull,
-                                       TRUE, /* no_prune */
-                                       NULL, /* cancellable */
-                                       &local_error))
-    {
-      if (g_error_matches (local_error, FLATPAK_ERROR, FLATPAK_ERROR_NOT_INSTALLED))
-        {
-          g_message ("%s is not installed, so not updating", formatted_ref);
-          g_clear_error (&local_error);
-          return TRUE;
-        }
+  g_message ("Finding remote name for %s", collection_id);
 
-      g_propagate_error (error, g_steal_pointer (&local_error));
+  /* Ignore errors here. We always have the @in_remote_name to use. */
+  candidate_remote_name = euu_lookup_flatpak_remote_for_collection_id (installation,
+                                                                       collection_id,
+                                                                       NULL);
+
+  if (candidate_remote_name != NULL &&
+      g_strcmp0 (in_remote_name, candidate_remote_name) != 0)
+    {
+      g_set_error (error,
+                   EOS_UPDATER_ERROR,
+                   EOS_UPDATER_ERROR_FLATPAK_REMOTE_CONFLICT,
+                   "Specified flatpak remote ‘%s’ conflicts with the remote "
+                   "detected for collection ID ‘%s’ (‘%s’), cannot continue.",
+                   in_remote_name,
+                   collection_id,
+                   candidate_remote_name);
       return FALSE;
     }
 
-  g_message ("Successfully updated %s", formatted_ref);
+  g_message ("Remote name for %s is %s", collection_id, in_remote_name);
+
   return TRUE;
 }
 
+/* Add @action to @transaction. Flatpak checks whether the ref is installed
+ * when the operation is added, so this is where an install of an already
+ * installed ref is turned into an update, and where an update or uninstall of
+ * a ref which isn’t installed is dropped. If that happens, @out_skipped is set
+ * to %TRUE, as no operation has been added for @action. */
 static gboolean
-try_install_application (FlatpakInstallation       *installation,
-                         const gchar               *collection_id,
-                         const gchar               *in_remote_name,
-                         FlatpakRef                *ref,
-                         EosUpdaterInstallerFlags   flags,
-                         GError                   **error)
+add_action_to_transaction (FlatpakTransaction         *transaction,
+                           FlatpakInstallation        *installation,
+                           EuuFlatpakRemoteRefAction  *action,
+                           gboolean                   *out_skipped,
+                           GError                    **error)
 {
-  g_autofree gchar *formatted_ref = flatpak_ref_format_ref (ref);
-  g_autofree gchar *candidate_remote_name = NULL;
-  const gchar *remote_name = in_remote_name;
-  gboolean no_pull = !(flags & EU_INSTALLER_FLAGS_ALSO_PULL);
+  g_autofree gchar *formatted_ref = flatpak_ref_format_ref (action->ref->ref);
+  const gchar *remote_name = action->ref->remote;
   g_autoptr(GError) local_error = NULL;
 
-  g_assert (in_remote_name != NULL);
+  *out_skipped = FALSE;
 
-  if (collection_id != NULL)
+  switch (action->type)
     {
-      g_message ("Finding remote name for %s", collection_id);
+      case EUU_FLATPAK_REMOTE_REF_ACTION_INSTALL:
+        g_assert (remote_name != NULL);
 
-      /* Ignore errors here. We always have the @in_remote_name to use. */
-      candidate_remote_name = euu_lookup_flatpak_remote_for_collection_id (installation,
-                                                                           collection_id,
-                                                                           NULL);
+        if (!check_remote_for_collection_id (installation,
+                                             action->ref->collection_id,
+                                             remote_name,
+                                             error))
+          return FALSE;
+
+        g_message ("Attempting to install %s:%s", remote_name, formatted_ref);
+
+        if (flatpak_transaction_add_install (transaction,
+                                             remote_name,
+                                             formatted_ref,
+                                             NULL, /* subpaths */
+                                             &local_error))
+          return TRUE;
 
-      if (candidate_remote_name != NULL &&
-          g_strcmp0 (in_remote_name, candidate_remote_name) != 0)
+        if (!g_error_matches (local_error, FLATPAK_ERROR, FLATPAK_ERROR_ALREADY_INSTALLED))
+          {
+            g_message ("Failed to install %s:%s: %s", remote_name, formatted_ref,
+                       local_error->message);
+            g_propagate_error (error, g_steal_pointer (&local_error));
+            return FALSE;
+          }
+
+        g_message ("%s:%s already installed, updating", remote_name, formatted_ref);
+        g_clear_error (&local_error);
+
+        return flatpak_transaction_add_update (transaction,
+                                               formatted_ref,
+                                               NULL, /* subpaths */
+                                               NULL, /* commit */
+                                               error);
+      case EUU_FLATPAK_REMOTE_REF_ACTION_UPDATE:
+        g_message ("Attempting to update %s", formatted_ref);
+
+        if (flatpak_transaction_add_update (transaction,
+                                            formatted_ref,
+                                            NULL, /* subpaths */
+                                            NULL, /* commit */
+                                            &local_error))
+          return TRUE;
+
+        if (!g_error_matches (local_error, FLATPAK_ERROR, FLATPAK_ERROR_NOT_INSTALLED))
+          {
+            g_propagate_error (error, g_steal_pointer (&local_error));
+            return FALSE;
+          }
+
+        g_message ("%s is not installed, so not updating", formatted_ref);
+        *out_skipped = TRUE;
+        return TRUE;
+      case EUU_FLATPAK_REMOTE_REF_ACTION_UNINSTALL:
+        g_message ("Attempting to uninstall %s", formatted_ref);
+
+        if (flatpak_transaction_add_uninstall (transaction,
+                                               formatted_ref,
+                                               &local_error))
+          return TRUE;
+
+        if (!g_error_matches (local_error, FLATPAK_ERROR, FLATPAK_ERROR_NOT_INSTALLED))
+          {
+            g_message ("Could not uninstall %s", formatted_ref);
+            g_propagate_error (error, g_steal_pointer (&local_error));
+            return FALSE;
+          }
+
+        g_message ("%s already uninstalled", formatted_ref);
+        *out_skipped = TRUE;
+        return TRUE;
+      default:
+        g_assert_not_reached ();
+    }
+}
+
+/* Number of records appended to the progress journal between each fsync().
+ * Losing the last few records in a crash only means those actions are
+ * applied again, which is harmless. */
+#define PROGRESS_JOURNAL_SYNC_BATCH 8
+
+/* Append-only journal of the progress made through the actions during a run,
+ * so that an interrupted run can resume from where it stopped, without
+ * rewriting the counter file after every action. It is folded into the
+ * counter file, and deleted, by update_counter(). See
+ * euu_flatpak_progress_journal_path() for the format. */
+typedef struct
+{
+  int fd;
+  guint n_unsynced;
+} ProgressJournal;
+
+static void
+progress_journal_close (ProgressJournal *journal)
+{
+  if (journal->fd >= 0)
+    {
+      if (journal->n_unsynced > 0)
+        fsync (journal->fd);
+      g_close (journal->fd, NULL);
+    }
+
+  g_free (journal);
+}
+
+G_DEFINE_AUTOPTR_CLEANUP_FUNC (ProgressJournal, progress_journal_close)
+
+/* Open the journal for the counter at @counter_path. If that fails, progress
+ * is only saved at the end of the run, as it would be without a journal, so
+ * %NULL is returned rather than an error. */
+static ProgressJournal *
+progress_journal_open (const gchar *counter_path)
+{
+  g_autofree gchar *journal_path = euu_flatpak_progress_journal_path (counter_path);
+  g_autofree gchar *parent_path = g_path_get_dirname (counter_path);
+  ProgressJournal *journal;
+  gboolean created = TRUE;
+  int fd;
+
+  if (g_mkdir_with_parents (parent_path, 0755) != 0)
+    fd = -1;
+  else if ((fd = g_open (journal_path, O_WRONLY | O_APPEND | O_CREAT | O_EXCL | O_CLOEXEC, 0644)) < 0 &&
+           errno == EEXIST)
+    {
+      created = FALSE;
+      fd = g_open (journal_path, O_WRONLY | O_APPEND | O_CLOEXEC, 0);
+    }
+
+  if (fd < 0)
+    {
+      int errsv = errno;
+      g_message ("Could not open progress journal ‘%s’: %s",
+                 journal_path, g_strerror (errsv));
+      return NULL;
+    }
+
+  /* The records are fsync()ed, but the journal’s directory entry also has to
+   * reach the disk for them to survive a crash. That only needs doing once,
+   * when the journal is created; if it fails, the journal may be lost in a
+   * crash, which only means those actions are applied again. */
+  if (created)
+    {
+      int dir_fd = g_open (parent_path, O_RDONLY | O_DIRECTORY | O_CLOEXEC, 0);
+
+      if (dir_fd < 0 || fsync (dir_fd) != 0)
         {
-          g_set_error (error,
-                       EOS_UPDATER_ERROR,
-                       EOS_UPDATER_ERROR_FLATPAK_REMOTE_CONFLICT,
-                       "Specified flatpak remote ‘%s’ conflicts with the remote "
-                       "detected for collection ID ‘%s’ (‘%s’), cannot continue.",
-                       in_remote_name,
-                       collection_id,
-                       candidate_remote_name);
-          return FALSE;
+          int errsv = errno;
+          g_debug ("Could not sync directory ‘%s’: %s",
+                   parent_path, g_strerror (errsv));
         }
 
-      g_message ("Remote name for %s is %s", collection_id, remote_name);
+      if (dir_fd >= 0)
+        g_close (dir_fd, NULL);
     }
 
-  g_message ("Attempting to install %s:%s", remote_name, formatted_ref);
+  journal = g_new0 (ProgressJournal, 1);
+  journal->fd = fd;
 
-  if (!euu_flatpak_transaction_install (installation,
-                                        remote_name,
-                                        formatted_ref,
-                                        FALSE, /* no_deploy */
-                                        no_pull,
-                                        NULL, /* cancellable */
-                                        &local_error))
+  return journal;
+}
+
+static void
+progress_journal_append (ProgressJournal *journal,
+                         const gchar     *source,
+                         gint32           serial)
+{
+  g_autofree gchar *record = NULL;
+  gsize record_len, written = 0;
+
+  if (journal->fd < 0)
+    return;
+
+  /* The whole record is written at once, so a crash can only leave the last
+   * line truncated; such lines are ignored when the journal is read. */
+  record = g_strdup_printf ("%" G_GINT32_FORMAT " %s\n", serial, source);
+  record_len = strlen (record);
+
+  while (written < record_len)
     {
-      if (!g_error_matches (local_error, FLATPAK_ERROR, FLATPAK_ERROR_ALREADY_INSTALLED))
+      gssize n = write (journal->fd, record + written, record_len - written);
+
+      if (n < 0 && errno == EINTR)
+        continue;
+
+      if (n < 0)
         {
-          g_message ("Failed to install %s:%s: %s", remote_name, formatted_ref,
-                     local_error->message);
-          g_propagate_error (error, g_steal_pointer (&local_error));
-          return FALSE;
+          int errsv = errno;
+          g_message ("Could not write to progress journal: %s", g_strerror (errsv));
+          g_close (journal->fd, NULL);
+          journal->fd = -1;
+          return;
         }
 
-      g_message ("%s:%s already installed, updating", remote_name, formatted_ref);
-      g_clear_error (&local_error);
+      written += n;
+    }
 
-      if (!euu_flatpak_transaction_update (installation,
-                                           formatted_ref,
-                                           FALSE, /* no_deploy */
-                                           no_pull,
-                                           TRUE, /* no_prune */
-                                           NULL, /* cancellable */
-                                           error))
-        return FALSE;
+  if (++journal->n_unsynced >= PROGRESS_JOURNAL_SYNC_BATCH)
+    {
+      fsync (journal->fd);
+      journal->n_unsynced = 0;
     }
+}
 
-  g_message ("Successfully installed or updated %s:%s", remote_name, formatted_ref);
-  return TRUE;
+typedef struct
+{
+  GPtrArray *actions;  /* (element-type EuuFlatpakRemoteRefAction) */
+  const gboolean *record_progress;  /* (array): whether to record progress for each action */
+  GHashTable *action_indices;  /* (owned) (element-type utf8 guint): formatted ref → index in actions, plus one */
+  gboolean *applied;  /* (owned) (array): whether each action has been applied */
+  guint *next_for_source;  /* (owned) (array): index of the next action from the same source, or actions->len */
+  GHashTable *source_cursors;  /* (owned) (element-type filename guint): source → index of its first action not yet recorded */
+  GHashTable *new_progresses;  /* (element-type filename gint32) */
+  ProgressJournal *journal;  /* (nullable) */
+  GError *operation_error;  /* (owned) (nullable) */
+  gboolean operation_started;  /* whether any operation has been started */
+} ApplyTransactionData;
+
+/* Flatpak orders the operations in a transaction itself (for example, runtimes
+ * before the apps which use them), so the actions may be applied in a
+ * different order from @data->actions. The progress counter for each source
+ * means that all its actions up to that serial have been applied, so advance
+ * the progress for @source over its leading actions which have now all been
+ * applied, recording them in @data->new_progresses and the journal. The
+ * progress of other sources is independent, so an action which failed only
+ * holds back the progress of its own source. */
+static void
+apply_transaction_advance (ApplyTransactionData *data,
+                           const gchar          *source)
+{
+  guint i = GPOINTER_TO_UINT (g_hash_table_lookup (data->source_cursors, source));
+
+  while (i < data->actions->len && data->applied[i])
+    {
+      EuuFlatpakRemoteRefAction *action = g_ptr_array_index (data->actions, i);
+
+      if (data->record_progress[i])
+        {
+          if (data->journal != NULL)
+            progress_journal_append (data->journal, action->source, action->serial);
+
+          g_hash_table_replace (data->new_progresses,
+                                (gpointer) action->source,
+                                GINT_TO_POINTER (action->serial));
+        }
+
+      i = data->next_for_source[i];
+    }
+
+  g_hash_table_replace (data->source_cursors, (gpointer) source, GUINT_TO_POINTER (i));
+}
+
+static void
+apply_transaction_new_operation (FlatpakTransaction          *transaction,
+                                 FlatpakTransactionOperation *operation,
+                                 FlatpakTransactionProgress  *progress,
+                                 gpointer                     user_data)
+{
+  ApplyTransactionData *data = user_data;
+
+  data->operation_started = TRUE;
+}
+
+static void
+apply_transaction_operation_done (FlatpakTransaction          *transaction,
+                                  FlatpakTransactionOperation *operation,
+                                  const gchar                 *commit,
+                                  FlatpakTransactionResult     details,
+                                  gpointer                     user_data)
+{
+  ApplyTransactionData *data = user_data;
+  const gchar *formatted_ref = flatpak_transaction_operation_get_ref (operation);
+  guint index_plus_one = GPOINTER_TO_UINT (g_hash_table_lookup (data->action_indices,
+                                                                formatted_ref));
+  EuuFlatpakRemoteRefAction *action;
+
+  /* Operations on dependencies and related refs which weren’t added
+   * explicitly aren’t tracked. */
+  if (index_plus_one == 0)
+    return;
+
+  g_message ("Successfully applied %s", formatted_ref);
+  action = g_ptr_array_index (data->actions, index_plus_one - 1);
+  data->applied[index_plus_one - 1] = TRUE;
+  apply_transaction_advance (data, action->source);
 }
 
 static gboolean
-try_uninstall_application (FlatpakInstallation  *installation,
-                           FlatpakRef           *ref,
-                           GError              **error)
+apply_transaction_operation_error (FlatpakTransaction             *transaction,
+                                   FlatpakTransactionOperation    *operation,
+                                   const GError                   *error,
+                                   FlatpakTransactionErrorDetails  details,
+                                   gpointer                        user_data)
 {
-  g_autofree gchar *formatted_ref = flatpak_ref_format_ref (ref);
-  g_autoptr(GError) local_error = NULL;
+  ApplyTransactionData *data = user_data;
+  const gchar *formatted_ref = flatpak_transaction_operation_get_ref (operation);
 
-  g_message ("Attempting to uninstall %s", formatted_ref);
+  if (g_error_matches (error, FLATPAK_ERROR, FLATPAK_ERROR_SKIPPED))
+    {
+      g_debug ("Skipped %s", formatted_ref);
+      return TRUE;  /* continue */
+    }
 
-  if (!euu_flatpak_transaction_uninstall (installation,
-                                          formatted_ref,
-                                          TRUE, /* no_prune */
-                                          NULL, /* cancellable */
-                                          &local_error))
+  if (details & FLATPAK_TRANSACTION_ERROR_DETAILS_NON_FATAL)
     {
-      if (!g_error_matches (local_error, FLATPAK_ERROR, FLATPAK_ERROR_NOT_INSTALLED))
+      g_message ("Non-fatal failure to apply %s: %s", formatted_ref, error->message);
+      return TRUE;  /* continue */
+    }
+
+  g_message ("Failed to apply %s: %s", formatted_ref, error->message);
+
+  if (data->operation_error == NULL)
+    data->operation_error = g_error_copy (error);
+
+  /* Abort the transaction. */
+  return FALSE;
+}
+
+/* Perform @actions in a single #FlatpakTransaction, rather than one
+ * transaction per action, so that the installation is only locked and its
+ * state only loaded and updated once.
+ *
+ * As each action for which @record_progress is set is applied (or turns out
+ * not to need applying), its progress is recorded in @new_progresses (a map of
+ * source to serial) and appended to @journal, if it’s non-%NULL, once all the
+ * earlier actions from its source have been applied too. See
+ * apply_transaction_advance().
+ *
+ * @out_n_applied is set to the number of leading actions in @actions which
+ * were applied before any failure. If an action can’t be added to the
+ * transaction, the ones before it are still applied. If the transaction
+ * fails before running any operations (for example, because one of the refs
+ * can’t be resolved in its remote), the actions are applied again one per
+ * transaction, so that the ones before the failing action are still
+ * applied. */
+static gboolean
+apply_actions_in_transaction (FlatpakInstallation       *installation,
+                              GPtrArray                 *actions,
+                              const gboolean            *record_progress,
+                              ProgressJournal           *journal,
+                              GHashTable                *new_progresses,
+                              EosUpdaterInstallerFlags   flags,
+                              guint                     *out_n_applied,
+                              GError                   **error)
+{
+  g_autoptr(FlatpakTransaction) transaction = NULL;
+  g_autoptr(GHashTable) action_indices = g_hash_table_new_full (g_str_hash, g_str_equal, g_free, NULL);
+  g_autoptr(GHashTable) source_cursors = g_hash_table_new (g_str_hash, g_str_equal);
+  g_autoptr(GHashTable) last_for_source = g_hash_table_new (g_str_hash, g_str_equal);
+  g_autofree gboolean *applied = g_new0 (gboolean, actions->len);
+  g_autofree guint *next_for_source = g_new0 (guint, actions->len);
+  ApplyTransactionData data = { actions, record_progress, action_indices, applied,
+                                next_for_source, source_cursors, new_progresses,
+                                journal, NULL, FALSE };
+  g_autoptr(GError) add_error = NULL;
+  g_autoptr(GError) operation_error = NULL;
+  g_autoptr(GError) transaction_error = NULL;
+  gboolean success = TRUE;
+  guint n_added;
+  gulong new_operation_id, done_id, error_id;
+  gint64 start_time_usec;
+  guint i;
+
+  *out_n_applied = 0;
+
+  /* Chain together the actions from each source, so the progress for each
+   * source can be advanced independently. */
+  for (i = 0; i < actions->len; i++)
+    {
+      EuuFlatpakRemoteRefAction *action = g_ptr_array_index (actions, i);
+      gpointer last;
+
+      next_for_source[i] = actions->len;
+
+      if (g_hash_table_lookup_extended (last_for_source, action->source, NULL, &last))
+        next_for_source[GPOINTER_TO_UINT (last)] = i;
+      else
+        g_hash_table_insert (source_cursors, (gpointer) action->source, GUINT_TO_POINTER (i));
+
+      g_hash_table_replace (last_for_source, (gpointer) action->source, GUINT_TO_POINTER (i));
+    }
+
+  transaction = flatpak_transaction_new_for_installation (installation, NULL, error);
+  if (transaction == NULL)
+    return FALSE;
+
+  flatpak_transaction_set_no_interaction (transaction, TRUE);
+  flatpak_transaction_set_no_pull (transaction, !(flags & EU_INSTALLER_FLAGS_ALSO_PULL));
+  flatpak_transaction_set_disable_prune (transaction, TRUE);
+
+  for (n_added = 0; n_added < actions->len; n_added++)
+    {
+      EuuFlatpakRemoteRefAction *action = g_ptr_array_index (actions, n_added);
+      gboolean skipped;
+
+      if (!add_action_to_transaction (transaction, installation, action,
+                                      &skipped, &add_error))
+        break;
+
+      if (skipped)
+        applied[n_added] = TRUE;
+      else
+        g_hash_table_replace (action_indices,
+                              flatpak_ref_format_ref (action->ref->ref),
+                              GUINT_TO_POINTER (n_added + 1));
+    }
+
+  if (!flatpak_transaction_is_empty (transaction))
+    {
+      start_time_usec = g_get_monotonic_time ();
+
+      new_operation_id = g_signal_connect (transaction, "new-operation",
+                                           G_CALLBACK (apply_transaction_new_operation), &data);
+      done_id = g_signal_connect (transaction, "operation-done",
+                                  G_CALLBACK (apply_transaction_operation_done), &data);
+      error_id = g_signal_connect (transaction, "operation-error",
+                                   G_CALLBACK (apply_transaction_operation_error), &data);
+      success = flatpak_transaction_run (transaction, NULL, &transaction_error);
+      g_signal_handler_disconnect (transaction, new_operation_id);
+      g_signal_handler_disconnect (transaction, done_id);
+      g_signal_handler_disconnect (transaction, error_id);
+      operation_error = g_steal_pointer (&data.operation_error);
+
+      g_message ("Ran transaction for %u actions in %" G_GINT64_FORMAT " ms",
+                 n_added, (g_get_monotonic_time () - start_time_usec) / 1000);
+
+      /* Operations which flatpak decides not to run (such as an update to a
+       * ref which is already up to date) don’t signal that they are done, so
+       * rely on the overall result if it’s successful. */
+      if (success)
         {
-          g_message ("Could not uninstall %s", formatted_ref);
-          g_propagate_error (error, g_steal_pointer (&local_error));
+          for (i = 0; i < n_added; i++)
+            applied[i] = TRUE;
+        }
+    }
+
+  /* Nothing was applied, so rather than losing the progress which could
+   * have been made on the actions before the failing one, apply each action
+   * in its own transaction, stopping at the first failure. */
+  if (!success && !data.operation_started && n_added > 1)
+    {
+      g_message ("Transaction failed before running any operations: %s; "
+                 "applying the %u actions one at a time",
+                 (operation_error != NULL) ? operation_error->message : transaction_error->message,
+                 n_added);
+
+      for (i = 0; i < n_added; i++)
+        {
+          g_autoptr(GPtrArray) single_action = g_ptr_array_new ();
+          guint n_single_applied;
+
+          g_ptr_array_add (single_action, g_ptr_array_index (actions, i));
+
+          if (!apply_actions_in_transaction (installation, single_action,
+                                             record_progress + i, journal,
+                                             new_progresses, flags,
+                                             &n_single_applied, error))
+            {
+              *out_n_applied = i;
+              return FALSE;
+            }
+        }
+
+      *out_n_applied = n_added;
+
+      if (add_error != NULL)
+        {
+          g_propagate_error (error, g_steal_pointer (&add_error));
           return FALSE;
         }
 
-      g_message ("%s already uninstalled", formatted_ref);
-      g_clear_error (&local_error);
       return TRUE;
     }
 
-  g_message ("Successfully uninstalled %s", formatted_ref);
-  return TRUE;
-}
+  /* The caller saves the counter straight away, so there’s no need to journal
+   * the rest of the progress. */
+  data.journal = NULL;
+  for (i = 0; i < actions->len; i++)
+    {
+      EuuFlatpakRemoteRefAction *action = g_ptr_array_index (actions, i);
+      apply_transaction_advance (&data, action->source);
+    }
 
-static gboolean
-perform_action (FlatpakInstallation        *installation,
-                EuuFlatpakRemoteRefAction  *action,
-                EosUpdaterInstallerFlags    flags,
-                GError                    **error)
-{
-  const gchar *collection_id = action->ref->collection_id;
-  const gchar *remote_name = action->ref->remote;
+  *out_n_applied = 0;
+  while (*out_n_applied < actions->len && applied[*out_n_applied])
+    (*out_n_applied)++;
 
-  switch (action->type)
+  /* Report the error for the earliest failing action. The transaction only
+   * contains the actions before @add_error’s one, so its errors come first.
+   * Prefer the operation error, as it’s always more specific than the
+   * transaction error (which is always %FLATPAK_ERROR_ABORTED). */
+  if (!success && operation_error != NULL)
     {
-      case EUU_FLATPAK_REMOTE_REF_ACTION_INSTALL:
-        return try_install_application (installation,
-                                        collection_id,
-                                        remote_name,
-                                        action->ref->ref,
-                                        flags,
-                                        error);
-      case EUU_FLATPAK_REMOTE_REF_ACTION_UPDATE:
-        return try_update_application (installation,
-                                       action->ref->ref,
-                                       flags,
-                                       error);
-      case EUU_FLATPAK_REMOTE_REF_ACTION_UNINSTALL:
-        return try_uninstall_application (installation,
-                                          action->ref->ref,
-                                          error);
-      default:
-        g_assert_not_reached ();
+      g_propagate_error (error, g_steal_pointer (&operation_error));
+      return FALSE;
+    }
+  else if (!success)
+    {
+      g_propagate_error (error, g_steal_pointer (&transaction_error));
+      return FALSE;
+    }
+  else if (add_error != NULL)
+    {
+      g_propagate_error (error, g_steal_pointer (&add_error));
+      return FALSE;
     }
+
+  return TRUE;
 }
 
 static void
@@ -238,6 +634,7 @@ update_counter (const gchar  *counter_path,
   g_autoptr(GFile) counter_file = g_file_new_for_path (counter_path);
   g_autoptr(GFile) parent = g_file_get_parent (counter_file);
   g_autoptr(GKeyFile) counter_keyfile = g_key_file_new ();
+  g_autofree gchar *journal_path = euu_flatpak_progress_journal_path (counter_path);
   GHashTableIter iter;
   gpointer key, value;
   g_autoptr(GError) local_error = NULL;
@@ -268,6 +665,11 @@ update_counter (const gchar  *counter_path,
       g_clear_error (&local_error);
     }
 
+  /* Fold in the progress journalled by any earlier run which was
+   * interrupted, as well as by this one. */
+  if (!euu_flatpak_progress_journal_replay (counter_path, counter_keyfile, error))
+    return FALSE;
+
   g_hash_table_iter_init (&iter, new_progresses);
 
   while (g_hash_table_iter_next (&iter, &key, &value))
@@ -276,6 +678,15 @@ update_counter (const gchar  *counter_path,
   if (!g_key_file_save_to_file (counter_keyfile, counter_path, error))
     return FALSE;
 
+  /* The journal is now redundant. If this fails, or we crash before it’s
+   * done, replaying it again later is harmless. */
+  if (g_unlink (journal_path) != 0 && errno != ENOENT)
+    {
+      int errsv = errno;
+      g_message ("Could not remove progress journal ‘%s’: %s",
+                 journal_path, g_strerror (errsv));
+    }
+
   return TRUE;
 }
 
@@ -292,6 +703,22 @@ update_counter_complain_on_error (const gchar *failing_name,
                                                                   error);
 }
 
+/* Whether @action has to be applied before the system finishes booting, or
+ * can be deferred to a later run when %EU_INSTALLER_FLAGS_DEFER_NON_CRITICAL
+ * is set. Uninstalls are critical, as are actions on runtimes and
+ * dependencies, since the apps which are already installed may need them.
+ * Installs and updates of apps can wait. */
+static gboolean
+action_is_critical (EuuFlatpakRemoteRefAction *action)
+{
+  if (action->type == EUU_FLATPAK_REMOTE_REF_ACTION_UNINSTALL)
+    return TRUE;
+  if (action->flags & EUU_FLATPAK_REMOTE_REF_ACTION_FLAG_IS_DEPENDENCY)
+    return TRUE;
+
+  return flatpak_ref_get_kind (action->ref->ref) != FLATPAK_REF_KIND_APP;
+}
+
 /**
  * eufi_apply_flatpak_ref_actions:
  * @installation: a #FlatpakInstallation
@@ -306,6 +733,11 @@ update_counter_complain_on_error (const gchar *failing_name,
  * @state_counter_path to the last successfully applied action. The actions are
  * only actually performed if @mode is set to %EU_INSTALLER_MODE_PERFORM.
  *
+ * If %EU_INSTALLER_FLAGS_DEFER_NON_CRITICAL is set in @flags, installs and
+ * updates of apps are skipped. The state counter for each file is not updated
+ * past the first action skipped from it, so those actions (and any after them
+ * in the same file) are applied again by the next run without the flag.
+ *
  * Returns: %TRUE on success, %FALSE otherwise
  */
 gboolean
@@ -317,7 +749,15 @@ eufi_apply_flatpak_ref_actions (FlatpakInstallation       *installation,
                                 GError                   **error)
 {
   gsize i;
+  guint n_applied = 0;
+  gboolean success = TRUE;
+  g_autoptr(GError) local_error = NULL;
   g_autoptr(GHashTable) new_progresses = g_hash_table_new_full (g_str_hash, g_str_equal, NULL, NULL);
+  g_autoptr(GHashTable) deferred_sources = g_hash_table_new (g_str_hash, g_str_equal);
+  g_autoptr(GPtrArray) actions_to_perform = NULL;  /* (element-type EuuFlatpakRemoteRefAction) */
+  g_autofree gboolean *record_progress = NULL;
+  g_autoptr(ProgressJournal) journal = NULL;
+  gboolean defer_non_critical;
 
   g_return_val_if_fail (FLATPAK_IS_INSTALLATION (installation), FALSE);
   g_return_val_if_fail (state_counter_path != NULL, FALSE);
@@ -325,10 +765,15 @@ eufi_apply_flatpak_ref_actions (FlatpakInstallation       *installation,
   g_return_val_if_fail (mode != EU_INSTALLER_MODE_CHECK, FALSE);
   g_return_val_if_fail (error == NULL || *error == NULL, FALSE);
 
+  /* Deferring only makes sense if actions are actually being performed. */
+  defer_non_critical = (mode == EU_INSTALLER_MODE_PERFORM &&
+                        (flags & EU_INSTALLER_FLAGS_DEFER_NON_CRITICAL));
+  actions_to_perform = g_ptr_array_new_full (actions->len, NULL);
+  record_progress = g_new0 (gboolean, actions->len);
+
   for (i = 0; i < actions->len; ++i)
     {
       EuuFlatpakRemoteRefAction *pending_action = g_ptr_array_index (actions, i);
-      const gchar *source = pending_action->source;
       gboolean is_dependency = (pending_action->flags & EUU_FLATPAK_REMOTE_REF_ACTION_FLAG_IS_DEPENDENCY) != 0;
 
       /* Dependencies should not be passed through this function - they
@@ -337,24 +782,63 @@ eufi_apply_flatpak_ref_actions (FlatpakInstallation       *installation,
        * `eos-updater-flatpak-installer --mode deploy --pull` manually though. */
       g_assert (!is_dependency || flags & EU_INSTALLER_FLAGS_ALSO_PULL);
 
-      /* Only perform actions if we’re in the "perform" mode. Otherwise
-       * we just pretend to perform actions and update the counter
-       * accordingly */
-      if (mode == EU_INSTALLER_MODE_PERFORM &&
-          !perform_action (installation, pending_action, flags, error))
+      if (defer_non_critical && !action_is_critical (pending_action))
         {
-          /* If we fail, we should still update the state of the counter
-           * to the last successful one before we get out. This is to ensure
-           * that we don’t perform the same action again next time. */
-          update_counter_complain_on_error (source,
-                                            state_counter_path,
-                                            new_progresses);
-          return FALSE;
+          g_autofree gchar *formatted_ref = flatpak_ref_format_ref (pending_action->ref->ref);
+
+          g_message ("Deferring %s from %s to a later run",
+                     formatted_ref, pending_action->source);
+          g_hash_table_add (deferred_sources, (gpointer) pending_action->source);
+          continue;
+        }
+
+      /* The counter for a file must not move past an action which was
+       * deferred, or it would never be applied; any actions from the same
+       * file after it are applied again next time, which is harmless. */
+      record_progress[actions_to_perform->len] = !g_hash_table_contains (deferred_sources,
+                                                                         pending_action->source);
+      g_ptr_array_add (actions_to_perform, pending_action);
+    }
+
+  /* Only perform actions if we’re in the "perform" mode. Otherwise
+   * we just pretend to perform actions and update the counter
+   * accordingly */
+  if (mode == EU_INSTALLER_MODE_PERFORM)
+    {
+      journal = progress_journal_open (state_counter_path);
+      success = apply_actions_in_transaction (installation, actions_to_perform,
+                                              record_progress, journal,
+                                              new_progresses, flags,
+                                              &n_applied, &local_error);
+      g_clear_pointer (&journal, progress_journal_close);
+    }
+  else
+    {
+      n_applied = actions_to_perform->len;
+
+      for (i = 0; i < n_applied; ++i)
+        {
+          EuuFlatpakRemoteRefAction *applied_action = g_ptr_array_index (actions_to_perform, i);
+
+          if (record_progress[i])
+            g_hash_table_replace (new_progresses,
+                                  (gpointer) applied_action->source,
+                                  GINT_TO_POINTER (applied_action->serial));
         }
+    }
 
-      g_hash_table_replace (new_progresses,
-                            (gpointer) source,
-                            GINT_TO_POINTER (pending_action->serial));
+  if (!success)
+    {
+      EuuFlatpakRemoteRefAction *failed_action = g_ptr_array_index (actions_to_perform, MIN (n_applied, actions_to_perform->len - 1));
+
+      /* If we fail, we should still update the state of the counter
+       * to the last successful one before we get out. This is to ensure
+       * that we don’t perform the same action again next time. */
+      update_counter_complain_on_error (failed_action->source,
+                                        state_counter_path,
+                                        new_progresses);
+      g_propagate_error (error, g_steal_pointer (&local_error));
+      return FALSE;
     }
 
     /* Once we’re done, update the state of the counter, but bail out
@@ -368,43 +852,17 @@ eufi_apply_flatpak_ref_actions (FlatpakInstallation       *installation,
 }
 
 static gboolean
-check_if_flatpak_is_installed (FlatpakInstallation        *installation,
-                               EuuFlatpakRemoteRefAction  *action,
-                               gboolean                   *out_is_installed,
-                               GError                    **error)
+check_if_flatpak_is_installed (GHashTable                 *installed_refs,
+                               EuuFlatpakRemoteRefAction  *action)
 {
-  g_autoptr(GError) local_error = NULL;
-  g_autoptr(FlatpakInstalledRef) installed_ref = NULL;
-  FlatpakRef *ref = action->ref->ref;
   g_autofree gchar *formatted_ref = flatpak_ref_format_ref (action->ref->ref);
+  gboolean is_installed = g_hash_table_contains (installed_refs, action->ref->ref);
 
-  g_return_val_if_fail (out_is_installed != NULL, FALSE);
-
-  g_message ("Checking if flatpak described by ref %s is installed",
-             formatted_ref);
-
-  installed_ref = flatpak_installation_get_installed_ref (installation,
-                                                          flatpak_ref_get_kind (ref),
-                                                          flatpak_ref_get_name (ref),
-                                                          flatpak_ref_get_arch (ref),
-                                                          flatpak_ref_get_branch (ref),
-                                                          NULL,
-                                                          &local_error);
-
-  if (installed_ref == NULL &&
-      !g_error_matches (local_error, FLATPAK_ERROR, FLATPAK_ERROR_NOT_INSTALLED))
-    {
-      g_propagate_error (error, g_steal_pointer (&local_error));
-      return FALSE;
-    }
-  g_clear_error (&local_error);
-
-  *out_is_installed = (installed_ref != NULL);
   g_message ("Flatpak described by ref %s is %s",
              formatted_ref,
-             *out_is_installed ? "installed": "not installed");
+             is_installed ? "installed": "not installed");
 
-  return TRUE;
+  return is_installed;
 }
 
 /**
@@ -425,28 +883,27 @@ eufi_check_ref_actions_applied (FlatpakInstallation  *installation,
                                 GPtrArray            *actions,
                                 GError              **error)
 {
-  g_autoptr(GError) local_error = NULL;
   g_autoptr(GString) deltas = g_string_new ("");
+  g_autoptr(GHashTable) installed_refs = NULL;  /* (element-type FlatpakRef FlatpakRef) */
   gsize i;
 
   g_return_val_if_fail (installation != NULL, FALSE);
 
+  /* List the installed refs once, rather than querying the installation for
+   * each action. */
+  installed_refs = euu_flatpak_installed_ref_index_new (installation, NULL, error);
+  if (installed_refs == NULL)
+    return FALSE;
+
   for (i = 0; i < actions->len; ++i)
     {
       EuuFlatpakRemoteRefAction *pending_action = g_ptr_array_index (actions, i);
       const gchar *name = pending_action->source;
-      gboolean is_installed;
 
       switch (pending_action->type)
         {
           case EUU_FLATPAK_REMOTE_REF_ACTION_INSTALL:
-            if (!check_if_flatpak_is_installed (installation,
-                                                pending_action,
-                                                &is_installed,
-                                                error))
-              return FALSE;
-
-            if (!is_installed)
+            if (!check_if_flatpak_is_installed (installed_refs, pending_action))
               {
                 g_autofree gchar *formatted_ref = flatpak_ref_format_ref (pending_action->ref->ref);
                 g_autofree gchar *msg = g_strdup_printf ("Flatpak %s should have been installed by "
@@ -457,13 +914,7 @@ eufi_check_ref_actions_applied (FlatpakInstallation  *installation,
               }
             break;
           case EUU_FLATPAK_REMOTE_REF_ACTION_UNINSTALL:
-            if (!check_if_flatpak_is_installed (installation,
-                                                pending_action,
-                                                &is_installed,
-                                                error))
-              return FALSE;
-
-            if (is_installed)
+            if (check_if_flatpak_is_installed (installed_refs, pending_action))
               {
                 g_autofree gchar *formatted_ref = flatpak_ref_format_ref (pending_action->ref->ref);
                 g_autofree gchar *msg = g_strdup_printf ("Flatpak %s should have been uninstalled by "
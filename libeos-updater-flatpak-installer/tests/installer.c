@@ -108,6 +108,123 @@ flatpak_deployments_fixture_teardown (FlatpakDeploymentsFixture  *fixture,
   eos_updater_fixture_teardown ((EosUpdaterFixture *) fixture, user_data);
 }
 
+/* Like flatpak_deployments_fixture_setup(), but with none of the flatpaks
+ * installed, so that installing an app needs its dependencies:
+ *  - org.test.Test and org.test.Test2 both use org.test.Runtime;
+ *  - org.test.Runtime has an autodownload extension,
+ *    org.test.Runtime.Extension, which is only related to the apps through
+ *    the runtime;
+ *  - org.test.Test2 has its own autodownload extension,
+ *    org.test.Test2.Extension. */
+static void
+flatpak_dependencies_fixture_setup (FlatpakDeploymentsFixture  *fixture,
+                                    gconstpointer               user_data G_GNUC_UNUSED)
+{
+  g_autoptr(GError) error = NULL;
+  g_autofree gchar *flatpak_deployments_path = g_dir_make_tmp ("eos-updater-test-flatpak-deployments-XXXXXX", &error);
+  g_autoptr(GFile) flatpak_deployments_directory = g_file_new_for_path (flatpak_deployments_path);
+  g_autoptr(GFile) flatpak_build_dir = g_file_get_child (flatpak_deployments_directory, "flatpak");
+  g_autofree gchar *top_srcdir = g_test_build_filename (G_TEST_DIST, "..", "..", NULL);
+  g_autoptr(GFile) gpg_key_file = NULL;
+  g_autofree gchar *keyid = NULL;
+  g_autofree gchar *runtime_ref = g_strdup_printf ("runtime/org.test.Runtime/%s/stable",
+                                                   euu_get_system_architecture_string ());
+  g_autofree gchar *app_ref = g_strdup_printf ("app/org.test.Test2/%s/stable",
+                                               euu_get_system_architecture_string ());
+  g_autoptr(GPtrArray) runtime_extension_points = g_ptr_array_new_with_free_func ((GDestroyNotify) flatpak_extension_point_info_free);
+  g_autoptr(GPtrArray) app_extension_points = g_ptr_array_new_with_free_func ((GDestroyNotify) flatpak_extension_point_info_free);
+  g_autoptr(GPtrArray) flatpak_install_infos = g_ptr_array_new_with_free_func ((GDestroyNotify) flatpak_install_info_free);
+  g_autoptr(GHashTable) flatpak_repo_infos = g_hash_table_new_full (g_str_hash,
+                                                                    g_str_equal,
+                                                                    g_free,
+                                                                    (GDestroyNotify) flatpak_repo_info_free);
+
+  eos_updater_fixture_setup_full ((EosUpdaterFixture *) fixture, top_srcdir);
+
+  keyid = get_keyid (((EosUpdaterFixture *) fixture)->gpg_home);
+  gpg_key_file = get_gpg_key_file_for_keyid (((EosUpdaterFixture *) fixture)->gpg_home, keyid);
+
+  g_ptr_array_add (runtime_extension_points,
+                   flatpak_extension_point_info_new_single_version ("org.test.Runtime.Extension",
+                                                                    "extension_point_directory",
+                                                                    "stable",
+                                                                    FLATPAK_EXTENSION_POINT_NONE));
+  g_ptr_array_add (app_extension_points,
+                   flatpak_extension_point_info_new_single_version ("org.test.Test2.Extension",
+                                                                    "extension_point_directory",
+                                                                    "stable",
+                                                                    FLATPAK_EXTENSION_POINT_NONE));
+
+  /* These have to be in dependency order. */
+  g_ptr_array_add (flatpak_install_infos,
+                   flatpak_install_info_new_with_extension_info (FLATPAK_INSTALL_INFO_TYPE_RUNTIME,
+                                                                 "org.test.Runtime",
+                                                                 "stable",
+                                                                 NULL,
+                                                                 NULL,
+                                                                 "test-repo",
+                                                                 FALSE,
+                                                                 NULL,
+                                                                 runtime_extension_points));
+  g_ptr_array_add (flatpak_install_infos,
+                   flatpak_install_info_new_with_extension_info (FLATPAK_INSTALL_INFO_TYPE_EXTENSION,
+                                                                 "org.test.Runtime.Extension",
+                                                                 "stable",
+                                                                 NULL,
+                                                                 NULL,
+                                                                 "test-repo",
+                                                                 FALSE,
+                                                                 runtime_ref,
+                                                                 NULL));
+  g_ptr_array_add (flatpak_install_infos,
+                   flatpak_install_info_new (FLATPAK_INSTALL_INFO_TYPE_APP,
+                                             "org.test.Test",
+                                             "stable",
+                                             "org.test.Runtime",
+                                             "stable",
+                                             "test-repo",
+                                             FALSE));
+  g_ptr_array_add (flatpak_install_infos,
+                   flatpak_install_info_new_with_extension_info (FLATPAK_INSTALL_INFO_TYPE_APP,
+                                                                 "org.test.Test2",
+                                                                 "stable",
+                                                                 "org.test.Runtime",
+                                                                 "stable",
+                                                                 "test-repo",
+                                                                 FALSE,
+                                                                 NULL,
+                                                                 app_extension_points));
+  g_ptr_array_add (flatpak_install_infos,
+                   flatpak_install_info_new_with_extension_info (FLATPAK_INSTALL_INFO_TYPE_EXTENSION,
+                                                                 "org.test.Test2.Extension",
+                                                                 "stable",
+                                                                 NULL,
+                                                                 NULL,
+                                                                 "test-repo",
+                                                                 FALSE,
+                                                                 app_ref,
+                                                                 NULL));
+
+  g_hash_table_insert (flatpak_repo_infos,
+                       g_strdup ("test-repo"),
+                       flatpak_repo_info_new ("test-repo",
+                                              "com.test.CollectionId",
+                                              "com.test.CollectionId"));
+
+  eos_test_setup_flatpak_repo (flatpak_deployments_directory,
+                               flatpak_install_infos,
+                               flatpak_repo_infos,
+                               gpg_key_file,
+                               keyid,
+                               &error);
+  g_assert_no_error (error);
+
+  fixture->flatpak_deployments_directory = g_object_ref (flatpak_deployments_directory);
+  fixture->flatpak_remote_directory = g_file_get_child (flatpak_build_dir, "repo");
+  fixture->flatpak_installation_directory = g_file_get_child (flatpak_deployments_directory, "flatpak-user");
+  fixture->counter_file = g_file_get_child (flatpak_deployments_directory, "counter");
+}
+
 static GPtrArray *
 sample_flatpak_ref_actions_of_type (const gchar                   *source,
                                     const gchar * const           *flatpaks_to_install,
@@ -295,6 +412,214 @@ test_stamp_counter_state_updated (FlatpakDeploymentsFixture *fixture,
   g_assert (g_key_file_get_integer (counter_key_file, "autoinstall", "Progress", NULL) == 1);
 }
 
+/* Leave a progress journal behind, as if a previous run had crashed before
+ * updating the counter file, and check that its progress is folded into the
+ * counter file by the next run, and the journal removed. */
+static void
+test_stamp_counter_journal_replayed (FlatpakDeploymentsFixture *fixture,
+                                     gconstpointer              user G_GNUC_UNUSED)
+{
+  g_autoptr(GError) error = NULL;
+  const gchar *flatpaks_to_install[] = { "org.test.Test", NULL };
+  g_autoptr(GPtrArray) actions = sample_flatpak_ref_actions ("autoinstall", flatpaks_to_install);
+  g_autofree gchar *state_counter_path = g_file_get_path (fixture->counter_file);
+  g_autofree gchar *journal_path = euu_flatpak_progress_journal_path (state_counter_path);
+  g_autoptr(FlatpakInstallation) installation = flatpak_installation_new_for_path (fixture->flatpak_installation_directory,
+                                                                                   TRUE,
+                                                                                   NULL,
+                                                                                   &error);
+  g_autoptr(GKeyFile) counter_key_file = g_key_file_new ();
+
+  g_assert_no_error (error);
+
+  g_file_set_contents (journal_path, "5 other\n", -1, &error);
+  g_assert_no_error (error);
+
+  eufi_apply_flatpak_ref_actions (installation,
+                                  state_counter_path,
+                                  actions,
+                                  EU_INSTALLER_MODE_STAMP,
+                                  TRUE,
+                                  &error);
+  g_assert_no_error (error);
+
+  g_key_file_load_from_file (counter_key_file,
+                             state_counter_path,
+                             G_KEY_FILE_NONE,
+                             &error);
+  g_assert_no_error (error);
+
+  g_assert_cmpint (g_key_file_get_integer (counter_key_file, "autoinstall", "Progress", NULL), ==, 1);
+  g_assert_cmpint (g_key_file_get_integer (counter_key_file, "other", "Progress", NULL), ==, 5);
+  g_assert_false (g_file_test (journal_path, G_FILE_TEST_EXISTS));
+}
+
+/* Apply installs and uninstalls from several files in one run, and check
+ * that they are all performed and the counter is updated for each file. */
+static void
+test_deploy_mixed_actions (FlatpakDeploymentsFixture *fixture,
+                           gconstpointer              user G_GNUC_UNUSED)
+{
+  g_autoptr(GError) error = NULL;
+  const gchar *flatpaks_to_install[] = { "org.test.Test", "org.test.Test2", NULL };
+  const gchar *flatpaks_to_uninstall[] = { "org.test.Preinstalled", NULL };
+  g_autoptr(GPtrArray) actions = sample_flatpak_ref_actions ("autoinstall", flatpaks_to_install);
+  g_autoptr(GPtrArray) uninstall_actions = sample_flatpak_ref_actions_of_type ("autoinstall2",
+                                                                               flatpaks_to_uninstall,
+                                                                               EUU_FLATPAK_REMOTE_REF_ACTION_UNINSTALL);
+  g_autofree gchar *state_counter_path = g_file_get_path (fixture->counter_file);
+  g_autoptr(FlatpakInstallation) installation = flatpak_installation_new_for_path (fixture->flatpak_installation_directory,
+                                                                                   TRUE,
+                                                                                   NULL,
+                                                                                   &error);
+  g_autoptr(FlatpakInstalledRef) installed_ref = NULL;
+  g_autoptr(GKeyFile) counter_key_file = g_key_file_new ();
+  gsize i;
+
+  g_assert_no_error (error);
+
+  for (i = 0; i < uninstall_actions->len; i++)
+    g_ptr_array_add (actions, euu_flatpak_remote_ref_action_ref (g_ptr_array_index (uninstall_actions, i)));
+
+  eufi_apply_flatpak_ref_actions (installation,
+                                  state_counter_path,
+                                  actions,
+                                  EU_INSTALLER_MODE_PERFORM,
+                                  TRUE,
+                                  &error);
+  g_assert_no_error (error);
+
+  for (i = 0; flatpaks_to_install[i] != NULL; i++)
+    {
+      installed_ref = flatpak_installation_get_installed_ref (installation,
+                                                              FLATPAK_REF_KIND_APP,
+                                                              flatpaks_to_install[i],
+                                                              euu_get_system_architecture_string (),
+                                                              "stable",
+                                                              NULL,
+                                                              &error);
+      g_assert_no_error (error);
+      g_assert_nonnull (installed_ref);
+      g_clear_object (&installed_ref);
+    }
+
+  installed_ref = flatpak_installation_get_installed_ref (installation,
+                                                          FLATPAK_REF_KIND_APP,
+                                                          "org.test.Preinstalled",
+                                                          euu_get_system_architecture_string (),
+                                                          "stable",
+                                                          NULL,
+                                                          &error);
+  g_assert_error (error, FLATPAK_ERROR, FLATPAK_ERROR_NOT_INSTALLED);
+  g_assert_null (installed_ref);
+  g_clear_error (&error);
+
+  g_key_file_load_from_file (counter_key_file,
+                             state_counter_path,
+                             G_KEY_FILE_NONE,
+                             &error);
+  g_assert_no_error (error);
+
+  g_assert_cmpint (g_key_file_get_integer (counter_key_file, "autoinstall", "Progress", NULL), ==, 2);
+  g_assert_cmpint (g_key_file_get_integer (counter_key_file, "autoinstall2", "Progress", NULL), ==, 1);
+}
+
+/* Apply actions with EU_INSTALLER_FLAGS_DEFER_NON_CRITICAL set, and check that
+ * only the uninstall is performed, and that the counter isn’t updated past the
+ * deferred installs. Then run again without it and check the installs are
+ * performed. */
+static void
+test_deploy_defer_non_critical (FlatpakDeploymentsFixture *fixture,
+                                gconstpointer              user G_GNUC_UNUSED)
+{
+  g_autoptr(GError) error = NULL;
+  const gchar *flatpaks_to_install[] = { "org.test.Test", "org.test.Test2", NULL };
+  const gchar *flatpaks_to_uninstall[] = { "org.test.Preinstalled", NULL };
+  g_autoptr(GPtrArray) actions = sample_flatpak_ref_actions ("autoinstall", flatpaks_to_install);
+  g_autoptr(GPtrArray) uninstall_actions = sample_flatpak_ref_actions_of_type ("autoinstall2",
+                                                                               flatpaks_to_uninstall,
+                                                                               EUU_FLATPAK_REMOTE_REF_ACTION_UNINSTALL);
+  g_autofree gchar *state_counter_path = g_file_get_path (fixture->counter_file);
+  g_autoptr(FlatpakInstallation) installation = flatpak_installation_new_for_path (fixture->flatpak_installation_directory,
+                                                                                   TRUE,
+                                                                                   NULL,
+                                                                                   &error);
+  g_autoptr(FlatpakInstalledRef) installed_ref = NULL;
+  g_autoptr(GKeyFile) counter_key_file = g_key_file_new ();
+  gsize i;
+
+  g_assert_no_error (error);
+
+  for (i = 0; i < uninstall_actions->len; i++)
+    g_ptr_array_add (actions, euu_flatpak_remote_ref_action_ref (g_ptr_array_index (uninstall_actions, i)));
+
+  eufi_apply_flatpak_ref_actions (installation,
+                                  state_counter_path,
+                                  actions,
+                                  EU_INSTALLER_MODE_PERFORM,
+                                  EU_INSTALLER_FLAGS_ALSO_PULL | EU_INSTALLER_FLAGS_DEFER_NON_CRITICAL,
+                                  &error);
+  g_assert_no_error (error);
+
+  installed_ref = flatpak_installation_get_installed_ref (installation,
+                                                          FLATPAK_REF_KIND_APP,
+                                                          "org.test.Test",
+                                                          euu_get_system_architecture_string (),
+                                                          "stable",
+                                                          NULL,
+                                                          &error);
+  g_assert_error (error, FLATPAK_ERROR, FLATPAK_ERROR_NOT_INSTALLED);
+  g_assert_null (installed_ref);
+  g_clear_error (&error);
+
+  installed_ref = flatpak_installation_get_installed_ref (installation,
+                                                          FLATPAK_REF_KIND_APP,
+                                                          "org.test.Preinstalled",
+                                                          euu_get_system_architecture_string (),
+                                                          "stable",
+                                                          NULL,
+                                                          &error);
+  g_assert_error (error, FLATPAK_ERROR, FLATPAK_ERROR_NOT_INSTALLED);
+  g_assert_null (installed_ref);
+  g_clear_error (&error);
+
+  g_key_file_load_from_file (counter_key_file,
+                             state_counter_path,
+                             G_KEY_FILE_NONE,
+                             &error);
+  g_assert_no_error (error);
+
+  g_assert_false (g_key_file_has_group (counter_key_file, "autoinstall"));
+  g_assert_cmpint (g_key_file_get_integer (counter_key_file, "autoinstall2", "Progress", NULL), ==, 1);
+
+  /* The deferred actions are applied by the next normal run. */
+  eufi_apply_flatpak_ref_actions (installation,
+                                  state_counter_path,
+                                  actions,
+                                  EU_INSTALLER_MODE_PERFORM,
+                                  EU_INSTALLER_FLAGS_ALSO_PULL,
+                                  &error);
+  g_assert_no_error (error);
+
+  installed_ref = flatpak_installation_get_installed_ref (installation,
+                                                          FLATPAK_REF_KIND_APP,
+                                                          "org.test.Test",
+                                                          euu_get_system_architecture_string (),
+                                                          "stable",
+                                                          NULL,
+                                                          &error);
+  g_assert_no_error (error);
+  g_assert_nonnull (installed_ref);
+
+  g_key_file_load_from_file (counter_key_file,
+                             state_counter_path,
+                             G_KEY_FILE_NONE,
+                             &error);
+  g_assert_no_error (error);
+
+  g_assert_cmpint (g_key_file_get_integer (counter_key_file, "autoinstall", "Progress", NULL), ==, 2);
+}
+
 static void
 test_deploy_failure_previous_flatpaks_stay_deployed (FlatpakDeploymentsFixture *fixture,
                                                      gconstpointer              user G_GNUC_UNUSED)
@@ -438,6 +763,68 @@ test_deploy_failure_resume_from_latest (FlatpakDeploymentsFixture *fixture,
   g_assert (g_file_test (directory_expected_to_fail_initially_path, G_FILE_TEST_EXISTS));
 }
 
+/* Apply some installs where one of the refs doesn’t exist in the remote, so
+ * that the transaction fails before running any operations. Check that the
+ * actions before the missing ref are still applied, as they would be if each
+ * action were applied on its own, and that the counter is updated to them. */
+static void
+test_deploy_failure_missing_ref_previous_flatpaks_deployed (FlatpakDeploymentsFixture *fixture,
+                                                            gconstpointer              user G_GNUC_UNUSED)
+{
+  g_autoptr(GError) error = NULL;
+  const gchar *flatpaks_to_install[] = { "org.test.Test", "org.test.Missing", "org.test.Test2", NULL };
+  g_autoptr(GPtrArray) actions = sample_flatpak_ref_actions ("autoinstall", flatpaks_to_install);
+  g_autofree gchar *state_counter_path = g_file_get_path (fixture->counter_file);
+  g_autoptr(FlatpakInstallation) installation = flatpak_installation_new_for_path (fixture->flatpak_installation_directory,
+                                                                                   TRUE,
+                                                                                   NULL,
+                                                                                   &error);
+  g_autoptr(FlatpakInstalledRef) installed_ref = NULL;
+  g_autoptr(GKeyFile) counter_key_file = g_key_file_new ();
+
+  g_assert_no_error (error);
+
+  eufi_apply_flatpak_ref_actions (installation,
+                                  state_counter_path,
+                                  actions,
+                                  EU_INSTALLER_MODE_PERFORM,
+                                  EU_INSTALLER_FLAGS_ALSO_PULL,
+                                  &error);
+  g_assert_nonnull (error);
+  g_clear_error (&error);
+
+  installed_ref = flatpak_installation_get_installed_ref (installation,
+                                                          FLATPAK_REF_KIND_APP,
+                                                          "org.test.Test",
+                                                          euu_get_system_architecture_string (),
+                                                          "stable",
+                                                          NULL,
+                                                          &error);
+  g_assert_no_error (error);
+  g_assert_nonnull (installed_ref);
+  g_clear_object (&installed_ref);
+
+  /* Actions after the failing one aren’t applied. */
+  installed_ref = flatpak_installation_get_installed_ref (installation,
+                                                          FLATPAK_REF_KIND_APP,
+                                                          "org.test.Test2",
+                                                          euu_get_system_architecture_string (),
+                                                          "stable",
+                                                          NULL,
+                                                          &error);
+  g_assert_error (error, FLATPAK_ERROR, FLATPAK_ERROR_NOT_INSTALLED);
+  g_assert_null (installed_ref);
+  g_clear_error (&error);
+
+  g_key_file_load_from_file (counter_key_file,
+                             state_counter_path,
+                             G_KEY_FILE_NONE,
+                             &error);
+  g_assert_no_error (error);
+
+  g_assert_cmpint (g_key_file_get_integer (counter_key_file, "autoinstall", "Progress", NULL), ==, 1);
+}
+
 static void
 test_flatpak_check_succeeds_if_actions_are_up_to_date (FlatpakDeploymentsFixture *fixture,
                                                        gconstpointer              user G_GNUC_UNUSED)
@@ -548,6 +935,206 @@ test_flatpak_check_fails_if_unininstalled_flatpak_is_installed (FlatpakDeploymen
   g_assert_error (error, G_IO_ERROR, G_IO_ERROR_FAILED);
 }
 
+/* Check a mixture of installs and uninstalls from several files once they have
+ * all been applied, then check that an action which hasn’t been applied is
+ * still spotted. */
+static void
+test_flatpak_check_mixed_actions (FlatpakDeploymentsFixture *fixture,
+                                  gconstpointer              user G_GNUC_UNUSED)
+{
+  g_autoptr(GError) error = NULL;
+  const gchar *flatpaks_to_install[] = { "org.test.Test", "org.test.Test2", NULL };
+  const gchar *flatpaks_to_uninstall[] = { "org.test.Preinstalled", NULL };
+  const gchar *flatpaks_not_installed[] = { "org.test.Test3", NULL };
+  g_autoptr(GPtrArray) actions = sample_flatpak_ref_actions ("autoinstall", flatpaks_to_install);
+  g_autoptr(GPtrArray) uninstall_actions = sample_flatpak_ref_actions_of_type ("autoinstall2",
+                                                                               flatpaks_to_uninstall,
+                                                                               EUU_FLATPAK_REMOTE_REF_ACTION_UNINSTALL);
+  g_autoptr(GPtrArray) unapplied_actions = sample_flatpak_ref_actions ("autoinstall3", flatpaks_not_installed);
+  g_autofree gchar *state_counter_path = g_file_get_path (fixture->counter_file);
+  g_autoptr(FlatpakInstallation) installation = flatpak_installation_new_for_path (fixture->flatpak_installation_directory,
+                                                                                   TRUE,
+                                                                                   NULL,
+                                                                                   &error);
+  gsize i;
+
+  g_assert_no_error (error);
+
+  for (i = 0; i < uninstall_actions->len; i++)
+    g_ptr_array_add (actions, euu_flatpak_remote_ref_action_ref (g_ptr_array_index (uninstall_actions, i)));
+
+  eufi_apply_flatpak_ref_actions (installation,
+                                  state_counter_path,
+                                  actions,
+                                  EU_INSTALLER_MODE_PERFORM,
+                                  TRUE,
+                                  &error);
+  g_assert_no_error (error);
+
+  eufi_check_ref_actions_applied (installation, actions, &error);
+  g_assert_no_error (error);
+
+  for (i = 0; i < unapplied_actions->len; i++)
+    g_ptr_array_add (actions, euu_flatpak_remote_ref_action_ref (g_ptr_array_index (unapplied_actions, i)));
+
+  eufi_check_ref_actions_applied (installation, actions, &error);
+  g_assert_error (error, G_IO_ERROR, G_IO_ERROR_FAILED);
+}
+
+/* Create an action to install the app @name, with the given @serial. */
+static EuuFlatpakRemoteRefAction *
+install_app_ref_action_new (const gchar *name,
+                            gint32       serial)
+{
+  g_autoptr(FlatpakRef) ref = g_object_new (FLATPAK_TYPE_REF,
+                                            "kind", FLATPAK_REF_KIND_APP,
+                                            "name", name,
+                                            "arch", euu_get_system_architecture_string (),
+                                            "branch", "stable",
+                                            NULL);
+  g_autoptr(EuuFlatpakLocationRef) location_ref = euu_flatpak_location_ref_new (ref,
+                                                                                "test-repo",
+                                                                                NULL);
+
+  return euu_flatpak_remote_ref_action_new (EUU_FLATPAK_REMOTE_REF_ACTION_INSTALL,
+                                            location_ref,
+                                            "autoinstall",
+                                            serial,
+                                            EUU_FLATPAK_REMOTE_REF_ACTION_FLAG_NONE);
+}
+
+/* Add the dependencies of the apps in @app_names (which are installed with
+ * serials 1, 2, …) using euu_add_dependency_ref_actions_for_installation().
+ * @app_names may contain the same app more than once. */
+static GPtrArray *
+add_dependencies_for_apps (FlatpakDeploymentsFixture *fixture,
+                           const gchar * const       *app_names)
+{
+  g_autoptr(GError) error = NULL;
+  g_autoptr(GPtrArray) actions = g_ptr_array_new_with_free_func ((GDestroyNotify) euu_flatpak_remote_ref_action_unref);
+  g_autoptr(GPtrArray) actions_with_dependencies = NULL;
+  g_autoptr(FlatpakInstallation) installation = flatpak_installation_new_for_path (fixture->flatpak_installation_directory,
+                                                                                   TRUE,
+                                                                                   NULL,
+                                                                                   &error);
+  gsize i;
+
+  g_assert_no_error (error);
+
+  for (i = 0; app_names[i] != NULL; i++)
+    g_ptr_array_add (actions, install_app_ref_action_new (app_names[i], (gint32) i + 1));
+
+  actions_with_dependencies = euu_add_dependency_ref_actions_for_installation (installation,
+                                                                               actions,
+                                                                               NULL,
+                                                                               &error);
+  g_assert_no_error (error);
+  g_assert_nonnull (actions_with_dependencies);
+
+  return g_steal_pointer (&actions_with_dependencies);
+}
+
+/* Get the index of the only action for @name in @actions. */
+static guint
+get_ref_action_index (GPtrArray   *actions,
+                      const gchar *name)
+{
+  guint index = G_MAXUINT;
+  guint i;
+
+  for (i = 0; i < actions->len; i++)
+    {
+      EuuFlatpakRemoteRefAction *action = g_ptr_array_index (actions, i);
+
+      if (g_str_equal (flatpak_ref_get_name (action->ref->ref), name))
+        {
+          g_assert_cmpuint (index, ==, G_MAXUINT);
+          index = i;
+        }
+    }
+
+  g_assert_cmpuint (index, !=, G_MAXUINT);
+
+  return index;
+}
+
+/* Install two apps which use the same runtime, neither of which is installed.
+ * The runtime should be added once, as a dependency of the first app, and
+ * before it. */
+static void
+test_dependencies_shared_runtime (FlatpakDeploymentsFixture *fixture,
+                                  gconstpointer              user_data G_GNUC_UNUSED)
+{
+  const gchar *app_names[] = { "org.test.Test", "org.test.Test2", NULL };
+  g_autoptr(GPtrArray) actions = add_dependencies_for_apps (fixture, app_names);
+  guint runtime_index = get_ref_action_index (actions, "org.test.Runtime");
+  guint app_index = get_ref_action_index (actions, "org.test.Test");
+  guint app2_index = get_ref_action_index (actions, "org.test.Test2");
+  EuuFlatpakRemoteRefAction *runtime_action = g_ptr_array_index (actions, runtime_index);
+
+  g_assert_cmpuint (runtime_index, <, app_index);
+  g_assert_cmpuint (app_index, <, app2_index);
+  g_assert_cmpint (runtime_action->type, ==, EUU_FLATPAK_REMOTE_REF_ACTION_INSTALL);
+  g_assert_cmpint (runtime_action->serial, ==, 1);
+  g_assert_true (runtime_action->flags & EUU_FLATPAK_REMOTE_REF_ACTION_FLAG_IS_DEPENDENCY);
+}
+
+/* Check that each related ref is attributed to the action which caused it,
+ * including when it is only related to that action through another related
+ * ref (the runtime’s extension is related to the runtime, which is related to
+ * the apps). Each dependency inherits the serial of the action it was
+ * attributed to, and goes just before it. */
+static void
+test_dependencies_attributed_to_actions (FlatpakDeploymentsFixture *fixture,
+                                         gconstpointer              user_data G_GNUC_UNUSED)
+{
+  const gchar *app_names[] = { "org.test.Test", "org.test.Test2", NULL };
+  g_autoptr(GPtrArray) actions = add_dependencies_for_apps (fixture, app_names);
+  guint runtime_extension_index = get_ref_action_index (actions, "org.test.Runtime.Extension");
+  guint app_index = get_ref_action_index (actions, "org.test.Test");
+  guint app2_extension_index = get_ref_action_index (actions, "org.test.Test2.Extension");
+  guint app2_index = get_ref_action_index (actions, "org.test.Test2");
+  EuuFlatpakRemoteRefAction *runtime_extension_action = g_ptr_array_index (actions, runtime_extension_index);
+  EuuFlatpakRemoteRefAction *app2_extension_action = g_ptr_array_index (actions, app2_extension_index);
+
+  g_assert_cmpuint (actions->len, ==, 5);
+
+  g_assert_cmpuint (runtime_extension_index, <, app_index);
+  g_assert_cmpint (runtime_extension_action->serial, ==, 1);
+  g_assert_true (runtime_extension_action->flags & EUU_FLATPAK_REMOTE_REF_ACTION_FLAG_IS_DEPENDENCY);
+
+  g_assert_cmpuint (app_index, <, app2_extension_index);
+  g_assert_cmpuint (app2_extension_index, <, app2_index);
+  g_assert_cmpint (app2_extension_action->serial, ==, 2);
+  g_assert_true (app2_extension_action->flags & EUU_FLATPAK_REMOTE_REF_ACTION_FLAG_IS_DEPENDENCY);
+}
+
+/* Two actions for the same ref can’t be resolved in one transaction, so the
+ * dependencies are looked up one action at a time instead. The result should
+ * be the same as without the duplicate, apart from the duplicated app now
+ * being installed with its later serial. */
+static void
+test_dependencies_duplicate_ref_fallback (FlatpakDeploymentsFixture *fixture,
+                                          gconstpointer              user_data G_GNUC_UNUSED)
+{
+  const gchar *app_names[] = { "org.test.Test", "org.test.Test2", "org.test.Test", NULL };
+  g_autoptr(GPtrArray) actions = add_dependencies_for_apps (fixture, app_names);
+  guint runtime_index = get_ref_action_index (actions, "org.test.Runtime");
+  guint runtime_extension_index = get_ref_action_index (actions, "org.test.Runtime.Extension");
+  guint app_index = get_ref_action_index (actions, "org.test.Test");
+  guint app2_extension_index = get_ref_action_index (actions, "org.test.Test2.Extension");
+  guint app2_index = get_ref_action_index (actions, "org.test.Test2");
+  EuuFlatpakRemoteRefAction *app_action = g_ptr_array_index (actions, app_index);
+
+  g_assert_cmpuint (actions->len, ==, 5);
+
+  g_assert_cmpuint (runtime_index, <, app2_index);
+  g_assert_cmpuint (runtime_extension_index, <, app2_index);
+  g_assert_cmpuint (app2_extension_index, <, app2_index);
+  g_assert_cmpuint (app2_index, <, app_index);
+  g_assert_cmpint (app_action->serial, ==, 3);
+}
+
 int
 main (int   argc,
       char *argv[])
@@ -593,6 +1180,24 @@ main (int   argc,
               flatpak_deployments_fixture_setup,
               test_stamp_counter_state_updated,
               flatpak_deployments_fixture_teardown);
+  g_test_add ("/flatpak/stamp-counter-journal-replayed",
+              FlatpakDeploymentsFixture,
+              NULL,
+              flatpak_deployments_fixture_setup,
+              test_stamp_counter_journal_replayed,
+              flatpak_deployments_fixture_teardown);
+  g_test_add ("/flatpak/deploy-mixed-actions",
+              FlatpakDeploymentsFixture,
+              NULL,
+              flatpak_deployments_fixture_setup,
+              test_deploy_mixed_actions,
+              flatpak_deployments_fixture_teardown);
+  g_test_add ("/flatpak/deploy-defer-non-critical",
+              FlatpakDeploymentsFixture,
+              NULL,
+              flatpak_deployments_fixture_setup,
+              test_deploy_defer_non_critical,
+              flatpak_deployments_fixture_teardown);
   g_test_add ("/flatpak/deploy-flatpak-fail-other-ones-stay-deployed",
               FlatpakDeploymentsFixture,
               NULL,
@@ -611,6 +1216,12 @@ main (int   argc,
               flatpak_deployments_fixture_setup,
               test_deploy_failure_resume_from_latest,
               flatpak_deployments_fixture_teardown);
+  g_test_add ("/flatpak/deploy-flatpak-fail-missing-ref-other-ones-deployed",
+              FlatpakDeploymentsFixture,
+              NULL,
+              flatpak_deployments_fixture_setup,
+              test_deploy_failure_missing_ref_previous_flatpaks_deployed,
+              flatpak_deployments_fixture_teardown);
 
   g_test_add ("/flatpak/check-succeeds-if-actions-are-up-to-date",
               FlatpakDeploymentsFixture,
@@ -630,6 +1241,31 @@ main (int   argc,
               flatpak_deployments_fixture_setup,
               test_flatpak_check_fails_if_unininstalled_flatpak_is_installed,
               flatpak_deployments_fixture_teardown);
+  g_test_add ("/flatpak/check-mixed-actions",
+              FlatpakDeploymentsFixture,
+              NULL,
+              flatpak_deployments_fixture_setup,
+              test_flatpak_check_mixed_actions,
+              flatpak_deployments_fixture_teardown);
+
+  g_test_add ("/flatpak/dependencies/shared-runtime",
+              FlatpakDeploymentsFixture,
+              NULL,
+              flatpak_dependencies_fixture_setup,
+              test_dependencies_shared_runtime,
+              flatpak_deployments_fixture_teardown);
+  g_test_add ("/flatpak/dependencies/attributed-to-actions",
+              FlatpakDeploymentsFixture,
+              NULL,
+              flatpak_dependencies_fixture_setup,
+              test_dependencies_attributed_to_actions,
+              flatpak_deployments_fixture_teardown);
+  g_test_add ("/flatpak/dependencies/duplicate-ref-fallback",
+              FlatpakDeploymentsFixture,
+              NULL,
+              flatpak_dependencies_fixture_setup,
+              test_dependencies_duplicate_ref_fallback,
+              flatpak_deployments_fixture_teardown);
 
   return g_test_run ();
 }
@@ -23,6 +23,8 @@
  *  - Philip Withnall <withnall@endlessm.com>
  */
 
+#include "config.h"
+
 #include <errno.h>
 #include <flatpak.h>
 #include <glib.h>
@@ -76,7 +78,9 @@ euu_flatpak_location_ref_unref (EuuFlatpakLocationRef *location_ref)
 {
   g_return_if_fail (location_ref->ref_count > 0);
 
-  if (--location_ref->ref_count != 0)
+  /* Location refs are shared between the threads parsing autoinstall files,
+   * so this must be atomic. */
+  if (!g_atomic_int_dec_and_test (&location_ref->ref_count))
     return;
 
   g_clear_object (&location_ref->ref);
@@ -100,7 +104,7 @@ euu_flatpak_location_ref_ref (EuuFlatpakLocationRef *location_ref)
   g_return_val_if_fail (location_ref->ref_count > 0, NULL);
   g_return_val_if_fail (location_ref->ref_count < G_MAXINT, NULL);
 
-  ++location_ref->ref_count;
+  g_atomic_int_inc (&location_ref->ref_count);
   return location_ref;
 }
 
@@ -743,30 +747,162 @@ get_locales_list_from_flatpak_installation (GStrv  *out_strv,
   return TRUE;
 }
 
-/* Calculate whether this entry (@object) is filtered out of the list by the
- * value in @filter_key_name on @object (if present). If @object _is_ filtered
- * (should be removed from the list), @is_filtered will be set to %TRUE. It is
- * an error if @filter_key_name is not a valid filter name. */
+static guint
+location_ref_hash (gconstpointer data)
+{
+  const EuuFlatpakLocationRef *location_ref = data;
+
+  return (euu_flatpak_ref_hash (location_ref->ref) * 31 +
+          ((location_ref->remote != NULL) ? g_str_hash (location_ref->remote) : 0));
+}
+
 static gboolean
-action_filter_applies (JsonObject   *object,
-                       const gchar  *filter_key_name,
-                       gboolean     *is_filtered,
-                       GError      **error)
+location_ref_equal (gconstpointer a,
+                    gconstpointer b)
+{
+  const EuuFlatpakLocationRef *a_location_ref = a, *b_location_ref = b;
+
+  return (euu_flatpak_ref_equal (a_location_ref->ref, b_location_ref->ref) &&
+          g_strcmp0 (a_location_ref->remote, b_location_ref->remote) == 0 &&
+          g_strcmp0 (a_location_ref->collection_id, b_location_ref->collection_id) == 0);
+}
+
+/* The system properties which autoinstall entries’ `filters` are matched
+ * against. They are the same for every entry, so are looked up once, the
+ * first time an entry with filters is parsed, and then shared between all the
+ * entries parsed with the same context. Files may be parsed in several threads
+ * at once, so loading is done under @lock; once @loaded is set, the other
+ * members are not modified again.
+ *
+ * The context also interns the #EuuFlatpakLocationRefs of the parsed entries,
+ * so that all the entries for a given ref share one, and comparing them is
+ * usually a pointer comparison. */
+struct _EuuFlatpakFilterContext
+{
+  GMutex lock;
+  gboolean loaded;
+  gchar *architectures[2];  /* (owned) (array zero-terminated=1) */
+  GStrv locales;  /* (owned) (array zero-terminated=1) */
+
+  GHashTable *location_refs;  /* (owned) (element-type EuuFlatpakLocationRef EuuFlatpakLocationRef); protected by @lock */
+};
+
+/**
+ * euu_flatpak_filter_context_new:
+ *
+ * Create a new #EuuFlatpakFilterContext for parsing autoinstall files with.
+ * The architecture and locales which entries are filtered on are looked up
+ * when they are first needed, so they should not change while the context is
+ * in use.
+ *
+ * Returns: (transfer full): a new #EuuFlatpakFilterContext
+ */
+EuuFlatpakFilterContext *
+euu_flatpak_filter_context_new (void)
+{
+  EuuFlatpakFilterContext *context = g_new0 (EuuFlatpakFilterContext, 1);
+
+  g_mutex_init (&context->lock);
+  context->location_refs = g_hash_table_new_full (location_ref_hash,
+                                                  location_ref_equal,
+                                                  (GDestroyNotify) euu_flatpak_location_ref_unref,
+                                                  NULL);
+
+  return context;
+}
+
+/**
+ * euu_flatpak_filter_context_free:
+ * @context: (transfer full): an #EuuFlatpakFilterContext
+ *
+ * Free @context.
+ */
+void
+euu_flatpak_filter_context_free (EuuFlatpakFilterContext *context)
+{
+  g_free (context->architectures[0]);
+  g_strfreev (context->locales);
+  g_hash_table_unref (context->location_refs);
+  g_mutex_clear (&context->lock);
+  g_free (context);
+}
+
+/* Get the location ref in @context which is equal to @location_ref, adding
+ * @location_ref if there isn’t one yet. */
+static EuuFlatpakLocationRef *
+filter_context_intern_location_ref (EuuFlatpakFilterContext *context,
+                                    EuuFlatpakLocationRef   *location_ref)
 {
-  const gchar *current_architecture_strv[] =
+  g_autoptr(GMutexLocker) locker = g_mutex_locker_new (&context->lock);
+  EuuFlatpakLocationRef *interned = g_hash_table_lookup (context->location_refs,
+                                                         location_ref);
+
+  if (interned == NULL)
     {
-      euu_get_system_architecture_string (),
-      NULL
-    };
-  g_auto(GStrv) supported_languages = NULL;
+      interned = location_ref;
+      g_hash_table_add (context->location_refs,
+                        euu_flatpak_location_ref_ref (location_ref));
+    }
+
+  return euu_flatpak_location_ref_ref (interned);
+}
+
+/* Replace the location ref of @action with the equal one interned in
+ * @context. */
+static void
+filter_context_intern_action (EuuFlatpakFilterContext   *context,
+                              EuuFlatpakRemoteRefAction *action)
+{
+  EuuFlatpakLocationRef *interned = filter_context_intern_location_ref (context,
+                                                                        action->ref);
+
+  euu_flatpak_location_ref_unref (action->ref);
+  action->ref = interned;
+}
+
+static gboolean
+filter_context_ensure_loaded (EuuFlatpakFilterContext  *context,
+                              GError                  **error)
+{
+  g_autoptr(GMutexLocker) locker = g_mutex_locker_new (&context->lock);
+
+  if (context->loaded)
+    return TRUE;
+
+  if (!get_locales_list_from_flatpak_installation (&context->locales, error))
+    return FALSE;
+
+  context->architectures[0] = g_strdup (euu_get_system_architecture_string ());
+  context->architectures[1] = NULL;
+  context->loaded = TRUE;
+
+  return TRUE;
+}
+
+/* Calculate whether this entry (@object) is filtered out of the list by the
+ * value in @filter_key_name on @object (if present), given the system
+ * properties in @filter_context. If @object _is_ filtered (should be removed
+ * from the list), @is_filtered will be set to %TRUE. It is an error if
+ * @filter_key_name is not a valid filter name. */
+static gboolean
+action_filter_applies (JsonObject               *object,
+                       const gchar              *filter_key_name,
+                       EuuFlatpakFilterContext  *filter_context,
+                       gboolean                 *is_filtered,
+                       GError                  **error)
+{
+  GStrv current_architecture_strv;
+  GStrv supported_languages;
 
   g_return_val_if_fail (filter_key_name != NULL, FALSE);
   g_return_val_if_fail (is_filtered != NULL, FALSE);
 
-  if (!get_locales_list_from_flatpak_installation (&supported_languages,
-                                                   error))
+  if (!filter_context_ensure_loaded (filter_context, error))
     return FALSE;
 
+  current_architecture_strv = filter_context->architectures;
+  supported_languages = filter_context->locales;
+
   /* If adding support for a new filter:
    *  - Expand the inverse check in action_node_should_be_filtered_out().
    *  - Add a checkpoint to the OSTree after releasing the new version of
@@ -776,7 +912,7 @@ action_filter_applies (JsonObject   *object,
    *  - Update the JSON Schema and the man page.
    */
   if (g_str_equal (filter_key_name, "architecture"))
-    return strv_element_in_json_member ((GStrv) current_architecture_strv,
+    return strv_element_in_json_member (current_architecture_strv,
                                         object,
                                         filter_key_name,
                                         is_filtered,
@@ -784,7 +920,7 @@ action_filter_applies (JsonObject   *object,
            invert_outvalue (is_filtered);
 
   if (g_str_equal (filter_key_name, "~architecture"))
-    return strv_element_in_json_member ((GStrv) current_architecture_strv,
+    return strv_element_in_json_member (current_architecture_strv,
                                         object,
                                         filter_key_name,
                                         is_filtered,
@@ -821,9 +957,11 @@ action_filter_applies (JsonObject   *object,
  * We do this at the same time as reading the JSON node so that we don’t have
  * to keep filter information around in memory. */
 static gboolean
-action_node_should_be_filtered_out (JsonNode  *node,
-                                    gboolean  *is_filtered,
-                                    GError   **error)
+action_node_should_be_filtered_out (JsonNode                 *node,
+                                    EuuFlatpakFilterContext  *filter_context,
+                                    gboolean                 *uses_filters,
+                                    gboolean                 *is_filtered,
+                                    GError                  **error)
 {
   JsonObject *object = json_node_get_object (node);
   JsonNode *filters_object_node = json_object_get_member (object, "filters");
@@ -868,12 +1006,16 @@ action_node_should_be_filtered_out (JsonNode  *node,
 
   filters_object_keys = json_object_get_members (filters_object);
 
+  if (filters_object_keys != NULL)
+    *uses_filters = TRUE;
+
   for (iter = filters_object_keys; iter != NULL; iter = iter->next)
     {
       gboolean action_is_filtered_on_this_filter;
 
       if (!action_filter_applies (filters_object,
                                   iter->data,
+                                  filter_context,
                                   &action_is_filtered_on_this_filter,
                                   error))
         return FALSE;
@@ -890,14 +1032,18 @@ action_node_should_be_filtered_out (JsonNode  *node,
 }
 
 /* Load all the entries from the given @file, filtering out any which don’t
- * apply given their `filters`. If any entry fails to parse, an error is
- * returned overall. If any entry fails to parse non-fatally, its JSON
- * is listed in @skipped_action_entries and the next entry is parsed. */
+ * apply given their `filters` and @filter_context. If any entry fails to
+ * parse, an error is returned overall. If any entry fails to parse
+ * non-fatally, its JSON is listed in @skipped_action_entries and the next
+ * entry is parsed. @out_uses_filters is set to whether any of the entries had
+ * `filters`, and hence whether the result depends on @filter_context. */
 static GPtrArray *  /* (element-type EuuFlatpakRemoteRefAction) */
-read_flatpak_ref_actions_from_node (JsonNode      *node,
-                                    const gchar   *filename,
-                                    GPtrArray     *skipped_action_entries  /* (element-type utf8) */,
-                                    GError       **error)
+read_flatpak_ref_actions_from_node (JsonNode                 *node,
+                                    const gchar              *filename,
+                                    EuuFlatpakFilterContext  *filter_context,
+                                    GPtrArray                *skipped_action_entries  /* (element-type utf8) */,
+                                    gboolean                 *out_uses_filters,
+                                    GError                  **error)
 {
   /* Now that we have the file contents, time to read in the list of
    * flatpaks to install into a pointer array. Parse out the OSTree ref
@@ -907,6 +1053,7 @@ read_flatpak_ref_actions_from_node (JsonNode      *node,
   JsonArray *array = NULL;
   g_autoptr(GList) elements = NULL;
   GList *iter = NULL;  /* (element-type JsonNode) */
+  gboolean uses_filters = FALSE;
   gsize i;
 
   g_assert (skipped_action_entries != NULL);
@@ -947,7 +1094,9 @@ read_flatpak_ref_actions_from_node (JsonNode      *node,
           return NULL;
         }
 
-      if (!action_node_should_be_filtered_out (element_node, &is_filtered, &local_error))
+      if (!action_node_should_be_filtered_out (element_node, filter_context,
+                                               &uses_filters, &is_filtered,
+                                               &local_error))
         {
           if (g_error_matches (local_error,
                                EOS_UPDATER_ERROR,
@@ -1006,6 +1155,7 @@ read_flatpak_ref_actions_from_node (JsonNode      *node,
           return NULL;
         }
 
+      filter_context_intern_action (filter_context, action);
       g_ptr_array_add (actions, g_steal_pointer (&action));
     }
 
@@ -1030,23 +1180,21 @@ read_flatpak_ref_actions_from_node (JsonNode      *node,
         }
     }
 
+  if (out_uses_filters != NULL)
+    *out_uses_filters = uses_filters;
+
   return g_steal_pointer (&actions);
 }
 
-/**
- * euu_flatpak_ref_actions_from_file:
- * @file:
- * @out_skipped_actions: (out) (element-type utf8) (transfer container) (optional):
- * @cancellable:
- * @error:
- *
- * Returns: (transfer container) (element-type EuuFlatpakRemoteRefAction):
- */
-GPtrArray *
-euu_flatpak_ref_actions_from_file (GFile         *file,
-                                   GPtrArray    **out_skipped_actions,
-                                   GCancellable  *cancellable,
-                                   GError       **error)
+/* Version of euu_flatpak_ref_actions_from_file() which also returns whether
+ * any of the entries in @file had `filters`. */
+static GPtrArray *  /* (element-type EuuFlatpakRemoteRefAction) */
+ref_actions_from_file (GFile                    *file,
+                       EuuFlatpakFilterContext  *filter_context,
+                       GPtrArray               **out_skipped_actions,
+                       gboolean                 *out_uses_filters,
+                       GCancellable             *cancellable,
+                       GError                  **error)
 {
   g_autoptr(GPtrArray) actions = NULL;
   g_autoptr(GPtrArray) skipped_actions = g_ptr_array_new_with_free_func (g_free);
@@ -1055,7 +1203,9 @@ euu_flatpak_ref_actions_from_file (GFile         *file,
   if (node == NULL)
     return NULL;
 
-  actions = read_flatpak_ref_actions_from_node (node, path, skipped_actions, error);
+  actions = read_flatpak_ref_actions_from_node (node, path, filter_context,
+                                                skipped_actions,
+                                                out_uses_filters, error);
 
   if (actions == NULL)
     return NULL;
@@ -1066,6 +1216,33 @@ euu_flatpak_ref_actions_from_file (GFile         *file,
   return g_steal_pointer (&actions);
 }
 
+/**
+ * euu_flatpak_ref_actions_from_file:
+ * @file:
+ * @filter_context: (nullable): context to filter entries with, or %NULL to
+ *    use a new one
+ * @out_skipped_actions: (out) (element-type utf8) (transfer container) (optional):
+ * @cancellable:
+ * @error:
+ *
+ * Returns: (transfer container) (element-type EuuFlatpakRemoteRefAction):
+ */
+GPtrArray *
+euu_flatpak_ref_actions_from_file (GFile                    *file,
+                                   EuuFlatpakFilterContext  *filter_context,
+                                   GPtrArray               **out_skipped_actions,
+                                   GCancellable             *cancellable,
+                                   GError                  **error)
+{
+  g_autoptr(EuuFlatpakFilterContext) own_filter_context = NULL;
+
+  if (filter_context == NULL)
+    filter_context = own_filter_context = euu_flatpak_filter_context_new ();
+
+  return ref_actions_from_file (file, filter_context, out_skipped_actions,
+                                NULL, cancellable, error);
+}
+
 /**
  * euu_flatpak_ref_actions_from_data:
  * @data:
@@ -1093,6 +1270,7 @@ euu_flatpak_ref_actions_from_data (const gchar   *data,
   g_autoptr(JsonParser) parser = json_parser_new_immutable ();
   g_autoptr(JsonNode) root_node = NULL;
   g_autoptr(GError) local_error = NULL;
+  g_autoptr(EuuFlatpakFilterContext) filter_context = euu_flatpak_filter_context_new ();
 
   if (!json_parser_load_from_data (parser, data, length, &local_error))
     {
@@ -1113,7 +1291,8 @@ euu_flatpak_ref_actions_from_data (const gchar   *data,
       json_node_take_array (root_node, json_array_new ());
     }
 
-  actions = read_flatpak_ref_actions_from_node (root_node, path, skipped_actions, error);
+  actions = read_flatpak_ref_actions_from_node (root_node, path, filter_context,
+                                                skipped_actions, NULL, error);
 
   if (actions == NULL)
     return NULL;
@@ -1169,35 +1348,536 @@ euu_flatpak_remote_ref_actions_file_free (EuuFlatpakRemoteRefActionsFile *file)
   g_slice_free (EuuFlatpakRemoteRefActionsFile, file);
 }
 
-/* Update @ref_actions_for_files to add all the action lists from files in
- * @directory to it, at the given @priority. Lower numeric @priority values are
- * more important. If a filename from @directory is already listed in
- * @ref_actions_for_files, it will be replaced if @priority is more important
- * than the priority attached to the existing entry in the hash table.
+/* Cache of the parsed autoinstall lists loaded by
+ * euu_flatpak_ref_actions_from_paths(), so that they don’t all have to be
+ * parsed again by every run of eos-updater-flatpak-installer. It’s stored
+ * alongside the progress file (see euu_pending_flatpak_deployments_state_path())
+ * as a #GVariant of type %FLATPAK_AUTOINSTALL_CACHE_FORMAT, which is mapped and
+ * read in place.
  *
- * @ref_actions_for_files maps filenames (gchar*) to
- * #EuuFlatpakRemoteRefActionsFile instances.
- *
- * If any of the files in @directory fail to be parsed, all parsing will be
- * aborted and an error will be returned.
+ * Entries are keyed by the path of each file, and are only used if its device,
+ * inode, size, modification time and change time are unchanged. The parsed
+ * refs depend on the system architecture, which is stored for the cache as a
+ * whole; and on the locales if the file has any `filters`, so those are stored
+ * too, and entries which used them are only reused if the locales match.
  *
- * If @directory does not exist, a %G_IO_ERROR_NOT_FOUND error will be returned
- * unless @allow_noent is %TRUE, in which case, %TRUE will be returned and
- * @ref_actions_for_files will not be modified. */
-gboolean
-euu_flatpak_ref_actions_append_from_directory (GFile         *directory,
-                                               GHashTable    *ref_actions_for_files,
-                                               gint           priority,
-                                               gboolean       allow_noent,
-                                               GCancellable  *cancellable,
-                                               GError       **error)
+ * Files which aren’t on the local file system don’t have an inode, and are
+ * never cached. */
+#define FLATPAK_AUTOINSTALL_CACHE_VERSION 1
+#define FLATPAK_AUTOINSTALL_CACHE_NAME "flatpak-autoinstall.cache"
+
+/* (type, kind, name, branch, remote, collection ID, serial, flags) */
+#define FLATPAK_AUTOINSTALL_CACHE_ACTION_FORMAT "(uussmsmsiu)"
+/* (device, inode, size, mtime, ctime, uses filters, actions, skipped actions) */
+#define FLATPAK_AUTOINSTALL_CACHE_ENTRY_FORMAT "(tttttba" FLATPAK_AUTOINSTALL_CACHE_ACTION_FORMAT "as)"
+/* (version, architecture, locales, {path: entry}) */
+#define FLATPAK_AUTOINSTALL_CACHE_FORMAT "(usmasa{s" FLATPAK_AUTOINSTALL_CACHE_ENTRY_FORMAT "})"
+
+#define FLATPAK_AUTOINSTALL_CACHE_FILE_ATTRIBUTES \
+  G_FILE_ATTRIBUTE_STANDARD_NAME "," \
+  G_FILE_ATTRIBUTE_STANDARD_SIZE "," \
+  G_FILE_ATTRIBUTE_UNIX_DEVICE "," \
+  G_FILE_ATTRIBUTE_UNIX_INODE "," \
+  G_FILE_ATTRIBUTE_TIME_MODIFIED "," \
+  G_FILE_ATTRIBUTE_TIME_MODIFIED_USEC "," \
+  G_FILE_ATTRIBUTE_TIME_CHANGED "," \
+  G_FILE_ATTRIBUTE_TIME_CHANGED_USEC
+
+typedef struct
+{
+  gchar *path;  /* (owned) */
+  GVariant *entries;  /* (owned) (nullable); entries loaded from @path */
+  gboolean has_locales;
+  GStrv locales;  /* (owned) (nullable); locales the loaded entries used */
+
+  /* Entries to save; those from @entries which were used, plus any new ones. */
+  GHashTable *new_entries;  /* (owned) (element-type filename GVariant) */
+  gboolean changed;
+} FlatpakAutoinstallCache;
+
+static void
+flatpak_autoinstall_cache_free (FlatpakAutoinstallCache *cache)
+{
+  g_free (cache->path);
+  g_clear_pointer (&cache->entries, g_variant_unref);
+  g_strfreev (cache->locales);
+  g_clear_pointer (&cache->new_entries, g_hash_table_unref);
+  g_free (cache);
+}
+
+G_DEFINE_AUTOPTR_CLEANUP_FUNC (FlatpakAutoinstallCache, flatpak_autoinstall_cache_free)
+
+/* Load the cache. This never fails: if the cache can’t be read, or is from a
+ * different version or for a different architecture, it’s treated as empty. */
+static FlatpakAutoinstallCache *
+flatpak_autoinstall_cache_load (void)
+{
+  g_autoptr(FlatpakAutoinstallCache) cache = g_new0 (FlatpakAutoinstallCache, 1);
+  g_autofree gchar *state_dir = g_path_get_dirname (euu_pending_flatpak_deployments_state_path ());
+  g_autoptr(GMappedFile) mapped_file = NULL;
+  g_autoptr(GBytes) bytes = NULL;
+  g_autoptr(GVariant) cache_variant = NULL;
+  g_autoptr(GVariant) locales_variant = NULL;
+  g_autoptr(GVariant) locales = NULL;
+  g_autoptr(GError) local_error = NULL;
+  guint32 version;
+  const gchar *architecture;
+
+  cache->path = g_build_filename (state_dir, FLATPAK_AUTOINSTALL_CACHE_NAME, NULL);
+  cache->new_entries = g_hash_table_new_full (g_str_hash, g_str_equal,
+                                              g_free, (GDestroyNotify) g_variant_unref);
+
+  mapped_file = g_mapped_file_new (cache->path, FALSE, &local_error);
+  if (mapped_file == NULL)
+    {
+      if (!g_error_matches (local_error, G_FILE_ERROR, G_FILE_ERROR_NOENT))
+        g_debug ("%s: Error loading autoinstall cache ‘%s’: %s",
+                 G_STRFUNC, cache->path, local_error->message);
+      cache->changed = TRUE;
+      return g_steal_pointer (&cache);
+    }
+
+  /* The cache is only ever written by us, but it isn’t trusted to be in
+   * normal form: #GVariant returns default values for any malformed parts,
+   * which will then fail to validate against the files. */
+  bytes = g_mapped_file_get_bytes (mapped_file);
+  cache_variant = g_variant_ref_sink (g_variant_new_from_bytes (G_VARIANT_TYPE (FLATPAK_AUTOINSTALL_CACHE_FORMAT),
+                                                                bytes, FALSE));
+  g_variant_get (cache_variant, "(u&s@mas@a{s" FLATPAK_AUTOINSTALL_CACHE_ENTRY_FORMAT "})",
+                 &version, &architecture, &locales_variant, &cache->entries);
+
+  if (version != FLATPAK_AUTOINSTALL_CACHE_VERSION ||
+      !g_str_equal (architecture, euu_get_system_architecture_string ()))
+    {
+      g_debug ("%s: Ignoring autoinstall cache ‘%s’ for version %u, architecture ‘%s’",
+               G_STRFUNC, cache->path, version, architecture);
+      g_clear_pointer (&cache->entries, g_variant_unref);
+      cache->changed = TRUE;
+      return g_steal_pointer (&cache);
+    }
+
+  locales = g_variant_get_maybe (locales_variant);
+  if (locales != NULL)
+    {
+      cache->has_locales = TRUE;
+      cache->locales = g_variant_dup_strv (locales, NULL);
+    }
+
+  return g_steal_pointer (&cache);
+}
+
+/* Get the key fields for the file described by @info. Returns %FALSE if it has
+ * no inode, and hence can’t be cached. */
+static gboolean
+flatpak_autoinstall_cache_get_file_key (GFileInfo *info,
+                                        guint64   *out_device,
+                                        guint64   *out_inode,
+                                        guint64   *out_size,
+                                        guint64   *out_mtime_usec,
+                                        guint64   *out_ctime_usec)
+{
+  if (!g_file_info_has_attribute (info, G_FILE_ATTRIBUTE_UNIX_INODE) ||
+      !g_file_info_has_attribute (info, G_FILE_ATTRIBUTE_TIME_CHANGED))
+    return FALSE;
+
+  *out_device = g_file_info_get_attribute_uint32 (info, G_FILE_ATTRIBUTE_UNIX_DEVICE);
+  *out_inode = g_file_info_get_attribute_uint64 (info, G_FILE_ATTRIBUTE_UNIX_INODE);
+  *out_size = (guint64) g_file_info_get_size (info);
+  *out_mtime_usec = g_file_info_get_attribute_uint64 (info, G_FILE_ATTRIBUTE_TIME_MODIFIED) * G_USEC_PER_SEC +
+                    g_file_info_get_attribute_uint32 (info, G_FILE_ATTRIBUTE_TIME_MODIFIED_USEC);
+  *out_ctime_usec = g_file_info_get_attribute_uint64 (info, G_FILE_ATTRIBUTE_TIME_CHANGED) * G_USEC_PER_SEC +
+                    g_file_info_get_attribute_uint32 (info, G_FILE_ATTRIBUTE_TIME_CHANGED_USEC);
+
+  return TRUE;
+}
+
+/* Whether entries in @cache which used `filters` are still valid with the
+ * locales from @filter_context. */
+static gboolean
+flatpak_autoinstall_cache_locales_match (FlatpakAutoinstallCache *cache,
+                                         EuuFlatpakFilterContext *filter_context)
+{
+  g_autoptr(GError) local_error = NULL;
+
+  if (!cache->has_locales)
+    return FALSE;
+
+  if (!filter_context_ensure_loaded (filter_context, &local_error))
+    {
+      g_debug ("%s: Error loading filter context: %s",
+               G_STRFUNC, local_error->message);
+      return FALSE;
+    }
+
+  return g_strv_equal ((const gchar * const *) cache->locales,
+                       (const gchar * const *) filter_context->locales);
+}
+
+static GPtrArray *  /* (element-type EuuFlatpakRemoteRefAction) */
+actions_from_cache_variant (GVariant                *actions_variant,
+                            const gchar             *source,
+                            EuuFlatpakFilterContext *filter_context)
+{
+  g_autoptr(GPtrArray) actions = g_ptr_array_new_with_free_func ((GDestroyNotify) euu_flatpak_remote_ref_action_unref);
+  GVariantIter iter;
+  guint32 type, kind, flags;
+  const gchar *name, *branch, *remote, *collection_id;
+  gint32 serial;
+
+  g_variant_iter_init (&iter, actions_variant);
+
+  while (g_variant_iter_next (&iter, "(uu&s&sm&sm&siu)",
+                              &type, &kind, &name, &branch, &remote,
+                              &collection_id, &serial, &flags))
+    {
+      g_autoptr(FlatpakRef) ref = NULL;
+      g_autoptr(EuuFlatpakLocationRef) new_location_ref = NULL;
+      g_autoptr(EuuFlatpakLocationRef) location_ref = NULL;
+
+      if (type > EUU_FLATPAK_REMOTE_REF_ACTION_UPDATE ||
+          (kind != FLATPAK_REF_KIND_APP && kind != FLATPAK_REF_KIND_RUNTIME) ||
+          (remote != NULL && !ostree_validate_remote_name (remote, NULL)) ||
+          (collection_id != NULL && !ostree_validate_collection_id (collection_id, NULL)))
+        return NULL;
+
+      ref = g_object_new (FLATPAK_TYPE_REF,
+                          "kind", (FlatpakRefKind) kind,
+                          "name", name,
+                          "arch", euu_get_system_architecture_string (),
+                          "branch", branch,
+                          NULL);
+      new_location_ref = euu_flatpak_location_ref_new (ref, remote, collection_id);
+      location_ref = filter_context_intern_location_ref (filter_context,
+                                                         new_location_ref);
+      g_ptr_array_add (actions,
+                       euu_flatpak_remote_ref_action_new ((EuuFlatpakRemoteRefActionType) type,
+                                                          location_ref,
+                                                          source,
+                                                          serial,
+                                                          (EuuFlatpakRemoteRefActionFlags) flags));
+    }
+
+  return g_steal_pointer (&actions);
+}
+
+/* Look up the cached actions for @file, which is described by @info. Returns
+ * %NULL if it isn’t cached or the cached entry is out of date. */
+static GPtrArray *  /* (element-type EuuFlatpakRemoteRefAction) */
+flatpak_autoinstall_cache_lookup (FlatpakAutoinstallCache  *cache,
+                                  EuuFlatpakFilterContext  *filter_context,
+                                  GFile                    *file,
+                                  GFileInfo                *info,
+                                  GPtrArray               **out_skipped_actions)
+{
+  g_autofree gchar *path = g_file_get_path (file);
+  g_autoptr(GVariant) entry = NULL;
+  g_autoptr(GVariant) actions_variant = NULL;
+  g_autoptr(GVariant) skipped_variant = NULL;
+  g_autoptr(GPtrArray) actions = NULL;
+  g_autoptr(GPtrArray) skipped_actions = NULL;
+  guint64 device, inode, size, mtime_usec, ctime_usec;
+  guint64 cached_device, cached_inode, cached_size, cached_mtime_usec, cached_ctime_usec;
+  gboolean uses_filters;
+  GVariantIter iter;
+  const gchar *skipped;
+
+  if (cache->entries == NULL || path == NULL ||
+      !flatpak_autoinstall_cache_get_file_key (info, &device, &inode, &size,
+                                               &mtime_usec, &ctime_usec))
+    return NULL;
+
+  entry = g_variant_lookup_value (cache->entries, path,
+                                  G_VARIANT_TYPE (FLATPAK_AUTOINSTALL_CACHE_ENTRY_FORMAT));
+  if (entry == NULL)
+    return NULL;
+
+  g_variant_get (entry, "(tttttb@a" FLATPAK_AUTOINSTALL_CACHE_ACTION_FORMAT "@as)",
+                 &cached_device, &cached_inode, &cached_size, &cached_mtime_usec,
+                 &cached_ctime_usec, &uses_filters, &actions_variant, &skipped_variant);
+
+  if (device != cached_device || inode != cached_inode || size != cached_size ||
+      mtime_usec != cached_mtime_usec || ctime_usec != cached_ctime_usec)
+    return NULL;
+
+  if (uses_filters &&
+      !flatpak_autoinstall_cache_locales_match (cache, filter_context))
+    return NULL;
+
+  actions = actions_from_cache_variant (actions_variant,
+                                        g_file_info_get_name (info),
+                                        filter_context);
+  if (actions == NULL)
+    return NULL;
+
+  skipped_actions = g_ptr_array_new_with_free_func (g_free);
+  g_variant_iter_init (&iter, skipped_variant);
+  while (g_variant_iter_next (&iter, "&s", &skipped))
+    g_ptr_array_add (skipped_actions, g_strdup (skipped));
+
+  g_debug ("%s: Using cached actions for ‘%s’", G_STRFUNC, path);
+
+  g_hash_table_replace (cache->new_entries, g_steal_pointer (&path),
+                        g_steal_pointer (&entry));
+  *out_skipped_actions = g_steal_pointer (&skipped_actions);
+
+  return g_steal_pointer (&actions);
+}
+
+/* Add the freshly parsed @actions and @skipped_actions for @file, which is
+ * described by @info, to @cache. @uses_filters is whether they depended on the
+ * locales in the filter context. */
+static void
+flatpak_autoinstall_cache_insert (FlatpakAutoinstallCache *cache,
+                                  GFile                   *file,
+                                  GFileInfo               *info,
+                                  GPtrArray               *actions,
+                                  GPtrArray               *skipped_actions,
+                                  gboolean                 uses_filters)
+{
+  g_autofree gchar *path = g_file_get_path (file);
+  g_auto(GVariantBuilder) actions_builder = G_VARIANT_BUILDER_INIT (G_VARIANT_TYPE ("a" FLATPAK_AUTOINSTALL_CACHE_ACTION_FORMAT));
+  g_auto(GVariantBuilder) skipped_builder = G_VARIANT_BUILDER_INIT (G_VARIANT_TYPE_STRING_ARRAY);
+  guint64 device, inode, size, mtime_usec, ctime_usec;
+  gsize i;
+
+  if (path == NULL ||
+      !flatpak_autoinstall_cache_get_file_key (info, &device, &inode, &size,
+                                               &mtime_usec, &ctime_usec))
+    return;
+
+  for (i = 0; i < actions->len; i++)
+    {
+      const EuuFlatpakRemoteRefAction *action = g_ptr_array_index (actions, i);
+      FlatpakRef *ref = action->ref->ref;
+
+      g_variant_builder_add (&actions_builder, FLATPAK_AUTOINSTALL_CACHE_ACTION_FORMAT,
+                             (guint32) action->type,
+                             (guint32) flatpak_ref_get_kind (ref),
+                             flatpak_ref_get_name (ref),
+                             flatpak_ref_get_branch (ref),
+                             action->ref->remote,
+                             action->ref->collection_id,
+                             action->serial,
+                             (guint32) action->flags);
+    }
+
+  for (i = 0; skipped_actions != NULL && i < skipped_actions->len; i++)
+    g_variant_builder_add (&skipped_builder, "s",
+                           (const gchar *) g_ptr_array_index (skipped_actions, i));
+
+  g_hash_table_replace (cache->new_entries, g_steal_pointer (&path),
+                        g_variant_ref_sink (g_variant_new (FLATPAK_AUTOINSTALL_CACHE_ENTRY_FORMAT,
+                                                           device, inode, size,
+                                                           mtime_usec, ctime_usec,
+                                                           uses_filters,
+                                                           &actions_builder,
+                                                           &skipped_builder)));
+  cache->changed = TRUE;
+}
+
+/* Write @cache back to disk if it has changed. The cache is only an
+ * optimisation, so failure to do so is not fatal. Only the entries which were
+ * used this time are kept, so entries for removed files don’t accumulate. */
+static void
+flatpak_autoinstall_cache_save (FlatpakAutoinstallCache *cache,
+                                EuuFlatpakFilterContext *filter_context)
+{
+  g_auto(GVariantBuilder) entries_builder = G_VARIANT_BUILDER_INIT (G_VARIANT_TYPE ("a{s" FLATPAK_AUTOINSTALL_CACHE_ENTRY_FORMAT "}"));
+  g_autoptr(GVariant) cache_variant = NULL;
+  g_autoptr(GVariant) locales = NULL;
+  g_autofree gchar *state_dir = NULL;
+  g_autoptr(GError) local_error = NULL;
+  GHashTableIter iter;
+  gpointer key, value;
+
+  if (!cache->changed && cache->entries != NULL &&
+      g_hash_table_size (cache->new_entries) == g_variant_n_children (cache->entries))
+    return;
+
+  /* Entries which used filters can only have been added if the filter context
+   * was loaded, so its locales are the ones to save. */
+  if (filter_context->loaded)
+    locales = g_variant_ref_sink (g_variant_new_strv ((const gchar * const *) filter_context->locales, -1));
+
+  g_hash_table_iter_init (&iter, cache->new_entries);
+  while (g_hash_table_iter_next (&iter, &key, &value))
+    g_variant_builder_add (&entries_builder, "{s@" FLATPAK_AUTOINSTALL_CACHE_ENTRY_FORMAT "}",
+                           (const gchar *) key, (GVariant *) value);
+
+  cache_variant = g_variant_ref_sink (g_variant_new ("(usm@asa{s" FLATPAK_AUTOINSTALL_CACHE_ENTRY_FORMAT "})",
+                                                     (guint32) FLATPAK_AUTOINSTALL_CACHE_VERSION,
+                                                     euu_get_system_architecture_string (),
+                                                     locales,
+                                                     &entries_builder));
+
+  state_dir = g_path_get_dirname (cache->path);
+
+  if (g_mkdir_with_parents (state_dir, 0755) != 0)
+    {
+      int errsv = errno;
+      g_debug ("%s: Error creating directory ‘%s’: %s",
+               G_STRFUNC, state_dir, g_strerror (errsv));
+      return;
+    }
+
+  if (!g_file_set_contents (cache->path,
+                            g_variant_get_data (cache_variant),
+                            (gssize) g_variant_get_size (cache_variant),
+                            &local_error))
+    g_debug ("%s: Error saving autoinstall cache ‘%s’: %s",
+             G_STRFUNC, cache->path, local_error->message);
+}
+
+/* Maximum number of threads to parse the files in one directory with. */
+#define MAX_AUTOINSTALL_PARSE_THREADS 4
+
+/* A file found by append_from_directory_cached(), and its parsed actions. */
+typedef struct
+{
+  GFile *file;  /* (owned) */
+  GFileInfo *info;  /* (owned) */
+  GPtrArray *actions;  /* (owned) (nullable) (element-type EuuFlatpakRemoteRefAction) */
+  GPtrArray *skipped_actions;  /* (owned) (nullable) (element-type utf8) */
+  gboolean uses_filters;
+  gboolean from_cache;
+  GError *error;  /* (owned) (nullable) */
+} AutoinstallFile;
+
+static void
+autoinstall_file_free (AutoinstallFile *autoinstall_file)
+{
+  g_object_unref (autoinstall_file->file);
+  g_object_unref (autoinstall_file->info);
+  g_clear_pointer (&autoinstall_file->actions, g_ptr_array_unref);
+  g_clear_pointer (&autoinstall_file->skipped_actions, g_ptr_array_unref);
+  g_clear_error (&autoinstall_file->error);
+  g_free (autoinstall_file);
+}
+
+/* State shared between the threads parsing files in parse_autoinstall_files().
+ * Each thread takes the next file from @files until there are none left or one
+ * of them has failed to parse. */
+typedef struct
+{
+  GPtrArray *files;  /* (element-type AutoinstallFile) (unowned) */
+  EuuFlatpakFilterContext *filter_context;  /* (unowned) */
+  GCancellable *cancellable;  /* (unowned) (nullable) */
+
+  GMutex lock;
+  /* The following members are protected by @lock: */
+  guint next_file;
+  gboolean failed;
+} AutoinstallParseState;
+
+static void
+autoinstall_parse_worker_run (AutoinstallParseState *state)
+{
+  while (TRUE)
+    {
+      AutoinstallFile *autoinstall_file;
+
+      g_mutex_lock (&state->lock);
+      autoinstall_file = (!state->failed && state->next_file < state->files->len) ?
+                         g_ptr_array_index (state->files, state->next_file++) : NULL;
+      g_mutex_unlock (&state->lock);
+
+      if (autoinstall_file == NULL)
+        break;
+
+      autoinstall_file->actions = ref_actions_from_file (autoinstall_file->file,
+                                                         state->filter_context,
+                                                         &autoinstall_file->skipped_actions,
+                                                         &autoinstall_file->uses_filters,
+                                                         state->cancellable,
+                                                         &autoinstall_file->error);
+
+      if (autoinstall_file->actions == NULL)
+        {
+          g_mutex_lock (&state->lock);
+          state->failed = TRUE;
+          g_mutex_unlock (&state->lock);
+        }
+    }
+}
+
+static gpointer
+autoinstall_parse_thread (gpointer user_data)
+{
+  AutoinstallParseState *state = user_data;
+  g_autoptr(GMainContext) context = g_main_context_new ();
+
+  g_main_context_push_thread_default (context);
+  autoinstall_parse_worker_run (state);
+  g_main_context_pop_thread_default (context);
+
+  return NULL;
+}
+
+/* Parse each of @files, across a few threads if there are several. Each
+ * file’s actions or error are stored in its #AutoinstallFile. Once one file
+ * has failed, no further files are started; but as files are started in
+ * order, all the files before it will have been parsed. */
+static void
+parse_autoinstall_files (GPtrArray               *files,
+                         EuuFlatpakFilterContext *filter_context,
+                         GCancellable            *cancellable)
+{
+  AutoinstallParseState state = { NULL, };
+  g_autoptr(GPtrArray) threads = g_ptr_array_new ();
+  guint n_threads = MIN (MIN (MAX_AUTOINSTALL_PARSE_THREADS,
+                              (guint) g_get_num_processors ()),
+                         files->len);
+  gsize i;
+
+  state.files = files;
+  state.filter_context = filter_context;
+  state.cancellable = cancellable;
+  g_mutex_init (&state.lock);
+
+  /* Parsing one file at a time needs no threads. */
+  if (n_threads <= 1)
+    {
+      autoinstall_parse_worker_run (&state);
+    }
+  else
+    {
+      for (i = 0; i < n_threads; i++)
+        g_ptr_array_add (threads, g_thread_new ("autoinstall-parse",
+                                                autoinstall_parse_thread, &state));
+
+      for (i = 0; i < threads->len; i++)
+        g_thread_join (g_ptr_array_index (threads, i));
+    }
+
+  g_mutex_clear (&state.lock);
+}
+
+/* Like euu_flatpak_ref_actions_append_from_directory(), but looking up and
+ * adding the files’ actions in @cache, if it’s non-%NULL. The files which
+ * need parsing are parsed in parallel, but the results are merged in
+ * enumeration order, so the outcome (including which error is returned if
+ * several files are invalid) is the same as parsing them one at a time. */
+static gboolean
+append_from_directory_cached (GFile                    *directory,
+                              EuuFlatpakFilterContext  *filter_context,
+                              FlatpakAutoinstallCache  *cache,
+                              GHashTable               *ref_actions_for_files,
+                              gint                      priority,
+                              gboolean                  allow_noent,
+                              GCancellable             *cancellable,
+                              GError                  **error)
 {
   g_autoptr(GFileEnumerator) autoinstall_d_enumerator = NULL;
+  g_autoptr(GPtrArray) files = g_ptr_array_new_with_free_func ((GDestroyNotify) autoinstall_file_free);
+  g_autoptr(GPtrArray) files_to_parse = g_ptr_array_new ();
   g_autoptr(GError) local_error = NULL;
+  gsize i;
 
   /* Repository checked out, read all files in order and build up a list
    * of flatpaks to auto-install */
   autoinstall_d_enumerator = g_file_enumerate_children (directory,
+                                                        (cache != NULL) ?
+                                                        FLATPAK_AUTOINSTALL_CACHE_FILE_ATTRIBUTES :
                                                         G_FILE_ATTRIBUTE_STANDARD_NAME,
                                                         G_FILE_QUERY_INFO_NONE,
                                                         cancellable,
@@ -1217,8 +1897,7 @@ euu_flatpak_ref_actions_append_from_directory (GFile         *directory,
     {
       GFile *file;
       GFileInfo *info;
-      g_autoptr(GPtrArray) action_refs = NULL;
-      g_autoptr(GPtrArray) skipped_action_refs = NULL;
+      AutoinstallFile *autoinstall_file;
       const gchar *filename = NULL;
       EuuFlatpakRemoteRefActionsFile *existing_actions_file = NULL;
 
@@ -1248,10 +1927,44 @@ euu_flatpak_ref_actions_append_from_directory (GFile         *directory,
           existing_actions_file->priority < priority)
         continue;
 
-      action_refs = euu_flatpak_ref_actions_from_file (file, &skipped_action_refs, cancellable, error);
+      autoinstall_file = g_new0 (AutoinstallFile, 1);
+      autoinstall_file->file = g_object_ref (file);
+      autoinstall_file->info = g_object_ref (info);
+      g_ptr_array_add (files, autoinstall_file);
 
-      if (action_refs == NULL)
-        return FALSE;
+      if (cache != NULL)
+        autoinstall_file->actions = flatpak_autoinstall_cache_lookup (cache, filter_context,
+                                                                      file, info,
+                                                                      &autoinstall_file->skipped_actions);
+
+      if (autoinstall_file->actions != NULL)
+        autoinstall_file->from_cache = TRUE;
+      else
+        g_ptr_array_add (files_to_parse, autoinstall_file);
+    }
+
+  parse_autoinstall_files (files_to_parse, filter_context, cancellable);
+
+  for (i = 0; i < files->len; i++)
+    {
+      AutoinstallFile *autoinstall_file = g_ptr_array_index (files, i);
+      const gchar *filename = g_file_info_get_name (autoinstall_file->info);
+      GPtrArray *skipped_action_refs = autoinstall_file->skipped_actions;
+
+      if (autoinstall_file->error != NULL)
+        {
+          g_propagate_error (error, g_steal_pointer (&autoinstall_file->error));
+          return FALSE;
+        }
+
+      g_assert (autoinstall_file->actions != NULL);
+
+      if (cache != NULL && !autoinstall_file->from_cache)
+        flatpak_autoinstall_cache_insert (cache, autoinstall_file->file,
+                                          autoinstall_file->info,
+                                          autoinstall_file->actions,
+                                          skipped_action_refs,
+                                          autoinstall_file->uses_filters);
 
       if (skipped_action_refs != NULL && skipped_action_refs->len > 0)
         {
@@ -1265,20 +1978,57 @@ euu_flatpak_ref_actions_append_from_directory (GFile         *directory,
 
       g_hash_table_replace (ref_actions_for_files,
                             g_strdup (filename),
-                            euu_flatpak_remote_ref_actions_file_new (action_refs,
+                            euu_flatpak_remote_ref_actions_file_new (autoinstall_file->actions,
                                                                      priority));
     }
 
   return TRUE;
 }
 
-/**
- * euu_flatpak_ref_actions_from_directory:
- * @directory:
- * @priority:
- * @cancellable:
- * @error:
- *
+/* Update @ref_actions_for_files to add all the action lists from files in
+ * @directory to it, at the given @priority. Lower numeric @priority values are
+ * more important. If a filename from @directory is already listed in
+ * @ref_actions_for_files, it will be replaced if @priority is more important
+ * than the priority attached to the existing entry in the hash table.
+ *
+ * @ref_actions_for_files maps filenames (gchar*) to
+ * #EuuFlatpakRemoteRefActionsFile instances.
+ *
+ * If any of the files in @directory fail to be parsed, all parsing will be
+ * aborted and an error will be returned.
+ *
+ * If @directory does not exist, a %G_IO_ERROR_NOT_FOUND error will be returned
+ * unless @allow_noent is %TRUE, in which case, %TRUE will be returned and
+ * @ref_actions_for_files will not be modified.
+ *
+ * Entries are filtered using @filter_context, which should be shared between
+ * all the directories being loaded. If it is %NULL, a new one is used. */
+gboolean
+euu_flatpak_ref_actions_append_from_directory (GFile                    *directory,
+                                               EuuFlatpakFilterContext  *filter_context,
+                                               GHashTable               *ref_actions_for_files,
+                                               gint                      priority,
+                                               gboolean                  allow_noent,
+                                               GCancellable             *cancellable,
+                                               GError                  **error)
+{
+  g_autoptr(EuuFlatpakFilterContext) own_filter_context = NULL;
+
+  if (filter_context == NULL)
+    filter_context = own_filter_context = euu_flatpak_filter_context_new ();
+
+  return append_from_directory_cached (directory, filter_context, NULL,
+                                       ref_actions_for_files, priority,
+                                       allow_noent, cancellable, error);
+}
+
+/**
+ * euu_flatpak_ref_actions_from_directory:
+ * @directory:
+ * @priority:
+ * @cancellable:
+ * @error:
+ *
  * Returns an associative map from action-ref list to a pointer array of
  * actions. The action-ref lists are considered to be append-only.
  *
@@ -1296,6 +2046,7 @@ euu_flatpak_ref_actions_from_directory (GFile         *directory,
                                                                        (GDestroyNotify) euu_flatpak_remote_ref_actions_file_free);
 
   if (!euu_flatpak_ref_actions_append_from_directory (directory,
+                                                      NULL,
                                                       ref_actions_for_files,
                                                       priority,
                                                       FALSE,  /* error if @directory doesn’t exist */
@@ -1315,10 +2066,16 @@ euu_flatpak_ref_hash (gconstpointer data)
   const gchar *arch = flatpak_ref_get_arch (ref);
   const gchar *branch = flatpak_ref_get_branch (ref);
 
-  return ((guint) kind ^
-          ((name != NULL) ? g_str_hash (name) : 0) ^
-          ((arch != NULL) ? g_str_hash (arch) : 0) ^
-          ((branch != NULL) ? g_str_hash (branch) : 0));
+  guint hash = (guint) kind;
+
+  /* Combine the fields asymmetrically, as XORing them would cancel out equal
+   * fields (for example, a name and branch which are both `stable`) and make
+   * apps and runtimes with the same name collide. */
+  hash = hash * 31 + ((name != NULL) ? g_str_hash (name) : 0);
+  hash = hash * 31 + ((arch != NULL) ? g_str_hash (arch) : 0);
+  hash = hash * 31 + ((branch != NULL) ? g_str_hash (branch) : 0);
+
+  return hash;
 }
 
 gboolean
@@ -1326,6 +2083,10 @@ euu_flatpak_ref_equal (gconstpointer a,
                        gconstpointer b)
 {
   FlatpakRef *a_ref = FLATPAK_REF (a), *b_ref = FLATPAK_REF (b);
+
+  if (a_ref == b_ref)
+    return TRUE;
+
   return (flatpak_ref_get_kind (a_ref) == flatpak_ref_get_kind (b_ref) &&
           g_strcmp0 (flatpak_ref_get_name (a_ref), flatpak_ref_get_name (b_ref)) == 0 &&
           g_strcmp0 (flatpak_ref_get_arch (a_ref), flatpak_ref_get_arch (b_ref)) == 0 &&
@@ -1397,26 +2158,21 @@ squash_ref_actions_ptr_array (GPtrArray *ref_actions  /* (element-type EuuFlatpa
       EuuFlatpakRemoteRefAction *squashed_action_for_ref = NULL;
 
       squashed_action_for_ref = g_hash_table_lookup (hash_table, action->ref->ref);
-      g_assert (squashed_action_for_ref != NULL);
 
       /* Check that the action matches so that e.g.
        * [ install A, install B, uninstall A ] gets squashed into
-       * [ install B, uninstall A ] not [ uninstall A, install B ]
+       * [ install B, uninstall A ] not [ uninstall A, install B ].
+       *
+       * The lookup returns %NULL if the action for this ref has already been
+       * added, which ensures we're not adding a duplicate in case the input
+       * array contains the same action more than once.
        */
       if (squashed_action_for_ref != action)
         continue;
 
-      /* Ensure we're not adding a duplicate in case the input array has
-       * multiple actions of the same type on the same ref
-       */
-      if (g_ptr_array_find_with_equal_func (squashed_ref_actions,
-                                            action,
-                                            euu_flatpak_remote_ref_action_equal_ref_only,
-                                            NULL))
-        continue;
-
       g_ptr_array_add (squashed_ref_actions,
                        euu_flatpak_remote_ref_action_ref (squashed_action_for_ref));
+      g_hash_table_remove (hash_table, action->ref->ref);
     }
 
   g_ptr_array_sort (squashed_ref_actions, sort_flatpak_remote_ref_actions);
@@ -1524,12 +2280,18 @@ filter_flatpak_ref_actions_table (GHashTable                  *ref_actions_table
 
   g_hash_table_iter_init (&ref_actions_iter, ref_actions_table);
 
+  /* Squash each filtered array as it’s produced, rather than building an
+   * intermediate table of them and squashing that. */
   while (g_hash_table_iter_next (&ref_actions_iter, &key, &value))
-    g_hash_table_insert (filtered_flatpak_ref_actions_table,
-                         g_strdup (key),
-                         (*filter_func) (key, value, filter_func_user_data));
+    {
+      g_autoptr(GPtrArray) filtered_actions = (*filter_func) (key, value, filter_func_user_data);
 
-  return euu_squash_remote_ref_actions (filtered_flatpak_ref_actions_table);
+      g_hash_table_insert (filtered_flatpak_ref_actions_table,
+                           g_strdup (key),
+                           squash_ref_actions_ptr_array (filtered_actions));
+    }
+
+  return g_steal_pointer (&filtered_flatpak_ref_actions_table);
 }
 
 /* A callback to pass to filter_flatpak_ref_actions_table(). It filters out
@@ -1659,6 +2421,80 @@ euu_filter_for_existing_flatpak_ref_actions (GHashTable *ref_actions  /* (elemen
                                            progresses);
 }
 
+/* Create a dependency ref action for the related @op found while resolving
+ * @ref_action. */
+static EuuFlatpakRemoteRefAction *
+related_ref_action_new_for_op (FlatpakTransactionOperation *op,
+                               EuuFlatpakRemoteRefAction   *ref_action,
+                               GPtrArray                   *remotes)
+{
+  FlatpakTransactionOperationType op_type = flatpak_transaction_operation_get_operation_type (op);
+  const char *op_ref = flatpak_transaction_operation_get_ref (op);
+  const char *op_remote = flatpak_transaction_operation_get_remote (op);
+  g_autoptr(EuuFlatpakLocationRef) location_ref = NULL;
+  g_autoptr(FlatpakRef) related_ref_as_ref = NULL;
+  FlatpakRemote *remote = NULL;
+  EuuFlatpakRemoteRefActionType action_type;
+
+  related_ref_as_ref = flatpak_ref_parse (op_ref, NULL);
+  g_assert (related_ref_as_ref != NULL);
+
+  for (gsize i = 0; i < remotes->len; ++i)
+    {
+      FlatpakRemote *candidate_remote = g_ptr_array_index (remotes, i);
+      /* We don't skip noenumerate remotes here, because while Flatpak
+       * doesn't use such remotes for runtime dependencies it does use them
+       * for related ref dependencies, in case the origin remote of the
+       * main ref is noenumerate.
+       */
+      if (flatpak_remote_get_disabled (candidate_remote) ||
+          flatpak_remote_get_nodeps (candidate_remote))
+        continue;
+
+      if (g_strcmp0 (op_remote, flatpak_remote_get_name (candidate_remote)) == 0)
+        {
+          remote = candidate_remote;
+          break;
+        }
+    }
+  g_assert (remote != NULL);
+
+  location_ref =
+    euu_flatpak_location_ref_new (related_ref_as_ref,
+                                  flatpak_remote_get_name (remote),
+                                  flatpak_remote_get_collection_id (remote));
+
+  switch (op_type)
+    {
+      case FLATPAK_TRANSACTION_OPERATION_INSTALL:
+        action_type = EUU_FLATPAK_REMOTE_REF_ACTION_INSTALL;
+        break;
+      case FLATPAK_TRANSACTION_OPERATION_UNINSTALL:
+        action_type = EUU_FLATPAK_REMOTE_REF_ACTION_UNINSTALL;
+        break;
+      case FLATPAK_TRANSACTION_OPERATION_UPDATE:
+        action_type = EUU_FLATPAK_REMOTE_REF_ACTION_UPDATE;
+        break;
+      case FLATPAK_TRANSACTION_OPERATION_INSTALL_BUNDLE:
+      case FLATPAK_TRANSACTION_OPERATION_LAST_TYPE:
+      default:
+        /* We don't expect to see FLATPAK_TRANSACTION_OPERATION_INSTALL_BUNDLE */
+        g_assert_not_reached ();
+    }
+
+  /* Dependencies inherit the serial number and the
+   * source and have the EUU_FLATPAK_REMOTE_REF_ACTION_FLAG_IS_DEPENDENCY flag set.
+   * At the point at which dependencies are added, action ordering
+   * and prioritization has already occurred, so the serial doesn't have
+   * much meaning. The source is inherited because then we can at least
+   * show where the dependency came from in the debug output. */
+  return euu_flatpak_remote_ref_action_new (action_type,
+                                            location_ref,
+                                            ref_action->source,
+                                            ref_action->serial,
+                                            EUU_FLATPAK_REMOTE_REF_ACTION_FLAG_IS_DEPENDENCY);
+}
+
 typedef struct {
   EuuFlatpakRemoteRefAction *ref_action;
   const char                *ref_action_ref;
@@ -1675,87 +2511,138 @@ transaction_ready (FlatpakTransaction  *transaction,
   for (GList *l = ops; l != NULL; l = l->next)
     {
       FlatpakTransactionOperation *op = l->data;
-      FlatpakTransactionOperationType op_type = flatpak_transaction_operation_get_operation_type (op);
       const char *op_ref = flatpak_transaction_operation_get_ref (op);
-      const char *op_remote = flatpak_transaction_operation_get_remote (op);
-      EuuFlatpakLocationRef *location_ref = NULL;
-      g_autoptr(FlatpakRef) related_ref_as_ref = NULL;
-      FlatpakRemote *remote = NULL;
-      EuuFlatpakRemoteRefActionType action_type;
 
       /* We are only interested in related refs */
       if (g_strcmp0 (euu_transaction_data->ref_action_ref, op_ref) == 0)
         continue;
 
       g_debug ("Found dependency %s in remote %s for %s",
-               op_ref, op_remote, euu_transaction_data->ref_action_ref);
+               op_ref, flatpak_transaction_operation_get_remote (op),
+               euu_transaction_data->ref_action_ref);
 
-      related_ref_as_ref = flatpak_ref_parse (op_ref, NULL);
-      g_assert (related_ref_as_ref != NULL);
+      g_ptr_array_add (euu_transaction_data->related_ref_actions,
+                       related_ref_action_new_for_op (op,
+                                                      euu_transaction_data->ref_action,
+                                                      euu_transaction_data->remotes));
+    }
 
-      for (gsize i = 0; i < euu_transaction_data->remotes->len; ++i)
-        {
-          FlatpakRemote *candidate_remote = g_ptr_array_index (euu_transaction_data->remotes, i);
-          /* We don't skip noenumerate remotes here, because while Flatpak
-           * doesn't use such remotes for runtime dependencies it does use them
-           * for related ref dependencies, in case the origin remote of the
-           * main ref is noenumerate.
-           */
-          if (flatpak_remote_get_disabled (candidate_remote) ||
-              flatpak_remote_get_nodeps (candidate_remote))
-            continue;
+  /* Abort the transaction; we only wanted to know what it would do */
+  return FALSE;
+}
 
-          if (g_strcmp0 (op_remote, flatpak_remote_get_name (candidate_remote)) == 0)
-            {
-              remote = candidate_remote;
-              break;
-            }
-        }
-      g_assert (remote != NULL);
+/**
+ * euu_flatpak_installed_ref_index_new:
+ * @installation: a #FlatpakInstallation
+ * @cancellable: (nullable): a #GCancellable, or %NULL
+ * @error: return location for a #GError, or %NULL
+ *
+ * List the refs installed in @installation into a set, so that checking
+ * whether several refs are installed needs only one query of @installation,
+ * rather than one per ref. Look refs up in the set using
+ * g_hash_table_contains(); it uses euu_flatpak_ref_hash() and
+ * euu_flatpak_ref_equal(), so any #FlatpakRef can be passed.
+ *
+ * The set is not updated if @installation changes.
+ *
+ * Returns: (transfer full) (element-type FlatpakRef FlatpakRef): set of
+ *    installed refs
+ */
+GHashTable *
+euu_flatpak_installed_ref_index_new (FlatpakInstallation  *installation,
+                                     GCancellable         *cancellable,
+                                     GError              **error)
+{
+  g_autoptr(GPtrArray) installed_refs = NULL;  /* (element-type FlatpakInstalledRef) */
+  g_autoptr(GHashTable) index = NULL;  /* (element-type FlatpakRef FlatpakRef) */
+  gsize i;
+
+  g_return_val_if_fail (FLATPAK_IS_INSTALLATION (installation), NULL);
+  g_return_val_if_fail (cancellable == NULL || G_IS_CANCELLABLE (cancellable), NULL);
+  g_return_val_if_fail (error == NULL || *error == NULL, NULL);
 
-      location_ref =
-        euu_flatpak_location_ref_new (related_ref_as_ref,
-                                      flatpak_remote_get_name (remote),
-                                      flatpak_remote_get_collection_id (remote));
+  installed_refs = flatpak_installation_list_installed_refs (installation,
+                                                             cancellable,
+                                                             error);
+  if (installed_refs == NULL)
+    return NULL;
 
-      switch (op_type)
-        {
-          case FLATPAK_TRANSACTION_OPERATION_INSTALL:
-            action_type = EUU_FLATPAK_REMOTE_REF_ACTION_INSTALL;
-            break;
-          case FLATPAK_TRANSACTION_OPERATION_UNINSTALL:
-            action_type = EUU_FLATPAK_REMOTE_REF_ACTION_UNINSTALL;
-            break;
-          case FLATPAK_TRANSACTION_OPERATION_UPDATE:
-            action_type = EUU_FLATPAK_REMOTE_REF_ACTION_UPDATE;
-            break;
-          case FLATPAK_TRANSACTION_OPERATION_INSTALL_BUNDLE:
-          case FLATPAK_TRANSACTION_OPERATION_LAST_TYPE:
-          default:
-            /* We don't expect to see FLATPAK_TRANSACTION_OPERATION_INSTALL_BUNDLE */
-            g_assert_not_reached ();
-        }
+  index = g_hash_table_new_full (euu_flatpak_ref_hash, euu_flatpak_ref_equal,
+                                 g_object_unref, NULL);
 
-      /* Dependencies inherit the serial number and the
-       * source and have the EUU_FLATPAK_REMOTE_REF_ACTION_FLAG_IS_DEPENDENCY flag set.
-       * At the point at which dependencies are added, action ordering
-       * and prioritization has already occurred, so the serial doesn't have
-       * much meaning. The source is inherited because then we can at least
-       * show where the dependency came from in the debug output. */
-      g_ptr_array_add (euu_transaction_data->related_ref_actions,
-                       euu_flatpak_remote_ref_action_new (action_type,
-                                                          location_ref,
-                                                          euu_transaction_data->ref_action->source,
-                                                          euu_transaction_data->ref_action->serial,
-                                                          EUU_FLATPAK_REMOTE_REF_ACTION_FLAG_IS_DEPENDENCY));
+  for (i = 0; i < installed_refs->len; i++)
+    g_hash_table_add (index, g_object_ref (g_ptr_array_index (installed_refs, i)));
+
+  return g_steal_pointer (&index);
+}
+
+/* Work out what @ref_action will do given the current state of the
+ * installation, whose installed refs are in @installed_refs:
+ * - install means "update if installed, install otherwise"
+ * - update means "update if installed, do nothing otherwise"
+ * - uninstall means "uninstall if installed, do nothing otherwise"
+ *
+ * If it will do nothing, @out_skip is set to %TRUE. */
+static void
+resolve_ref_action_type (GHashTable                     *installed_refs,
+                         EuuFlatpakRemoteRefAction      *ref_action,
+                         EuuFlatpakRemoteRefActionType  *out_resolved_action_type,
+                         gboolean                       *out_skip)
+{
+  gboolean is_installed = g_hash_table_contains (installed_refs, ref_action->ref->ref);
+
+  *out_resolved_action_type = ref_action->type;
+  *out_skip = FALSE;
+
+  switch (ref_action->type)
+    {
+      case EUU_FLATPAK_REMOTE_REF_ACTION_INSTALL:
+        if (!is_installed)
+          *out_resolved_action_type = EUU_FLATPAK_REMOTE_REF_ACTION_INSTALL;
+        else
+          *out_resolved_action_type = EUU_FLATPAK_REMOTE_REF_ACTION_UPDATE;
+        break;
+      case EUU_FLATPAK_REMOTE_REF_ACTION_UNINSTALL:
+        if (!is_installed)
+          *out_skip = TRUE;
+        else
+          *out_resolved_action_type = EUU_FLATPAK_REMOTE_REF_ACTION_UNINSTALL;
+        break;
+      case EUU_FLATPAK_REMOTE_REF_ACTION_UPDATE:
+        if (!is_installed)
+          *out_skip = TRUE;
+        else
+          *out_resolved_action_type = EUU_FLATPAK_REMOTE_REF_ACTION_UPDATE;
+        break;
+      default:
+          g_assert_not_reached ();
     }
+}
 
-  /* Abort the transaction; we only wanted to know what it would do */
-  return FALSE;
+static gboolean
+add_ref_action_to_transaction (FlatpakTransaction             *transaction,
+                               EuuFlatpakRemoteRefAction      *ref_action,
+                               const char                     *ref_action_ref,
+                               EuuFlatpakRemoteRefActionType   resolved_action_type,
+                               GError                        **error)
+{
+  switch (resolved_action_type)
+    {
+      case EUU_FLATPAK_REMOTE_REF_ACTION_INSTALL:
+        return flatpak_transaction_add_install (transaction, ref_action->ref->remote, ref_action_ref, NULL, error);
+      case EUU_FLATPAK_REMOTE_REF_ACTION_UNINSTALL:
+        return flatpak_transaction_add_uninstall (transaction, ref_action_ref, error);
+      case EUU_FLATPAK_REMOTE_REF_ACTION_UPDATE:
+        return flatpak_transaction_add_update (transaction, ref_action_ref, NULL, NULL, error);
+      default:
+          g_assert_not_reached ();
+          return FALSE;
+    }
 }
 
 static gboolean
 find_related_refs_for_action (FlatpakInstallation       *installation,
+                              GHashTable                *installed_refs,
                               EuuFlatpakRemoteRefAction *ref_action,
                               GPtrArray                 *remotes,
                               GPtrArray                 *related_ref_actions,
@@ -1767,54 +2654,11 @@ find_related_refs_for_action (FlatpakInstallation       *installation,
   EuuTransactionData euu_transaction_data = { NULL };
   g_autofree char *ref_action_ref = flatpak_ref_format_ref (ref_action->ref->ref);
   EuuFlatpakRemoteRefActionType resolved_action_type;
+  gboolean skip;
 
-  /* Enforce the conditions for each action type:
-   * - install means "update if installed, install otherwise"
-   * - update means "update if installed, do nothing otherwise"
-   * - uninstall means "uninstall if installed, do nothing otherwise"
-   */
-    {
-      g_autoptr(FlatpakInstalledRef) installed_ref =
-        flatpak_installation_get_installed_ref (installation,
-                                                flatpak_ref_get_kind (ref_action->ref->ref),
-                                                flatpak_ref_get_name (ref_action->ref->ref),
-                                                flatpak_ref_get_arch (ref_action->ref->ref),
-                                                flatpak_ref_get_branch (ref_action->ref->ref),
-                                                cancellable,
-                                                &local_error);
-      if (installed_ref == NULL &&
-          !g_error_matches (local_error, FLATPAK_ERROR, FLATPAK_ERROR_NOT_INSTALLED))
-        {
-          g_propagate_error (error, g_steal_pointer (&local_error));
-          return FALSE;
-        }
-
-      switch (ref_action->type)
-        {
-          case EUU_FLATPAK_REMOTE_REF_ACTION_INSTALL:
-            if (installed_ref == NULL)
-              resolved_action_type = EUU_FLATPAK_REMOTE_REF_ACTION_INSTALL;
-            else
-              resolved_action_type = EUU_FLATPAK_REMOTE_REF_ACTION_UPDATE;
-            break;
-          case EUU_FLATPAK_REMOTE_REF_ACTION_UNINSTALL:
-            if (installed_ref == NULL)
-              return TRUE; /* early return */
-            else
-              resolved_action_type = EUU_FLATPAK_REMOTE_REF_ACTION_UNINSTALL;
-            break;
-          case EUU_FLATPAK_REMOTE_REF_ACTION_UPDATE:
-            if (installed_ref == NULL)
-              return TRUE; /* early return */
-            else
-              resolved_action_type = EUU_FLATPAK_REMOTE_REF_ACTION_UPDATE;
-            break;
-          default:
-              g_assert_not_reached ();
-        }
-
-      g_clear_error (&local_error);
-    }
+  resolve_ref_action_type (installed_refs, ref_action, &resolved_action_type, &skip);
+  if (skip)
+    return TRUE;
 
   /* Here we use a FlatpakTransaction to determine the dependencies of
    * @action_ref, and abort the transaction before it executes the operations.
@@ -1832,23 +2676,9 @@ find_related_refs_for_action (FlatpakInstallation       *installation,
 
   flatpak_transaction_set_no_interaction (transaction, TRUE);
 
-  switch (resolved_action_type)
-    {
-      case EUU_FLATPAK_REMOTE_REF_ACTION_INSTALL:
-        if (!flatpak_transaction_add_install (transaction, ref_action->ref->remote, ref_action_ref, NULL, error))
-          return FALSE;
-        break;
-      case EUU_FLATPAK_REMOTE_REF_ACTION_UNINSTALL:
-        if (!flatpak_transaction_add_uninstall (transaction, ref_action_ref, error))
-          return FALSE;
-        break;
-      case EUU_FLATPAK_REMOTE_REF_ACTION_UPDATE:
-        if (!flatpak_transaction_add_update (transaction, ref_action_ref, NULL, NULL, error))
-          return FALSE;
-        break;
-      default:
-          g_assert_not_reached ();
-    }
+  if (!add_ref_action_to_transaction (transaction, ref_action, ref_action_ref,
+                                      resolved_action_type, error))
+    return FALSE;
 
   euu_transaction_data.ref_action = ref_action;
   euu_transaction_data.ref_action_ref = ref_action_ref;
@@ -1870,6 +2700,171 @@ find_related_refs_for_action (FlatpakInstallation       *installation,
   return TRUE;
 }
 
+#if FLATPAK_CHECK_VERSION (1, 13, 4)
+typedef struct {
+  GPtrArray  *ref_actions; /* (element-type EuuFlatpakRemoteRefAction) */
+  GHashTable *ref_action_indices; /* (element-type utf8 guint) formatted ref → index in @ref_actions + 1 */
+  GPtrArray  *related_ref_actions; /* (element-type GPtrArray<EuuFlatpakRemoteRefAction>), one per ref action */
+  GPtrArray  *remotes; /* (element-type FlatpakRemote) */
+} EuuBatchedTransactionData;
+
+/* Find the indices of the ref actions which caused @op to be added to the
+ * transaction, following its chain of related operations (for example, an
+ * extension of a runtime of an app) back to the actions themselves. */
+static void
+find_originating_ref_actions (EuuBatchedTransactionData   *data,
+                              FlatpakTransactionOperation *op,
+                              GHashTable                  *visited_ops,
+                              GArray                      *out_indices)
+{
+  GPtrArray *related_to_ops = flatpak_transaction_operation_get_related_to_ops (op);
+
+  if (related_to_ops == NULL)
+    return;
+
+  for (gsize i = 0; i < related_to_ops->len; i++)
+    {
+      FlatpakTransactionOperation *related_to_op = g_ptr_array_index (related_to_ops, i);
+      const char *related_to_ref = flatpak_transaction_operation_get_ref (related_to_op);
+      guint index_plus_one;
+
+      if (!g_hash_table_add (visited_ops, related_to_op))
+        continue;
+
+      index_plus_one = GPOINTER_TO_UINT (g_hash_table_lookup (data->ref_action_indices,
+                                                              related_to_ref));
+      if (index_plus_one > 0)
+        g_array_append_val (out_indices, index_plus_one);
+
+      find_originating_ref_actions (data, related_to_op, visited_ops, out_indices);
+    }
+}
+
+static gboolean
+batched_transaction_ready (FlatpakTransaction         *transaction,
+                           EuuBatchedTransactionData  *data)
+{
+  g_autolist(GObject) ops = flatpak_transaction_get_operations (transaction);
+
+  for (GList *l = ops; l != NULL; l = l->next)
+    {
+      FlatpakTransactionOperation *op = l->data;
+      const char *op_ref = flatpak_transaction_operation_get_ref (op);
+      g_autoptr(GHashTable) visited_ops = g_hash_table_new (NULL, NULL);
+      g_autoptr(GArray) indices = g_array_new (FALSE, FALSE, sizeof (guint));
+
+      find_originating_ref_actions (data, op, visited_ops, indices);
+
+      for (gsize i = 0; i < indices->len; i++)
+        {
+          guint index = g_array_index (indices, guint, i) - 1;
+          EuuFlatpakRemoteRefAction *ref_action = g_ptr_array_index (data->ref_actions, index);
+          g_autofree char *ref_action_ref = flatpak_ref_format_ref (ref_action->ref->ref);
+
+          g_debug ("Found dependency %s in remote %s for %s",
+                   op_ref, flatpak_transaction_operation_get_remote (op),
+                   ref_action_ref);
+
+          g_ptr_array_add (g_ptr_array_index (data->related_ref_actions, index),
+                           related_ref_action_new_for_op (op, ref_action, data->remotes));
+        }
+    }
+
+  /* Abort the transaction; we only wanted to know what it would do */
+  return FALSE;
+}
+
+/* Like find_related_refs_for_action(), but for all of @ref_actions at once,
+ * using a single transaction so the remotes’ metadata is only loaded once.
+ * The related operations are attributed back to the actions which caused
+ * them using flatpak_transaction_operation_get_related_to_ops().
+ *
+ * On success, @out_related_ref_actions is set to an array with one array of
+ * related ref actions for each element of @ref_actions. This fails if the
+ * actions can’t be resolved together (for example, if one uninstalls a
+ * runtime which another needs); the caller should then resolve them one at
+ * a time. */
+static gboolean
+find_related_refs_for_actions_batched (FlatpakInstallation  *installation,
+                                       GHashTable           *installed_refs,
+                                       GPtrArray            *ref_actions,
+                                       GPtrArray            *remotes,
+                                       GPtrArray           **out_related_ref_actions,
+                                       GCancellable         *cancellable,
+                                       GError              **error)
+{
+  g_autoptr(FlatpakTransaction) transaction = NULL;
+  g_autoptr(GError) local_error = NULL;
+  g_autoptr(GHashTable) ref_action_indices = g_hash_table_new_full (g_str_hash, g_str_equal,
+                                                                    g_free, NULL);
+  g_autoptr(GPtrArray) related_ref_actions =
+    g_ptr_array_new_with_free_func ((GDestroyNotify) g_ptr_array_unref);
+  EuuBatchedTransactionData data = { NULL };
+  gboolean any_added = FALSE;
+
+  transaction = flatpak_transaction_new_for_installation (installation, cancellable, error);
+  if (transaction == NULL)
+    return FALSE;
+
+  flatpak_transaction_set_no_interaction (transaction, TRUE);
+
+  for (gsize i = 0; i < ref_actions->len; i++)
+    {
+      EuuFlatpakRemoteRefAction *ref_action = g_ptr_array_index (ref_actions, i);
+      g_autofree char *ref_action_ref = flatpak_ref_format_ref (ref_action->ref->ref);
+      EuuFlatpakRemoteRefActionType resolved_action_type;
+      gboolean skip;
+
+      g_ptr_array_add (related_ref_actions,
+                       g_ptr_array_new_with_free_func ((GDestroyNotify) euu_flatpak_remote_ref_action_unref));
+
+      resolve_ref_action_type (installed_refs, ref_action, &resolved_action_type, &skip);
+      if (skip)
+        continue;
+
+      /* Each ref can only have one action in a transaction. */
+      if (g_hash_table_contains (ref_action_indices, ref_action_ref))
+        {
+          g_set_error (error, FLATPAK_ERROR, FLATPAK_ERROR_INVALID_DATA,
+                       "Multiple actions for %s", ref_action_ref);
+          return FALSE;
+        }
+
+      if (!add_ref_action_to_transaction (transaction, ref_action, ref_action_ref,
+                                          resolved_action_type, error))
+        return FALSE;
+
+      g_hash_table_insert (ref_action_indices, g_steal_pointer (&ref_action_ref),
+                           GUINT_TO_POINTER (i + 1));
+      any_added = TRUE;
+    }
+
+  /* Running an empty transaction doesn’t emit ::ready. */
+  if (any_added)
+    {
+      data.ref_actions = ref_actions;
+      data.ref_action_indices = ref_action_indices;
+      data.related_ref_actions = related_ref_actions;
+      data.remotes = remotes;
+
+      g_signal_connect (transaction, "ready", G_CALLBACK (batched_transaction_ready), &data);
+      /* no need to connect to operation-error since we abort the transaction */
+
+      flatpak_transaction_run (transaction, cancellable, &local_error);
+      g_assert (local_error != NULL);
+      if (!g_error_matches (local_error, FLATPAK_ERROR, FLATPAK_ERROR_ABORTED))
+        {
+          g_propagate_error (error, g_steal_pointer (&local_error));
+          return FALSE;
+        }
+      g_clear_error (&local_error);
+    }
+
+  *out_related_ref_actions = g_steal_pointer (&related_ref_actions);
+  return TRUE;
+}
+#endif  /* FLATPAK_CHECK_VERSION (1, 13, 4) */
+
 /**
  * euu_add_dependency_ref_actions_for_installation:
  * @installation: A #FlatpakInstallation
@@ -1904,6 +2899,8 @@ euu_add_dependency_ref_actions_for_installation (FlatpakInstallation  *installat
   g_autoptr(GPtrArray) dependency_ref_actions =
     g_ptr_array_new_with_free_func ((GDestroyNotify) euu_flatpak_remote_ref_action_unref);
   g_autoptr(GPtrArray) remotes = NULL; /* (element-type FlatpakRemote) */
+  g_autoptr(GHashTable) installed_refs = NULL; /* (element-type FlatpakRef FlatpakRef) */
+  g_autoptr(GPtrArray) batched_related_ref_actions = NULL; /* (element-type GPtrArray<EuuFlatpakRemoteRefAction>) */
 
   g_return_val_if_fail (FLATPAK_IS_INSTALLATION (installation), NULL);
   g_return_val_if_fail (cancellable == NULL || G_IS_CANCELLABLE (cancellable), NULL);
@@ -1914,19 +2911,64 @@ euu_add_dependency_ref_actions_for_installation (FlatpakInstallation  *installat
   if (remotes == NULL)
     return NULL;
 
+  /* The transactions used below are all aborted before they change anything,
+   * so the installed refs only need to be listed once. */
+  installed_refs = euu_flatpak_installed_ref_index_new (installation, cancellable, error);
+
+  if (installed_refs == NULL)
+    return NULL;
+
+  /* Resolving all the actions in one transaction needs
+   * flatpak_transaction_operation_get_related_to_ops(). Older versions of
+   * flatpak always resolve them one action at a time below. */
+#if FLATPAK_CHECK_VERSION (1, 13, 4)
+  {
+    g_autoptr(GError) local_error = NULL;
+
+    if (!find_related_refs_for_actions_batched (installation,
+                                                installed_refs,
+                                                ref_actions,
+                                                remotes,
+                                                &batched_related_ref_actions,
+                                                cancellable,
+                                                &local_error))
+      {
+        if (g_error_matches (local_error, G_IO_ERROR, G_IO_ERROR_CANCELLED))
+          {
+            g_propagate_error (error, g_steal_pointer (&local_error));
+            return NULL;
+          }
+
+        g_debug ("Failed to resolve dependencies of all flatpak ref actions "
+                 "together; resolving them one at a time: %s",
+                 local_error->message);
+      }
+  }
+#endif
+
   for (gsize i = 0; i < ref_actions->len; ++i)
     {
       EuuFlatpakRemoteRefAction *ref_action = g_ptr_array_index (ref_actions, i);
-      g_autoptr(GPtrArray) related_ref_actions =
-        g_ptr_array_new_with_free_func ((GDestroyNotify) euu_flatpak_remote_ref_action_unref);
-
-      if (!find_related_refs_for_action (installation,
-                                         ref_action,
-                                         remotes,
-                                         related_ref_actions,
-                                         cancellable,
-                                         error))
-        return FALSE;
+      g_autoptr(GPtrArray) related_ref_actions = NULL;
+
+      if (batched_related_ref_actions != NULL)
+        {
+          related_ref_actions = g_ptr_array_ref (g_ptr_array_index (batched_related_ref_actions, i));
+        }
+      else
+        {
+          related_ref_actions =
+            g_ptr_array_new_with_free_func ((GDestroyNotify) euu_flatpak_remote_ref_action_unref);
+
+          if (!find_related_refs_for_action (installation,
+                                             installed_refs,
+                                             ref_action,
+                                             remotes,
+                                             related_ref_actions,
+                                             cancellable,
+                                             error))
+            return FALSE;
+        }
 
       /* If the source ref action is to uninstall then its
        * dependencies should go after it. */
@@ -1993,15 +3035,108 @@ euu_flatpak_autoinstall_override_paths (void)
                                     LOCALSTATEDIR "/lib/eos-application-tools/flatpak-autoinstall.d");
 }
 
+/**
+ * euu_flatpak_progress_journal_path:
+ * @counter_path: (type filename): path to a progress counter file, such as
+ *    euu_pending_flatpak_deployments_state_path()
+ *
+ * Get the path of the journal which goes with the progress counter file at
+ * @counter_path.
+ *
+ * While eos-updater-flatpak-installer applies actions, it appends a record to
+ * the journal as each one completes, rather than rewriting the counter file
+ * every time. Each record is a line containing a serial number, a space, and
+ * the basename of the autoinstall file the action came from. The journal is
+ * folded into the counter file at the end of the run and then deleted. If a
+ * run is interrupted, the journal is left behind, and is used together with
+ * the counter file by the next run so it resumes where the last one stopped.
+ *
+ * Returns: (transfer full) (type filename): path to the journal
+ */
+gchar *
+euu_flatpak_progress_journal_path (const gchar *counter_path)
+{
+  g_return_val_if_fail (counter_path != NULL, NULL);
+
+  return g_strconcat (counter_path, ".journal", NULL);
+}
+
+/**
+ * euu_flatpak_progress_journal_replay:
+ * @counter_path: (type filename): path to a progress counter file
+ * @counter_keyfile: the loaded contents of @counter_path, if it exists
+ * @error: return location for a #GError, or %NULL
+ *
+ * Apply the progress recorded in the journal for @counter_path (see
+ * euu_flatpak_progress_journal_path()) to @counter_keyfile. Progress values are
+ * only ever increased, so replaying the same journal more than once is
+ * harmless. It is not an error for the journal not to exist. A truncated or
+ * malformed record (for example, the last one, if writing it was interrupted)
+ * is ignored.
+ *
+ * Returns: %TRUE on success, %FALSE otherwise
+ */
+gboolean
+euu_flatpak_progress_journal_replay (const gchar  *counter_path,
+                                     GKeyFile     *counter_keyfile,
+                                     GError      **error)
+{
+  g_autofree gchar *journal_path = NULL;
+  g_autofree gchar *contents = NULL;
+  g_autoptr(GError) local_error = NULL;
+  const gchar *line;
+  const gchar *line_end;
+
+  g_return_val_if_fail (counter_path != NULL, FALSE);
+  g_return_val_if_fail (counter_keyfile != NULL, FALSE);
+  g_return_val_if_fail (error == NULL || *error == NULL, FALSE);
+
+  journal_path = euu_flatpak_progress_journal_path (counter_path);
+
+  if (!g_file_get_contents (journal_path, &contents, NULL, &local_error))
+    {
+      if (g_error_matches (local_error, G_FILE_ERROR, G_FILE_ERROR_NOENT))
+        return TRUE;
+
+      g_propagate_error (error, g_steal_pointer (&local_error));
+      return FALSE;
+    }
+
+  for (line = contents; (line_end = strchr (line, '\n')) != NULL; line = line_end + 1)
+    {
+      g_autofree gchar *source = NULL;
+      gchar *serial_end = NULL;
+      gint64 serial;
+
+      serial = g_ascii_strtoll (line, &serial_end, 10);
+
+      if (serial_end == line || *serial_end != ' ' || serial_end + 1 >= line_end ||
+          !is_valid_serial (serial))
+        {
+          g_debug ("%s: Ignoring malformed record in ‘%s’", G_STRFUNC, journal_path);
+          continue;
+        }
+
+      source = g_strndup (serial_end + 1, line_end - (serial_end + 1));
+
+      if (!g_key_file_has_key (counter_keyfile, source, "Progress", NULL) ||
+          g_key_file_get_int64 (counter_keyfile, source, "Progress", NULL) < serial)
+        g_key_file_set_int64 (counter_keyfile, source, "Progress", serial);
+    }
+
+  return TRUE;
+}
+
 /**
  * euu_flatpak_ref_action_application_progress_in_state_path:
  * @cancellable:
  * @error:
  *
- * Load the progress information from euu_pending_flatpak_deployments_state_path()
- * and return it in a hash table of filename → progress. Each progress value
- * is an integer which is the serial number of the last applied autoinstall
- * entry for that filename.
+ * Load the progress information from euu_pending_flatpak_deployments_state_path(),
+ * and its journal (see euu_flatpak_progress_journal_path()), and return it in a
+ * hash table of filename → progress. Each progress value is an integer which
+ * is the serial number of the last applied autoinstall entry for that
+ * filename.
  *
  * Returns: (element-type filename gint32) (transfer container):
  */
@@ -2033,9 +3168,14 @@ euu_flatpak_ref_action_application_progress_in_state_path (GCancellable  *cancel
           return NULL;
         }
 
-      return g_steal_pointer (&ref_action_progress_for_files);
+      g_clear_error (&local_error);
     }
 
+  /* Add any progress from a run which was interrupted before it could update
+   * the state file. */
+  if (!euu_flatpak_progress_journal_replay (state_file_path, state_key_file, error))
+    return NULL;
+
   /* Enumerate each section. The section name is the path to the file */
   groups = g_key_file_get_groups (state_key_file, NULL);
 
@@ -2085,11 +3225,21 @@ GPtrArray *
 euu_flatten_flatpak_ref_actions_table (GHashTable *ref_actions_table)
 {
   g_autoptr(GList) remote_ref_actions_keys = g_hash_table_get_keys (ref_actions_table);
-  g_autoptr(GPtrArray) concatenated_actions_pointer_array = g_ptr_array_new_with_free_func ((GDestroyNotify) euu_flatpak_remote_ref_action_unref);
+  g_autoptr(GPtrArray) concatenated_actions_pointer_array = NULL;
+  GHashTableIter size_iter;
+  gpointer value;
+  guint n_actions = 0;
   GList *iter = NULL;
 
   remote_ref_actions_keys = g_list_sort (remote_ref_actions_keys, (GCompareFunc) g_strcmp0);
 
+  g_hash_table_iter_init (&size_iter, ref_actions_table);
+  while (g_hash_table_iter_next (&size_iter, NULL, &value))
+    n_actions += ((GPtrArray *) value)->len;
+
+  concatenated_actions_pointer_array = g_ptr_array_new_full (n_actions,
+                                                             (GDestroyNotify) euu_flatpak_remote_ref_action_unref);
+
   for (iter = remote_ref_actions_keys; iter != NULL; iter = iter->next)
     {
       GPtrArray *ref_actions = g_hash_table_lookup (ref_actions_table, iter->data);
@@ -2301,6 +3451,7 @@ directories_to_search_from_environment (void)
  * euu_flatpak_ref_actions_from_paths:
  * @directories_to_search: (nullable): potentially empty %NULL-terminated array
  *    of directories to search, or %NULL to use the default directory list
+ * @update_cache: %TRUE to save any changes to the cache of parsed files
  * @error: return location for a #GError, or %NULL
  *
  * Load the #EuuFlatpakRemoteRefActions from all the autoinstall JSON files in
@@ -2311,13 +3462,23 @@ directories_to_search_from_environment (void)
  * @directories_to_search take priority over files with the same name in later
  * directories.
  *
+ * The parsed files are cached alongside
+ * euu_pending_flatpak_deployments_state_path(), and are only parsed again if
+ * they have changed. The cache is only written if @update_cache is %TRUE, so
+ * that callers which only inspect the autoinstall files (such as
+ * `eos-updater-flatpak-installer --mode check`, or
+ * eos-updater-prepare-volume through
+ * euu_flattened_flatpak_ref_actions_from_paths()) don’t modify the state of
+ * the system they run on.
+ *
  * Returns: (transfer container) (element-type filename GPtrArray<EuuFlatpakRemoteRefAction>):
  *    a potentially empty map of autoinstall filename to array of #EuuFlatpakRemoteRefActions
  *    in that file
  */
 GHashTable *
-euu_flatpak_ref_actions_from_paths (GStrv    directories_to_search,
-                                    GError **error)
+euu_flatpak_ref_actions_from_paths (GStrv      directories_to_search,
+                                    gboolean   update_cache,
+                                    GError   **error)
 {
   g_auto(GStrv) default_directories_to_search = NULL;
   GStrv iter = NULL;
@@ -2326,6 +3487,8 @@ euu_flatpak_ref_actions_from_paths (GStrv    directories_to_search,
                                                              g_str_equal,
                                                              g_free,
                                                              (GDestroyNotify) euu_flatpak_remote_ref_actions_file_free);
+  g_autoptr(EuuFlatpakFilterContext) filter_context = euu_flatpak_filter_context_new ();
+  g_autoptr(FlatpakAutoinstallCache) cache = flatpak_autoinstall_cache_load ();
 
   if (directories_to_search == NULL)
     {
@@ -2336,15 +3499,20 @@ euu_flatpak_ref_actions_from_paths (GStrv    directories_to_search,
   for (iter = directories_to_search; *iter != NULL; ++iter, ++priority_counter)
     {
       g_autoptr(GFile) directory = g_file_new_for_path (*iter);
-      if (!euu_flatpak_ref_actions_append_from_directory (directory,
-                                                          ref_actions,
-                                                          priority_counter,
-                                                          TRUE,  /* ignore ENOENT */
-                                                          NULL,
-                                                          error))
+      if (!append_from_directory_cached (directory,
+                                         filter_context,
+                                         cache,
+                                         ref_actions,
+                                         priority_counter,
+                                         TRUE,  /* ignore ENOENT */
+                                         NULL,
+                                         error))
         return NULL;
     }
 
+  if (update_cache)
+    flatpak_autoinstall_cache_save (cache, filter_context);
+
   return euu_hoist_flatpak_remote_ref_actions (ref_actions);
 }
 
@@ -2355,8 +3523,8 @@ euu_flatpak_ref_actions_from_paths (GStrv    directories_to_search,
  * @error: return location for a #GError, or %NULL
  *
  * Using this function is equivalent to calling
- * euu_flatpak_ref_actions_from_paths() followed by
- * euu_flatten_flatpak_ref_actions_table().
+ * euu_flatpak_ref_actions_from_paths() (without updating the cache) followed
+ * by euu_flatten_flatpak_ref_actions_table().
  *
  * Returns: (transfer container) (element-type EuuFlatpakRemoteRefAction):
  *    The set of actions, with at most one per ref
@@ -2367,33 +3535,13 @@ euu_flattened_flatpak_ref_actions_from_paths (GStrv    directories_to_search,
 {
   g_autoptr(GHashTable) ref_actions = NULL;
 
-  ref_actions = euu_flatpak_ref_actions_from_paths (directories_to_search, error);
+  ref_actions = euu_flatpak_ref_actions_from_paths (directories_to_search, FALSE, error);
   if (ref_actions == NULL)
     return NULL;
 
   return euu_flatten_flatpak_ref_actions_table (ref_actions);
 }
 
-static gboolean
-inspect_directory_in_ostree_repo (OstreeRepo    *repo,
-                                  const gchar   *checksum,
-                                  const gchar   *subpath,
-                                  const gchar   *checkout_path,
-                                  GCancellable  *cancellable,
-                                  GError       **error)
-{
-  OstreeRepoCheckoutAtOptions options = { 0, };
-  options.subpath = subpath;
-
-  return ostree_repo_checkout_at (repo,
-                                  &options,
-                                  -1,
-                                  checkout_path,
-                                  checksum,
-                                  cancellable,
-                                  error);
-}
-
 /**
  * euu_flatpak_ref_actions_from_ostree_commit:
  * @repo:
@@ -2401,6 +3549,10 @@ inspect_directory_in_ostree_repo (OstreeRepo    *repo,
  * @cancellable:
  * @error:
  *
+ * Load the autoinstall lists from the commit @checksum in @repo, and from the
+ * override directories, which take priority over it. The lists are read
+ * directly from the commit’s tree, without checking it out.
+ *
  * Returns: (transfer container) (element-type filename GPtrArray<EuuFlatpakRemoteRefAction>):
  */
 GHashTable *
@@ -2409,67 +3561,57 @@ euu_flatpak_ref_actions_from_ostree_commit (OstreeRepo    *repo,
                                             GCancellable  *cancellable,
                                             GError       **error)
 {
-  g_autofree gchar *temp_dir_path = NULL;
-  g_autofree gchar *checkout_path = NULL;
   const gchar *path_relative_to_deployment = "usr/share/eos-application-tools/flatpak-autoinstall.d";
-  g_autoptr(GHashTable) flatpak_ref_actions_table = NULL;
-  const gchar *override_paths = euu_flatpak_autoinstall_override_paths ();
-  const gchar *paths_to_search_string = NULL;
-  g_autofree gchar *allocated_paths_to_search_string = NULL;
-  g_auto(GStrv) paths_to_search = NULL;
+  g_autoptr(GHashTable) ref_actions = g_hash_table_new_full (g_str_hash,
+                                                             g_str_equal,
+                                                             g_free,
+                                                             (GDestroyNotify) euu_flatpak_remote_ref_actions_file_free);
+  g_auto(GStrv) override_paths = g_strsplit (euu_flatpak_autoinstall_override_paths (), ";", -1);
+  g_autoptr(EuuFlatpakFilterContext) filter_context = euu_flatpak_filter_context_new ();
+  g_autoptr(GFile) root = NULL;
+  g_autoptr(GFile) commit_directory = NULL;
   g_autoptr(GError) local_error = NULL;
-  GHashTable *ret_actions_table = NULL;
-
-  temp_dir_path = g_dir_make_tmp ("ostree-checkout-XXXXXX", error);
-  if (temp_dir_path == NULL)
-    goto out;
-
-  /* Now that we have a temporary directory, checkout the OSTree in it
-   * at the /usr/share/eos-application-tools path. If it fails, there’s nothing to
-   * read, otherwise we can read in the list of flatpaks to be auto-installed
-   * for this commit. */
-  checkout_path = g_build_filename (temp_dir_path, "checkout", NULL);
-  if (inspect_directory_in_ostree_repo (repo,
-                                        checksum,
-                                        path_relative_to_deployment,
-                                        checkout_path,
-                                        cancellable,
-                                        &local_error))
-    {
-      /* Checkout directory has the lowest priority, if it is specified */
-      allocated_paths_to_search_string = g_strjoin (";", override_paths, checkout_path, NULL);
-      paths_to_search_string = allocated_paths_to_search_string;
+  gint priority_counter = 0;
+  GStrv iter = NULL;
+
+  for (iter = override_paths; *iter != NULL; ++iter, ++priority_counter)
+    {
+      g_autoptr(GFile) directory = g_file_new_for_path (*iter);
+      if (!euu_flatpak_ref_actions_append_from_directory (directory,
+                                                          filter_context,
+                                                          ref_actions,
+                                                          priority_counter,
+                                                          TRUE,  /* ignore ENOENT */
+                                                          cancellable,
+                                                          error))
+        return NULL;
     }
-  else
+
+  /* The commit’s directory has the lowest priority. If the commit can’t be
+   * found, there’s nothing to read from it; this matches what happened when
+   * it used to be checked out. */
+  if (!ostree_repo_read_commit (repo, checksum, &root, NULL, cancellable, &local_error))
     {
       if (!g_error_matches (local_error, G_IO_ERROR, G_IO_ERROR_NOT_FOUND))
         {
           g_propagate_error (error, g_steal_pointer (&local_error));
-          goto out;
+          return NULL;
         }
-
-      paths_to_search_string = override_paths;
     }
-
-  paths_to_search = g_strsplit (paths_to_search_string, ";", -1);
-  flatpak_ref_actions_table = euu_flatpak_ref_actions_from_paths (paths_to_search,
-                                                                  error);
-
-  ret_actions_table = g_steal_pointer (&flatpak_ref_actions_table);
-
- out:
-  /* Regardless of whether there was an error, we always want to remove
-   * the temporary directory at this point and garbage-collect on the
-   * OstreeRepo. Note that these operations may fail, but we don’t
-   * really care. */
-  if (temp_dir_path != NULL)
+  else
     {
-      g_autoptr(GFile) temp_dir = g_file_new_for_path (temp_dir_path);
-      eos_updater_remove_recursive (temp_dir, NULL, NULL);
+      commit_directory = g_file_resolve_relative_path (root, path_relative_to_deployment);
+      if (!euu_flatpak_ref_actions_append_from_directory (commit_directory,
+                                                          filter_context,
+                                                          ref_actions,
+                                                          priority_counter,
+                                                          TRUE,  /* ignore ENOENT */
+                                                          cancellable,
+                                                          error))
+        return NULL;
     }
-  ostree_repo_checkout_gc (repo, cancellable, NULL);
 
-  return ret_actions_table;
+  return euu_hoist_flatpak_remote_ref_actions (ref_actions);
 }
 
 /**
@@ -2549,22 +3691,67 @@ transaction_operation_error (FlatpakTransaction             *object,
   return FALSE;
 }
 
+typedef struct
+{
+  EuuFlatpakTransactionProgressFunc func;
+  gpointer user_data;
+
+  /* Bytes transferred by operations which have finished, and by the current
+   * one. A transaction runs its operations one at a time. */
+  guint64 completed_bytes;
+  guint64 current_bytes;
+} TransactionProgressData;
+
+static void
+transaction_progress_changed (FlatpakTransactionProgress *progress,
+                              gpointer                    user_data)
+{
+  TransactionProgressData *data = user_data;
+
+  data->current_bytes = flatpak_transaction_progress_get_bytes_transferred (progress);
+  data->func (data->completed_bytes + data->current_bytes, data->user_data);
+}
+
+static void
+transaction_new_operation (FlatpakTransaction          *transaction,
+                           FlatpakTransactionOperation *operation,
+                           FlatpakTransactionProgress  *progress,
+                           gpointer                     user_data)
+{
+  TransactionProgressData *data = user_data;
+
+  data->completed_bytes += data->current_bytes;
+  data->current_bytes = 0;
+
+  g_signal_connect (progress, "changed",
+                    G_CALLBACK (transaction_progress_changed), data);
+}
+
 /* Run a transaction which contains a single op, and report the most specific
- * error possible on failure. */
+ * error possible on failure. If @progress_func is non-%NULL, it is called
+ * whenever more data has been downloaded. */
 static gboolean
-transaction_run_single_op (FlatpakTransaction  *transaction,
-                           GCancellable        *cancellable,
-                           GError             **error)
+transaction_run_single_op (FlatpakTransaction                 *transaction,
+                           EuuFlatpakTransactionProgressFunc   progress_func,
+                           gpointer                            progress_data,
+                           GCancellable                       *cancellable,
+                           GError                            **error)
 {
   g_autoptr(GError) operation_error = NULL;
   g_autoptr(GError) transaction_error = NULL;
+  TransactionProgressData data = { progress_func, progress_data, 0, 0 };
   gboolean success;
-  gulong id;
+  gulong id, progress_id = 0;
 
   id = g_signal_connect (transaction, "operation-error",
                          G_CALLBACK (transaction_operation_error), &operation_error);
+  if (progress_func != NULL)
+    progress_id = g_signal_connect (transaction, "new-operation",
+                                    G_CALLBACK (transaction_new_operation), &data);
   success = flatpak_transaction_run (transaction, cancellable, &transaction_error);
   g_signal_handler_disconnect (transaction, id);
+  if (progress_id != 0)
+    g_signal_handler_disconnect (transaction, progress_id);
 
   /* Always prefer to report the operation error, as it’s always more specific
    * than the transaction error (which is always %FLATPAK_ERROR_ABORTED). */
@@ -2576,14 +3763,38 @@ transaction_run_single_op (FlatpakTransaction  *transaction,
   return success;
 }
 
+/* Let @transaction pull from the local repositories in @sideload_repos (for
+ * example, on a USB stick), where they have the refs it needs, rather than
+ * from the remotes. This needs flatpak 1.7.1; with older versions, the remotes
+ * are always used. */
+static void
+transaction_add_sideload_repos (FlatpakTransaction  *transaction,
+                                const gchar * const *sideload_repos)
+{
+  gsize i;
+
+  for (i = 0; sideload_repos != NULL && sideload_repos[i] != NULL; i++)
+    {
+#ifdef HAVE_FLATPAK_TRANSACTION_ADD_SIDELOAD_REPO
+      flatpak_transaction_add_sideload_repo (transaction, sideload_repos[i]);
+#else
+      g_debug ("%s: Ignoring sideload repository ‘%s’ as flatpak does not support them",
+               G_STRFUNC, sideload_repos[i]);
+#endif
+    }
+}
+
 gboolean
-euu_flatpak_transaction_install (FlatpakInstallation *installation,
-                                 const gchar         *remote,
-                                 const gchar         *formatted_ref,
-                                 gboolean             no_deploy,
-                                 gboolean             no_pull,
-                                 GCancellable        *cancellable,
-                                 GError              **error)
+euu_flatpak_transaction_install (FlatpakInstallation               *installation,
+                                 const gchar                       *remote,
+                                 const gchar                       *formatted_ref,
+                                 gboolean                           no_deploy,
+                                 gboolean                           no_pull,
+                                 const gchar * const               *sideload_repos,
+                                 EuuFlatpakTransactionProgressFunc  progress_func,
+                                 gpointer                           progress_data,
+                                 GCancellable                      *cancellable,
+                                 GError                           **error)
 {
   g_autoptr(FlatpakTransaction) transaction = NULL;
 
@@ -2600,6 +3811,7 @@ euu_flatpak_transaction_install (FlatpakInstallation *installation,
   flatpak_transaction_set_no_interaction (transaction, TRUE);
   flatpak_transaction_set_no_deploy (transaction, no_deploy);
   flatpak_transaction_set_no_pull (transaction, no_pull);
+  transaction_add_sideload_repos (transaction, sideload_repos);
 
   if (!flatpak_transaction_add_install (transaction,
                                         remote,
@@ -2608,17 +3820,21 @@ euu_flatpak_transaction_install (FlatpakInstallation *installation,
                                         error))
     return FALSE;
 
-  return transaction_run_single_op (transaction, cancellable, error);
+  return transaction_run_single_op (transaction, progress_func, progress_data,
+                                    cancellable, error);
 }
 
 gboolean
-euu_flatpak_transaction_update (FlatpakInstallation *installation,
-                                const gchar         *formatted_ref,
-                                gboolean             no_deploy,
-                                gboolean             no_pull,
-                                gboolean             no_prune,
-                                GCancellable        *cancellable,
-                                GError              **error)
+euu_flatpak_transaction_update (FlatpakInstallation               *installation,
+                                const gchar                       *formatted_ref,
+                                gboolean                           no_deploy,
+                                gboolean                           no_pull,
+                                gboolean                           no_prune,
+                                const gchar * const               *sideload_repos,
+                                EuuFlatpakTransactionProgressFunc  progress_func,
+                                gpointer                           progress_data,
+                                GCancellable                      *cancellable,
+                                GError                           **error)
 {
   g_autoptr(FlatpakTransaction) transaction = NULL;
 
@@ -2636,6 +3852,7 @@ euu_flatpak_transaction_update (FlatpakInstallation *installation,
   flatpak_transaction_set_no_deploy (transaction, no_deploy);
   flatpak_transaction_set_no_pull (transaction, no_pull);
   flatpak_transaction_set_disable_prune (transaction, no_prune);
+  transaction_add_sideload_repos (transaction, sideload_repos);
 
   if (!flatpak_transaction_add_update (transaction,
                                        formatted_ref,
@@ -2644,7 +3861,8 @@ euu_flatpak_transaction_update (FlatpakInstallation *installation,
                                        error))
     return FALSE;
 
-  return transaction_run_single_op (transaction, cancellable, error);
+  return transaction_run_single_op (transaction, progress_func, progress_data,
+                                    cancellable, error);
 }
 
 gboolean
@@ -2671,5 +3889,5 @@ euu_flatpak_transaction_uninstall (FlatpakInstallation *installation,
   if (!flatpak_transaction_add_uninstall (transaction, formatted_ref, error))
     return FALSE;
 
-  return transaction_run_single_op (transaction, cancellable, error);
+  return transaction_run_single_op (transaction, NULL, NULL, cancellable, error);
 }
@@ -116,22 +116,31 @@ void euu_flatpak_remote_ref_actions_file_free (EuuFlatpakRemoteRefActionsFile *f
 
 G_DEFINE_AUTOPTR_CLEANUP_FUNC (EuuFlatpakRemoteRefActionsFile, euu_flatpak_remote_ref_actions_file_free)
 
-GPtrArray *euu_flatpak_ref_actions_from_file (GFile         *file,
-                                              GPtrArray    **out_skipped_actions,
-                                              GCancellable  *cancellable,
-                                              GError       **error);
+typedef struct _EuuFlatpakFilterContext EuuFlatpakFilterContext;
+
+EuuFlatpakFilterContext *euu_flatpak_filter_context_new (void);
+void euu_flatpak_filter_context_free (EuuFlatpakFilterContext *context);
+
+G_DEFINE_AUTOPTR_CLEANUP_FUNC (EuuFlatpakFilterContext, euu_flatpak_filter_context_free)
+
+GPtrArray *euu_flatpak_ref_actions_from_file (GFile                    *file,
+                                              EuuFlatpakFilterContext  *filter_context,
+                                              GPtrArray               **out_skipped_actions,
+                                              GCancellable             *cancellable,
+                                              GError                  **error);
 GPtrArray *euu_flatpak_ref_actions_from_data (const gchar   *data,
                                               gssize         length,
                                               const gchar   *path,
                                               GPtrArray    **out_skipped_actions,
                                               GCancellable  *cancellable,
                                               GError       **error);
-gboolean euu_flatpak_ref_actions_append_from_directory (GFile         *directory,
-                                                        GHashTable    *ref_actions,
-                                                        gint           priority,
-                                                        gboolean       allow_noent,
-                                                        GCancellable  *cancellable,
-                                                        GError       **error);
+gboolean euu_flatpak_ref_actions_append_from_directory (GFile                    *directory,
+                                                        EuuFlatpakFilterContext  *filter_context,
+                                                        GHashTable               *ref_actions,
+                                                        gint                      priority,
+                                                        gboolean                  allow_noent,
+                                                        GCancellable             *cancellable,
+                                                        GError                  **error);
 GHashTable *euu_flatpak_ref_actions_from_directory (GFile         *directory,
                                                     gint           priority,
                                                     GCancellable  *cancellable,
@@ -145,6 +154,9 @@ GHashTable *euu_filter_for_existing_flatpak_ref_actions (GHashTable *ref_actions
                                                          GHashTable *progresses);
 GHashTable *euu_squash_remote_ref_actions (GHashTable *ref_actions_table);
 GPtrArray *euu_flatten_flatpak_ref_actions_table (GHashTable *ref_actions_table);
+GHashTable *euu_flatpak_installed_ref_index_new (FlatpakInstallation  *installation,
+                                                 GCancellable         *cancellable,
+                                                 GError              **error);
 GPtrArray * euu_add_dependency_ref_actions_for_installation (FlatpakInstallation  *installation,
                                                              GPtrArray            *ref_actions,
                                                              GCancellable         *cancellable,
@@ -160,11 +172,16 @@ gchar *euu_lookup_flatpak_remote_for_collection_id (FlatpakInstallation  *instal
                                                     GError              **error);
 
 const gchar *euu_pending_flatpak_deployments_state_path (void);
+gchar *euu_flatpak_progress_journal_path (const gchar *counter_path);
+gboolean euu_flatpak_progress_journal_replay (const gchar  *counter_path,
+                                              GKeyFile     *counter_keyfile,
+                                              GError      **error);
 const gchar *euu_flatpak_autoinstall_override_paths (void);
 const gchar *euu_get_system_architecture_string (void);
 
-GHashTable *euu_flatpak_ref_actions_from_paths (GStrv    directories_to_search,
-                                                GError **error);
+GHashTable *euu_flatpak_ref_actions_from_paths (GStrv      directories_to_search,
+                                                gboolean   update_cache,
+                                                GError   **error);
 GPtrArray *euu_flattened_flatpak_ref_actions_from_paths (GStrv    directories_to_search,
                                                          GError **error);
 GHashTable *euu_flatpak_ref_actions_from_ostree_commit (OstreeRepo    *repo,
@@ -178,21 +195,40 @@ FlatpakInstallation *eos_updater_get_flatpak_installation (GCancellable  *cancel
 guint euu_flatpak_ref_hash (gconstpointer ref);
 gboolean euu_flatpak_ref_equal (gconstpointer a, gconstpointer b);
 
-gboolean euu_flatpak_transaction_install (FlatpakInstallation *installation,
-                                          const gchar         *remote,
-                                          const gchar         *formatted_ref,
-                                          gboolean             no_deploy,
-                                          gboolean             no_pull,
-                                          GCancellable        *cancellable,
-                                          GError              **error);
-
-gboolean euu_flatpak_transaction_update (FlatpakInstallation *installation,
-                                         const gchar         *formatted_ref,
-                                         gboolean             no_deploy,
-                                         gboolean             no_pull,
-                                         gboolean             no_prune,
-                                         GCancellable        *cancellable,
-                                         GError              **error);
+/**
+ * EuuFlatpakTransactionProgressFunc:
+ * @bytes_transferred: total bytes downloaded so far by all the operations in
+ *    the transaction
+ * @user_data: user data passed to the transaction function
+ *
+ * Progress callback for euu_flatpak_transaction_install() and
+ * euu_flatpak_transaction_update(). It is called in the thread which is
+ * running the transaction.
+ */
+typedef void (*EuuFlatpakTransactionProgressFunc) (guint64  bytes_transferred,
+                                                   gpointer user_data);
+
+gboolean euu_flatpak_transaction_install (FlatpakInstallation               *installation,
+                                          const gchar                       *remote,
+                                          const gchar                       *formatted_ref,
+                                          gboolean                           no_deploy,
+                                          gboolean                           no_pull,
+                                          const gchar * const               *sideload_repos,
+                                          EuuFlatpakTransactionProgressFunc  progress_func,
+                                          gpointer                           progress_data,
+                                          GCancellable                      *cancellable,
+                                          GError                           **error);
+
+gboolean euu_flatpak_transaction_update (FlatpakInstallation               *installation,
+                                         const gchar                       *formatted_ref,
+                                         gboolean                           no_deploy,
+                                         gboolean                           no_pull,
+                                         gboolean                           no_prune,
+                                         const gchar * const               *sideload_repos,
+                                         EuuFlatpakTransactionProgressFunc  progress_func,
+                                         gpointer                           progress_data,
+                                         GCancellable                      *cancellable,
+                                         GError                           **error);
 
 gboolean euu_flatpak_transaction_uninstall (FlatpakInstallation *installation,
                                             const gchar         *formatted_ref,
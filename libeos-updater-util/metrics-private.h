@@ -44,6 +44,14 @@ static const gchar *const EOS_UPDATER_METRIC_FAILURE = "927d0f61-4890-4912-a513-
  */
 static const gchar *const EOS_UPDATER_METRIC_BRANCH_SELECTED = "99f48aac-b5a0-426d-95f4-18af7d081c4e";
 
+/*
+ * Records that a poll reused the result of the previous poll, as the summary
+ * file of the remote being polled was unchanged. The payload is a 2-tuple of
+ * the number of bytes the previous full poll downloaded, and the number of
+ * milliseconds saved compared to it (`(tt)`).
+ */
+static const gchar *const EOS_UPDATER_METRIC_POLL_SUMMARY_UNCHANGED = "404902dc-2b1a-4843-8541-f86e85a65abf";
+
 /**
  * euu_get_metrics_enabled:
  *
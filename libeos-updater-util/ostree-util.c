@@ -28,6 +28,7 @@
 #include <libsoup/soup.h>
 #include <ostree.h>
 #include <string.h>
+#include <sys/stat.h>
 
 /**
  * eos_updater_sysroot_get_advertisable_commit:
@@ -248,6 +249,120 @@ eos_updater_get_booted_deployment_from_loaded_sysroot (OstreeSysroot *sysroot,
   return NULL;
 }
 
+/* Snapshot of the default sysroot, shared between all callers of
+ * eos_updater_get_sysroot_snapshot(). libostree bumps the mtime of the
+ * `ostree/deploy` directory whenever it writes out a new set of deployments
+ * (this is what ostree_sysroot_load_if_changed() checks), so the snapshot is
+ * reloaded only if that has changed. A new #OstreeSysroot is loaded each time,
+ * rather than reloading the shared one, so that callers in other threads can
+ * keep using the old snapshot safely. */
+G_LOCK_DEFINE_STATIC (sysroot_snapshot);
+static OstreeSysroot *sysroot_snapshot = NULL;  /* (owned) (nullable) */
+static struct timespec sysroot_snapshot_mtime;
+static guint sysroot_snapshot_n_loads = 0;
+static guint sysroot_snapshot_n_reuses = 0;
+static guint64 sysroot_snapshot_load_time_us = 0;
+
+/**
+ * eos_updater_get_sysroot_snapshot:
+ * @cancellable: a #GCancellable, or %NULL
+ * @error: return location for a #GError
+ *
+ * Get a loaded #OstreeSysroot for the default sysroot. This is shared with
+ * other callers (including in other threads), and is only reloaded from disk
+ * if the set of deployments has changed since it was last loaded.
+ *
+ * The returned sysroot must be treated as read-only: it must not be locked,
+ * reloaded or used to write deployments. Use a new #OstreeSysroot for that.
+ *
+ * Returns: (transfer full): a loaded sysroot
+ */
+OstreeSysroot *
+eos_updater_get_sysroot_snapshot (GCancellable  *cancellable,
+                                  GError       **error)
+{
+  g_autoptr(OstreeSysroot) sysroot = ostree_sysroot_new_default ();
+  g_autoptr(GFile) deploy_dir = NULL;
+  g_autofree gchar *deploy_path = NULL;
+  struct stat stbuf;
+  gboolean have_mtime;
+  gint64 start_time;
+
+  g_return_val_if_fail (cancellable == NULL || G_IS_CANCELLABLE (cancellable), NULL);
+  g_return_val_if_fail (error == NULL || *error == NULL, NULL);
+
+  deploy_dir = g_file_resolve_relative_path (ostree_sysroot_get_path (sysroot),
+                                             "ostree/deploy");
+  deploy_path = g_file_get_path (deploy_dir);
+  have_mtime = (stat (deploy_path, &stbuf) == 0);
+
+  G_LOCK (sysroot_snapshot);
+  if (sysroot_snapshot != NULL && have_mtime &&
+      sysroot_snapshot_mtime.tv_sec == stbuf.st_mtim.tv_sec &&
+      sysroot_snapshot_mtime.tv_nsec == stbuf.st_mtim.tv_nsec)
+    {
+      OstreeSysroot *snapshot = g_object_ref (sysroot_snapshot);
+
+      sysroot_snapshot_n_reuses++;
+      G_UNLOCK (sysroot_snapshot);
+
+      return snapshot;
+    }
+  G_UNLOCK (sysroot_snapshot);
+
+  /* If the deployments change between the stat() and the load, the snapshot
+   * will be newer than the mtime it’s stored with, so will just be reloaded
+   * again next time. */
+  start_time = g_get_monotonic_time ();
+
+  if (!ostree_sysroot_load (sysroot, cancellable, error))
+    return NULL;
+
+  G_LOCK (sysroot_snapshot);
+  sysroot_snapshot_n_loads++;
+  sysroot_snapshot_load_time_us += (guint64) (g_get_monotonic_time () - start_time);
+
+  if (have_mtime)
+    {
+      g_set_object (&sysroot_snapshot, sysroot);
+      sysroot_snapshot_mtime = stbuf.st_mtim;
+    }
+  else
+    {
+      g_clear_object (&sysroot_snapshot);
+    }
+  G_UNLOCK (sysroot_snapshot);
+
+  return g_steal_pointer (&sysroot);
+}
+
+/**
+ * eos_updater_get_sysroot_snapshot_stats:
+ * @out_n_loads: (out) (optional): return location for the number of times the
+ *    sysroot has been loaded from disk
+ * @out_n_reuses: (out) (optional): return location for the number of times
+ *    the snapshot has been reused rather than loading the sysroot again
+ * @out_load_time_us: (out) (optional): return location for the total time
+ *    spent loading the sysroot, in microseconds
+ *
+ * Get statistics about eos_updater_get_sysroot_snapshot(), for reporting how
+ * much loading work the snapshot has saved.
+ */
+void
+eos_updater_get_sysroot_snapshot_stats (guint   *out_n_loads,
+                                        guint   *out_n_reuses,
+                                        guint64 *out_load_time_us)
+{
+  G_LOCK (sysroot_snapshot);
+  if (out_n_loads != NULL)
+    *out_n_loads = sysroot_snapshot_n_loads;
+  if (out_n_reuses != NULL)
+    *out_n_reuses = sysroot_snapshot_n_reuses;
+  if (out_load_time_us != NULL)
+    *out_load_time_us = sysroot_snapshot_load_time_us;
+  G_UNLOCK (sysroot_snapshot);
+}
+
 /**
  * eos_updater_get_booted_deployment:
  * @error:
@@ -257,9 +372,10 @@ eos_updater_get_booted_deployment_from_loaded_sysroot (OstreeSysroot *sysroot,
 OstreeDeployment *
 eos_updater_get_booted_deployment (GError **error)
 {
-  g_autoptr(OstreeSysroot) sysroot = ostree_sysroot_new_default ();
+  g_autoptr(OstreeSysroot) sysroot = NULL;
 
-  if (!ostree_sysroot_load (sysroot, NULL, error))
+  sysroot = eos_updater_get_sysroot_snapshot (NULL, error);
+  if (sysroot == NULL)
     return NULL;
 
   return eos_updater_get_booted_deployment_from_loaded_sysroot (sysroot, error);
@@ -40,6 +40,12 @@ OstreeRepo *eos_updater_local_repo (GError **error);
 OstreeDeployment *eos_updater_get_booted_deployment_from_loaded_sysroot (OstreeSysroot *sysroot,
                                                                          GError **error);
 
+OstreeSysroot *eos_updater_get_sysroot_snapshot (GCancellable  *cancellable,
+                                                 GError       **error);
+void eos_updater_get_sysroot_snapshot_stats (guint   *out_n_loads,
+                                             guint   *out_n_reuses,
+                                             guint64 *out_load_time_us);
+
 OstreeDeployment *eos_updater_get_booted_deployment (GError **error);
 
 gchar *eos_updater_get_booted_checksum (GError **error);
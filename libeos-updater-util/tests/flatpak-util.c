@@ -25,9 +25,11 @@
 
 #include <flatpak.h>
 #include <glib.h>
+#include <glib/gstdio.h>
 #include <libeos-updater-util/flatpak-util.h>
 #include <libeos-updater-util/types.h>
 #include <locale.h>
+#include <sys/resource.h>
 
 static guint n_warnings = 0;
 
@@ -445,6 +447,191 @@ test_compression_preserves_order (void)
                    EUU_FLATPAK_REMOTE_REF_ACTION_UNINSTALL);
 }
 
+/* The large tests check that the code scales linearly with the size of its
+ * input. By default they use inputs which are quick to process; if run with
+ * `-m perf`, they use larger inputs and report the time and memory taken.
+ * Return @perf_size or @default_size accordingly. */
+static gsize
+large_test_size (gsize default_size,
+                 gsize perf_size)
+{
+  return g_test_perf () ? perf_size : default_size;
+}
+
+/* Report that a large test processed @n_items (described by @items) in
+ * @elapsed seconds, and the peak resident set size of the process so far.
+ * The peak only ever increases, so to measure the memory used by one test, run
+ * it on its own with `-p`. */
+static void
+large_test_report (const gchar *verb,
+                   gsize        n_items,
+                   const gchar *items,
+                   gdouble      elapsed)
+{
+  struct rusage usage;
+
+  g_test_minimized_result (elapsed, "%s %" G_GSIZE_FORMAT " %s in %.3fs",
+                           verb, n_items, items, elapsed);
+
+  /* ru_maxrss is in KiB on Linux. */
+  g_assert_cmpint (getrusage (RUSAGE_SELF, &usage), ==, 0);
+  g_test_minimized_result ((gdouble) usage.ru_maxrss, "Peak RSS %ld KiB",
+                           (long) usage.ru_maxrss);
+}
+
+/* The environment variables set by large_test_env_set(), with their previous
+ * values. */
+typedef struct
+{
+  gchar *old_env_arch;  /* (owned) (nullable) */
+  gchar *old_env_locales;  /* (owned) (nullable) */
+  gchar *old_env_state;  /* (owned) (nullable) */
+} LargeTestEnv;
+
+/* Override the architecture to @arch and, if @locales is non-%NULL, the
+ * locales to @locales (semicolon-separated). If @state_path is non-%NULL, the
+ * flatpak installer’s progress file (and hence the autoinstall cache) is put
+ * there. The previous values are stored in @env, to be put back by
+ * large_test_env_restore(). */
+static void
+large_test_env_set (LargeTestEnv *env,
+                    const gchar  *arch,
+                    const gchar  *locales,
+                    const gchar  *state_path)
+{
+  env->old_env_arch = g_strdup (g_getenv ("EOS_UPDATER_TEST_OVERRIDE_ARCHITECTURE"));
+  env->old_env_locales = g_strdup (g_getenv ("EOS_UPDATER_TEST_UPDATER_OVERRIDE_LOCALES"));
+  env->old_env_state = g_strdup (g_getenv ("EOS_UPDATER_TEST_UPDATER_FLATPAK_UPGRADE_STATE_DIR"));
+
+  g_setenv ("EOS_UPDATER_TEST_OVERRIDE_ARCHITECTURE", arch, TRUE);
+  if (locales != NULL)
+    g_setenv ("EOS_UPDATER_TEST_UPDATER_OVERRIDE_LOCALES", locales, TRUE);
+  if (state_path != NULL)
+    g_setenv ("EOS_UPDATER_TEST_UPDATER_FLATPAK_UPGRADE_STATE_DIR", state_path, TRUE);
+}
+
+static void
+large_test_env_restore (LargeTestEnv *env)
+{
+  if (env->old_env_arch != NULL)
+    g_setenv ("EOS_UPDATER_TEST_OVERRIDE_ARCHITECTURE", env->old_env_arch, TRUE);
+  else
+    g_unsetenv ("EOS_UPDATER_TEST_OVERRIDE_ARCHITECTURE");
+  if (env->old_env_locales != NULL)
+    g_setenv ("EOS_UPDATER_TEST_UPDATER_OVERRIDE_LOCALES", env->old_env_locales, TRUE);
+  else
+    g_unsetenv ("EOS_UPDATER_TEST_UPDATER_OVERRIDE_LOCALES");
+  if (env->old_env_state != NULL)
+    g_setenv ("EOS_UPDATER_TEST_UPDATER_FLATPAK_UPGRADE_STATE_DIR", env->old_env_state, TRUE);
+  else
+    g_unsetenv ("EOS_UPDATER_TEST_UPDATER_FLATPAK_UPGRADE_STATE_DIR");
+
+  g_clear_pointer (&env->old_env_arch, g_free);
+  g_clear_pointer (&env->old_env_locales, g_free);
+  g_clear_pointer (&env->old_env_state, g_free);
+}
+
+/* Generate the contents of an autoinstall file with @n_entries entries, the
+ * ith of which installs `org.example.App<name_prefix><i>` with serial i + 1.
+ * If @n_entry_filters is non-zero, the ith entry has the filters
+ * `entry_filters[i % n_entry_filters]` (a comma-separated list of JSON
+ * members). */
+static GString *
+large_test_autoinstall_data (const gchar         *name_prefix,
+                             gsize                n_entries,
+                             const gchar * const *entry_filters,
+                             gsize                n_entry_filters)
+{
+  g_autoptr(GString) data = g_string_new ("[");
+  gsize i;
+
+  for (i = 0; i < n_entries; i++)
+    {
+      g_string_append_printf (data,
+                              "%s{ 'action': 'install', 'serial': %" G_GSIZE_FORMAT ", "
+                              "'ref-kind': 'app', 'name': 'org.example.App%s%" G_GSIZE_FORMAT "', "
+                              "'collection-id': 'org.example.Apps', 'remote': 'example-apps', "
+                              "'branch': 'stable'",
+                              (i > 0) ? ", " : "", i + 1, name_prefix, i);
+      if (n_entry_filters > 0)
+        g_string_append_printf (data, ", 'filters': { %s }",
+                                entry_filters[i % n_entry_filters]);
+      g_string_append (data, " }");
+    }
+
+  g_string_append (data, "]");
+
+  return g_steal_pointer (&data);
+}
+
+/* Test that a large table of actions, with many actions on each ref spread
+ * across several files, is squashed correctly. */
+static void
+test_compression_large (void)
+{
+  gsize n_refs = large_test_size (5000, 50000);
+  const gsize n_files = 10;
+  g_autoptr(GPtrArray) app_ids = g_ptr_array_new_with_free_func (g_free);
+  g_autofree FlatpakToInstallEntry *entries = g_new0 (FlatpakToInstallEntry, n_refs * n_files);
+  g_autofree FlatpakToInstallFile *files = g_new0 (FlatpakToInstallFile, n_files);
+  g_autoptr(GPtrArray) file_names = g_ptr_array_new_with_free_func (g_free);
+  FlatpakToInstallDirectory directory = { files, n_files };
+  g_autoptr(GHashTable) uncompressed_ref_actions_table = NULL;
+  g_autoptr(GPtrArray) flattened_actions_list = NULL;
+  gsize i, j, n_uninstalls = 0;
+  gdouble elapsed;
+
+  for (i = 0; i < n_refs; i++)
+    g_ptr_array_add (app_ids, g_strdup_printf ("org.test.App%" G_GSIZE_FORMAT, i));
+
+  /* Every file acts on every ref. The last file (in lexicographical order)
+   * uninstalls every other ref, which should take priority over the
+   * installs in the other files. */
+  for (i = 0; i < n_files; i++)
+    {
+      FlatpakToInstallEntry *file_entries = entries + i * n_refs;
+
+      g_ptr_array_add (file_names, g_strdup_printf ("autoinstall%02" G_GSIZE_FORMAT, i));
+
+      for (j = 0; j < n_refs; j++)
+        {
+          gboolean uninstall = (i == n_files - 1 && j % 2 == 0);
+
+          file_entries[j].type = uninstall ? EUU_FLATPAK_REMOTE_REF_ACTION_UNINSTALL : EUU_FLATPAK_REMOTE_REF_ACTION_INSTALL;
+          file_entries[j].kind = FLATPAK_REF_KIND_APP;
+          file_entries[j].app_id = g_ptr_array_index (app_ids, (i + j) % n_refs);
+          file_entries[j].branch = "stable";
+          file_entries[j].serial = j + 1;
+          file_entries[j].flags = 0;
+        }
+
+      files[i].name = g_ptr_array_index (file_names, i);
+      files[i].entries = file_entries;
+      files[i].n_entries = n_refs;
+    }
+
+  uncompressed_ref_actions_table = flatpak_to_install_directory_to_hash_table (&directory);
+
+  g_test_timer_start ();
+  flattened_actions_list = euu_flatten_flatpak_ref_actions_table (uncompressed_ref_actions_table);
+  elapsed = g_test_timer_elapsed ();
+
+  g_assert_cmpuint (flattened_actions_list->len, ==, n_refs);
+
+  for (i = 0; i < flattened_actions_list->len; i++)
+    {
+      EuuFlatpakRemoteRefAction *action = g_ptr_array_index (flattened_actions_list, i);
+
+      g_assert_cmpstr (action->source, ==, g_ptr_array_index (file_names, n_files - 1));
+      if (action->type == EUU_FLATPAK_REMOTE_REF_ACTION_UNINSTALL)
+        n_uninstalls++;
+    }
+
+  g_assert_cmpuint (n_uninstalls, ==, (n_refs + 1) / 2);
+
+  large_test_report ("Squashed", n_refs * n_files, "actions", elapsed);
+}
+
 /* Test the autoinstall file parser handles various different constructs (valid
  * and erroneous) in the format, returning success or an error when appropriate. */
 static void
@@ -840,6 +1027,320 @@ test_autoinstall_file_filters (void)
     g_unsetenv ("EOS_UPDATER_TEST_UPDATER_OVERRIDE_LOCALES");
 }
 
+/* Test that a large autoinstall file, with filters on every entry, is parsed
+ * and filtered correctly. The filter context is shared between all the
+ * entries. */
+static void
+test_parse_autoinstall_file_large (void)
+{
+  /* Alternate between entries which are kept and entries which are filtered
+   * out by each of the filters. */
+  const gchar * const entry_filters[] =
+    {
+      "'architecture': ['arch1', 'arch2'], 'locale': ['locale2']",
+      "'architecture': ['arch2']",
+      "'~locale': ['locale1']",
+      "'~architecture': ['arch3'], '~locale': ['locale3']",
+    };
+  const gboolean entry_kept[] = { TRUE, FALSE, FALSE, TRUE };
+  LargeTestEnv env = { NULL, };
+  g_autoptr(GString) data = NULL;
+  g_autoptr(GPtrArray) actions = NULL;
+  g_autoptr(GPtrArray) skipped_actions = NULL;
+  g_autoptr(GError) error = NULL;
+  gsize n_entries = large_test_size (1000, 20000);
+  gsize expected_n_actions = 0;
+  gsize i;
+  gdouble elapsed;
+
+  G_STATIC_ASSERT (G_N_ELEMENTS (entry_filters) == G_N_ELEMENTS (entry_kept));
+
+  large_test_env_set (&env, "arch1", "locale1;locale2", NULL);
+
+  data = large_test_autoinstall_data ("", n_entries,
+                                      entry_filters, G_N_ELEMENTS (entry_filters));
+  for (i = 0; i < n_entries; i++)
+    if (entry_kept[i % G_N_ELEMENTS (entry_kept)])
+      expected_n_actions++;
+
+  g_test_timer_start ();
+  actions = euu_flatpak_ref_actions_from_data (data->str, data->len, "test",
+                                               &skipped_actions, NULL, &error);
+  elapsed = g_test_timer_elapsed ();
+
+  g_assert_no_error (error);
+  g_assert_nonnull (actions);
+  g_assert_cmpuint (actions->len, ==, expected_n_actions);
+  g_assert_nonnull (skipped_actions);
+  g_assert_cmpuint (skipped_actions->len, ==, 0);
+
+  large_test_report ("Parsed", n_entries, "entries", elapsed);
+
+  large_test_env_restore (&env);
+}
+
+/* Test that a directory with many autoinstall files in is loaded correctly.
+ * The files are parsed in parallel, so check the results are merged properly. */
+static void
+test_parse_autoinstall_directory_large (void)
+{
+  LargeTestEnv env = { NULL, };
+  g_autofree gchar *tmp_dir = NULL;
+  g_autoptr(GFile) directory = NULL;
+  g_autoptr(GHashTable) ref_actions = NULL;
+  g_autoptr(GError) error = NULL;
+  gsize n_files = large_test_size (200, 2000);
+  const gsize n_entries_per_file = 20;
+  gsize i;
+  gdouble elapsed;
+
+  large_test_env_set (&env, "arch", NULL, NULL);
+
+  tmp_dir = g_dir_make_tmp ("eos-updater-util-tests-flatpak-XXXXXX", &error);
+  g_assert_no_error (error);
+
+  for (i = 0; i < n_files; i++)
+    {
+      g_autofree gchar *name_prefix = g_strdup_printf ("%" G_GSIZE_FORMAT "_", i);
+      g_autoptr(GString) data = large_test_autoinstall_data (name_prefix, n_entries_per_file,
+                                                             NULL, 0);
+      g_autofree gchar *filename = g_strdup_printf ("%04" G_GSIZE_FORMAT ".json", i);
+      g_autofree gchar *path = g_build_filename (tmp_dir, filename, NULL);
+
+      g_file_set_contents (path, data->str, (gssize) data->len, &error);
+      g_assert_no_error (error);
+    }
+
+  directory = g_file_new_for_path (tmp_dir);
+
+  g_test_timer_start ();
+  ref_actions = euu_flatpak_ref_actions_from_directory (directory, 0, NULL, &error);
+  elapsed = g_test_timer_elapsed ();
+
+  g_assert_no_error (error);
+  g_assert_nonnull (ref_actions);
+  g_assert_cmpuint (g_hash_table_size (ref_actions), ==, n_files);
+
+  for (i = 0; i < n_files; i++)
+    {
+      g_autofree gchar *filename = g_strdup_printf ("%04" G_GSIZE_FORMAT ".json", i);
+      g_autofree gchar *path = g_build_filename (tmp_dir, filename, NULL);
+      g_autofree gchar *expected_ref = g_strdup_printf ("app/org.example.App%" G_GSIZE_FORMAT "_0/arch/stable", i);
+      g_autofree gchar *ref = NULL;
+      EuuFlatpakRemoteRefActionsFile *actions_file = g_hash_table_lookup (ref_actions, filename);
+      const EuuFlatpakRemoteRefAction *action;
+
+      g_assert_nonnull (actions_file);
+      g_assert_cmpint (actions_file->priority, ==, 0);
+      g_assert_cmpuint (actions_file->remote_ref_actions->len, ==, n_entries_per_file);
+
+      /* Check the actions came from the right file. */
+      action = g_ptr_array_index (actions_file->remote_ref_actions, 0);
+      ref = flatpak_ref_format_ref (action->ref->ref);
+      g_assert_cmpstr (ref, ==, expected_ref);
+      g_assert_cmpstr (action->source, ==, filename);
+
+      g_assert_cmpint (g_unlink (path), ==, 0);
+    }
+
+  g_assert_cmpint (g_rmdir (tmp_dir), ==, 0);
+
+  large_test_report ("Loaded", n_files, "files", elapsed);
+
+  large_test_env_restore (&env);
+}
+
+/* Get the number of actions loaded from @filename in @ref_actions, as returned
+ * by euu_flatpak_ref_actions_from_paths(). */
+static guint
+n_actions_for_file (GHashTable  *ref_actions,
+                    const gchar *filename)
+{
+  GPtrArray *actions = g_hash_table_lookup (ref_actions, filename);
+
+  g_assert_nonnull (actions);
+
+  return actions->len;
+}
+
+static guint64
+get_inode (const gchar *path)
+{
+  GStatBuf buf;
+
+  g_assert_cmpint (g_stat (path, &buf), ==, 0);
+
+  return buf.st_ino;
+}
+
+/* Test that the cache of parsed autoinstall files is used when the files are
+ * unchanged, and ignored when the files, the locales or the cache itself
+ * change. */
+static void
+test_autoinstall_file_cache (void)
+{
+  LargeTestEnv env = { NULL, };
+  g_autofree gchar *tmp_dir = NULL;
+  g_autofree gchar *autoinstall_dir = NULL;
+  g_autofree gchar *state_path = NULL;
+  g_autofree gchar *cache_path = NULL;
+  g_autofree gchar *plain_path = NULL;
+  g_autofree gchar *filtered_path = NULL;
+  gchar *directories[] = { NULL, NULL };
+  g_autoptr(GHashTable) ref_actions = NULL;
+  g_autoptr(GError) error = NULL;
+  const EuuFlatpakRemoteRefAction *action;
+  guint64 cache_inode;
+  const gchar *plain_data =
+    "[{ 'action': 'install', 'serial': 2017100100, 'ref-kind': 'app', "
+    "   'name': 'org.example.MyApp', 'collection-id': 'com.endlessm.Apps', "
+    "   'remote': 'eos-apps', 'branch': 'stable' },"
+    " { 'action': 'uninstall', 'serial': 2017100200, 'ref-kind': 'app', "
+    "   'name': 'org.example.OldApp', 'branch': 'stable' }]";
+  const gchar *filtered_data =
+    "[{ 'action': 'install', 'serial': 2017100100, 'ref-kind': 'app', "
+    "   'name': 'org.example.LocaleApp', 'collection-id': 'com.endlessm.Apps', "
+    "   'remote': 'eos-apps', 'branch': 'stable', "
+    "   'filters': { 'locale': ['locale1'] } }]";
+
+  tmp_dir = g_dir_make_tmp ("eos-updater-util-tests-flatpak-XXXXXX", &error);
+  g_assert_no_error (error);
+
+  autoinstall_dir = g_build_filename (tmp_dir, "flatpak-autoinstall.d", NULL);
+  g_assert_cmpint (g_mkdir (autoinstall_dir, 0755), ==, 0);
+  plain_path = g_build_filename (autoinstall_dir, "plain.json", NULL);
+  g_file_set_contents (plain_path, plain_data, -1, &error);
+  g_assert_no_error (error);
+  filtered_path = g_build_filename (autoinstall_dir, "filtered.json", NULL);
+  g_file_set_contents (filtered_path, filtered_data, -1, &error);
+  g_assert_no_error (error);
+
+  /* The cache is stored alongside the progress file. */
+  state_path = g_build_filename (tmp_dir, "flatpak-autoinstall.progress", NULL);
+  cache_path = g_build_filename (tmp_dir, "flatpak-autoinstall.cache", NULL);
+  directories[0] = autoinstall_dir;
+
+  large_test_env_set (&env, "arch", "locale1", state_path);
+
+  /* Loading without updating the cache parses the files, but doesn’t create
+   * the cache. */
+  ref_actions = euu_flatpak_ref_actions_from_paths (directories, FALSE, &error);
+  g_assert_no_error (error);
+  g_assert_cmpuint (n_actions_for_file (ref_actions, "plain.json"), ==, 2);
+  g_assert_cmpuint (n_actions_for_file (ref_actions, "filtered.json"), ==, 1);
+  g_assert_false (g_file_test (cache_path, G_FILE_TEST_EXISTS));
+  g_clear_pointer (&ref_actions, g_hash_table_unref);
+
+  /* The first load which updates the cache creates it. */
+  ref_actions = euu_flatpak_ref_actions_from_paths (directories, TRUE, &error);
+  g_assert_no_error (error);
+  g_assert_cmpuint (n_actions_for_file (ref_actions, "plain.json"), ==, 2);
+  g_assert_cmpuint (n_actions_for_file (ref_actions, "filtered.json"), ==, 1);
+  g_assert_true (g_file_test (cache_path, G_FILE_TEST_EXISTS));
+  cache_inode = get_inode (cache_path);
+  g_clear_pointer (&ref_actions, g_hash_table_unref);
+
+  /* The second load should give the same results from the cache, and not
+   * need to write it out again. */
+  ref_actions = euu_flatpak_ref_actions_from_paths (directories, TRUE, &error);
+  g_assert_no_error (error);
+  g_assert_cmpuint (n_actions_for_file (ref_actions, "plain.json"), ==, 2);
+  g_assert_cmpuint (n_actions_for_file (ref_actions, "filtered.json"), ==, 1);
+  action = g_ptr_array_index ((GPtrArray *) g_hash_table_lookup (ref_actions, "plain.json"), 0);
+  g_assert_cmpstr (action->source, ==, "plain.json");
+  g_assert_cmpuint (get_inode (cache_path), ==, cache_inode);
+  g_clear_pointer (&ref_actions, g_hash_table_unref);
+
+  /* Changing the locales invalidates the entry for the file with filters. */
+  g_setenv ("EOS_UPDATER_TEST_UPDATER_OVERRIDE_LOCALES", "locale2", TRUE);
+
+  ref_actions = euu_flatpak_ref_actions_from_paths (directories, TRUE, &error);
+  g_assert_no_error (error);
+  g_assert_cmpuint (n_actions_for_file (ref_actions, "plain.json"), ==, 2);
+  g_assert_cmpuint (n_actions_for_file (ref_actions, "filtered.json"), ==, 0);
+  g_clear_pointer (&ref_actions, g_hash_table_unref);
+
+  /* Changing a file invalidates its entry. */
+  g_file_set_contents (plain_path, "[]", -1, &error);
+  g_assert_no_error (error);
+
+  ref_actions = euu_flatpak_ref_actions_from_paths (directories, TRUE, &error);
+  g_assert_no_error (error);
+  g_assert_cmpuint (n_actions_for_file (ref_actions, "plain.json"), ==, 0);
+  g_assert_cmpuint (n_actions_for_file (ref_actions, "filtered.json"), ==, 0);
+  g_clear_pointer (&ref_actions, g_hash_table_unref);
+
+  /* A corrupt cache is ignored and replaced. */
+  g_file_set_contents (cache_path, "not a cache", -1, &error);
+  g_assert_no_error (error);
+  g_setenv ("EOS_UPDATER_TEST_UPDATER_OVERRIDE_LOCALES", "locale1", TRUE);
+
+  ref_actions = euu_flatpak_ref_actions_from_paths (directories, TRUE, &error);
+  g_assert_no_error (error);
+  g_assert_cmpuint (n_actions_for_file (ref_actions, "plain.json"), ==, 0);
+  g_assert_cmpuint (n_actions_for_file (ref_actions, "filtered.json"), ==, 1);
+  g_clear_pointer (&ref_actions, g_hash_table_unref);
+
+  g_assert_cmpint (g_unlink (cache_path), ==, 0);
+  g_assert_cmpint (g_unlink (filtered_path), ==, 0);
+  g_assert_cmpint (g_unlink (plain_path), ==, 0);
+  g_assert_cmpint (g_rmdir (autoinstall_dir), ==, 0);
+  g_assert_cmpint (g_rmdir (tmp_dir), ==, 0);
+
+  large_test_env_restore (&env);
+}
+
+/* Test that replaying a progress journal only ever increases the progress in
+ * the counter file, and ignores malformed and truncated records. */
+static void
+test_progress_journal_replay (void)
+{
+  g_autofree gchar *tmp_dir = NULL;
+  g_autofree gchar *counter_path = NULL;
+  g_autofree gchar *journal_path = NULL;
+  g_autoptr(GKeyFile) counter_keyfile = g_key_file_new ();
+  g_auto(GStrv) groups = NULL;
+  g_autoptr(GError) error = NULL;
+  const gchar *journal_data =
+    "5 first.json\n"
+    "3 second.json\n"
+    "not-a-serial third.json\n"
+    "9\n"
+    "7 third.json\n"
+    "8 first.js";  /* truncated by a crash */
+
+  tmp_dir = g_dir_make_tmp ("eos-updater-util-tests-progress-journal-XXXXXX", &error);
+  g_assert_no_error (error);
+  counter_path = g_build_filename (tmp_dir, "flatpak-autoinstall.progress", NULL);
+  journal_path = euu_flatpak_progress_journal_path (counter_path);
+
+  /* A missing journal is not an error. */
+  euu_flatpak_progress_journal_replay (counter_path, counter_keyfile, &error);
+  g_assert_no_error (error);
+  groups = g_key_file_get_groups (counter_keyfile, NULL);
+  g_assert_cmpuint (g_strv_length (groups), ==, 0);
+
+  g_file_set_contents (journal_path, journal_data, -1, &error);
+  g_assert_no_error (error);
+
+  g_key_file_set_int64 (counter_keyfile, "first.json", "Progress", 2);
+  g_key_file_set_int64 (counter_keyfile, "second.json", "Progress", 4);
+
+  /* Replaying twice should have the same result as replaying once. */
+  euu_flatpak_progress_journal_replay (counter_path, counter_keyfile, &error);
+  g_assert_no_error (error);
+  euu_flatpak_progress_journal_replay (counter_path, counter_keyfile, &error);
+  g_assert_no_error (error);
+
+  g_assert_cmpint (g_key_file_get_int64 (counter_keyfile, "first.json", "Progress", NULL), ==, 5);
+  g_assert_cmpint (g_key_file_get_int64 (counter_keyfile, "second.json", "Progress", NULL), ==, 4);
+  g_assert_cmpint (g_key_file_get_int64 (counter_keyfile, "third.json", "Progress", NULL), ==, 7);
+  g_assert_false (g_key_file_has_group (counter_keyfile, "first.js"));
+
+  g_assert_cmpint (g_unlink (journal_path), ==, 0);
+  g_assert_cmpint (g_rmdir (tmp_dir), ==, 0);
+}
+
 int
 main (int   argc,
       char *argv[])
@@ -877,12 +1378,22 @@ main (int   argc,
               test_uninstall_dependency_action_ordered_before_source);
   g_test_add_func ("/flatpak/compress/preserves-order",
               test_compression_preserves_order);
+  g_test_add_func ("/flatpak/compress/large",
+              test_compression_large);
   g_test_add_func ("/flatpak/parse-autoinstall-file",
                    test_parse_autoinstall_file);
   g_test_add_func ("/flatpak/parse-autoinstall-file/unsorted",
                    test_parse_autoinstall_file_unsorted);
+  g_test_add_func ("/flatpak/parse-autoinstall-file/large",
+                   test_parse_autoinstall_file_large);
+  g_test_add_func ("/flatpak/parse-autoinstall-directory/large",
+                   test_parse_autoinstall_directory_large);
   g_test_add_func ("/flatpak/autoinstall-file-filters",
                    test_autoinstall_file_filters);
+  g_test_add_func ("/flatpak/autoinstall-file-cache",
+                   test_autoinstall_file_cache);
+  g_test_add_func ("/flatpak/progress-journal/replay",
+                   test_progress_journal_replay);
 
   gint status = g_test_run ();
 
@@ -96,12 +96,17 @@ typedef enum {
  *                                to keep installed flatpaks up to date with
  *                                their system without having to use the
  *                                regular updater.
+ * @EU_INSTALLER_FLAGS_DEFER_NON_CRITICAL: Only perform the actions which are
+ *                                         needed before the system finishes
+ *                                         booting; leave installs and updates
+ *                                         of apps to a later run.
  *
  * Flags to change the behaviour of the flatpak-instasller.
  */
 typedef enum {
   EU_INSTALLER_FLAGS_NONE = 0,
-  EU_INSTALLER_FLAGS_ALSO_PULL = (1 << 0)
+  EU_INSTALLER_FLAGS_ALSO_PULL = (1 << 0),
+  EU_INSTALLER_FLAGS_DEFER_NON_CRITICAL = (1 << 1),
 } EosUpdaterInstallerFlags;
 
 G_END_DECLS
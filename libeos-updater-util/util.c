@@ -43,6 +43,17 @@ eos_updater_get_envvar_or (const gchar *envvar,
   return default_value;
 }
 
+/* Build the path to @file_name in the directory where eos-updater keeps its
+ * state, which can be overridden for the tests. */
+gchar *
+eos_updater_get_state_file_path (const gchar *file_name)
+{
+  const gchar *state_dir = eos_updater_get_envvar_or ("EOS_UPDATER_TEST_UPDATER_STATE_DIR",
+                                                      LOCALSTATEDIR "/lib/eos-updater");
+
+  return g_build_filename (state_dir, file_name, NULL);
+}
+
 gboolean
 eos_updater_read_file_to_bytes (GFile *file,
                                 GCancellable *cancellable,
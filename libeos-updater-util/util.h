@@ -45,6 +45,8 @@ G_DEFINE_AUTO_CLEANUP_FREE_FUNC(EuuBusNameID, g_bus_unown_name, 0)
 const gchar *eos_updater_get_envvar_or (const gchar *envvar,
                                         const gchar *default_value);
 
+gchar *eos_updater_get_state_file_path (const gchar *file_name);
+
 gboolean eos_updater_read_file_to_bytes (GFile *file,
                                          GCancellable *cancellable,
                                          GBytes **out_bytes,
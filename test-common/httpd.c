@@ -32,6 +32,9 @@ typedef struct {
   GMainContext *context;  /* (owned) */
   gint          running;
   gchar        *url;  /* (owned) */
+
+  GMutex        requests_lock;
+  GPtrArray    *requests;  /* (owned) (element-type utf8) (locked-by requests_lock) */
 } HttpdData;
 
 struct _Httpd {
@@ -45,6 +48,8 @@ httpd_data_new (GFile *root)
   HttpdData *data = g_new0 (HttpdData, 1);
   data->root = g_object_ref (root);
   data->context = g_main_context_new ();
+  g_mutex_init (&data->requests_lock);
+  data->requests = g_ptr_array_new_with_free_func (g_free);
   return data;
 }
 
@@ -54,6 +59,8 @@ httpd_data_free (HttpdData *data)
   g_clear_object (&data->root);
   g_clear_pointer (&data->context, g_main_context_unref);
   g_clear_pointer (&data->url, g_free);
+  g_clear_pointer (&data->requests, g_ptr_array_unref);
+  g_mutex_clear (&data->requests_lock);
   g_free (data);
 }
 
@@ -80,7 +87,8 @@ httpd_handler (SoupServer        *server,
                SoupClientContext *client,
                gpointer           user_data)
 {
-  GFile *root = G_FILE (user_data);
+  HttpdData *data = user_data;
+  GFile *root = data->root;
   g_autoptr(GFile) child = NULL;
   g_autoptr(GFileInfo) info = NULL;
   g_autoptr(GError) error = NULL;
@@ -105,6 +113,10 @@ httpd_handler (SoupServer        *server,
   while (path[0] == '/')
     path++;
 
+  g_mutex_lock (&data->requests_lock);
+  g_ptr_array_add (data->requests, g_strdup (path));
+  g_mutex_unlock (&data->requests_lock);
+
   child = g_file_get_child (root, path);
   if (!g_file_equal (child, root) && !g_file_has_prefix (child, root))
     {
@@ -232,7 +244,7 @@ httpd_thread (gpointer thread_data)
   g_autoptr(GError) error = NULL;
 
   server = soup_server_new (NULL, NULL);
-  soup_server_add_handler (server, NULL, httpd_handler, data->root, NULL);
+  soup_server_add_handler (server, NULL, httpd_handler, data, NULL);
   if (!soup_server_listen_local (server, 0, 0, &error))
     {
       g_prefix_error_literal (&error, "HTTP server could not listen for connections: ");
@@ -336,3 +348,36 @@ httpd_get_url (Httpd *httpd)
 {
   return g_atomic_pointer_get (&httpd->data->url);
 }
+
+/* Forget the paths of all the requests received so far, so that
+ * httpd_count_requests() only counts requests made after this call. */
+void
+httpd_clear_requests (Httpd *httpd)
+{
+  g_mutex_lock (&httpd->data->requests_lock);
+  g_ptr_array_set_size (httpd->data->requests, 0);
+  g_mutex_unlock (&httpd->data->requests_lock);
+}
+
+/* Count the GET and HEAD requests received for paths ending in @suffix, such
+ * as `.commit`, since the server was started or httpd_clear_requests() was
+ * last called. */
+guint
+httpd_count_requests (Httpd       *httpd,
+                      const gchar *suffix)
+{
+  guint count = 0;
+  gsize i;
+
+  g_mutex_lock (&httpd->data->requests_lock);
+  for (i = 0; i < httpd->data->requests->len; i++)
+    {
+      const gchar *path = g_ptr_array_index (httpd->data->requests, i);
+
+      if (g_str_has_suffix (path, suffix))
+        count++;
+    }
+  g_mutex_unlock (&httpd->data->requests_lock);
+
+  return count;
+}
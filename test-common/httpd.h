@@ -40,6 +40,10 @@ gboolean httpd_stop (Httpd   *httpd,
 
 const gchar *httpd_get_url (Httpd *httpd);
 
+void httpd_clear_requests (Httpd *httpd);
+guint httpd_count_requests (Httpd       *httpd,
+                            const gchar *suffix);
+
 G_DEFINE_AUTOPTR_CLEANUP_FUNC (Httpd, httpd_free)
 
 G_END_DECLS
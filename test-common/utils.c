@@ -1037,6 +1037,23 @@ eos_test_subserver_update (EosTestSubserver *subserver,
   return update_commits (subserver, error);
 }
 
+/* Remove the static deltas from @subserver’s repository, and regenerate its
+ * summary so it doesn’t list them. Clients will then have to pull the
+ * objects in each commit. */
+gboolean
+eos_test_subserver_remove_static_deltas (EosTestSubserver  *subserver,
+                                         GError           **error)
+{
+  g_autoptr(GFile) deltas_dir = g_file_get_child (subserver->repo, "deltas");
+  g_autoptr(GFile) delta_indexes_dir = g_file_get_child (subserver->repo, "delta-indexes");
+
+  if (!eos_updater_remove_recursive (deltas_dir, NULL, error) ||
+      !eos_updater_remove_recursive (delta_indexes_dir, NULL, error))
+    return FALSE;
+
+  return eos_test_subserver_update (subserver, error);
+}
+
 /**
  * EosTestServer:
  *
@@ -1256,6 +1273,7 @@ eos_test_client_finalize (GObject *object)
   g_free (self->cpuinfo);
   g_free (self->cmdline);
   g_free (self->uname_machine);
+  g_free (self->volume_repo_uris);
 
   G_OBJECT_CLASS (eos_test_client_parent_class)->finalize (object);
 }
@@ -1484,7 +1502,8 @@ get_updater_dir_for_client (GFile *client_root)
 static GKeyFile *
 get_updater_config (DownloadSource *order,
                     gsize           n_sources,
-                    GPtrArray      *override_uris)
+                    GPtrArray      *override_uris,
+                    guint           flatpak_pull_concurrency)
 {
   g_autoptr(GKeyFile) config = NULL;
   gsize idx;
@@ -1507,6 +1526,10 @@ get_updater_config (DownloadSource *order,
                               (const gchar * const*) ((override_uris != NULL) ? override_uris->pdata : NULL),
                               (override_uris != NULL) ? override_uris->len : 0);
 
+  if (flatpak_pull_concurrency > 0)
+    g_key_file_set_integer (config, "Download", "FlatpakPullConcurrency",
+                            (gint) flatpak_pull_concurrency);
+
   return g_steal_pointer (&config);
 }
 
@@ -1528,6 +1551,12 @@ updater_quit_file (GFile *updater_dir)
   return g_file_get_child (updater_dir, "quit-file");
 }
 
+static GFile *
+updater_state_dir (GFile *updater_dir)
+{
+  return g_file_get_child (updater_dir, "state");
+}
+
 static GFile *
 updater_config_file (GFile *updater_dir)
 {
@@ -1759,6 +1788,7 @@ spawn_updater (GFile *sysroot,
                GFile *config_file,
                GFile *hw_file,
                GFile *quit_file,
+               GFile *state_dir,
                GFile *flatpak_upgrade_state_dir,
                GFile *flatpak_installation_dir,
                GFile *flatpak_autoinstall_override_dir,
@@ -1769,6 +1799,7 @@ spawn_updater (GFile *sysroot,
                const gchar *uname_machine,
                gboolean is_split_disk,
                gboolean force_follow_checkpoint,
+               const gchar *volume_repo_uris,
                CmdAsyncResult *cmd,
                GError **error)
 {
@@ -1783,6 +1814,7 @@ spawn_updater (GFile *sysroot,
       { "EOS_UPDATER_TEST_UPDATER_CUSTOM_DESCRIPTORS_PATH", NULL, hw_file },
       { "EOS_UPDATER_TEST_UPDATER_DEPLOYMENT_FALLBACK", "yes", NULL },
       { "EOS_UPDATER_TEST_UPDATER_QUIT_FILE", NULL, quit_file },
+      { "EOS_UPDATER_TEST_UPDATER_STATE_DIR", NULL, state_dir },
       { "EOS_UPDATER_TEST_UPDATER_USE_SESSION_BUS", "yes", NULL },
       { "EOS_UPDATER_TEST_UPDATER_OSTREE_OSNAME", osname, NULL },
       { "EOS_UPDATER_TEST_UPDATER_FLATPAK_UPGRADE_STATE_DIR", NULL, flatpak_upgrade_state_dir },
@@ -1795,6 +1827,7 @@ spawn_updater (GFile *sysroot,
       { "EOS_UPDATER_TEST_CPUINFO_PATH", NULL, cpuinfo_file },
       { "EOS_UPDATER_TEST_CMDLINE_PATH", NULL, cmdline_file },
       { "EOS_UPDATER_FORCE_FOLLOW_CHECKPOINT", force_follow_checkpoint ? "1" : "", NULL },
+      { "EOS_UPDATER_TEST_VOLUME_REPO_URIS", (volume_repo_uris != NULL) ? volume_repo_uris : "", NULL },
       { "OSTREE_SYSROOT", NULL, sysroot },
       { "OSTREE_REPO", NULL, repo },
       { "OSTREE_SYSROOT_DEBUG", "mutable-deployments", NULL },
@@ -1854,6 +1887,7 @@ spawn_updater_simple (GFile *sysroot,
                       const gchar *uname_machine,
                       gboolean is_split_disk,
                       gboolean force_follow_checkpoint,
+                      const gchar *volume_repo_uris,
                       CmdAsyncResult *cmd,
                       GError **error)
 {
@@ -1862,6 +1896,7 @@ spawn_updater_simple (GFile *sysroot,
   g_autoptr(GFile) cpuinfo_file = updater_cpuinfo_file (updater_dir);
   g_autoptr(GFile) cmdline_file = updater_cmdline_file (updater_dir);
   g_autoptr(GFile) quit_file_path = updater_quit_file (updater_dir);
+  g_autoptr(GFile) state_dir_path = updater_state_dir (updater_dir);
   g_autoptr(GFile) flatpak_upgrade_state_dir_path = get_flatpak_upgrade_state_dir_for_updater_dir (updater_dir);
   g_autoptr(GFile) flatpak_installation_dir_path = get_flatpak_user_dir_for_updater_dir (updater_dir);
   g_autoptr(GFile) flatpak_autoinstall_override_dir = get_flatpak_autoinstall_override_dir (updater_dir);
@@ -1871,6 +1906,7 @@ spawn_updater_simple (GFile *sysroot,
                         config_file_path,
                         hw_file_path,
                         quit_file_path,
+                        state_dir_path,
                         flatpak_upgrade_state_dir_path,
                         flatpak_installation_dir_path,
                         flatpak_autoinstall_override_dir,
@@ -1881,6 +1917,7 @@ spawn_updater_simple (GFile *sysroot,
                         uname_machine,
                         is_split_disk,
                         force_follow_checkpoint,
+                        volume_repo_uris,
                         cmd,
                         error);
 }
@@ -1900,6 +1937,8 @@ run_updater (GFile *client_root,
              gboolean is_split_disk,
              gboolean flatpak_repo_is_symlink,
              gboolean force_follow_checkpoint,
+             const gchar *volume_repo_uris,
+             guint flatpak_pull_concurrency,
              CmdAsyncResult *updater_cmd,
              GError **error)
 {
@@ -1925,7 +1964,8 @@ run_updater (GFile *client_root,
 
   updater_config = get_updater_config (order,
                                        n_sources,
-                                       override_uris);
+                                       override_uris,
+                                       flatpak_pull_concurrency);
   hw_config = get_hw_config (vendor, product);
   if (!prepare_updater_dir (updater_dir,
                             updater_config,
@@ -1943,6 +1983,7 @@ run_updater (GFile *client_root,
                              uname_machine_override,
                              is_split_disk,
                              force_follow_checkpoint,
+                             volume_repo_uris,
                              updater_cmd,
                              error))
     return FALSE;
@@ -2074,6 +2115,25 @@ eos_test_client_set_force_follow_checkpoint (EosTestClient *client,
   client->force_follow_checkpoint = force_follow_checkpoint;
 }
 
+/* Make the updater find the repositories at @volume_repo_uris when polling the
+ * volume source, as if they were on mounted volumes. */
+void
+eos_test_client_set_volume_repo_uris (EosTestClient      *client,
+                                      const gchar *const *volume_repo_uris)
+{
+  g_free (client->volume_repo_uris);
+  client->volume_repo_uris = (volume_repo_uris != NULL) ? g_strjoinv (";", (gchar **) volume_repo_uris) : NULL;
+}
+
+/* Set how many flatpaks the updater may pull at once when fetching, or 0 to
+ * leave it at the default. */
+void
+eos_test_client_set_flatpak_pull_concurrency (EosTestClient *client,
+                                              guint          flatpak_pull_concurrency)
+{
+  client->flatpak_pull_concurrency = flatpak_pull_concurrency;
+}
+
 gboolean
 eos_test_client_run_updater (EosTestClient *client,
                              DownloadSource *order,
@@ -2096,6 +2156,8 @@ eos_test_client_run_updater (EosTestClient *client,
                     client->is_split_disk,
                     client->flatpak_repo_is_symlink,
                     client->force_follow_checkpoint,
+                    client->volume_repo_uris,
+                    client->flatpak_pull_concurrency,
                     cmd,
                     error))
     return FALSE;
@@ -2125,6 +2187,8 @@ eos_test_client_run_updater_ignore_warnings (EosTestClient   *client,
                     client->is_split_disk,
                     client->flatpak_repo_is_symlink,
                     client->force_follow_checkpoint,
+                    client->volume_repo_uris,
+                    client->flatpak_pull_concurrency,
                     cmd,
                     error))
     return FALSE;
@@ -3319,6 +3383,14 @@ eos_test_client_get_sysroot (EosTestClient *client)
   return get_sysroot_for_client (client->root);
 }
 
+GFile *
+eos_test_client_get_updater_state_dir (EosTestClient *client)
+{
+  g_autoptr(GFile) updater_dir = get_updater_dir_for_client (client->root);
+
+  return updater_state_dir (updater_dir);
+}
+
 const gchar *
 eos_test_client_get_big_file_path (void)
 {
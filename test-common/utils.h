@@ -181,6 +181,8 @@ void eos_test_subserver_populate_commit_graph_from_leaf_nodes (EosTestSubserver
                                                                GHashTable       *leaf_nodes);
 gboolean eos_test_subserver_update (EosTestSubserver *subserver,
                                     GError **error);
+gboolean eos_test_subserver_remove_static_deltas (EosTestSubserver  *subserver,
+                                                  GError           **error);
 
 #define EOS_TEST_TYPE_SERVER eos_test_server_get_type ()
 G_DECLARE_FINAL_TYPE (EosTestServer,
@@ -239,6 +241,8 @@ struct _EosTestClient
   gboolean is_split_disk;
   gboolean flatpak_repo_is_symlink;
   gboolean force_follow_checkpoint;
+  gchar *volume_repo_uris;  /* (nullable) semicolon-separated */
+  guint flatpak_pull_concurrency;  /* 0 for the default */
 };
 
 typedef enum
@@ -270,6 +274,10 @@ void eos_test_client_set_flatpak_repo_is_symlink (EosTestClient *client,
                                                   gboolean flatpak_repo_is_symlink);
 void eos_test_client_set_force_follow_checkpoint (EosTestClient *client,
                                                   gboolean       force_follow_checkpoint);
+void eos_test_client_set_volume_repo_uris (EosTestClient      *client,
+                                           const gchar *const *volume_repo_uris);
+void eos_test_client_set_flatpak_pull_concurrency (EosTestClient *client,
+                                                   guint          flatpak_pull_concurrency);
 
 gboolean eos_test_client_run_updater (EosTestClient *client,
                                       DownloadSource *order,
@@ -327,6 +335,8 @@ GFile *eos_test_client_get_repo (EosTestClient *client);
 
 GFile *eos_test_client_get_sysroot (EosTestClient *client);
 
+GFile *eos_test_client_get_updater_state_dir (EosTestClient *client);
+
 const gchar *eos_test_client_get_big_file_path (void);
 
 typedef enum _UpdateStep {
@@ -601,10 +601,117 @@ test_update_when_none_available (EosUpdaterFixture *fixture,
   g_assert_cmpuint (eos_updater_get_state (updater), !=, EOS_UPDATER_STATE_ERROR);
 }
 
-/* Tests getting the various Size properties */
+/* Get the size of @file in bytes, asserting that it exists. */
+static gint64
+get_file_size (GFile *file)
+{
+  g_autoptr(GFileInfo) info = NULL;
+  g_autoptr(GError) error = NULL;
+
+  info = g_file_query_info (file, G_FILE_ATTRIBUTE_STANDARD_SIZE,
+                            G_FILE_QUERY_INFO_NONE, NULL, &error);
+  g_assert_no_error (error);
+
+  return g_file_info_get_size (info);
+}
+
+/* Work out the total size of the parts of the static delta from
+ * @from_checksum to @to_checksum in @repo, which is what libostree reports
+ * as the size of the delta when it is pulled. The sizes are taken from the
+ * part files in @repo, which are named by their index. */
+static gint64
+get_static_delta_download_size (GFile       *repo,
+                                const gchar *from_checksum,
+                                const gchar *to_checksum)
+{
+  g_autofree guchar *from_bytes = ostree_checksum_to_bytes (from_checksum);
+  g_autofree guchar *to_bytes = ostree_checksum_to_bytes (to_checksum);
+  g_autofree gchar *from_b64 = ostree_checksum_b64_from_bytes (from_bytes);
+  g_autofree gchar *to_b64 = ostree_checksum_b64_from_bytes (to_bytes);
+  g_autofree gchar *delta_path = NULL;
+  g_autoptr(GFile) delta_dir = NULL;
+  gint64 size = 0;
+  gsize i;
+
+  delta_path = g_strdup_printf ("deltas/%.2s/%s-%s", from_b64, from_b64 + 2, to_b64);
+  delta_dir = g_file_resolve_relative_path (repo, delta_path);
+
+  for (i = 0; ; i++)
+    {
+      g_autofree gchar *part_name = g_strdup_printf ("%" G_GSIZE_FORMAT, i);
+      g_autoptr(GFile) part_file = g_file_get_child (delta_dir, part_name);
+
+      if (!g_file_query_exists (part_file, NULL))
+        break;
+
+      size += get_file_size (part_file);
+    }
+
+  g_assert_cmpuint (i, >, 0);
+
+  return size;
+}
+
+/* Check the Size properties for the update to commit 1 in
+ * _test_update_sizes(). If @expected_delta_download is non-negative, the
+ * download size should have been estimated from the static delta to the
+ * update, and be that many bytes; otherwise it should have been estimated
+ * from the objects in the update. */
 static void
-test_update_sizes (EosUpdaterFixture *fixture,
-                   gconstpointer user_data)
+assert_update_sizes (EosUpdater *updater,
+                     gint64      expected_delta_download)
+{
+  gint64 expected_download;
+  gint64 expected_unpacked;
+  gint64 expected_full_download;
+  gint64 expected_full_unpacked;
+
+  g_assert_cmpuint (eos_updater_get_state (updater), ==, EOS_UPDATER_STATE_UPDATE_AVAILABLE);
+
+#if defined (HAVE_OSTREE_COMMIT_GET_OBJECT_SIZES)
+  expected_download = 11635;
+  expected_unpacked = 10487043;
+  expected_full_download = 12696;
+  expected_full_unpacked = 10487887;
+#else
+  expected_download = -1;
+  expected_unpacked = -1;
+  expected_full_download = -1;
+  expected_full_unpacked = -1;
+#endif
+
+  if (expected_delta_download >= 0)
+    {
+      g_assert_cmpstr (eos_updater_get_download_size_estimate (updater), ==, "delta");
+      g_assert_cmpint (eos_updater_get_download_size (updater), ==,
+                       expected_delta_download);
+    }
+  else
+    {
+#if defined (HAVE_OSTREE_COMMIT_GET_OBJECT_SIZES)
+      g_assert_cmpstr (eos_updater_get_download_size_estimate (updater), ==, "objects");
+#else
+      g_assert_cmpstr (eos_updater_get_download_size_estimate (updater), ==, "");
+#endif
+      g_assert_cmpint (eos_updater_get_download_size (updater), ==,
+                       expected_download);
+    }
+
+  g_assert_cmpint (eos_updater_get_unpacked_size (updater), ==,
+                   expected_unpacked);
+  g_assert_cmpint (eos_updater_get_full_download_size (updater), ==,
+                   expected_full_download);
+  g_assert_cmpint (eos_updater_get_full_unpacked_size (updater), ==,
+                   expected_full_unpacked);
+}
+
+/* Poll for an update to commit 1 and check the various Size properties. The
+ * test server generates a static delta between each commit and its parent;
+ * if @use_static_deltas is %FALSE, those are removed before polling, so the
+ * download size is estimated from the objects in the update. */
+static void
+_test_update_sizes (EosUpdaterFixture *fixture,
+                    gboolean           use_static_deltas)
 {
   g_autoptr(GError) error = NULL;
   g_autoptr(EosTestServer) server = NULL;
@@ -614,6 +721,7 @@ test_update_sizes (EosUpdaterFixture *fixture,
   g_autoptr(GHashTable) leaf_commit_nodes =
     eos_test_subserver_ref_to_commit_new ();
   DownloadSource main_source = DOWNLOAD_MAIN;
+  gint64 expected_delta_download = -1;
 
   if (eos_test_skip_chroot ())
     return;
@@ -630,6 +738,19 @@ test_update_sizes (EosUpdaterFixture *fixture,
   eos_test_subserver_update (subserver, &error);
   g_assert_no_error (error);
 
+  if (use_static_deltas)
+    expected_delta_download =
+      get_static_delta_download_size (subserver->repo,
+                                      g_hash_table_lookup (subserver->commits_in_repo,
+                                                           GUINT_TO_POINTER (0)),
+                                      g_hash_table_lookup (subserver->commits_in_repo,
+                                                           GUINT_TO_POINTER (1)));
+  else
+    {
+      eos_test_subserver_remove_static_deltas (subserver, &error);
+      g_assert_no_error (error);
+    }
+
   eos_test_client_run_updater (client,
                                &main_source,
                                1,
@@ -665,31 +786,41 @@ test_update_sizes (EosUpdaterFixture *fixture,
 
   g_assert_false (timed_out);
 
-  g_assert_cmpuint (eos_updater_get_state (updater), ==, EOS_UPDATER_STATE_UPDATE_AVAILABLE);
+  assert_update_sizes (updater, expected_delta_download);
 
-  gint64 expected_download;
-  gint64 expected_unpacked;
-  gint64 expected_full_download;
-  gint64 expected_full_unpacked;
-#if defined (HAVE_OSTREE_COMMIT_GET_OBJECT_SIZES)
-  expected_download = 11635;
-  expected_unpacked = 10487043;
-  expected_full_download = 12696;
-  expected_full_unpacked = 10487887;
-#else
-  expected_download = -1;
-  expected_unpacked = -1;
-  expected_full_download = -1;
-  expected_full_unpacked = -1;
-#endif
-  g_assert_cmpint (eos_updater_get_download_size (updater), ==,
-                   expected_download);
-  g_assert_cmpint (eos_updater_get_unpacked_size (updater), ==,
-                   expected_unpacked);
-  g_assert_cmpint (eos_updater_get_full_download_size (updater), ==,
-                   expected_full_download);
-  g_assert_cmpint (eos_updater_get_full_unpacked_size (updater), ==,
-                   expected_full_unpacked);
+  /* Poll again: the sizes should be the same when they come from the cache. */
+  state = EOS_UPDATER_STATE_POLLING;
+  eos_updater_call_poll_sync (updater, NULL, &error);
+  g_assert_no_error (error);
+
+  timeout_id = g_timeout_add_seconds (DEFAULT_TIMEOUT_SECS, timeout_cb, &timed_out);
+
+  while (state == EOS_UPDATER_STATE_POLLING && !timed_out)
+    g_main_context_iteration (NULL, TRUE);
+
+  g_source_remove (timeout_id);
+
+  g_assert_false (timed_out);
+
+  assert_update_sizes (updater, expected_delta_download);
+}
+
+/* Tests getting the various Size properties when the server has no static
+ * deltas, so the download size comes from the object sizes */
+static void
+test_update_sizes (EosUpdaterFixture *fixture,
+                   gconstpointer user_data)
+{
+  _test_update_sizes (fixture, FALSE);
+}
+
+/* Tests getting the various Size properties when the server has a static
+ * delta from the booted commit to the update */
+static void
+test_update_sizes_delta (EosUpdaterFixture *fixture,
+                         gconstpointer user_data)
+{
+  _test_update_sizes (fixture, TRUE);
 }
 
 int
@@ -719,6 +850,7 @@ main (int argc,
                 }), test_update_release_notes_uri);
   eos_test_add ("/updater/update-not-available", NULL, test_update_when_none_available);
   eos_test_add ("/updater/commit-sizes", NULL, test_update_sizes);
+  eos_test_add ("/updater/commit-sizes/delta", NULL, test_update_sizes_delta);
 
   return g_test_run ();
 }
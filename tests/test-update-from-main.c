@@ -22,6 +22,7 @@
  *  - Krzesimir Nowak <krzesimir@kinvolk.io>
  */
 
+#include <eos-updater/dbus.h>
 #include <test-common/gpg.h>
 #include <test-common/misc-utils.h>
 #include <test-common/spawn-utils.h>
@@ -29,6 +30,7 @@
 
 #include <gio/gio.h>
 #include <locale.h>
+#include <string.h>
 
 static void
 test_update_from_main (EosUpdaterFixture *fixture,
@@ -58,6 +60,17 @@ test_update_from_main (EosUpdaterFixture *fixture,
   g_autofree gchar *collection_id_after_update = NULL;
   g_autoptr(GKeyFile) config = NULL;
   g_autofree gchar *remote_group = NULL;
+  g_autoptr(GFile) state_dir = NULL;
+  g_autoptr(GFile) summary_digests_file = NULL;
+  g_autoptr(GKeyFile) summary_digests = NULL;
+  g_autofree gchar *summary_digests_path = NULL;
+  g_autofree gchar *booted_refspec = NULL;
+  g_autofree gchar *summary_digest = NULL;
+  g_auto(CmdAsyncResult) second_updater_cmd = CMD_ASYNC_RESULT_CLEARED;
+  g_autoptr(GFile) second_autoupdater_root = NULL;
+  g_autoptr(EosTestAutoupdater) second_autoupdater = NULL;
+  g_auto(CmdResult) second_reaped = CMD_RESULT_CLEARED;
+  g_autofree gchar *second_output = NULL;
 
   if (eos_test_skip_chroot ())
     return;
@@ -168,6 +181,406 @@ test_update_from_main (EosUpdaterFixture *fixture,
                                  &collection_id_after_update, &error);
   g_assert_no_error (error);
   g_assert_cmpstr (collection_id_after_update, ==, default_collection_ref->collection_id);
+
+  /* As the remote had no collection ID, the poll pulled from it by name, and
+   * should have recorded the summary digest so the next poll can skip the
+   * pull if nothing has changed. */
+  state_dir = eos_test_client_get_updater_state_dir (client);
+  summary_digests_file = g_file_get_child (state_dir, "poll-summary-digests");
+  summary_digests_path = g_file_get_path (summary_digests_file);
+  summary_digests = g_key_file_new ();
+  g_key_file_load_from_file (summary_digests, summary_digests_path,
+                             G_KEY_FILE_NONE, &error);
+  g_assert_no_error (error);
+
+  booted_refspec = g_strdup_printf ("%s:%s", default_remote_name, default_ref);
+  summary_digest = g_key_file_get_string (summary_digests, booted_refspec,
+                                          "SummaryDigest", &error);
+  g_assert_no_error (error);
+  g_assert_cmpuint (strlen (summary_digest), ==, 64);
+
+  /* Poll again without changing anything on the server. The summary digest
+   * matches, so the poll should reuse the previous result and record that it
+   * did, without pulling any commits. The debug output is the only way to see
+   * the metric event, as metrics are disabled in the tests. */
+  httpd_clear_requests (server->httpd);
+  g_setenv ("G_MESSAGES_DEBUG", "eos-updater", TRUE);
+
+  eos_test_client_run_updater (client,
+                               &main_source,
+                               1,
+                               NULL,
+                               &second_updater_cmd,
+                               &error);
+  g_assert_no_error (error);
+
+  g_unsetenv ("G_MESSAGES_DEBUG");
+
+  second_autoupdater_root = g_file_get_child (fixture->tmpdir, "autoupdater-second");
+  second_autoupdater = eos_test_autoupdater_new (second_autoupdater_root,
+                                                 UPDATE_STEP_POLL,
+                                                 1,  /* interval (days) */
+                                                 0, /* user visible delay (days) */
+                                                 TRUE,  /* force update */
+                                                 &error);
+  g_assert_no_error (error);
+
+  eos_test_client_reap_updater (client,
+                                &second_updater_cmd,
+                                &second_reaped,
+                                &error);
+  g_assert_no_error (error);
+
+  g_ptr_array_set_size (cmds, 0);
+  g_ptr_array_add (cmds, &second_reaped);
+  g_ptr_array_add (cmds, second_autoupdater->cmd);
+  g_assert_true (cmd_result_ensure_all_ok_verbose (cmds));
+
+  g_assert_cmpuint (httpd_count_requests (server->httpd, "/summary"), >, 0);
+  g_assert_cmpuint (httpd_count_requests (server->httpd, ".commit"), ==, 0);
+
+  second_output = g_strconcat (second_reaped.standard_output, "\n",
+                               second_reaped.standard_error, NULL);
+  g_assert_nonnull (strstr (second_output, "is unchanged; reusing previous result"));
+  g_assert_nonnull (strstr (second_output, EOS_UPDATER_METRIC_POLL_SUMMARY_UNCHANGED));
+}
+
+/* Set up a server with an update to commit 1, and a client for it, for the
+ * update-state tests. */
+static void
+setup_update_state_test (EosUpdaterFixture  *fixture,
+                         EosTestServer     **out_server,
+                         EosTestClient     **out_client)
+{
+  g_autoptr(GFile) server_root = NULL;
+  g_autoptr(EosTestServer) server = NULL;
+  g_autofree gchar *keyid = get_keyid (fixture->gpg_home);
+  g_autoptr(GError) error = NULL;
+  g_autoptr(EosTestSubserver) subserver = NULL;
+  g_autoptr(GFile) client_root = NULL;
+  g_autoptr(EosTestClient) client = NULL;
+  g_autoptr(GHashTable) leaf_commit_nodes =
+    eos_test_subserver_ref_to_commit_new ();
+
+  server_root = g_file_get_child (fixture->tmpdir, "main");
+  server = eos_test_server_new_quick (server_root,
+                                      default_vendor,
+                                      default_product,
+                                      default_collection_ref,
+                                      0,
+                                      fixture->gpg_home,
+                                      keyid,
+                                      default_ostree_path,
+                                      NULL, NULL, NULL,
+                                      &error);
+  g_assert_no_error (error);
+  g_assert_cmpuint (server->subservers->len, ==, 1u);
+
+  subserver = g_object_ref (EOS_TEST_SUBSERVER (g_ptr_array_index (server->subservers, 0)));
+  client_root = g_file_get_child (fixture->tmpdir, "client");
+  client = eos_test_client_new (client_root,
+                                default_remote_name,
+                                subserver,
+                                default_collection_ref,
+                                default_vendor,
+                                default_product,
+                                default_auto_bootloader,
+                                &error);
+  g_assert_no_error (error);
+
+  g_hash_table_insert (leaf_commit_nodes,
+                       ostree_collection_ref_dup (default_collection_ref),
+                       GUINT_TO_POINTER (1));
+  eos_test_subserver_populate_commit_graph_from_leaf_nodes (subserver,
+                                                            leaf_commit_nodes);
+  eos_test_subserver_update (subserver,
+                             &error);
+  g_assert_no_error (error);
+
+  *out_server = g_steal_pointer (&server);
+  *out_client = g_steal_pointer (&client);
+}
+
+/* Run the updater for @client, and an autoupdater (rooted at @autoupdater_name
+ * in the fixture’s temporary directory) which goes as far as @step, and check
+ * they both succeed. */
+static void
+run_updater_to_step (EosUpdaterFixture *fixture,
+                     EosTestClient     *client,
+                     UpdateStep         step,
+                     const gchar       *autoupdater_name)
+{
+  g_auto(CmdAsyncResult) updater_cmd = CMD_ASYNC_RESULT_CLEARED;
+  g_autoptr(GFile) autoupdater_root = NULL;
+  g_autoptr(EosTestAutoupdater) autoupdater = NULL;
+  g_auto(CmdResult) reaped = CMD_RESULT_CLEARED;
+  g_autoptr(GPtrArray) cmds = NULL;
+  DownloadSource main_source = DOWNLOAD_MAIN;
+  g_autoptr(GError) error = NULL;
+
+  eos_test_client_run_updater (client,
+                               &main_source,
+                               1,
+                               NULL,
+                               &updater_cmd,
+                               &error);
+  g_assert_no_error (error);
+
+  autoupdater_root = g_file_get_child (fixture->tmpdir, autoupdater_name);
+  autoupdater = eos_test_autoupdater_new (autoupdater_root,
+                                          step,
+                                          1,  /* interval (days) */
+                                          0, /* user visible delay (days) */
+                                          TRUE,  /* force update */
+                                          &error);
+  g_assert_no_error (error);
+
+  eos_test_client_reap_updater (client,
+                                &updater_cmd,
+                                &reaped,
+                                &error);
+  g_assert_no_error (error);
+
+  cmds = g_ptr_array_new ();
+  g_ptr_array_add (cmds, &reaped);
+  g_ptr_array_add (cmds, autoupdater->cmd);
+  g_assert_true (cmd_result_ensure_all_ok_verbose (cmds));
+}
+
+/* Poll for an update, then check that its details are saved to the state
+ * directory so a restarted updater can restore them; and that they are deleted
+ * once the update has been applied by a later run of the updater. */
+static void
+test_update_state_saved (EosUpdaterFixture *fixture,
+                         gconstpointer user_data)
+{
+  g_autoptr(EosTestServer) server = NULL;
+  g_autoptr(EosTestClient) client = NULL;
+  g_autoptr(GError) error = NULL;
+  g_autoptr(GFile) state_dir = NULL;
+  g_autoptr(GFile) update_state_file = NULL;
+  g_autofree gchar *update_state_path = NULL;
+  g_autoptr(GKeyFile) update_state = g_key_file_new ();
+  g_autofree gchar *expected_refspec = g_strdup_printf ("%s:%s", default_remote_name, default_ref);
+  g_autofree gchar *update_refspec = NULL;
+  g_autofree gchar *update_id = NULL;
+  gboolean has_commit;
+
+  if (eos_test_skip_chroot ())
+    return;
+
+  setup_update_state_test (fixture, &server, &client);
+
+  state_dir = eos_test_client_get_updater_state_dir (client);
+  update_state_file = g_file_get_child (state_dir, "update-state");
+  update_state_path = g_file_get_path (update_state_file);
+
+  /* The update has been found but not fetched. */
+  run_updater_to_step (fixture, client, UPDATE_STEP_POLL, "autoupdater0");
+
+  g_key_file_load_from_file (update_state, update_state_path,
+                             G_KEY_FILE_NONE, &error);
+  g_assert_no_error (error);
+
+  update_refspec = g_key_file_get_string (update_state, "Update", "UpdateRefspec", &error);
+  g_assert_no_error (error);
+  g_assert_cmpstr (update_refspec, ==, expected_refspec);
+
+  update_id = g_key_file_get_string (update_state, "Update", "UpdateID", &error);
+  g_assert_no_error (error);
+  g_assert_true (ostree_validate_checksum_string (update_id, NULL));
+
+  g_assert_false (g_key_file_get_boolean (update_state, "Update", "Fetched", &error));
+  g_assert_no_error (error);
+
+  /* The update has been applied, so the state is no longer needed. */
+  run_updater_to_step (fixture, client, UPDATE_STEP_APPLY, "autoupdater1");
+
+  g_assert_false (g_file_query_exists (update_state_file, NULL));
+
+  eos_test_client_has_commit (client,
+                              default_remote_name,
+                              1,
+                              &has_commit,
+                              &error);
+  g_assert_no_error (error);
+  g_assert_true (has_commit);
+}
+
+typedef enum
+{
+  STATE_CHANGE_NONE,
+  STATE_CHANGE_MARK_PARTIAL,  /* mark the update commit as partial */
+  STATE_CHANGE_MOVE_REF,  /* move the update’s ref back to the booted commit */
+  STATE_CHANGE_BOOTED_COMMIT,  /* as if a different commit had been booted */
+} StateChange;
+
+typedef struct
+{
+  UpdateStep step;  /* how far the first run of the updater gets */
+  StateChange change;  /* what changes before the updater is started again */
+  EosUpdaterState expected_state;  /* the state the updater starts in */
+} UpdateStateRestoredData;
+
+/* Poll for (and maybe fetch) an update, make the change given in @user_data
+ * to the client, and then start the updater again without asking it to do
+ * anything. Check that it starts in the expected state: with the saved update
+ * details and without touching the network if the saved state was still
+ * valid, or in `Ready` with the saved state deleted if not. */
+static void
+test_update_state_restored (EosUpdaterFixture *fixture,
+                            gconstpointer user_data)
+{
+  const UpdateStateRestoredData *data = user_data;
+  g_autoptr(EosTestServer) server = NULL;
+  g_autoptr(EosTestClient) client = NULL;
+  g_autoptr(GError) error = NULL;
+  g_autoptr(GFile) state_dir = NULL;
+  g_autoptr(GFile) update_state_file = NULL;
+  g_autofree gchar *update_state_path = NULL;
+  g_autoptr(GKeyFile) update_state = g_key_file_new ();
+  g_autofree gchar *update_id = NULL;
+  g_autofree gchar *update_refspec = NULL;
+  g_autofree gchar *booted_checksum = NULL;
+  g_autofree gchar *version = NULL;
+  gint64 download_size;
+  g_autoptr(GFile) repo_path = NULL;
+  g_autoptr(OstreeRepo) repo = NULL;
+  g_auto(CmdAsyncResult) updater_cmd = CMD_ASYNC_RESULT_CLEARED;
+  g_auto(CmdResult) reaped = CMD_RESULT_CLEARED;
+  g_autoptr(EosUpdater) updater = NULL;
+  DownloadSource main_source = DOWNLOAD_MAIN;
+  EosUpdaterState state;
+
+  if (eos_test_skip_chroot ())
+    return;
+
+  setup_update_state_test (fixture, &server, &client);
+
+  state_dir = eos_test_client_get_updater_state_dir (client);
+  update_state_file = g_file_get_child (state_dir, "update-state");
+  update_state_path = g_file_get_path (update_state_file);
+
+  run_updater_to_step (fixture, client, data->step, "autoupdater");
+
+  g_key_file_load_from_file (update_state, update_state_path,
+                             G_KEY_FILE_KEEP_COMMENTS, &error);
+  g_assert_no_error (error);
+
+  g_assert_cmpint (g_key_file_get_boolean (update_state, "Update", "Fetched", NULL), ==,
+                   data->step == UPDATE_STEP_FETCH);
+
+  update_id = g_key_file_get_string (update_state, "Update", "UpdateID", &error);
+  g_assert_no_error (error);
+  update_refspec = g_key_file_get_string (update_state, "Update", "UpdateRefspec", &error);
+  g_assert_no_error (error);
+  booted_checksum = g_key_file_get_string (update_state, "Update", "BootedChecksum", &error);
+  g_assert_no_error (error);
+  version = g_key_file_get_string (update_state, "Update", "Version", &error);
+  g_assert_no_error (error);
+  download_size = g_key_file_get_int64 (update_state, "Update", "DownloadSize", &error);
+  g_assert_no_error (error);
+
+  repo_path = eos_test_client_get_repo (client);
+  repo = ostree_repo_new (repo_path);
+  ostree_repo_open (repo, NULL, &error);
+  g_assert_no_error (error);
+
+  switch (data->change)
+    {
+    case STATE_CHANGE_NONE:
+      break;
+    case STATE_CHANGE_MARK_PARTIAL:
+      {
+        /* This is how libostree records that a commit is partial; see
+         * ostree_repo_mark_commit_partial(), which is newer than the version
+         * of libostree the tests need. */
+        g_autofree gchar *partial_name = g_strdup_printf ("state/%s.commitpartial", update_id);
+        g_autoptr(GFile) partial_file = g_file_resolve_relative_path (repo_path, partial_name);
+
+        g_file_replace_contents (partial_file, "", 0, NULL, FALSE,
+                                 G_FILE_CREATE_NONE, NULL, NULL, &error);
+        g_assert_no_error (error);
+        break;
+      }
+    case STATE_CHANGE_MOVE_REF:
+      {
+        g_autofree gchar *remote_name = NULL;
+        g_autofree gchar *ref = NULL;
+
+        ostree_parse_refspec (update_refspec, &remote_name, &ref, &error);
+        g_assert_no_error (error);
+        ostree_repo_set_ref_immediate (repo, remote_name, ref, booted_checksum,
+                                       NULL, &error);
+        g_assert_no_error (error);
+        break;
+      }
+    case STATE_CHANGE_BOOTED_COMMIT:
+      {
+        g_autofree gchar *other_checksum =
+          g_compute_checksum_for_string (G_CHECKSUM_SHA256, "not booted", -1);
+
+        g_key_file_set_string (update_state, "Update", "BootedChecksum", other_checksum);
+        g_key_file_save_to_file (update_state, update_state_path, &error);
+        g_assert_no_error (error);
+        break;
+      }
+    default:
+      g_assert_not_reached ();
+    }
+
+  /* Start the updater again, but don’t ask it to do anything. */
+  httpd_clear_requests (server->httpd);
+
+  eos_test_client_run_updater (client,
+                               &main_source,
+                               1,
+                               NULL,
+                               &updater_cmd,
+                               &error);
+  g_assert_no_error (error);
+
+  updater = eos_updater_proxy_new_for_bus_sync (G_BUS_TYPE_SESSION,
+                                                G_DBUS_PROXY_FLAGS_NONE,
+                                                "com.endlessm.Updater",
+                                                "/com/endlessm/Updater",
+                                                NULL,
+                                                &error);
+  g_assert_no_error (error);
+
+  /* Read the properties before the updater exits, as the proxy’s cached
+   * properties are cleared when it does. */
+  state = eos_updater_get_state (updater);
+  g_assert_cmpuint (state, ==, data->expected_state);
+
+  if (state == EOS_UPDATER_STATE_READY)
+    {
+      g_assert_cmpstr (eos_updater_get_update_id (updater), ==, "");
+      g_assert_false (g_file_query_exists (update_state_file, NULL));
+    }
+  else
+    {
+      g_assert_cmpstr (eos_updater_get_update_id (updater), ==, update_id);
+      g_assert_cmpstr (eos_updater_get_update_refspec (updater), ==, update_refspec);
+      g_assert_cmpstr (eos_updater_get_version (updater), ==, version);
+      g_assert_cmpint (eos_updater_get_download_size (updater), ==, download_size);
+      if (download_size >= 0)
+        g_assert_cmpint (eos_updater_get_downloaded_bytes (updater), ==,
+                         (state == EOS_UPDATER_STATE_UPDATE_READY) ? download_size : 0);
+      g_assert_true (g_file_query_exists (update_state_file, NULL));
+    }
+
+  g_clear_object (&updater);
+
+  eos_test_client_reap_updater (client,
+                                &updater_cmd,
+                                &reaped,
+                                &error);
+  g_assert_no_error (error);
+  g_assert_true (cmd_result_ensure_ok_verbose (&reaped));
+
+  /* Restoring the state (or deciding not to) never needs the network. */
+  g_assert_cmpuint (httpd_count_requests (server->httpd, ""), ==, 0);
 }
 
 int
@@ -179,6 +592,32 @@ main (int argc,
   g_test_init (&argc, &argv, G_TEST_OPTION_ISOLATE_DIRS, NULL);
 
   eos_test_add ("/updater/update-from-main", NULL, test_update_from_main);
+  eos_test_add ("/updater/update-state-saved", NULL, test_update_state_saved);
+  eos_test_add ("/updater/update-state-restored/available", (&(UpdateStateRestoredData) {
+                  .step = UPDATE_STEP_POLL,
+                  .change = STATE_CHANGE_NONE,
+                  .expected_state = EOS_UPDATER_STATE_UPDATE_AVAILABLE,
+                }), test_update_state_restored);
+  eos_test_add ("/updater/update-state-restored/ready", (&(UpdateStateRestoredData) {
+                  .step = UPDATE_STEP_FETCH,
+                  .change = STATE_CHANGE_NONE,
+                  .expected_state = EOS_UPDATER_STATE_UPDATE_READY,
+                }), test_update_state_restored);
+  eos_test_add ("/updater/update-state-restored/ready-partial", (&(UpdateStateRestoredData) {
+                  .step = UPDATE_STEP_FETCH,
+                  .change = STATE_CHANGE_MARK_PARTIAL,
+                  .expected_state = EOS_UPDATER_STATE_UPDATE_AVAILABLE,
+                }), test_update_state_restored);
+  eos_test_add ("/updater/update-state-restored/ref-moved", (&(UpdateStateRestoredData) {
+                  .step = UPDATE_STEP_POLL,
+                  .change = STATE_CHANGE_MOVE_REF,
+                  .expected_state = EOS_UPDATER_STATE_READY,
+                }), test_update_state_restored);
+  eos_test_add ("/updater/update-state-restored/booted-commit-changed", (&(UpdateStateRestoredData) {
+                  .step = UPDATE_STEP_FETCH,
+                  .change = STATE_CHANGE_BOOTED_COMMIT,
+                  .expected_state = EOS_UPDATER_STATE_READY,
+                }), test_update_state_restored);
 
   return g_test_run ();
 }
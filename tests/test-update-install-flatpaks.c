@@ -22,6 +22,9 @@
  *  - Sam Spilsbury <sam@endlessm.com>
  */
 
+#include "config.h"
+
+#include <eos-updater/dbus.h>
 #include <libeos-updater-util/util.h>
 #include <test-common/flatpak-spawn.h>
 #include <test-common/gpg.h>
@@ -3563,6 +3566,661 @@ test_update_flatpak_pull_fail_system_not_deployed (EosUpdaterFixture *fixture,
 }
 
 
+#define FETCH_TIMEOUT_SECS 60
+
+/* State tracked by poll_and_fetch_update() while the updater runs. */
+typedef struct
+{
+  EosUpdaterState state;
+  gint64 max_downloaded_bytes;
+  gboolean downloaded_bytes_decreased;
+} FetchHelper;
+
+static void
+fetch_helper_state_changed_cb (EosUpdater *updater,
+                               GParamSpec *pspec,
+                               gpointer    user_data)
+{
+  FetchHelper *helper = user_data;
+
+  helper->state = eos_updater_get_state (updater);
+}
+
+static void
+fetch_helper_downloaded_bytes_changed_cb (EosUpdater *updater,
+                                          GParamSpec *pspec,
+                                          gpointer    user_data)
+{
+  FetchHelper *helper = user_data;
+  gint64 downloaded_bytes = eos_updater_get_downloaded_bytes (updater);
+
+  if (downloaded_bytes < helper->max_downloaded_bytes)
+    helper->downloaded_bytes_decreased = TRUE;
+  helper->max_downloaded_bytes = MAX (helper->max_downloaded_bytes,
+                                      downloaded_bytes);
+}
+
+static gboolean
+timeout_cb (gpointer user_data)
+{
+  gboolean *out_timed_out = user_data;
+  *out_timed_out = TRUE;
+
+  /* Removed by the caller. */
+  return G_SOURCE_CONTINUE;
+}
+
+/* Run the updater for the client in @data, polling @source (and
+ * @override_uris, if non-%NULL), then poll for and fetch the update over D-Bus
+ * (rather than using the autoupdater), so that the updater’s properties can be
+ * checked during and after the fetch. The updater is left running, in the
+ * state the fetch ended in, and its proxy is returned; it should be reaped
+ * using @updater_cmd once the properties have been checked. */
+static EosUpdater *
+poll_and_fetch_update_from (EtcData        *data,
+                            DownloadSource  source,
+                            GPtrArray      *override_uris,
+                            gboolean        fatal_warnings,
+                            CmdAsyncResult *updater_cmd,
+                            FetchHelper    *helper)
+{
+  g_autoptr(EosUpdater) updater = NULL;
+  g_autoptr(GError) error = NULL;
+  gboolean timed_out = FALSE;
+  guint timeout_id;
+
+  if (fatal_warnings)
+    eos_test_client_run_updater (data->client,
+                                 &source,
+                                 1,
+                                 override_uris,
+                                 updater_cmd,
+                                 &error);
+  else
+    eos_test_client_run_updater_ignore_warnings (data->client,
+                                                 &source,
+                                                 1,
+                                                 override_uris,
+                                                 updater_cmd,
+                                                 &error);
+  g_assert_no_error (error);
+
+  updater = eos_updater_proxy_new_for_bus_sync (G_BUS_TYPE_SESSION,
+                                                G_DBUS_PROXY_FLAGS_NONE,
+                                                "com.endlessm.Updater",
+                                                "/com/endlessm/Updater",
+                                                NULL,
+                                                &error);
+  g_assert_no_error (error);
+
+  g_signal_connect (updater, "notify::state",
+                    G_CALLBACK (fetch_helper_state_changed_cb), helper);
+  g_signal_connect (updater, "notify::downloaded-bytes",
+                    G_CALLBACK (fetch_helper_downloaded_bytes_changed_cb), helper);
+
+  timeout_id = g_timeout_add_seconds (FETCH_TIMEOUT_SECS, timeout_cb, &timed_out);
+
+  helper->state = EOS_UPDATER_STATE_POLLING;
+  eos_updater_call_poll_sync (updater, NULL, &error);
+  g_assert_no_error (error);
+
+  while (helper->state == EOS_UPDATER_STATE_POLLING && !timed_out)
+    g_main_context_iteration (NULL, TRUE);
+
+  g_assert_false (timed_out);
+  g_assert_cmpuint (helper->state, ==, EOS_UPDATER_STATE_UPDATE_AVAILABLE);
+
+  helper->state = EOS_UPDATER_STATE_FETCHING;
+  eos_updater_call_fetch_sync (updater, NULL, &error);
+  g_assert_no_error (error);
+
+  while (helper->state == EOS_UPDATER_STATE_FETCHING && !timed_out)
+    g_main_context_iteration (NULL, TRUE);
+
+  g_source_remove (timeout_id);
+  g_assert_false (timed_out);
+
+  g_signal_handlers_disconnect_by_data (updater, helper);
+
+  return g_steal_pointer (&updater);
+}
+
+/* As poll_and_fetch_update_from(), polling the main server. */
+static EosUpdater *
+poll_and_fetch_update (EtcData        *data,
+                       gboolean        fatal_warnings,
+                       CmdAsyncResult *updater_cmd,
+                       FetchHelper    *helper)
+{
+  return poll_and_fetch_update_from (data, DOWNLOAD_MAIN, NULL, fatal_warnings,
+                                     updater_cmd, helper);
+}
+
+/* Stop the updater run by poll_and_fetch_update(), and return everything it
+ * logged. */
+static gchar *
+reap_updater_output (EtcData        *data,
+                     CmdAsyncResult *updater_cmd)
+{
+  g_auto(CmdResult) reaped_updater = CMD_RESULT_CLEARED;
+  g_autoptr(GError) error = NULL;
+
+  eos_test_client_reap_updater (data->client,
+                                updater_cmd,
+                                &reaped_updater,
+                                &error);
+  g_assert_no_error (error);
+  g_assert_true (cmd_result_ensure_ok_verbose (&reaped_updater));
+
+  return g_strconcat (reaped_updater.standard_output, "\n",
+                      reaped_updater.standard_error, NULL);
+}
+
+/* Set up a client whose update to commit 1 installs @flatpaks_to_install,
+ * of which only @flatpaks_in_remote are available from the flatpak remote,
+ * and which pulls up to @concurrency flatpaks at once. */
+static void
+set_up_concurrent_flatpak_pull (EosUpdaterFixture      *fixture,
+                                EtcData                *data,
+                                const FlatpakToInstall *flatpaks_to_install,
+                                gsize                   n_flatpaks_to_install,
+                                const gchar           **flatpaks_in_remote,
+                                guint                   concurrency)
+{
+  g_autoptr(GFile) updater_directory = NULL;
+  g_autofree gchar *keyid = get_keyid (fixture->gpg_home);
+  g_autoptr(GFile) gpg_key_file = get_gpg_key_file_for_keyid (fixture->gpg_home, keyid);
+  g_autoptr(GError) error = NULL;
+
+  etc_data_init (data, fixture);
+
+  /* Commit number 1 will install some flatpaks
+   */
+  autoinstall_flatpaks_files (1,
+                              flatpaks_to_install,
+                              n_flatpaks_to_install,
+                              &data->additional_directories_for_commit,
+                              &data->additional_files_for_commit);
+
+  etc_set_up_server (data);
+  etc_set_up_client_synced_to_server (data);
+  eos_test_client_set_flatpak_pull_concurrency (data->client, concurrency);
+
+  updater_directory = g_file_get_child (data->client->root, "updater");
+  eos_test_setup_flatpak_repo_simple (updater_directory,
+                                      "stable",
+                                      "test-repo",
+                                      "com.endlessm.TestInstallFlatpaksCollection",
+                                      "com.endlessm.TestInstallFlatpaksCollection",
+                                      flatpaks_in_remote,
+                                      gpg_key_file,
+                                      keyid,
+                                      &error);
+  g_assert_no_error (error);
+
+  etc_update_server (data, 1);
+}
+
+/* Insert a list of several flatpaks to automatically install on the commit,
+ * and fetch the update while pulling more than one flatpak at once. All the
+ * flatpaks should be pulled into the local repo, and the DownloadedBytes
+ * property should never go backwards as the concurrent pulls report their
+ * progress. */
+static void
+test_update_install_flatpaks_pull_concurrently (EosUpdaterFixture *fixture,
+                                                gconstpointer      user_data)
+{
+  g_auto(EtcData) real_data = { NULL, };
+  EtcData *data = &real_data;
+  FlatpakToInstall flatpaks_to_install[] = {
+    { "install", "com.endlessm.TestInstallFlatpaksCollection", "test-repo", "org.test.Test", "stable", "app", FLATPAK_TO_INSTALL_FLAGS_NONE },
+    { "install", "com.endlessm.TestInstallFlatpaksCollection", "test-repo", "org.test.Test2", "stable", "app", FLATPAK_TO_INSTALL_FLAGS_NONE },
+    { "install", "com.endlessm.TestInstallFlatpaksCollection", "test-repo", "org.test.Test3", "stable", "app", FLATPAK_TO_INSTALL_FLAGS_NONE }
+  };
+  g_auto(GStrv) wanted_flatpaks = flatpaks_to_install_app_ids_strv (flatpaks_to_install,
+                                                                    G_N_ELEMENTS (flatpaks_to_install));
+  g_autoptr(GFile) flatpak_user_installation_dir = NULL;
+  g_auto(GStrv) flatpaks_in_repo = NULL;
+  FetchHelper helper = { EOS_UPDATER_STATE_NONE, 0, FALSE };
+  g_auto(CmdAsyncResult) updater_cmd = CMD_ASYNC_RESULT_CLEARED;
+  g_autoptr(EosUpdater) updater = NULL;
+  g_autofree gchar *updater_output = NULL;
+  g_autoptr(GError) error = NULL;
+  gsize i;
+
+  /* Allow the OS and two flatpaks to be pulled at once. */
+  set_up_concurrent_flatpak_pull (fixture, data,
+                                  flatpaks_to_install,
+                                  G_N_ELEMENTS (flatpaks_to_install),
+                                  (const gchar **) wanted_flatpaks,
+                                  3);
+
+  updater = poll_and_fetch_update (data, TRUE, &updater_cmd, &helper);
+
+  g_assert_cmpuint (helper.state, ==, EOS_UPDATER_STATE_UPDATE_READY);
+  g_assert_cmpstr (eos_updater_get_error_name (updater), ==, "");
+
+  /* The final count includes the OS and all the flatpaks. */
+  g_assert_false (helper.downloaded_bytes_decreased);
+  g_assert_cmpint (eos_updater_get_downloaded_bytes (updater), >, 0);
+  g_assert_cmpint (eos_updater_get_downloaded_bytes (updater), ==,
+                   helper.max_downloaded_bytes);
+
+  g_clear_object (&updater);
+  updater_output = reap_updater_output (data, &updater_cmd);
+  g_assert_nonnull (strstr (updater_output, "Fetch: pulling flatpaks while pulling the OS"));
+
+  flatpak_user_installation_dir = g_file_get_child (data->client->root,
+                                                    "updater/flatpak-user");
+  flatpaks_in_repo = flatpaks_in_installation_repo (flatpak_user_installation_dir,
+                                                    &error);
+  g_assert_no_error (error);
+
+  for (i = 0; i < G_N_ELEMENTS (flatpaks_to_install); i++)
+    g_assert_true (g_strv_contains ((const gchar * const *) flatpaks_in_repo,
+                                    flatpaks_to_install[i].app_id));
+}
+
+/* Insert a list of several flatpaks to automatically install on the commit,
+ * one of which is missing from the flatpak remote, and fetch the update while
+ * pulling more than one flatpak at once. The fetch should fail with the error
+ * from the missing flatpak, rather than with the cancellation of the other
+ * pulls which that causes. */
+static void
+test_update_install_flatpaks_pull_concurrently_fail (EosUpdaterFixture *fixture,
+                                                     gconstpointer      user_data)
+{
+  g_auto(EtcData) real_data = { NULL, };
+  EtcData *data = &real_data;
+  FlatpakToInstall flatpaks_to_install[] = {
+    { "install", "com.endlessm.TestInstallFlatpaksCollection", "test-repo", "org.test.Test", "stable", "app", FLATPAK_TO_INSTALL_FLAGS_NONE },
+    { "install", "com.endlessm.TestInstallFlatpaksCollection", "test-repo", "org.test.Missing", "stable", "app", FLATPAK_TO_INSTALL_FLAGS_NONE },
+    { "install", "com.endlessm.TestInstallFlatpaksCollection", "test-repo", "org.test.Test2", "stable", "app", FLATPAK_TO_INSTALL_FLAGS_NONE }
+  };
+  const gchar *flatpaks_in_remote[] = { "org.test.Test", "org.test.Test2", NULL };
+  FetchHelper helper = { EOS_UPDATER_STATE_NONE, 0, FALSE };
+  g_auto(CmdAsyncResult) updater_cmd = CMD_ASYNC_RESULT_CLEARED;
+  g_autoptr(EosUpdater) updater = NULL;
+  g_autofree gchar *updater_output = NULL;
+  const gchar *error_message;
+
+  set_up_concurrent_flatpak_pull (fixture, data,
+                                  flatpaks_to_install,
+                                  G_N_ELEMENTS (flatpaks_to_install),
+                                  flatpaks_in_remote,
+                                  3);
+
+  updater = poll_and_fetch_update (data, TRUE, &updater_cmd, &helper);
+
+  g_assert_cmpuint (helper.state, ==, EOS_UPDATER_STATE_ERROR);
+  g_assert_cmpstr (eos_updater_get_error_name (updater), !=, "");
+
+  /* Only the missing flatpak failed; the cancellation of the other pulls,
+   * including the OS pull running alongside them, should not be reported. */
+  error_message = eos_updater_get_error_message (updater);
+  g_assert_nonnull (strstr (error_message, "org.test.Missing"));
+  g_assert_null (strstr (error_message, "cancelled"));
+
+  g_assert_false (helper.downloaded_bytes_decreased);
+
+  g_clear_object (&updater);
+  updater_output = reap_updater_output (data, &updater_cmd);
+  g_assert_nonnull (strstr (updater_output, "Fetch: pulling flatpaks while pulling the OS"));
+  g_assert_nonnull (strstr (updater_output, "Fetch: failed to pull necessary new flatpaks for update"));
+}
+
+/* Set up a client whose update to commit 1 installs org.test.Test, which uses
+ * the org.test.Runtime runtime, so that the runtime is pulled as a dependency.
+ * The client pulls up to @concurrency flatpaks at once. */
+static void
+set_up_flatpak_pull_with_runtime (EosUpdaterFixture *fixture,
+                                  EtcData           *data,
+                                  guint              concurrency)
+{
+  FlatpakToInstall flatpaks_to_install[] = {
+    { "install", "com.endlessm.TestInstallFlatpaksCollection", "test-repo", "org.test.Test", "stable", "app", FLATPAK_TO_INSTALL_FLAGS_NONE }
+  };
+  g_autoptr(GPtrArray) flatpak_install_infos = g_ptr_array_new_with_free_func ((GDestroyNotify) flatpak_install_info_free);
+  g_autoptr(GHashTable) flatpak_repo_infos = g_hash_table_new_full (g_str_hash,
+                                                                    g_str_equal,
+                                                                    g_free,
+                                                                    (GDestroyNotify) flatpak_repo_info_free);
+  g_autoptr(GFile) updater_directory = NULL;
+  g_autofree gchar *keyid = get_keyid (fixture->gpg_home);
+  g_autoptr(GFile) gpg_key_file = get_gpg_key_file_for_keyid (fixture->gpg_home, keyid);
+  g_autoptr(GError) error = NULL;
+
+  etc_data_init (data, fixture);
+
+  g_ptr_array_add (flatpak_install_infos,
+                   flatpak_install_info_new (FLATPAK_INSTALL_INFO_TYPE_RUNTIME,
+                                             "org.test.Runtime",
+                                             "stable",
+                                             NULL,
+                                             NULL,
+                                             "test-repo",
+                                             FALSE));
+  g_ptr_array_add (flatpak_install_infos,
+                   flatpak_install_info_new (FLATPAK_INSTALL_INFO_TYPE_APP,
+                                             "org.test.Test",
+                                             "stable",
+                                             "org.test.Runtime",
+                                             "stable",
+                                             "test-repo",
+                                             FALSE));
+  g_hash_table_insert (flatpak_repo_infos,
+                       g_strdup ("test-repo"),
+                       flatpak_repo_info_new ("test-repo",
+                                              "com.endlessm.TestInstallFlatpaksCollection",
+                                              "com.endlessm.TestInstallFlatpaksCollection"));
+
+  /* Commit number 1 will install some flatpaks
+   */
+  autoinstall_flatpaks_files (1,
+                              flatpaks_to_install,
+                              G_N_ELEMENTS (flatpaks_to_install),
+                              &data->additional_directories_for_commit,
+                              &data->additional_files_for_commit);
+
+  etc_set_up_server (data);
+  etc_set_up_client_synced_to_server (data);
+  eos_test_client_set_flatpak_pull_concurrency (data->client, concurrency);
+
+  updater_directory = g_file_get_child (data->client->root, "updater");
+  eos_test_setup_flatpak_repo (updater_directory,
+                               flatpak_install_infos,
+                               flatpak_repo_infos,
+                               gpg_key_file,
+                               keyid,
+                               &error);
+  g_assert_no_error (error);
+
+  etc_update_server (data, 1);
+}
+
+/* Check that, after fetching the update set up by
+ * set_up_flatpak_pull_with_runtime(), the app and runtime have been pulled,
+ * and that the runtime has been deployed if @runtime_deployed is %TRUE.
+ * The app should never be deployed until the update is applied. */
+static void
+assert_flatpak_pull_with_runtime (EtcData  *data,
+                                  gboolean  runtime_deployed)
+{
+  g_autoptr(GFile) updater_directory = g_file_get_child (data->client->root, "updater");
+  g_autoptr(GFile) flatpak_user_installation_dir = g_file_get_child (updater_directory, "flatpak-user");
+  g_auto(GStrv) flatpaks_in_repo = NULL;
+  g_auto(GStrv) deployed_flatpaks = NULL;
+  g_autoptr(GError) error = NULL;
+
+  flatpaks_in_repo = flatpaks_in_installation_repo (flatpak_user_installation_dir,
+                                                    &error);
+  g_assert_no_error (error);
+  deployed_flatpaks = eos_test_get_installed_flatpaks (updater_directory, &error);
+  g_assert_no_error (error);
+
+  if (runtime_deployed)
+    {
+      g_assert_true (g_strv_contains ((const gchar * const *) flatpaks_in_repo, "org.test.Test"));
+      g_assert_true (g_strv_contains ((const gchar * const *) flatpaks_in_repo, "org.test.Runtime"));
+      g_assert_true (g_strv_contains ((const gchar * const *) deployed_flatpaks, "org.test.Runtime"));
+    }
+  else
+    {
+      g_assert_false (g_strv_contains ((const gchar * const *) deployed_flatpaks, "org.test.Runtime"));
+    }
+
+  g_assert_false (g_strv_contains ((const gchar * const *) deployed_flatpaks, "org.test.Test"));
+}
+
+/* Fetch an update which installs a flatpak with a runtime dependency, while
+ * allowing the flatpaks to be pulled alongside the OS. The runtime should be
+ * deployed once the OS has been pulled. */
+static void
+test_update_install_flatpaks_pull_pipelined (EosUpdaterFixture *fixture,
+                                             gconstpointer      user_data)
+{
+  g_auto(EtcData) real_data = { NULL, };
+  EtcData *data = &real_data;
+  FetchHelper helper = { EOS_UPDATER_STATE_NONE, 0, FALSE };
+  g_auto(CmdAsyncResult) updater_cmd = CMD_ASYNC_RESULT_CLEARED;
+  g_autoptr(EosUpdater) updater = NULL;
+  g_autofree gchar *updater_output = NULL;
+
+  set_up_flatpak_pull_with_runtime (fixture, data, 3);
+
+  updater = poll_and_fetch_update (data, TRUE, &updater_cmd, &helper);
+  g_assert_cmpuint (helper.state, ==, EOS_UPDATER_STATE_UPDATE_READY);
+
+  g_clear_object (&updater);
+  updater_output = reap_updater_output (data, &updater_cmd);
+  g_assert_nonnull (strstr (updater_output, "Fetch: pulling flatpaks while pulling the OS"));
+  g_assert_nonnull (strstr (updater_output, "Fetch: deploying 1 dependency flatpaks"));
+
+  assert_flatpak_pull_with_runtime (data, TRUE);
+}
+
+/* Delete the big file in commit 1 from @subserver’s repository, and its
+ * static deltas, so that pulling the commit fails, while pulling just its
+ * autoinstall lists still works. */
+static void
+break_os_pull_on_server (EosTestSubserver *subserver)
+{
+  g_autoptr(OstreeRepo) repo = ostree_repo_new (subserver->repo);
+  const gchar *checksum = g_hash_table_lookup (subserver->commits_in_repo,
+                                               GUINT_TO_POINTER (1));
+  g_autoptr(GFile) root = NULL;
+  g_autoptr(GFile) big_file = NULL;
+  g_autoptr(GError) error = NULL;
+
+  eos_test_subserver_remove_static_deltas (subserver, &error);
+  g_assert_no_error (error);
+
+  ostree_repo_open (repo, NULL, &error);
+  g_assert_no_error (error);
+  ostree_repo_read_commit (repo, checksum, &root, NULL, NULL, &error);
+  g_assert_no_error (error);
+
+  big_file = g_file_resolve_relative_path (root, eos_test_client_get_big_file_path ());
+  ostree_repo_file_ensure_resolved (OSTREE_REPO_FILE (big_file), &error);
+  g_assert_no_error (error);
+
+  ostree_repo_delete_object (repo, OSTREE_OBJECT_TYPE_FILE,
+                             ostree_repo_file_get_checksum (OSTREE_REPO_FILE (big_file)),
+                             NULL, &error);
+  g_assert_no_error (error);
+}
+
+/* Fetch an update which installs a flatpak with a runtime dependency, while
+ * allowing the flatpaks to be pulled alongside the OS, but make the OS pull
+ * fail. The fetch should fail with the OS error rather than the cancellation
+ * of the flatpak pulls, and the runtime must not be deployed. */
+static void
+test_update_install_flatpaks_pull_pipelined_os_fail (EosUpdaterFixture *fixture,
+                                                     gconstpointer      user_data)
+{
+  g_auto(EtcData) real_data = { NULL, };
+  EtcData *data = &real_data;
+  FetchHelper helper = { EOS_UPDATER_STATE_NONE, 0, FALSE };
+  g_auto(CmdAsyncResult) updater_cmd = CMD_ASYNC_RESULT_CLEARED;
+  g_autoptr(EosUpdater) updater = NULL;
+  g_autofree gchar *updater_output = NULL;
+
+  set_up_flatpak_pull_with_runtime (fixture, data, 3);
+  break_os_pull_on_server (data->subserver);
+
+  /* The failure of the P2P pull is a warning. */
+  updater = poll_and_fetch_update (data, FALSE, &updater_cmd, &helper);
+  g_assert_cmpuint (helper.state, ==, EOS_UPDATER_STATE_ERROR);
+  g_assert_null (strstr (eos_updater_get_error_message (updater), "cancelled"));
+
+  g_clear_object (&updater);
+  updater_output = reap_updater_output (data, &updater_cmd);
+  g_assert_nonnull (strstr (updater_output, "Fetch: pulling flatpaks while pulling the OS"));
+  g_assert_null (strstr (updater_output, "Fetch: deploying"));
+
+  assert_flatpak_pull_with_runtime (data, FALSE);
+}
+
+/* Fetch an update which installs a flatpak with a runtime dependency, pulling
+ * one thing at a time, so the flatpaks are pulled after the OS. */
+static void
+test_update_install_flatpaks_pull_sequential (EosUpdaterFixture *fixture,
+                                              gconstpointer      user_data)
+{
+  g_auto(EtcData) real_data = { NULL, };
+  EtcData *data = &real_data;
+  FetchHelper helper = { EOS_UPDATER_STATE_NONE, 0, FALSE };
+  g_auto(CmdAsyncResult) updater_cmd = CMD_ASYNC_RESULT_CLEARED;
+  g_autoptr(EosUpdater) updater = NULL;
+  g_autofree gchar *updater_output = NULL;
+
+  set_up_flatpak_pull_with_runtime (fixture, data, 1);
+
+  updater = poll_and_fetch_update (data, TRUE, &updater_cmd, &helper);
+  g_assert_cmpuint (helper.state, ==, EOS_UPDATER_STATE_UPDATE_READY);
+
+  g_clear_object (&updater);
+  updater_output = reap_updater_output (data, &updater_cmd);
+  g_assert_null (strstr (updater_output, "Fetch: pulling flatpaks while pulling the OS"));
+  g_assert_nonnull (strstr (updater_output, "Fetch: pulling any necessary new flatpaks for this update"));
+
+  assert_flatpak_pull_with_runtime (data, TRUE);
+}
+
+#ifdef HAVE_FLATPAK_TRANSACTION_ADD_SIDELOAD_REPO
+/* Copy @refs from the flatpak repository at @flatpak_repo_dir into the
+ * repository on a volume at @volume_repo_dir, as refs in @collection_id, and
+ * update its summary, the same as `flatpak create-usb` would. */
+static void
+copy_flatpaks_to_volume (GFile               *flatpak_repo_dir,
+                         GFile               *volume_repo_dir,
+                         const gchar         *collection_id,
+                         const gchar * const *refs)
+{
+  g_autoptr(OstreeRepo) flatpak_repo = ostree_repo_new (flatpak_repo_dir);
+  g_autoptr(OstreeRepo) volume_repo = ostree_repo_new (volume_repo_dir);
+  g_autofree gchar *flatpak_repo_uri = g_file_get_uri (flatpak_repo_dir);
+  g_auto(GVariantBuilder) builder = G_VARIANT_BUILDER_INIT (G_VARIANT_TYPE_VARDICT);
+  g_autoptr(GVariant) options = NULL;
+  g_autoptr(GError) error = NULL;
+  gsize i;
+
+  ostree_repo_open (flatpak_repo, NULL, &error);
+  g_assert_no_error (error);
+  ostree_repo_open (volume_repo, NULL, &error);
+  g_assert_no_error (error);
+
+  g_variant_builder_add (&builder, "{s@v}", "refs",
+                         g_variant_new_variant (g_variant_new_strv (refs, -1)));
+  g_variant_builder_add (&builder, "{s@v}", "gpg-verify",
+                         g_variant_new_variant (g_variant_new_boolean (FALSE)));
+  g_variant_builder_add (&builder, "{s@v}", "gpg-verify-summary",
+                         g_variant_new_variant (g_variant_new_boolean (FALSE)));
+  options = g_variant_ref_sink (g_variant_builder_end (&builder));
+
+  ostree_repo_pull_with_options (volume_repo, flatpak_repo_uri, options,
+                                 NULL, NULL, &error);
+  g_assert_no_error (error);
+
+  for (i = 0; refs[i] != NULL; i++)
+    {
+      const OstreeCollectionRef collection_ref = { (gchar *) collection_id, (gchar *) refs[i] };
+      g_autofree gchar *checksum = NULL;
+
+      ostree_repo_resolve_rev (flatpak_repo, refs[i], FALSE, &checksum, &error);
+      g_assert_no_error (error);
+
+      ostree_repo_set_collection_ref_immediate (volume_repo, &collection_ref,
+                                                checksum, NULL, &error);
+      g_assert_no_error (error);
+    }
+
+  ostree_repo_regenerate_summary (volume_repo, NULL, NULL, &error);
+  g_assert_no_error (error);
+}
+
+/* Fetch an update which installs a flatpak with a runtime dependency from a
+ * volume which also has the flatpaks on it. The objects are deleted from the
+ * flatpak remote, so the flatpaks can only be pulled from the volume. */
+static void
+test_update_install_flatpaks_pull_from_volume (EosUpdaterFixture *fixture,
+                                               gconstpointer      user_data)
+{
+  g_auto(EtcData) real_data = { NULL, };
+  EtcData *data = &real_data;
+  FetchHelper helper = { EOS_UPDATER_STATE_NONE, 0, FALSE };
+  g_auto(CmdAsyncResult) updater_cmd = CMD_ASYNC_RESULT_CLEARED;
+  g_autoptr(EosUpdater) updater = NULL;
+  g_autofree gchar *updater_output = NULL;
+  g_autoptr(GFile) volume_client_root = NULL;
+  g_autoptr(EosTestClient) volume_client = NULL;
+  g_autoptr(GFile) volume_path = NULL;
+  g_autoptr(GFile) volume_repo_path = NULL;
+  g_autoptr(GFile) flatpak_repo_path = NULL;
+  g_autoptr(GFile) flatpak_repo_objects_path = NULL;
+  g_autoptr(GPtrArray) override_uris = NULL;
+  g_autofree gchar *app_ref = g_strdup_printf ("app/org.test.Test/%s/stable",
+                                               flatpak_get_default_arch ());
+  g_autofree gchar *runtime_ref = g_strdup_printf ("runtime/org.test.Runtime/%s/stable",
+                                                   flatpak_get_default_arch ());
+  const gchar *refs[] = { app_ref, runtime_ref, NULL };
+  g_autofree gchar *expected_message = NULL;
+  g_autofree gchar *volume_repo_raw_path = NULL;
+  g_autoptr(GError) error = NULL;
+
+  if (eos_test_skip_chroot ())
+    return;
+
+  set_up_flatpak_pull_with_runtime (fixture, data, 1);
+
+  /* Put commit 1, and the flatpaks it installs, on a volume. */
+  volume_client_root = g_file_get_child (fixture->tmpdir, "volume-client");
+  volume_client = eos_test_client_new (volume_client_root,
+                                       default_remote_name,
+                                       data->subserver,
+                                       default_collection_ref,
+                                       default_vendor,
+                                       default_product,
+                                       default_auto_bootloader,
+                                       &error);
+  g_assert_no_error (error);
+
+  volume_path = g_file_get_child (fixture->tmpdir, "volume");
+  eos_test_client_prepare_volume (volume_client, volume_path, &error);
+  g_assert_no_error (error);
+
+  volume_repo_path = g_file_resolve_relative_path (volume_path, ".ostree/repo");
+  flatpak_repo_path = g_file_resolve_relative_path (data->client->root,
+                                                    "updater/flatpak/repos/test-repo");
+  copy_flatpaks_to_volume (flatpak_repo_path, volume_repo_path,
+                           "com.endlessm.TestInstallFlatpaksCollection", refs);
+
+  /* Leave the remote’s summary, so the refs can still be resolved, but none
+   * of the objects to pull. */
+  flatpak_repo_objects_path = g_file_get_child (flatpak_repo_path, "objects");
+  eos_updater_remove_recursive (flatpak_repo_objects_path, NULL, &error);
+  g_assert_no_error (error);
+  g_file_make_directory (flatpak_repo_objects_path, NULL, &error);
+  g_assert_no_error (error);
+
+  override_uris = g_ptr_array_new_with_free_func (g_free);
+  g_ptr_array_add (override_uris, g_file_get_uri (volume_repo_path));
+
+  updater = poll_and_fetch_update_from (data, DOWNLOAD_VOLUME, override_uris,
+                                        TRUE, &updater_cmd, &helper);
+  g_assert_cmpuint (helper.state, ==, EOS_UPDATER_STATE_UPDATE_READY);
+
+  g_clear_object (&updater);
+  updater_output = reap_updater_output (data, &updater_cmd);
+  volume_repo_raw_path = g_file_get_path (volume_repo_path);
+  expected_message = g_strdup_printf ("Fetch: using %s as a local source for flatpaks",
+                                      volume_repo_raw_path);
+  g_assert_nonnull (strstr (updater_output, expected_message));
+
+  assert_flatpak_pull_with_runtime (data, TRUE);
+}
+#endif  /* HAVE_FLATPAK_TRANSACTION_ADD_SIDELOAD_REPO */
+
 /* Insert a list of flatpaks to automatically install on the commit
  * and ensure that they are not installed before reboot */
 static void
@@ -6529,6 +7187,14 @@ main (int argc,
   eos_test_add ("/updater/update-deploy-fail-flatpaks-stay-in-repo", NULL, test_update_deploy_fail_flatpaks_stay_in_repo);
   eos_test_add ("/updater/update-deploy-fail-flatpaks-not-deployed", NULL, test_update_deploy_fail_flatpaks_not_deployed);
   eos_test_add ("/updater/update-flatpaks-pull-fail-system-not-deployed", NULL, test_update_flatpak_pull_fail_system_not_deployed);
+  eos_test_add ("/updater/install-flatpaks-pull-concurrently", NULL, test_update_install_flatpaks_pull_concurrently);
+  eos_test_add ("/updater/install-flatpaks-pull-concurrently-fail", NULL, test_update_install_flatpaks_pull_concurrently_fail);
+  eos_test_add ("/updater/install-flatpaks-pull-pipelined", NULL, test_update_install_flatpaks_pull_pipelined);
+  eos_test_add ("/updater/install-flatpaks-pull-pipelined-os-fail", NULL, test_update_install_flatpaks_pull_pipelined_os_fail);
+  eos_test_add ("/updater/install-flatpaks-pull-sequential", NULL, test_update_install_flatpaks_pull_sequential);
+#ifdef HAVE_FLATPAK_TRANSACTION_ADD_SIDELOAD_REPO
+  eos_test_add ("/updater/install-flatpaks-pull-from-volume", NULL, test_update_install_flatpaks_pull_from_volume);
+#endif
   eos_test_add ("/updater/update-install-through-squashed-list", NULL, test_update_install_through_squashed_list);
 
   return g_test_run ();
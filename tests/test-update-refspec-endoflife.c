@@ -34,6 +34,15 @@ const gchar *next_ref = "REFv2";
 const OstreeCollectionRef _next_collection_ref = { (gchar *) "com.endlessm.CollectionId", (gchar *) "REFv2" };
 const OstreeCollectionRef *next_collection_ref = &_next_collection_ref;
 
+/* Refs on the server which are not on the redirect chain. The client has an
+ * existing ref for the first, and no ref for the second. */
+const gchar *unrelated_existing_ref = "REFv3";
+const OstreeCollectionRef _unrelated_existing_collection_ref = { (gchar *) "com.endlessm.CollectionId", (gchar *) "REFv3" };
+const OstreeCollectionRef *unrelated_existing_collection_ref = &_unrelated_existing_collection_ref;
+const gchar *unrelated_new_ref = "REFv4";
+const OstreeCollectionRef _unrelated_new_collection_ref = { (gchar *) "com.endlessm.CollectionId", (gchar *) "REFv4" };
+const OstreeCollectionRef *unrelated_new_collection_ref = &_unrelated_new_collection_ref;
+
 const OstreeCollectionRef _default_collection_ref_no_id = { NULL, (gchar *) "REF" };
 const OstreeCollectionRef *default_collection_ref_no_id = &_default_collection_ref_no_id;
 
@@ -146,6 +155,12 @@ _test_update_refspec_endoflife (EosUpdaterFixture *fixture,
   gboolean has_commit;
   g_autofree gchar *branches_option = NULL;
   g_autofree gchar *expected_branches = NULL;
+  g_autofree gchar *booted_refspec = NULL;
+  g_autofree gchar *unrelated_existing_refspec = NULL;
+  g_autofree gchar *unrelated_new_refspec = NULL;
+  g_autofree gchar *original_checksum = NULL;
+  g_autofree gchar *unrelated_existing_checksum = NULL;
+  g_autofree gchar *unrelated_new_checksum = NULL;
 
   /* We could get OSTree working by setting OSTREE_BOOTID, but shortly
    * afterwards we hit unsupported syscalls in qemu-user when running in an
@@ -202,12 +217,30 @@ _test_update_refspec_endoflife (EosUpdaterFixture *fixture,
   g_hash_table_insert (leaf_commit_nodes,
                        ostree_collection_ref_dup (next_collection_ref),
                        GUINT_TO_POINTER (2));
+
+  /* And commits for two refs which are not on the redirect chain, and which
+   * the updater should leave alone. */
+  g_hash_table_insert (leaf_commit_nodes,
+                       ostree_collection_ref_dup (unrelated_existing_collection_ref),
+                       GUINT_TO_POINTER (3));
+  g_hash_table_insert (leaf_commit_nodes,
+                       ostree_collection_ref_dup (unrelated_new_collection_ref),
+                       GUINT_TO_POINTER (4));
   eos_test_subserver_populate_commit_graph_from_leaf_nodes (subserver,
                                                             leaf_commit_nodes);
   eos_test_subserver_update (subserver,
                              &error);
   g_assert_no_error (error);
 
+  /* Point the client’s ref for the first unrelated ref at the booted commit,
+   * so we can check that polling doesn’t move it. */
+  booted_refspec = g_strdup_printf ("%s:%s", default_remote_name, collection_ref->ref_name);
+  ostree_repo_resolve_rev (repo, booted_refspec, FALSE, &original_checksum, &error);
+  g_assert_no_error (error);
+  ostree_repo_set_ref_immediate (repo, default_remote_name, unrelated_existing_ref,
+                                 original_checksum, NULL, &error);
+  g_assert_no_error (error);
+
   /* Now update the client. */
   update_client (fixture, client, NULL);
 
@@ -230,6 +263,21 @@ _test_update_refspec_endoflife (EosUpdaterFixture *fixture,
                                  &branches_option, &error);
   g_assert_no_error (error);
   g_assert_cmpstr (branches_option, ==, expected_branches);
+
+  /* Only the refs on the redirect chain should have been pulled. */
+  unrelated_existing_refspec = g_strdup_printf ("%s:%s", default_remote_name,
+                                                unrelated_existing_ref);
+  ostree_repo_resolve_rev (repo, unrelated_existing_refspec, FALSE,
+                           &unrelated_existing_checksum, &error);
+  g_assert_no_error (error);
+  g_assert_cmpstr (unrelated_existing_checksum, ==, original_checksum);
+
+  unrelated_new_refspec = g_strdup_printf ("%s:%s", default_remote_name,
+                                           unrelated_new_ref);
+  ostree_repo_resolve_rev (repo, unrelated_new_refspec, TRUE,
+                           &unrelated_new_checksum, &error);
+  g_assert_no_error (error);
+  g_assert_null (unrelated_new_checksum);
 }
 
 /* Test following a redirect with a collection ID configured */